@@ -278,7 +278,7 @@ local ollama_connector = function()
         self.model = model
     end
 
-    instance.generate_response = function(self, prompt)
+    instance.generate_response = function(self, prompt, on_token)
         if not self.model then
             logger(logger.ERROR, "No model selected for Ollama connector")
             return false, 'No model selected'
@@ -288,11 +288,32 @@ local ollama_connector = function()
             model = self.model,
             prompt = prompt,
             options = self.options,
-            stream = false,
+            stream = on_token ~= nil,
         }
-        local promise = self.http:post('/generate', args)
+
+        -- Streamed replies arrive as one JSON object per line
+        local tokens = {}
+        local on_line = nil
+        if on_token then
+            on_line = function(line)
+                local chunk = util.from_json(line)
+                if chunk and chunk.response then
+                    table.insert(tokens, chunk.response)
+                    on_token(chunk.response)
+                end
+            end
+        end
+
+        local promise = self.http:post('/generate', args, nil, on_line)
         local result = promise:wait()
+        -- A long stream outlives the promise timeout, the connector fails it if the server goes quiet
+        while on_token and result == nil do
+            result = promise:wait()
+        end
         if result.ok then
+            if on_token then
+                return true, table.concat(tokens)
+            end
             local body = util.from_json(result.body)
             return true, body.response
         else
@@ -367,18 +388,38 @@ local llama_connector = function()
         end
     end
 
-    instance.generate_response = function(self, prompt)
+    instance.generate_response = function(self, prompt, on_token)
         local args = {
             prompt = prompt,
-            stream = false,
+            stream = on_token ~= nil,
         }
         for k, v in pairs(self.options) do
             args[k] = v
         end
 
-        local promise = self.http:post('/completion', args)
+        -- Streamed replies arrive as server-sent events
+        local tokens = {}
+        local on_event = nil
+        if on_token then
+            on_event = function(data)
+                local chunk = util.from_json(data)
+                if chunk and chunk.content then
+                    table.insert(tokens, chunk.content)
+                    on_token(chunk.content)
+                end
+            end
+        end
+
+        local promise = self.http:post('/completion', args, nil, on_event)
         local result = promise:wait()
+        -- A long stream outlives the promise timeout, the connector fails it if the server goes quiet
+        while on_token and result == nil do
+            result = promise:wait()
+        end
         if result.ok then
+            if on_token then
+                return true, table.concat(tokens)
+            end
             local body = util.from_json(result.body)
             return true, body.content
         else
@@ -7,7 +7,7 @@ local function oauth2_connector()
 
     instance.enabled = true
     instance.ports = { 3000, 3001, 3002, 3003 }
-    instance.server = deck.connector_factory.ServerSocket()
+    instance.server = deck.connector_factory.HttpServer()
     instance.promise = deck:Promise(60000)
 
     instance.server.on_connect_failed = function(server, err)
@@ -52,89 +52,49 @@ local function oauth2_connector()
         end
     end
 
-    instance.server.on_accept = function(server, client)
-        local message = 'OAuth2 on port ' .. server.port .. ' accepted client from ' .. client.host .. ':' .. client.port
-        logger(logger.TRACE, message)
-    end
-
-    instance.server.on_close = function(server, client)
-        local message = 'OAuth2 on port ' .. server.port .. ' closed connection to client ' .. client.host .. ':' .. client.port
-        logger(logger.TRACE, message)
-    end
-
-    instance.server.on_receive = function(sock, client, data)
-        client.buffer = (client.buffer or '') .. data
+    instance.server:route('/', function(server, request)
+        -- Routes ending in a slash match as a prefix, anything below the root is not ours
+        if request.path ~= '/' then
+            return nil
+        end
 
-        local ok, http, err = util.parse_http_message(client.buffer)
-        if ok then
-            local expected_length = tonumber(http.headers['Content-Length']) or -1
-            if expected_length > 0 and #http.body < expected_length then
-                return
-            end
+        if request.method == 'GET' or request.method == 'HEAD' then
+            return 200, util.oauth2_page, { ['Content-Type'] = 'text/html' }
+        elseif request.method ~= 'POST' then
+            return 405, 'Method not allowed'
+        end
 
-            local code = '200 OK'
-            local ctype = 'text/plain'
-            local body
-
-            if http.path == '/' then
-                if http.method == 'GET' then
-                    body = util.oauth2_page
-                    ctype = 'text/html'
-                elseif http.method == 'POST' then
-                    local reply
-                    if http.headers['Content-Type'] == 'application/json; charset=UTF-8' then
-                        local params = util.from_json(http.body)
-                        local callback_ok, callback_result = pcall(instance.on_auth_callback, instance, params)
-                        if not callback_ok or not callback_result then
-                            code = '500 Internal Server Error'
-                            reply = { granted = false, message = callback_result }
-                            logger(logger.ERROR, 'OAuth2 callback failed: ' .. callback_result)
-                        else
-                            reply = callback_result
-                        end
-                    else
-                        reply = {
-                            granted = false,
-                            message = 'Browser error: invalid Content-Type in message (expected: json)',
-                        }
-                    end
-                    body = util.to_json(reply, false)
-                    ctype = 'application/json; charset=UTF-8'
-                    instance.server.enabled = false
-                    instance.promise:fulfill(false)
-                else
-                    code = '405 Method Not Allowed'
-                    body = 'Method not allowed'
-                end
-            elseif http.path == '/favicon.svg' then
-                if http.method == 'GET' then
-                    body = util.svg_icon
-                    ctype = 'image/svg+xml'
-                else
-                    code = '405 Method Not Allowed'
-                    body = 'Method not allowed'
-                end
+        local code = 200
+        local reply
+        if request.headers['Content-Type'] == 'application/json; charset=UTF-8' then
+            local params = util.from_json(request.body)
+            local callback_ok, callback_result = pcall(instance.on_auth_callback, instance, params)
+            if not callback_ok or not callback_result then
+                code = 500
+                reply = { granted = false, message = callback_result }
+                logger(logger.ERROR, 'OAuth2 callback failed: ' .. tostring(callback_result))
             else
-                code = '404 Not Found'
-                body = 'Content not found'
+                reply = callback_result
             end
-
-            local parts = {
-                'HTTP/1.1 ' .. code,
-                'Server: deck-assistant',
-                'Content-Type: ' .. ctype,
-                'Content-Length: ' .. #body,
-                '',
-                body,
+        else
+            reply = {
+                granted = false,
+                message = 'Browser error: invalid Content-Type in message (expected: json)',
             }
-            local reply = table.concat(parts, '\r\n')
-            client:send(reply)
-            client:close()
-        elseif err then
-            logger(logger.WARNING, 'OAuth2: invalid HTTP request: ' .. err)
-            client:close()
         end
-    end
+
+        instance.server.enabled = false
+        instance.promise:fulfill(false)
+
+        return code, util.to_json(reply, false), { ['Content-Type'] = 'application/json; charset=UTF-8' }
+    end)
+
+    instance.server:route('/favicon.svg', function(server, request)
+        if request.method ~= 'GET' and request.method ~= 'HEAD' then
+            return 405, 'Method not allowed'
+        end
+        return 200, util.svg_icon, { ['Content-Type'] = 'image/svg+xml' }
+    end)
 
     instance.initial_setup = function(self)
         assert(#self.ports > 0)
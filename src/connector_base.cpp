@@ -19,16 +19,22 @@
 #include "connector_base.hpp"
 #include "connector_elgato_streamdeck.h"
 #include "connector_http.h"
+#include "connector_http_server.h"
+#include "connector_osc.h"
 #include "connector_server_socket.h"
 #include "connector_spout.h"
 #include "connector_vnc.h"
 #include "connector_websocket.h"
+#include "connector_websocket_server.h"
 #include "connector_window.h"
 
 template class ConnectorBase<ConnectorElgatoStreamDeck>;
 template class ConnectorBase<ConnectorHttp>;
+template class ConnectorBase<ConnectorHttpServer>;
+template class ConnectorBase<ConnectorOsc>;
 template class ConnectorBase<ConnectorServerSocket>;
 template class ConnectorBase<ConnectorWebsocket>;
+template class ConnectorBase<ConnectorWebsocketServer>;
 template class ConnectorBase<ConnectorWindow>;
 
 #ifdef HAVE_VNC
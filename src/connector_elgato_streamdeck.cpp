@@ -17,15 +17,25 @@
  */
 
 #include "connector_elgato_streamdeck.h"
-#include "SDL_error.h"
 #include "deck_card.h"
 #include "deck_logger.h"
 #include "lua_helpers.h"
+#include <SDL_image.h>
 #include <algorithm>
 #include <cassert>
-#include <codecvt>
+#include <condition_variable>
 #include <cstring>
-#include <locale>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <thread>
+
+struct JpegJob
+{
+	SDL_Surface* surface;
+	std::vector<unsigned char> bytes;
+	bool done;
+};
 
 namespace
 {
@@ -48,12 +58,6 @@ std::string_view get_model(int pid)
 	return std::string_view();
 }
 
-std::string convert(wchar_t const* wstr)
-{
-	static std::wstring_convert<std::codecvt_utf8<wchar_t>> convert;
-	return convert.to_bytes(wstr);
-}
-
 std::string convert_button_table(lua_State* L, int idx)
 {
 	std::vector<bool> buttons;
@@ -81,92 +85,193 @@ std::string convert_button_table(lua_State* L, int idx)
 	return result;
 }
 
+/**
+ * JPEG encoder shared by all Stream Deck connectors and devices.
+ *
+ * Jobs are picked up by a small pool of worker threads, and the main thread
+ * helps out with encoding while it is waiting for its own results.
+ */
+class JpegEncoder
+{
+public:
+	static JpegEncoder& instance()
+	{
+		static JpegEncoder encoder;
+		return encoder;
+	}
+
+	void submit(std::shared_ptr<JpegJob> job)
+	{
+		std::unique_lock lock(m_mutex);
+		m_queue.push_back(std::move(job));
+		m_condition.notify_all();
+	}
+
+	void wait(JpegJob& job)
+	{
+		std::unique_lock lock(m_mutex);
+		while (!job.done)
+		{
+			if (!m_queue.empty())
+				run_one(lock);
+			else
+				m_condition.wait(lock);
+		}
+	}
+
+private:
+	JpegEncoder()
+	{
+		// Make sure the JPEG backend is loaded before any of the workers need it
+		IMG_Init(IMG_INIT_JPG);
+
+		unsigned int const num_workers = std::clamp(std::thread::hardware_concurrency(), 2U, 5U) - 1;
+		for (unsigned int idx = 0; idx < num_workers; ++idx)
+			m_workers.emplace_back([this](std::stop_token stop_token) { worker(stop_token); });
+	}
+
+	void worker(std::stop_token stop_token)
+	{
+		std::unique_lock lock(m_mutex);
+		while (m_condition.wait(lock, stop_token, [this] { return !m_queue.empty(); }))
+			run_one(lock);
+	}
+
+	void run_one(std::unique_lock<std::mutex>& lock)
+	{
+		std::shared_ptr<JpegJob> job = std::move(m_queue.front());
+		m_queue.pop_front();
+
+		lock.unlock();
+		job->bytes = DeckCard::save_surface_as_jpeg(job->surface);
+		SDL_FreeSurface(job->surface);
+		job->surface = nullptr;
+		lock.lock();
+
+		job->done = true;
+		m_condition.notify_all();
+	}
+
+	std::mutex m_mutex;
+	std::condition_variable_any m_condition;
+	std::deque<std::shared_ptr<JpegJob>> m_queue;
+	std::vector<std::jthread> m_workers;
+};
+
 } // namespace
 
 char const* ConnectorElgatoStreamDeck::LUA_TYPENAME = "deck:ConnectorElgatoStreamDeck";
 
 ConnectorElgatoStreamDeck::ConnectorElgatoStreamDeck()
-    : m_hid_device(nullptr)
+    : m_hid_backend(util::HidBackend::get_default())
+    , m_filter_all(false)
     , m_hid_last_scan(-1)
     , m_wanted_brightness(INVALID_BRIGHTNESS)
-    , m_actual_brightness(INVALID_BRIGHTNESS)
 {
 }
 
-ConnectorElgatoStreamDeck::~ConnectorElgatoStreamDeck()
-{
-	if (m_hid_device)
-		SDL_hid_close(m_hid_device);
-}
+ConnectorElgatoStreamDeck::~ConnectorElgatoStreamDeck() = default;
 
 void ConnectorElgatoStreamDeck::tick_inputs(lua_State* L, lua_Integer clock)
 {
-	if (!m_hid_device)
+	std::size_t const max_devices = m_filter_all ? std::numeric_limits<std::size_t>::max() : std::max<std::size_t>(m_filter_serialnumbers.size(), 1);
+	if (m_devices.size() < max_devices)
 	{
-		std::uint32_t changes = SDL_hid_device_change_count();
+		std::uint32_t changes = m_hid_backend->get_change_count();
 		if (changes != m_hid_last_scan)
 		{
 			m_hid_last_scan = changes;
-			attempt_connect_device();
+			attempt_connect_devices();
 		}
+	}
 
-		if (!m_hid_device)
-			return;
-
-		LuaHelpers::emit_event(L, -1, "on_connect");
+	// Event handlers can change the device list, so no iterators or references are held across them
+	for (std::size_t device_idx = 0; device_idx < m_devices.size(); ++device_idx)
+	{
+		if (m_devices[device_idx]->is_new && m_devices[device_idx]->hid_device)
+		{
+			m_devices[device_idx]->is_new = false;
+			LuaHelpers::emit_event(L, 1, "on_connect", m_devices[device_idx]->serialnumber);
+		}
 	}
 
-	if (update_button_state())
+	for (std::size_t device_idx = 0; device_idx < m_devices.size(); ++device_idx)
 	{
-		m_buttons_state.resize(m_buttons_new_state.size());
+		Device* device = m_devices[device_idx].get();
+		if (!update_button_state(*device))
+			continue;
 
-		lua_createtable(L, m_buttons_new_state.size(), 0);
-		for (std::size_t idx = 0; idx < m_buttons_new_state.size(); ++idx)
+		device->buttons_state.resize(device->buttons_new_state.size());
+
+		lua_createtable(L, device->buttons_new_state.size(), 0);
+		for (std::size_t idx = 0; idx < device->buttons_new_state.size(); ++idx)
 		{
-			lua_pushboolean(L, m_buttons_new_state[idx]);
+			lua_pushboolean(L, device->buttons_new_state[idx]);
 			lua_rawseti(L, -2, idx + 1);
 		}
+		lua_pushlstring(L, device->serialnumber.data(), device->serialnumber.size());
 
-		for (std::size_t idx = 0; idx < m_buttons_state.size(); ++idx)
+		for (std::size_t idx = 0; idx < device->buttons_state.size(); ++idx)
 		{
-			if (m_buttons_state[idx] != m_buttons_new_state[idx])
+			if (device->buttons_state[idx] != device->buttons_new_state[idx])
 			{
-				char const* func_name = m_buttons_new_state[idx] ? "on_press" : "on_release";
-				LuaHelpers::emit_event(L, -1, func_name, idx + 1, LuaHelpers::StackValue(L, -3));
+				device->buttons_state[idx] = device->buttons_new_state[idx];
+
+				char const* func_name = device->buttons_state[idx] ? "on_press" : "on_release";
+				LuaHelpers::emit_event(L, 1, func_name, idx + 1, LuaHelpers::StackValue(L, -2), LuaHelpers::StackValue(L, -1));
 			}
-			m_buttons_state[idx] = m_buttons_new_state[idx];
 		}
 
-		lua_pop(L, 1);
+		lua_pop(L, 2);
 	}
 
-	if (!m_hid_device)
-		LuaHelpers::emit_event(L, -1, "on_disconnect");
+	emit_disconnects(L);
 }
 
 void ConnectorElgatoStreamDeck::tick_outputs(lua_State* L, lua_Integer clock)
 {
-	if (!m_hid_device)
+	if (m_devices.empty())
 		return;
 
-	if (m_actual_brightness != m_wanted_brightness && m_wanted_brightness != INVALID_BRIGHTNESS)
-		write_brightness(m_wanted_brightness);
+	std::size_t max_images = 0;
+	for (std::unique_ptr<Device>& device : m_devices)
+	{
+		if (device->actual_brightness != m_wanted_brightness && m_wanted_brightness != INVALID_BRIGHTNESS)
+			write_brightness(*device, m_wanted_brightness);
 
-	for (auto const& todo : m_buttons_image)
-		write_image_data(todo.first, todo.second);
-	m_buttons_image.clear();
+		collect_encoded_images(*device);
+		max_images = std::max(max_images, device->buttons_image.size());
+	}
 
-	if (!m_hid_device)
-		LuaHelpers::emit_event(L, -1, "on_disconnect");
+	// Interleave the uploads so that one device with a full page of changes does not hold back the others
+	for (std::size_t image_idx = 0; image_idx < max_images; ++image_idx)
+	{
+		for (std::unique_ptr<Device>& device : m_devices)
+		{
+			if (image_idx < device->buttons_image.size())
+			{
+				auto const& todo = device->buttons_image[image_idx];
+				write_image_data(*device, todo.first, todo.second);
+			}
+		}
+	}
+
+	for (std::unique_ptr<Device>& device : m_devices)
+		device->buttons_image.clear();
+
+	emit_disconnects(L);
 }
 
 void ConnectorElgatoStreamDeck::shutdown(lua_State* L)
 {
-	if (m_hid_device)
-	{
-		SDL_hid_close(m_hid_device);
-		m_hid_device = nullptr;
-	}
+	m_devices.clear();
+}
+
+void ConnectorElgatoStreamDeck::set_hid_backend(std::shared_ptr<util::HidBackend> backend)
+{
+	m_devices.clear();
+	m_hid_backend   = backend ? std::move(backend) : util::HidBackend::get_default();
+	m_hid_last_scan = -1;
 }
 
 void ConnectorElgatoStreamDeck::init_class_table(lua_State* L)
@@ -194,6 +299,8 @@ void ConnectorElgatoStreamDeck::init_instance_table(lua_State* L)
 
 int ConnectorElgatoStreamDeck::index(lua_State* L, std::string_view const& key) const
 {
+	Device const* primary = m_devices.empty() ? nullptr : m_devices.front().get();
+
 	if (key == "brightness")
 	{
 		if (m_wanted_brightness != INVALID_BRIGHTNESS)
@@ -201,7 +308,7 @@ int ConnectorElgatoStreamDeck::index(lua_State* L, std::string_view const& key)
 	}
 	else if (key == "connected")
 	{
-		lua_pushboolean(L, m_hid_device != nullptr);
+		lua_pushboolean(L, primary != nullptr);
 	}
 	else if (key == "error")
 	{
@@ -210,24 +317,33 @@ int ConnectorElgatoStreamDeck::index(lua_State* L, std::string_view const& key)
 	}
 	else if (key == "vid")
 	{
-		if (m_vid)
-			lua_pushinteger(L, m_vid);
+		if (primary)
+			lua_pushinteger(L, primary->vid);
 	}
 	else if (key == "pid")
 	{
-		if (m_pid)
-			lua_pushinteger(L, m_pid);
+		if (primary)
+			lua_pushinteger(L, primary->pid);
 	}
 	else if (key == "model")
 	{
-		std::string_view model = get_model(m_pid);
+		std::string_view model = primary ? get_model(primary->pid) : std::string_view();
 		if (!model.empty())
 			lua_pushlstring(L, model.data(), model.size());
 	}
 	else if (key == "serialnumber")
 	{
-		if (!m_serialnumber.empty())
-			lua_pushlstring(L, m_serialnumber.data(), m_serialnumber.size());
+		if (primary)
+			lua_pushlstring(L, primary->serialnumber.data(), primary->serialnumber.size());
+	}
+	else if (key == "serialnumbers")
+	{
+		lua_createtable(L, m_devices.size(), 0);
+		for (std::size_t idx = 0; idx < m_devices.size(); ++idx)
+		{
+			lua_pushlstring(L, m_devices[idx]->serialnumber.data(), m_devices[idx]->serialnumber.size());
+			lua_rawseti(L, -2, idx + 1);
+		}
 	}
 
 	return lua_gettop(L) == 2 ? 0 : 1;
@@ -244,6 +360,47 @@ int ConnectorElgatoStreamDeck::newindex(lua_State* L, std::string_view const& ke
 		lua_Integer value   = LuaHelpers::check_arg_int(L, 3);
 		m_wanted_brightness = std::clamp<int>(value, 0, 100);
 	}
+	else if (key == "serialnumbers")
+	{
+		std::vector<std::string> filter;
+		bool filter_all = false;
+
+		int const vtype = lua_type(L, 3);
+		if (vtype == LUA_TSTRING)
+		{
+			std::string_view value = LuaHelpers::to_string_view(L, 3);
+			if (value == "*")
+				filter_all = true;
+			else
+				filter.emplace_back(value);
+		}
+		else if (vtype == LUA_TTABLE)
+		{
+			for (int idx = 1;; ++idx)
+			{
+				lua_rawgeti(L, 3, idx);
+				if (lua_isnil(L, -1))
+					break;
+
+				filter.emplace_back(LuaHelpers::check_arg_string(L, -1));
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
+		}
+		else if (vtype != LUA_TNIL)
+		{
+			luaL_typerror(L, 3, "string, table or nil");
+		}
+
+		m_filter_serialnumbers.swap(filter);
+		m_filter_all    = filter_all;
+		m_hid_last_scan = -1;
+
+		// Devices that are no longer wanted get disconnected during the next tick
+		for (std::unique_ptr<Device>& device : m_devices)
+			if (!wants_device(device->serialnumber))
+				force_disconnect(*device);
+	}
 	else if (key.starts_with("on_"))
 	{
 		if (lua_type(L, 3) != LUA_TNIL)
@@ -261,8 +418,9 @@ int ConnectorElgatoStreamDeck::newindex(lua_State* L, std::string_view const& ke
 int ConnectorElgatoStreamDeck::_lua_default_on_connect(lua_State* L)
 {
 	ConnectorElgatoStreamDeck* self = from_stack(L, 1);
-	std::string_view model          = get_model(self->m_pid);
-	std::string_view serialnumber   = self->m_serialnumber;
+	std::string_view serialnumber   = LuaHelpers::to_string_view(L, 2);
+	Device const* device            = self->find_device(serialnumber);
+	std::string_view model          = device ? get_model(device->pid) : std::string_view();
 
 	DeckLogger::log_message(L, DeckLogger::Level::Info, LUA_TYPENAME, " on_connect(): ", model, " serialnumber ", serialnumber);
 	return 0;
@@ -271,7 +429,9 @@ int ConnectorElgatoStreamDeck::_lua_default_on_connect(lua_State* L)
 int ConnectorElgatoStreamDeck::_lua_default_on_disconnect(lua_State* L)
 {
 	ConnectorElgatoStreamDeck* self = from_stack(L, 1);
-	DeckLogger::log_message(L, DeckLogger::Level::Info, LUA_TYPENAME, " on_disconnect(): ", self->m_last_error);
+	std::string_view serialnumber   = LuaHelpers::to_string_view(L, 2);
+
+	DeckLogger::log_message(L, DeckLogger::Level::Info, LUA_TYPENAME, " on_disconnect(): serialnumber ", serialnumber, ": ", self->m_last_error);
 	return 0;
 }
 
@@ -281,10 +441,11 @@ int ConnectorElgatoStreamDeck::_lua_default_on_press(lua_State* L)
 	luaL_checktype(L, 2, LUA_TNUMBER);
 	luaL_checktype(L, 3, LUA_TTABLE);
 
-	int const button         = lua_tointeger(L, 2);
-	std::string button_table = convert_button_table(L, 3);
+	int const button              = lua_tointeger(L, 2);
+	std::string button_table      = convert_button_table(L, 3);
+	std::string_view serialnumber = LuaHelpers::to_string_view(L, 4);
 
-	DeckLogger::log_message(L, DeckLogger::Level::Info, LUA_TYPENAME, " on_press(): ", button, ' ', button_table);
+	DeckLogger::log_message(L, DeckLogger::Level::Info, LUA_TYPENAME, " on_press(): ", button, ' ', button_table, ' ', serialnumber);
 	return 0;
 }
 
@@ -294,10 +455,11 @@ int ConnectorElgatoStreamDeck::_lua_default_on_release(lua_State* L)
 	luaL_checktype(L, 2, LUA_TNUMBER);
 	luaL_checktype(L, 3, LUA_TTABLE);
 
-	int const button         = lua_tointeger(L, 2);
-	std::string button_table = convert_button_table(L, 3);
+	int const button              = lua_tointeger(L, 2);
+	std::string button_table      = convert_button_table(L, 3);
+	std::string_view serialnumber = LuaHelpers::to_string_view(L, 4);
 
-	DeckLogger::log_message(L, DeckLogger::Level::Info, LUA_TYPENAME, " on_release(): ", button, ' ', button_table);
+	DeckLogger::log_message(L, DeckLogger::Level::Info, LUA_TYPENAME, " on_release(): ", button, ' ', button_table, ' ', serialnumber);
 	return 0;
 }
 
@@ -306,12 +468,19 @@ int ConnectorElgatoStreamDeck::_lua_set_button(lua_State* L)
 	ConnectorElgatoStreamDeck* self = from_stack(L, 1);
 	unsigned char button            = LuaHelpers::check_arg_int(L, 2);
 	DeckCard* card                  = DeckCard::from_stack(L, 3);
+	std::string_view serialnumber   = LuaHelpers::check_arg_string_or_none(L, 4);
+
+	Device* device = nullptr;
+	if (!serialnumber.empty())
+		device = self->find_device(serialnumber);
+	else if (!self->m_devices.empty())
+		device = self->m_devices.front().get();
 
 	if (button < 1)
 	{
 		luaL_argerror(L, 2, "buttons start counting at 1");
 	}
-	else if (!self->m_hid_device)
+	else if (!device || !device->hid_device)
 	{
 		DeckLogger::lua_log_message(L, DeckLogger::Level::Warning, "Device is not connected");
 	}
@@ -319,72 +488,108 @@ int ConnectorElgatoStreamDeck::_lua_set_button(lua_State* L)
 	{
 		SDL_Surface* surface = card->get_surface();
 		if (surface)
-			self->set_button(button, surface);
+			self->set_button(*device, button, surface);
 	}
 
 	return 0;
 }
 
-void ConnectorElgatoStreamDeck::attempt_connect_device()
+void ConnectorElgatoStreamDeck::attempt_connect_devices()
 {
-	if (m_hid_device)
-		return;
+	std::vector<util::HidDeviceInfo> const& device_list = m_hid_backend->get_devices(0x0fd9);
+	std::size_t const max_devices                       = m_filter_all ? device_list.size() : std::max<std::size_t>(m_filter_serialnumbers.size(), 1);
+	bool found_any                                      = false;
 
-	SDL_hid_device_info* device_list = SDL_hid_enumerate(0x0fd9, 0);
-	if (!device_list)
+	for (util::HidDeviceInfo const& info : device_list)
 	{
-		m_last_error = "HID enumerate failed";
-		return;
-	}
+		if (m_devices.size() >= max_devices)
+			break;
 
-	bool found_any = false;
-
-	for (SDL_hid_device_info* info = device_list; info; info = info->next)
-	{
-		std::string_view model = get_model(info->product_id);
+		std::string_view model = get_model(info.product_id);
 		if (!model.empty())
 		{
 			found_any = true;
 
-			std::string device_serialnumber = convert(info->serial_number);
-			if (!m_filter_serialnumber.empty() && device_serialnumber != m_filter_serialnumber)
+			if (!wants_device(info.serial_number))
 			{
-				m_last_error = "Device ignored due to serialnumber mismatch (expected " + m_filter_serialnumber + ')';
+				m_last_error = "Device " + info.serial_number + " ignored due to serialnumber mismatch";
 				continue;
 			}
 
-			if (!m_hid_device)
+			if (find_device(info.serial_number))
+				continue;
+
+			std::unique_ptr<util::HidDevice> hid_device = m_hid_backend->open(info);
+			if (!hid_device)
 			{
-				m_hid_device = SDL_hid_open_path(info->path, false);
-				if (!m_hid_device)
-				{
-					m_last_error  = "Open failed: ";
-					m_last_error += SDL_GetError();
-				}
-				else
-				{
-					m_serialnumber.swap(device_serialnumber);
-					m_vid         = info->vendor_id;
-					m_pid         = info->product_id;
-					m_button_size = (info->product_id == 0x006c) ? 96 : 72;
-					break;
-				}
+				m_last_error  = "Open failed: ";
+				m_last_error += m_hid_backend->get_last_error();
+			}
+			else
+			{
+				std::unique_ptr<Device> device = std::make_unique<Device>();
+				device->hid_device             = std::move(hid_device);
+				device->serialnumber           = info.serial_number;
+				device->vid                    = info.vendor_id;
+				device->pid                    = info.product_id;
+				device->button_size            = (info.product_id == 0x006c) ? 96 : 72;
+				device->is_new                 = true;
+				device->actual_brightness      = INVALID_BRIGHTNESS;
+				m_devices.push_back(std::move(device));
+				m_last_error.clear();
 			}
 		}
 	}
 
-	SDL_hid_free_enumeration(device_list);
-
 	if (!found_any)
 		m_last_error = "No suitable devices found";
+}
+
+bool ConnectorElgatoStreamDeck::wants_device(std::string_view const& serialnumber) const
+{
+	if (m_filter_all || m_filter_serialnumbers.empty())
+		return true;
+
+	return std::find(m_filter_serialnumbers.begin(), m_filter_serialnumbers.end(), serialnumber) != m_filter_serialnumbers.end();
+}
+
+ConnectorElgatoStreamDeck::Device* ConnectorElgatoStreamDeck::find_device(std::string_view const& serialnumber)
+{
+	for (std::unique_ptr<Device>& device : m_devices)
+		if (device->serialnumber == serialnumber)
+			return device.get();
+	return nullptr;
+}
+
+void ConnectorElgatoStreamDeck::collect_encoded_images(Device& device)
+{
+	for (auto& encoding : device.buttons_encoding)
+	{
+		JpegEncoder::instance().wait(*encoding.second);
+
+		std::vector<unsigned char>& bytes = encoding.second->bytes;
+		if (bytes.empty())
+			continue;
+
+		bool found = false;
+		for (auto& todo : device.buttons_image)
+		{
+			if (todo.first == encoding.first)
+			{
+				todo.second.swap(bytes);
+				found = true;
+			}
+		}
 
-	if (m_hid_device)
-		m_last_error.clear();
+		if (!found)
+			device.buttons_image.emplace_back(std::make_pair(encoding.first, std::move(bytes)));
+	}
+	device.buttons_encoding.clear();
 }
 
-void ConnectorElgatoStreamDeck::write_brightness(unsigned char value)
+void ConnectorElgatoStreamDeck::write_brightness(Device& device, unsigned char value)
 {
-	if (m_hid_device && value != INVALID_BRIGHTNESS)
+	if (device.hid_device && value != INVALID_BRIGHTNESS)
 	{
 		if (value > 100)
 			value = 100;
@@ -394,23 +599,23 @@ void ConnectorElgatoStreamDeck::write_brightness(unsigned char value)
 		m_buffer[1] = 0x08;
 		m_buffer[2] = value;
 
-		int result = SDL_hid_send_feature_report(m_hid_device, m_buffer.data(), 32);
+		int result = device.hid_device->send_feature_report(m_buffer.data(), 32);
 		if (result == -1)
 		{
 			m_last_error  = "Send feature report failed: ";
-			m_last_error += SDL_GetError();
-			force_disconnect();
+			m_last_error += m_hid_backend->get_last_error();
+			force_disconnect(device);
 		}
 		else
 		{
-			m_actual_brightness = value;
+			device.actual_brightness = value;
 		}
 	}
 }
 
-void ConnectorElgatoStreamDeck::write_image_data(unsigned char button, std::vector<unsigned char> const& bytes)
+void ConnectorElgatoStreamDeck::write_image_data(Device& device, unsigned char button, std::vector<unsigned char> const& bytes)
 {
-	if (!m_hid_device)
+	if (!device.hid_device)
 		return;
 
 	int const max_payload_size = 1024 - 8;
@@ -418,7 +623,7 @@ void ConnectorElgatoStreamDeck::write_image_data(unsigned char button, std::vect
 	std::size_t total_sent  = 0;
 	std::uint16_t iteration = 0;
 
-	while (total_sent < bytes.size())
+	while (device.hid_device && total_sent < bytes.size())
 	{
 		std::size_t remaining      = bytes.size() - total_sent;
 		bool last_packet           = remaining <= max_payload_size;
@@ -440,11 +645,11 @@ void ConnectorElgatoStreamDeck::write_image_data(unsigned char button, std::vect
 		std::size_t sent = 0;
 		while (sent < m_buffer.size())
 		{
-			int result = SDL_hid_write(m_hid_device, m_buffer.data() + sent, m_buffer.size() - sent);
+			int result = device.hid_device->write(m_buffer.data() + sent, m_buffer.size() - sent);
 			if (result <= 0)
 			{
 				m_last_error = "HID write failed";
-				force_disconnect();
+				force_disconnect(device);
 				break;
 			}
 			sent += result;
@@ -455,38 +660,38 @@ void ConnectorElgatoStreamDeck::write_image_data(unsigned char button, std::vect
 	}
 }
 
-void ConnectorElgatoStreamDeck::set_button(unsigned char button, SDL_Surface* surface)
+void ConnectorElgatoStreamDeck::set_button(Device& device, unsigned char button, SDL_Surface* surface)
 {
 	if (!surface)
 		return;
 
-	std::vector<unsigned char> bytes;
+	int const button_size = device.button_size;
 
 	// Elgato has the buttons rotated 180 degrees so we need to make a copy and shuffle the pixels...
 	// There's a chance the surfaces are not continguous, so we have to reverse all pixel data per row
 	SDL_Surface* new_surface;
 
-	if (surface->w == m_button_size && surface->h == m_button_size)
+	if (surface->w == button_size && surface->h == button_size)
 	{
-		new_surface = SDL_CreateRGBSurfaceWithFormat(0, m_button_size, m_button_size, 32, SDL_PIXELFORMAT_RGBA32);
+		new_surface = SDL_CreateRGBSurfaceWithFormat(0, button_size, button_size, 32, SDL_PIXELFORMAT_RGBA32);
 
 		unsigned char* source_data = reinterpret_cast<unsigned char*>(surface->pixels);
 		unsigned char* target_data = reinterpret_cast<unsigned char*>(new_surface->pixels) + (new_surface->h * new_surface->pitch);
 
-		for (int y = 0; y < m_button_size; ++y)
+		for (int y = 0; y < button_size; ++y)
 		{
 			target_data -= new_surface->pitch;
 
 			std::uint32_t const* source = reinterpret_cast<std::uint32_t*>(source_data);
 			std::uint32_t* target       = reinterpret_cast<std::uint32_t*>(target_data);
-			std::reverse_copy(source, source + m_button_size, target);
+			std::reverse_copy(source, source + button_size, target);
 
 			source_data += surface->pitch;
 		}
 	}
 	else
 	{
-		new_surface = DeckCard::resize_surface(surface, m_button_size, m_button_size);
+		new_surface = DeckCard::resize_surface(surface, button_size, button_size);
 
 		unsigned char* start_data = reinterpret_cast<unsigned char*>(new_surface->pixels);
 		unsigned char* end_data   = start_data + (new_surface->h * new_surface->pitch);
@@ -512,48 +717,48 @@ void ConnectorElgatoStreamDeck::set_button(unsigned char button, SDL_Surface* su
 		}
 	}
 
-	bytes = DeckCard::save_surface_as_jpeg(new_surface);
-	SDL_FreeSurface(new_surface);
+	// The actual encoding is done by the shared encoder, results are collected in tick_outputs
+	std::shared_ptr<JpegJob> job = std::make_shared<JpegJob>();
+	job->surface                   = new_surface;
+	job->done                      = false;
+	JpegEncoder::instance().submit(job);
 
-	if (!bytes.empty())
-	{
-		--button;
+	--button;
 
-		bool found = false;
-		for (auto& todo : m_buttons_image)
+	bool found = false;
+	for (auto& todo : device.buttons_encoding)
+	{
+		if (todo.first == button)
 		{
-			if (todo.first == button)
-			{
-				todo.second.swap(bytes);
-				found = true;
-			}
+			todo.second = job;
+			found       = true;
 		}
-
-		if (!found)
-			m_buttons_image.emplace_back(std::make_pair(button, std::move(bytes)));
 	}
+
+	if (!found)
+		device.buttons_encoding.emplace_back(std::make_pair(button, std::move(job)));
 }
 
-bool ConnectorElgatoStreamDeck::update_button_state()
+bool ConnectorElgatoStreamDeck::update_button_state(Device& device)
 {
-	if (m_hid_device)
+	if (device.hid_device)
 	{
-		int len = SDL_hid_read_timeout(m_hid_device, m_buffer.data(), m_buffer.size(), 0);
+		int len = device.hid_device->read_timeout(m_buffer.data(), m_buffer.size(), 0);
 		if (len == -1)
 		{
 			m_last_error = "HID read failed";
-			force_disconnect();
+			force_disconnect(device);
 		}
 		else if (len >= 4 && m_buffer[0] == 0x01) // button report
 		{
 			std::uint16_t num_buttons = m_buffer[2] + (m_buffer[3] << 8);
 			if (len >= 4 + num_buttons)
 			{
-				m_buttons_new_state.resize(num_buttons);
+				device.buttons_new_state.resize(num_buttons);
 				for (std::uint16_t idx = 0; idx < num_buttons; ++idx)
 				{
-					bool new_state           = m_buffer[4 + idx] != 0;
-					m_buttons_new_state[idx] = new_state;
+					bool new_state                 = m_buffer[4 + idx] != 0;
+					device.buttons_new_state[idx] = new_state;
 				}
 				return true;
 			}
@@ -562,11 +767,30 @@ bool ConnectorElgatoStreamDeck::update_button_state()
 	return false;
 }
 
-void ConnectorElgatoStreamDeck::force_disconnect()
+void ConnectorElgatoStreamDeck::force_disconnect(Device& device)
 {
-	if (m_hid_device)
+	device.hid_device.reset();
+}
+
+void ConnectorElgatoStreamDeck::emit_disconnects(lua_State* L)
+{
+	std::vector<std::string> disconnected;
+
+	for (auto iter = m_devices.begin(); iter != m_devices.end();)
 	{
-		SDL_hid_close(m_hid_device);
-		m_hid_device = nullptr;
+		Device& device = **iter;
+		if (device.hid_device)
+		{
+			++iter;
+			continue;
+		}
+
+		if (!device.is_new)
+			disconnected.push_back(std::move(device.serialnumber));
+
+		iter = m_devices.erase(iter);
 	}
+
+	for (std::string const& serialnumber : disconnected)
+		LuaHelpers::emit_event(L, 1, "on_disconnect", serialnumber);
 }
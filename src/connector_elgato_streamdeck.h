@@ -20,7 +20,7 @@
 #define DECK_ASSISTANT_CONNECTOR_ELGATO_STREAMDECK_H
 
 #include "connector_base.h"
-#include <SDL_hidapi.h>
+#include "util_hid.h"
 #include <SDL_surface.h>
 #include <array>
 #include <cstdint>
@@ -28,6 +28,8 @@
 #include <string>
 #include <vector>
 
+struct JpegJob;
+
 class ConnectorElgatoStreamDeck : public ConnectorBase<ConnectorElgatoStreamDeck>
 {
 public:
@@ -38,6 +40,8 @@ public:
 	void tick_outputs(lua_State* L, lua_Integer clock) override;
 	void shutdown(lua_State* L) override;
 
+	void set_hid_backend(std::shared_ptr<util::HidBackend> backend);
+
 	static char const* LUA_TYPENAME;
 	static void init_class_table(lua_State* L);
 	void init_instance_table(lua_State* L);
@@ -52,30 +56,43 @@ private:
 	static int _lua_set_button(lua_State* L);
 
 private:
-	void attempt_connect_device();
-	void write_brightness(unsigned char value);
-	void write_image_data(unsigned char button, std::vector<unsigned char> const& bytes);
-	void set_button(unsigned char button, SDL_Surface* surface);
-	bool update_button_state();
-	void force_disconnect();
+	struct Device
+	{
+		std::unique_ptr<util::HidDevice> hid_device;
+		std::string serialnumber;
+		int vid;
+		int pid;
+		int button_size;
+		bool is_new;
+		unsigned char actual_brightness;
+		std::vector<bool> buttons_state;
+		std::vector<bool> buttons_new_state;
+		std::vector<std::pair<unsigned char, std::shared_ptr<JpegJob>>> buttons_encoding;
+		std::vector<std::pair<unsigned char, std::vector<unsigned char>>> buttons_image;
+	};
+
+	void attempt_connect_devices();
+	bool wants_device(std::string_view const& serialnumber) const;
+	Device* find_device(std::string_view const& serialnumber);
+	void collect_encoded_images(Device& device);
+	void write_brightness(Device& device, unsigned char value);
+	void write_image_data(Device& device, unsigned char button, std::vector<unsigned char> const& bytes);
+	void set_button(Device& device, unsigned char button, SDL_Surface* surface);
+	bool update_button_state(Device& device);
+	void force_disconnect(Device& device);
+	void emit_disconnects(lua_State* L);
 
 private:
-	SDL_hid_device* m_hid_device;
+	std::shared_ptr<util::HidBackend> m_hid_backend;
 	std::string m_last_error;
-	std::string m_filter_serialnumber;
+	std::vector<std::string> m_filter_serialnumbers;
+	bool m_filter_all;
 	std::uint32_t m_hid_last_scan;
 
-	std::string m_serialnumber;
-	int m_vid;
-	int m_pid;
-	int m_button_size;
+	std::vector<std::unique_ptr<Device>> m_devices;
 
 	unsigned char m_wanted_brightness;
-	unsigned char m_actual_brightness;
 	std::array<unsigned char, 1024> m_buffer;
-	std::vector<bool> m_buttons_state;
-	std::vector<bool> m_buttons_new_state;
-	std::vector<std::pair<unsigned char, std::vector<unsigned char>>> m_buttons_image;
 };
 
 #endif // DECK_ASSISTANT_CONNECTOR_ELGATO_STREAMDECK_H
@@ -0,0 +1,255 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "connector_elgato_streamdeck.h"
+#include "deck_card.h"
+#include "lua_helpers.h"
+#include "test_utils_test.h"
+#include "util_hid_mock.h"
+#include <catch2/catch_test_macros.hpp>
+
+namespace
+{
+
+int g_connects;
+int g_presses;
+int g_releases;
+int g_last_button;
+
+int count_connect(lua_State* L)
+{
+	++g_connects;
+	return 0;
+}
+
+int count_press(lua_State* L)
+{
+	++g_presses;
+	g_last_button = lua_tointeger(L, 2);
+	return 0;
+}
+
+int count_release(lua_State* L)
+{
+	++g_releases;
+	g_last_button = lua_tointeger(L, 2);
+	return 0;
+}
+
+void call_set_button(lua_State* L, int deck_idx, int button, int card_idx, char const* serialnumber = nullptr)
+{
+	lua_getfield(L, deck_idx, "set_button");
+	lua_pushvalue(L, deck_idx);
+	lua_pushinteger(L, button);
+	lua_pushvalue(L, card_idx);
+	if (serialnumber)
+		lua_pushstring(L, serialnumber);
+	else
+		lua_pushnil(L);
+	lua_call(L, 4, 0);
+}
+
+} // namespace
+
+TEST_CASE("ConnectorElgatoStreamDeck", "[connector]")
+{
+	lua_State* L = new_test_state();
+
+	std::shared_ptr<util::HidMock> mock               = std::make_shared<util::HidMock>();
+	std::shared_ptr<util::HidMock::Device> mock_deck = mock->add_device(0x006c, "MOCK-XL-1");
+
+	ConnectorElgatoStreamDeck* deck = ConnectorElgatoStreamDeck::push_new(L);
+	deck->set_hid_backend(mock);
+
+	lua_pushcfunction(L, &count_connect);
+	lua_setfield(L, 1, "on_connect");
+	lua_pushcfunction(L, &count_press);
+	lua_setfield(L, 1, "on_press");
+	lua_pushcfunction(L, &count_release);
+	lua_setfield(L, 1, "on_release");
+
+	g_connects    = 0;
+	g_presses     = 0;
+	g_releases    = 0;
+	g_last_button = 0;
+
+	deck->tick_inputs(L, 0);
+	REQUIRE(lua_gettop(L) == 1);
+
+	SECTION("Connect")
+	{
+		REQUIRE(g_connects == 1);
+
+		lua_getfield(L, 1, "connected");
+		REQUIRE(lua_toboolean(L, -1));
+
+		lua_getfield(L, 1, "model");
+		REQUIRE(LuaHelpers::to_string_view(L, -1) == "Stream Deck XL");
+
+		lua_getfield(L, 1, "serialnumber");
+		REQUIRE(LuaHelpers::to_string_view(L, -1) == "MOCK-XL-1");
+	}
+
+	SECTION("Disconnect")
+	{
+		mock->remove_device(mock_deck);
+		deck->tick_inputs(L, 1);
+
+		lua_getfield(L, 1, "connected");
+		REQUIRE(!lua_toboolean(L, -1));
+	}
+
+	SECTION("Button input replay")
+	{
+		mock_deck->queue_press(3);
+		mock_deck->queue_release(3);
+		mock_deck->queue_press(31);
+		REQUIRE(mock_deck->get_pending_reports() == 3);
+
+		deck->tick_inputs(L, 1);
+		REQUIRE(g_presses == 1);
+		REQUIRE(g_releases == 0);
+		REQUIRE(g_last_button == 4);
+
+		deck->tick_inputs(L, 2);
+		deck->tick_inputs(L, 3);
+		REQUIRE(g_presses == 2);
+		REQUIRE(g_releases == 1);
+		REQUIRE(g_last_button == 32);
+
+		REQUIRE(mock_deck->get_pending_reports() == 0);
+		REQUIRE(mock_deck->get_reports_delivered() == 3);
+		REQUIRE(lua_gettop(L) == 1);
+	}
+
+	SECTION("Button input replay rate")
+	{
+		mock_deck->set_replay_rate(1);
+		mock_deck->queue_press(0);
+		mock_deck->queue_release(0);
+
+		deck->tick_inputs(L, 1);
+		deck->tick_inputs(L, 2);
+		REQUIRE(g_presses == 1);
+		REQUIRE(g_releases == 0);
+		REQUIRE(mock_deck->get_pending_reports() == 1);
+	}
+
+	SECTION("Brightness")
+	{
+		lua_pushinteger(L, 150);
+		lua_setfield(L, 1, "brightness");
+		deck->tick_outputs(L, 1);
+
+		REQUIRE(mock_deck->get_brightness() == 100);
+		REQUIRE(mock_deck->get_protocol_errors() == 0);
+	}
+
+	SECTION("Image upload")
+	{
+		SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(0, 120, 120, 32, SDL_PIXELFORMAT_RGBA32);
+		REQUIRE(surface != nullptr);
+		SDL_FillRect(surface, nullptr, SDL_MapRGB(surface->format, 200, 100, 50));
+		DeckCard::push_new(L, surface);
+
+		for (int button = 1; button <= 32; ++button)
+			call_set_button(L, 1, button, 2);
+
+		// Replacing a pending image must not cause a second upload
+		call_set_button(L, 1, 5, 2);
+
+		lua_settop(L, 1);
+		deck->tick_outputs(L, 1);
+
+		auto const& images = mock_deck->get_images();
+		REQUIRE(images.size() == 32);
+		REQUIRE(mock_deck->get_protocol_errors() == 0);
+		REQUIRE(mock_deck->get_packets_written() == mock_deck->get_packets().size());
+		REQUIRE(mock_deck->get_bytes_written() == mock_deck->get_packets_written() * 1024);
+
+		for (auto const& image : images)
+		{
+			REQUIRE(image.data.size() > 2);
+			REQUIRE(image.data[0] == 0xff);
+			REQUIRE(image.data[1] == 0xd8);
+			REQUIRE(image.completed >= image.started);
+		}
+	}
+
+	SECTION("Multiple devices")
+	{
+		std::shared_ptr<util::HidMock::Device> mock_mini = mock->add_device(0x0063, "MOCK-MINI-1");
+		mock->add_device(0x006d, "MOCK-V2-1");
+
+		lua_pushliteral(L, "*");
+		lua_setfield(L, 1, "serialnumbers");
+		deck->tick_inputs(L, 1);
+		REQUIRE(g_connects == 3);
+
+		lua_getfield(L, 1, "serialnumbers");
+		REQUIRE(lua_objlen(L, -1) == 3);
+		lua_pop(L, 1);
+
+		// A second connector must reuse the enumeration of the first
+		std::size_t const enumerations = mock->get_enumerate_count();
+		ConnectorElgatoStreamDeck* deck2 = ConnectorElgatoStreamDeck::push_new(L);
+		deck2->set_hid_backend(mock);
+		lua_pushliteral(L, "MOCK-V2-1");
+		lua_setfield(L, -2, "serialnumbers");
+		lua_insert(L, 1);
+		deck2->tick_inputs(L, 1);
+		lua_remove(L, 1);
+		REQUIRE(mock->get_enumerate_count() == enumerations);
+		REQUIRE(g_connects == 3);
+
+		mock_mini->queue_press(5);
+		deck->tick_inputs(L, 2);
+		REQUIRE(g_presses == 1);
+		REQUIRE(g_last_button == 6);
+
+		SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(0, 72, 72, 32, SDL_PIXELFORMAT_RGBA32);
+		REQUIRE(surface != nullptr);
+		DeckCard::push_new(L, surface);
+
+		for (int button = 1; button <= 6; ++button)
+		{
+			call_set_button(L, 1, button, 2, "MOCK-XL-1");
+			call_set_button(L, 1, button, 2, "MOCK-MINI-1");
+		}
+
+		lua_settop(L, 1);
+		deck->tick_outputs(L, 2);
+
+		REQUIRE(mock_deck->get_images().size() == 6);
+		REQUIRE(mock_mini->get_images().size() == 6);
+		REQUIRE(mock_mini->get_protocol_errors() == 0);
+
+		// Uploads are interleaved between the devices
+		REQUIRE(mock_mini->get_images().front().completed < mock_deck->get_images().back().completed);
+
+		mock->remove_device(mock_mini);
+		deck->tick_inputs(L, 3);
+
+		lua_getfield(L, 1, "serialnumbers");
+		REQUIRE(lua_objlen(L, -1) == 2);
+		lua_pop(L, 1);
+	}
+
+	lua_close(L);
+}
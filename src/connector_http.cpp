@@ -20,10 +20,11 @@
 #include "deck_logger.h"
 #include "deck_promise_list.h"
 #include "lua_helpers.h"
+#include "util_deflate.h"
 #include "util_text.h"
+#include "util_tls_session.h"
 #include "util_url.h"
 #include <cassert>
-#include <charconv>
 #include <string>
 
 using namespace std::literals::string_view_literals;
@@ -35,6 +36,18 @@ constexpr std::string_view const g_content_type     = "Content-Type";
 constexpr std::string_view const g_header_separator = ": ";
 constexpr std::string_view const g_header_newline   = "\r\n";
 
+// Idle keep-alive connections are closed after this long; most servers give up somewhere between 5 and 60 seconds
+constexpr lua_Integer const DEFAULT_KEEPALIVE_TIMEOUT = 15000;
+
+// Requests sent ahead while waiting for a response, when pipelining is enabled
+constexpr std::size_t const MAX_PIPELINE_DEPTH = 8;
+
+// Upper limit for the number of parallel connections per connector
+constexpr std::size_t const MAX_POOL_SIZE = 16;
+
+// Address used as key for the table of streaming callbacks in the instance table
+char const g_stream_callbacks_key = 0;
+
 DeckPromiseList* push_promise_list(lua_State* L)
 {
 	LuaHelpers::push_instance_table(L, 1);
@@ -58,308 +71,140 @@ void push_error_response(lua_State* L, std::string_view const& err)
 	lua_setfield(L, -2, "error");
 }
 
-int convert_to_http_message(lua_State* L, std::string_view const& input, bool is_eof)
+void push_http_response(lua_State* L, util::HttpResponseParser& parser)
 {
-	std::string_view error;
+	util::HttpResponseParser::Headers const& headers = parser.get_headers();
+	std::string const& body                          = parser.get_body();
 
-	util::HttpMessage http = util::parse_http_message(input);
-	if (!http.error.empty())
-	{
-		error = http.error;
-	}
-	else if (http.body_start == 0)
-	{
-		if (is_eof)
-			error = "EOF before response finished";
-	}
-	else
-	{
-		std::size_t const body_size = input.size() - http.body_start;
-		bool is_done                = false;
+	lua_createtable(L, 0, 4);
 
-		auto found_content_length = http.headers.find("Content-Length");
-		if (found_content_length == http.headers.cend())
-		{
-			is_done = is_eof;
-		}
-		else
-		{
-			int content_length = 0;
-			char const* first  = found_content_length->second.data();
-			char const* last   = first + found_content_length->second.size();
-			auto result        = std::from_chars(first, last, content_length, 10);
-			if (result.ec != std::errc() || result.ptr != last || content_length < 0)
-			{
-				error = "Invalid Content-Length in response";
-			}
-			else if (body_size < std::size_t(content_length))
-			{
-				if (is_eof)
-					error = "EOF before response finished";
-			}
-			else
-			{
-				is_done = true;
-			}
-		}
-
-		if (is_done)
-		{
-			lua_createtable(L, 0, 3);
-
-			lua_pushboolean(L, true);
-			lua_setfield(L, -2, "ok");
-
-			lua_pushinteger(L, http.response_status_code);
-			lua_setfield(L, -2, "code");
-
-			lua_createtable(L, 0, http.headers.size());
-			for (auto const& header : http.headers)
-			{
-				lua_pushlstring(L, header.first.data(), header.first.size());
-				lua_pushlstring(L, header.second.data(), header.second.size());
-				lua_rawset(L, -3);
-			}
-			lua_setfield(L, -2, "headers");
+	lua_pushboolean(L, true);
+	lua_setfield(L, -2, "ok");
 
-			if (body_size > 0)
-			{
-				lua_pushlstring(L, input.data() + http.body_start, body_size);
-				lua_setfield(L, -2, "body");
-			}
+	lua_pushinteger(L, parser.get_status_code());
+	lua_setfield(L, -2, "code");
 
-			return 1;
-		}
+	lua_createtable(L, 0, headers.size());
+	for (auto const& header : headers)
+	{
+		lua_pushlstring(L, header.first.data(), header.first.size());
+		lua_pushlstring(L, header.second.data(), header.second.size());
+		lua_rawset(L, -3);
 	}
+	lua_setfield(L, -2, "headers");
 
-	if (!error.empty())
+	if (!body.empty())
 	{
-		push_error_response(L, error);
-		return -1;
+		lua_pushlstring(L, body.data(), body.size());
+		lua_setfield(L, -2, "body");
 	}
+}
 
-	return 0;
+bool is_content_type(std::string_view const& content_type, std::string_view const& mimetype)
+{
+	std::string_view const value = util::split1(content_type, ";", true).first;
+	return util::nocase_equals(value, mimetype);
 }
 
 } // namespace
 
 char const* ConnectorHttp::LUA_TYPENAME = "deck:ConnectorHttp";
 
+ConnectorHttp::Connection::Connection(std::shared_ptr<util::SocketSet> const& socketset)
+    : socket(socketset)
+    , stream_mode(StreamMode::Pending)
+    , request_started_at(0)
+    , last_activity(0)
+    , next_connect_attempt(0)
+    , connect_attempts(0)
+    , responses_on_connection(0)
+    , total_connects(0)
+    , total_responses(0)
+    , total_failures(0)
+    , total_bytes_sent(0)
+    , total_bytes_received(0)
+{
+	parser.set_decompression(util::Deflate::is_available());
+}
+
 ConnectorHttp::ConnectorHttp(std::shared_ptr<util::SocketSet> const& socketset)
-    : m_socket(socketset)
+    : m_socketset(socketset)
     , m_request_timeout(2000)
-    , m_request_started_at(0)
-    , m_next_connect_attempt(0)
+    , m_keepalive_timeout(DEFAULT_KEEPALIVE_TIMEOUT)
+    , m_pool_size(1)
     , m_request_counter(0)
-    , m_connect_attempts(0)
     , m_enabled(true)
     , m_insecure(false)
+    , m_pipelining(false)
+    , m_compression(util::Deflate::is_available())
 {
 	m_default_headers.reserve(4);
+	m_connections.reserve(MAX_POOL_SIZE);
 }
 
 ConnectorHttp::~ConnectorHttp()
 {
-	m_enabled            = false;
-	m_request_started_at = 0;
-	while (!m_queue.empty())
-		m_queue.pop();
+	m_enabled = false;
+	m_connections.clear();
+	m_queue.clear();
 }
 
 void ConnectorHttp::tick_inputs(lua_State* L, lua_Integer clock)
 {
-	if (!m_request_started_at)
-		return;
-
-	switch (m_socket.get_state())
-	{
-		case util::Socket::State::Disconnected:
-		case util::Socket::State::Connecting:
-			return;
-
-		case util::Socket::State::TLSHandshaking:
-			m_socket.tls_handshake();
-			return;
-
-		case util::Socket::State::Connected:
-			break;
-	}
-
-	if (m_response.space() < 1024)
-		m_response.reserve(m_response.capacity() + 4096);
-
-	int read_result  = m_socket.read_nonblock(m_response.tail(), m_response.space());
-	int have_message = 0;
-
-	if (read_result < 0)
-		DeckLogger::log_message(L, DeckLogger::Level::Debug, "ConnectorHttp ", m_base_url.get_connection_string(), " connection closed by peer");
-
-	if (read_result > 0)
-	{
-		m_response.added_to_tail(read_result);
-		m_connect_attempts = 0;
-	}
+	for (ConnectionPtr const& conn : m_connections)
+		tick_inputs(L, clock, *conn);
+}
 
-	if (read_result != 0)
-		have_message = convert_to_http_message(L, m_response.to_bin(), read_result < 0);
+void ConnectorHttp::tick_outputs(lua_State* L, lua_Integer clock)
+{
+	while (m_connections.size() < m_pool_size)
+		m_connections.push_back(std::make_unique<Connection>(m_socketset));
 
-	if (have_message == 0)
+	// Only open as many connections as the queue needs, counting those that are already on their way
+	std::size_t available = 0;
+	for (ConnectionPtr const& conn : m_connections)
 	{
-		if (read_result < 0)
-		{
-			push_error_response(L, "Connection closed by peer");
-			have_message = -1;
-		}
-		else if (clock > m_request_started_at + m_request_timeout)
-		{
-			DeckLogger::log_message(L, DeckLogger::Level::Debug, "ConnectorHttp ", m_base_url.get_connection_string(), " request timed out, closing socket");
-			m_socket.shutdown();
-			m_socket.close();
-			m_connect_attempts = 0;
-
-			push_error_response(L, "Request timed out");
-			have_message = -1;
-		}
+		util::Socket::State const state = conn->socket.get_state();
+		if (state == util::Socket::State::Connecting || state == util::Socket::State::TLSHandshaking || (state == util::Socket::State::Connected && conn->requests.empty()))
+			++available;
 	}
 
-	if (have_message != 0)
+	for (std::size_t i = 0; i < m_connections.size(); ++i)
 	{
-		m_next_connect_attempt = clock + 200;
+		Connection& conn = *m_connections[i];
 
-		DeckPromiseList* promise_list = push_promise_list(L);
-		lua_pushinteger(L, m_queue.front().promise);
-		lua_pushvalue(L, -3);
-
-		if (!promise_list->fulfill_promise(L))
-		{
-			if (have_message < 0)
-			{
-				lua_getfield(L, -2, "error");
-				LuaHelpers::emit_event(L, 1, "on_request_failed", LuaHelpers::StackValue(L, -1));
-			}
-			else
-			{
-				lua_pushvalue(L, -2);
-				LuaHelpers::emit_event(L, 1, "on_response", LuaHelpers::StackValue(L, -1));
-			}
-		}
+		util::Socket::State const state = conn.socket.get_state();
+		bool const wanted               = i < m_pool_size && m_queue.size() > available;
 
-		lua_pop(L, 3);
+		tick_outputs(L, clock, conn, wanted);
 
-		m_response.clear();
-		m_queue.pop();
-		m_request_started_at = 0;
+		if (state == util::Socket::State::Disconnected && conn.socket.get_state() != util::Socket::State::Disconnected)
+			++available;
 	}
-}
 
-void ConnectorHttp::tick_outputs(lua_State* L, lua_Integer clock)
-{
-	util::Socket::State const state = m_socket.get_state();
+	dispatch_requests(clock);
 
-	switch (state)
+	// Connections beyond a shrunk pool size are dropped once they have nothing left in flight
+	while (m_connections.size() > m_pool_size && m_connections.back()->requests.empty())
 	{
-		case util::Socket::State::Disconnected:
-			if (!m_queue.empty() && m_enabled && clock >= m_next_connect_attempt)
-			{
-				m_queue.front().payload.rewind();
-				m_response.clear();
-
-				std::string_view err = m_socket.get_last_error();
-
-				++m_connect_attempts;
-				if (m_connect_attempts > 1)
-					DeckLogger::log_message(L, DeckLogger::Level::Warning, "ConnectorHttp ", m_base_url.get_connection_string(), " connection reset: ", err);
-
-				if (m_connect_attempts > 3)
-				{
-					DeckLogger::log_message(L, DeckLogger::Level::Error, "ConnectorHttp ", m_base_url.get_connection_string(), " too many connection errors, connector paused");
-
-					// TODO cancel all pending promises instead of just the front
-
-					DeckPromiseList* promise_list = push_promise_list(L);
-					push_error_response(L, err);
-
-					if (!promise_list->fulfill_all_promises(L))
-						LuaHelpers::emit_event(L, 1, "on_request_failed", err);
-
-					lua_pop(L, 1);
-
-					while (!m_queue.empty())
-						m_queue.pop();
-
-					m_connect_attempts     = 0;
-					m_next_connect_attempt = clock + 6000;
-				}
-				else
-				{
-					bool const use_tls = m_base_url.get_schema() == "https";
-
-					int port = m_base_url.get_port();
-					if (!port)
-						port = use_tls ? 443 : 80;
-
-					util::Socket::TLS tls;
-					if (!use_tls)
-						tls = util::Socket::TLS::NoTLS;
-					else if (m_insecure)
-						tls = util::Socket::TLS::TLSNoVerify;
-					else
-						tls = util::Socket::TLS::TLS;
-
-					DeckLogger::log_message(L, DeckLogger::Level::Debug, "ConnectorHttp ", m_base_url.get_connection_string(), " connecting to server");
-					m_socket.set_tls(tls);
-					m_socket.start_connect(m_base_url.get_host(), port);
-					m_next_connect_attempt = clock + 1000;
-				}
-			}
-			break;
-
-		case util::Socket::State::Connecting:
-			break;
-
-		case util::Socket::State::TLSHandshaking:
-			m_socket.tls_handshake();
-			break;
-
-		case util::Socket::State::Connected:
-			if (m_queue.empty())
-			{
-				DeckLogger::log_message(L, DeckLogger::Level::Debug, "ConnectorHttp ", m_base_url.get_connection_string(), " queue empty, closing socket");
-				m_socket.shutdown();
-				m_socket.close();
-			}
-			else if (!m_enabled)
-			{
-				DeckLogger::log_message(L, DeckLogger::Level::Debug, "ConnectorHttp ", m_base_url.get_connection_string(), " disabled, closing socket");
-				m_socket.shutdown();
-				m_socket.close();
-			}
-			else
-			{
-				if (!m_request_started_at)
-					m_request_started_at = clock;
-
-				util::BlobBuffer& outbuf = m_queue.front().payload;
-				if (!outbuf.empty())
-				{
-					m_socket.write(outbuf.data(), outbuf.size());
-					outbuf.advance(outbuf.size());
-				}
-			}
-			break;
+		m_connections.back()->socket.shutdown();
+		m_connections.back()->socket.close();
+		m_connections.pop_back();
 	}
 }
 
 void ConnectorHttp::shutdown(lua_State* L)
 {
-	m_enabled            = false;
-	m_request_started_at = 0;
-	m_response.release();
-	while (!m_queue.empty())
-		m_queue.pop();
-
-	m_socket.shutdown();
-	m_socket.close();
+	m_enabled = false;
+	m_queue.clear();
+
+	for (ConnectionPtr const& conn : m_connections)
+	{
+		conn->requests.clear();
+		conn->response.release();
+		conn->socket.shutdown();
+		conn->socket.close();
+	}
 }
 
 void ConnectorHttp::init_class_table(lua_State* L)
@@ -392,6 +237,10 @@ void ConnectorHttp::init_instance_table(lua_State* L)
 	DeckPromiseList::push_new(L, 10000);
 	lua_settable(L, -3);
 
+	lua_pushlightuserdata(L, (void*)&g_stream_callbacks_key);
+	lua_createtable(L, 0, 0);
+	lua_rawset(L, -3);
+
 	LuaHelpers::create_callback_warning(L, "on_request_failed");
 	LuaHelpers::create_callback_warning(L, "on_response");
 }
@@ -436,6 +285,40 @@ int ConnectorHttp::index(lua_State* L, std::string_view const& key) const
 	{
 		lua_pushinteger(L, m_request_timeout);
 	}
+	else if (key == "keepalive_timeout")
+	{
+		lua_pushinteger(L, m_keepalive_timeout);
+	}
+	else if (key == "pipelining")
+	{
+		lua_pushboolean(L, m_pipelining);
+	}
+	else if (key == "pool_size")
+	{
+		lua_pushinteger(L, lua_Integer(m_pool_size));
+	}
+	else if (key == "queued_requests")
+	{
+		lua_pushinteger(L, lua_Integer(m_queue.size()));
+	}
+	else if (key == "connections")
+	{
+		push_connection_stats(L);
+	}
+	else if (key == "compression")
+	{
+		lua_pushboolean(L, m_compression);
+	}
+	else if (key == "compression_stats")
+	{
+		lua_createtable(L, 0, 3);
+		lua_pushinteger(L, lua_Integer(m_compression_stats.received));
+		lua_setfield(L, -2, "received");
+		lua_pushinteger(L, lua_Integer(m_compression_stats.received_inflated));
+		lua_setfield(L, -2, "received_inflated");
+		lua_pushnumber(L, m_compression_stats.received ? double(m_compression_stats.received_inflated) / double(m_compression_stats.received) : 1.0);
+		lua_setfield(L, -2, "ratio");
+	}
 	else if (key == "connection_string")
 	{
 		std::string_view const value = m_base_url.get_connection_string();
@@ -482,6 +365,11 @@ int ConnectorHttp::newindex(lua_State* L, std::string_view const& key)
 	else if (key == "insecure")
 	{
 		bool value = LuaHelpers::check_arg_bool(L, 3);
+
+		// Sessions cached under the old setting are not reused, connects start with a full handshake again
+		if (value != m_insecure)
+			util::TLSSession::flush_session_cache();
+
 		m_insecure = value;
 	}
 	else if (key == "tls")
@@ -494,6 +382,32 @@ int ConnectorHttp::newindex(lua_State* L, std::string_view const& key)
 		lua_Integer value = LuaHelpers::check_arg_int(L, 3);
 		m_request_timeout = value;
 	}
+	else if (key == "keepalive_timeout")
+	{
+		lua_Integer value = LuaHelpers::check_arg_int(L, 3);
+		luaL_argcheck(L, (value >= 0), 3, "keepalive_timeout must not be negative");
+		m_keepalive_timeout = value;
+	}
+	else if (key == "pipelining")
+	{
+		m_pipelining = LuaHelpers::check_arg_bool(L, 3);
+	}
+	else if (key == "pool_size")
+	{
+		lua_Integer value = LuaHelpers::check_arg_int(L, 3);
+		luaL_argcheck(L, (value >= 1 && value <= lua_Integer(MAX_POOL_SIZE)), 3, "pool_size must be between 1 and 16");
+		m_pool_size = std::size_t(value);
+	}
+	else if (key == "queued_requests" || key == "connections" || key == "compression_stats")
+	{
+		luaL_error(L, "key %s is readonly for %s", key.data(), LUA_TYPENAME);
+	}
+	else if (key == "compression")
+	{
+		bool value = LuaHelpers::check_arg_bool(L, 3);
+		luaL_argcheck(L, (!value || util::Deflate::is_available()), 3, "compression is not supported by this build");
+		m_compression = value;
+	}
 	else if (key == "connection_string" || key == "base_url")
 	{
 		std::string_view value = LuaHelpers::check_arg_string(L, 3);
@@ -527,12 +441,14 @@ int ConnectorHttp::_lua_get(lua_State* L)
 	ConnectorHttp* self           = from_stack(L, 1);
 	std::string_view request_path = LuaHelpers::check_arg_string(L, 2);
 	int const htype               = lua_type(L, 3);
-	luaL_argcheck(L, (htype == LUA_TTABLE || htype == LUA_TNONE), 3, "GET extra headers must be a table");
+	int const ctype               = lua_type(L, 4);
+	luaL_argcheck(L, (htype == LUA_TTABLE || htype == LUA_TNIL || htype == LUA_TNONE), 3, "GET extra headers must be a table");
+	luaL_argcheck(L, (ctype == LUA_TFUNCTION || ctype == LUA_TNIL || ctype == LUA_TNONE), 4, "GET stream callback must be a function");
 
-	luaL_checktype(L, 4, LUA_TNONE);
+	luaL_checktype(L, 5, LUA_TNONE);
 
 	util::BlobBuffer payload = self->compose_payload(L, request_path, "GET", 3, std::string_view(), std::string_view());
-	int queue_result = self->queue_request(L, std::move(payload));
+	int queue_result = self->queue_request(L, std::move(payload), true, ctype == LUA_TFUNCTION ? 4 : 0);
 	if (!queue_result)
 		luaL_error(L, "ConnectorHttp failed to queue GET request");
 
@@ -548,10 +464,12 @@ int ConnectorHttp::_lua_post(lua_State* L)
 	std::string_view request_path = LuaHelpers::check_arg_string(L, 2);
 	int const vtype               = lua_type(L, 3);
 	int const htype               = lua_type(L, 4);
+	int const ctype               = lua_type(L, 5);
 	luaL_argcheck(L, (vtype == LUA_TTABLE || vtype == LUA_TSTRING), 3, "POST payload must be a string or table");
-	luaL_argcheck(L, (htype == LUA_TTABLE || htype == LUA_TNONE), 4, "POST extra headers must be a table");
+	luaL_argcheck(L, (htype == LUA_TTABLE || htype == LUA_TNIL || htype == LUA_TNONE), 4, "POST extra headers must be a table");
+	luaL_argcheck(L, (ctype == LUA_TFUNCTION || ctype == LUA_TNIL || ctype == LUA_TNONE), 5, "POST stream callback must be a function");
 
-	luaL_checktype(L, 5, LUA_TNONE);
+	luaL_checktype(L, 6, LUA_TNONE);
 
 	std::string_view mimetype;
 	std::string_view body;
@@ -570,7 +488,7 @@ int ConnectorHttp::_lua_post(lua_State* L)
 	}
 
 	util::BlobBuffer payload = self->compose_payload(L, request_path, "POST", 4, mimetype, body);
-	int queue_result = self->queue_request(L, std::move(payload));
+	int queue_result = self->queue_request(L, std::move(payload), false, ctype == LUA_TFUNCTION ? 5 : 0);
 	if (!queue_result)
 		luaL_error(L, "ConnectorHttp failed to queue POST request");
 
@@ -585,12 +503,14 @@ int ConnectorHttp::_lua_delete(lua_State* L)
 	ConnectorHttp* self           = from_stack(L, 1);
 	std::string_view request_path = LuaHelpers::check_arg_string(L, 2);
 	int const htype               = lua_type(L, 3);
-	luaL_argcheck(L, (htype == LUA_TTABLE || htype == LUA_TNONE), 3, "DELETE extra headers must be a table");
+	int const ctype               = lua_type(L, 4);
+	luaL_argcheck(L, (htype == LUA_TTABLE || htype == LUA_TNIL || htype == LUA_TNONE), 3, "DELETE extra headers must be a table");
+	luaL_argcheck(L, (ctype == LUA_TFUNCTION || ctype == LUA_TNIL || ctype == LUA_TNONE), 4, "DELETE stream callback must be a function");
 
-	luaL_checktype(L, 4, LUA_TNONE);
+	luaL_checktype(L, 5, LUA_TNONE);
 
 	util::BlobBuffer payload = self->compose_payload(L, request_path, "DELETE", 3, std::string_view(), std::string_view());
-	int queue_result = self->queue_request(L, std::move(payload));
+	int queue_result = self->queue_request(L, std::move(payload), true, ctype == LUA_TFUNCTION ? 4 : 0);
 	if (!queue_result)
 		luaL_error(L, "ConnectorHttp failed to queue DELETE request");
 
@@ -661,8 +581,11 @@ util::BlobBuffer ConnectorHttp::compose_payload(lua_State* L, std::string_view c
 	buffer << method << ' ' << base_path << request_path << " HTTP/1.1" << g_header_newline;
 	buffer << "Host: " << m_base_url.get_host() << g_header_newline
 	       << "User-Agent: Deck-Assistant\r\n"
-	          "Cache-Control: no-cache\r\n"
-	          "Connection: keep-alive\r\n"sv;
+	          "Cache-Control: no-cache\r\n"sv;
+	buffer << (m_keepalive_timeout > 0 ? "Connection: keep-alive\r\n"sv : "Connection: close\r\n"sv);
+
+	if (m_compression)
+		buffer << "Accept-Encoding: gzip, deflate\r\n"sv;
 
 	for (auto const& pair : m_default_headers)
 		buffer << pair.first << g_header_separator << pair.second << g_header_newline;
@@ -700,7 +623,7 @@ util::BlobBuffer ConnectorHttp::compose_payload(lua_State* L, std::string_view c
 	return buffer;
 }
 
-int ConnectorHttp::queue_request(lua_State* L, util::BlobBuffer&& payload)
+int ConnectorHttp::queue_request(lua_State* L, util::BlobBuffer&& payload, bool idempotent, int callback_idx)
 {
 	++m_request_counter;
 
@@ -719,10 +642,489 @@ int ConnectorHttp::queue_request(lua_State* L, util::BlobBuffer&& payload)
 	}
 	lua_replace(L, -2);
 
+	if (callback_idx)
+	{
+		LuaHelpers::push_instance_table(L, 1);
+		lua_pushlightuserdata(L, (void*)&g_stream_callbacks_key);
+		lua_rawget(L, -2);
+		lua_pushvalue(L, callback_idx);
+		lua_rawseti(L, -2, promise_idx);
+		lua_pop(L, 2);
+	}
+
 	Request req;
-	req.payload = std::move(payload);
-	req.promise = promise_idx;
-	m_queue.emplace(std::move(req));
+	req.payload    = std::move(payload);
+	req.promise    = promise_idx;
+	req.idempotent = idempotent;
+	req.streaming  = callback_idx != 0;
+	m_queue.emplace_back(std::move(req));
 
 	return 1;
 }
+
+void ConnectorHttp::tick_inputs(lua_State* L, lua_Integer clock, Connection& conn)
+{
+	switch (conn.socket.get_state())
+	{
+		case util::Socket::State::Disconnected:
+		case util::Socket::State::Connecting:
+			return;
+
+		case util::Socket::State::TLSHandshaking:
+			conn.socket.tls_handshake();
+			return;
+
+		case util::Socket::State::Connected:
+			break;
+	}
+
+	if (conn.requests.empty())
+	{
+		// Idle keep-alive connection, only watch for the server hanging up
+		if (conn.socket.is_readable())
+		{
+			char discard[256];
+			if (conn.socket.read_nonblock(discard, sizeof(discard)) != 0)
+			{
+				DeckLogger::log_message(L, DeckLogger::Level::Debug, "ConnectorHttp ", m_base_url.get_connection_string(), " idle connection closed by peer");
+				reset_connection(L, conn);
+			}
+		}
+		return;
+	}
+
+	// Whatever arrived before the server hung up still counts
+	std::size_t const previous_size = conn.response.size();
+	int const read_result           = conn.socket.read_available(conn.response, SIZE_MAX);
+	if (conn.response.size() > previous_size)
+	{
+		conn.total_bytes_received += conn.response.size() - previous_size;
+		conn.connect_attempts      = 0;
+	}
+
+	bool const is_eof = read_result < 0;
+	if (is_eof)
+		DeckLogger::log_message(L, DeckLogger::Level::Debug, "ConnectorHttp ", m_base_url.get_connection_string(), " connection closed by peer");
+
+	while (!conn.requests.empty())
+	{
+		std::string_view const response(reinterpret_cast<char const*>(conn.response.data()), conn.response.size());
+		conn.response.advance(conn.parser.feed(response));
+
+		if (is_eof && !conn.parser.is_done() && !conn.parser.has_error())
+		{
+			// A reused connection that the server dropped before answering: idempotent requests silently try again on a fresh one
+			if (conn.parser.is_idle() && conn.response.empty() && conn.responses_on_connection > 0)
+			{
+				DeckLogger::log_message(L, DeckLogger::Level::Debug, "ConnectorHttp ", m_base_url.get_connection_string(), " keep-alive connection went stale, retrying");
+				reset_connection(L, conn);
+				return;
+			}
+
+			conn.parser.feed_eof();
+		}
+
+		if (conn.requests.front().streaming)
+			deliver_stream(L, conn, conn.requests.front().promise, clock);
+
+		int have_message = 0;
+		if (conn.parser.is_done())
+		{
+			push_http_response(L, conn.parser);
+			have_message = 1;
+		}
+		else if (conn.parser.has_error())
+		{
+			push_error_response(L, conn.parser.get_error());
+			have_message = -1;
+		}
+		else if (clock > conn.request_started_at + m_request_timeout)
+		{
+			DeckLogger::log_message(L, DeckLogger::Level::Debug, "ConnectorHttp ", m_base_url.get_connection_string(), " request timed out, closing socket");
+			conn.socket.shutdown();
+			conn.connect_attempts = 0;
+
+			push_error_response(L, "Request timed out");
+			have_message = -1;
+		}
+		else
+		{
+			break;
+		}
+
+		if (conn.parser.is_compressed())
+		{
+			m_compression_stats.received          += conn.parser.get_body_received();
+			m_compression_stats.received_inflated += conn.parser.get_body_decoded();
+		}
+
+		bool const keep_alive = have_message > 0 && conn.parser.is_keep_alive();
+		conn.parser.reset();
+		conn.stream_mode = StreamMode::Pending;
+
+		int const promise = conn.requests.front().promise;
+		conn.requests.pop_front();
+
+		++conn.responses_on_connection;
+		if (have_message < 0)
+			++conn.total_failures;
+		else
+			++conn.total_responses;
+
+		conn.next_connect_attempt = clock + 200;
+		conn.last_activity        = clock;
+		conn.request_started_at   = clock;
+
+		// Whatever else was sent on this connection goes back to the queue for the next one, or fails if it cannot be repeated
+		bool const done_with_connection = have_message < 0 || !keep_alive;
+		if (done_with_connection)
+			reset_connection(L, conn);
+
+		// The event handlers may queue new requests, so only call out once the connection state is settled
+		complete_request(L, promise, have_message);
+
+		if (done_with_connection)
+			break;
+	}
+}
+
+void ConnectorHttp::tick_outputs(lua_State* L, lua_Integer clock, Connection& conn, bool wanted)
+{
+	switch (conn.socket.get_state())
+	{
+		case util::Socket::State::Disconnected:
+			if (!conn.requests.empty() || conn.responses_on_connection > 0)
+				reset_connection(L, conn);
+
+			if (wanted && m_enabled && clock >= conn.next_connect_attempt)
+			{
+				conn.response.clear();
+
+				std::string_view err = conn.socket.get_last_error();
+
+				++conn.connect_attempts;
+				if (conn.connect_attempts > 1)
+					DeckLogger::log_message(L, DeckLogger::Level::Warning, "ConnectorHttp ", m_base_url.get_connection_string(), " connection reset: ", err);
+
+				if (conn.connect_attempts > 3)
+				{
+					DeckLogger::log_message(L, DeckLogger::Level::Error, "ConnectorHttp ", m_base_url.get_connection_string(), " too many connection errors, connector paused");
+
+					// Take the queue out first, the handlers might well queue a retry
+					std::deque<Request> failed;
+					failed.swap(m_queue);
+
+					push_error_response(L, err);
+					for (Request const& request : failed)
+					{
+						lua_pushvalue(L, -1);
+						complete_request(L, request.promise, -1);
+					}
+					lua_pop(L, 1);
+
+					conn.connect_attempts     = 0;
+					conn.next_connect_attempt = clock + 6000;
+				}
+				else
+				{
+					bool const use_tls = m_base_url.get_schema() == "https";
+
+					int port = m_base_url.get_port();
+					if (!port)
+						port = use_tls ? 443 : 80;
+
+					util::Socket::TLS tls;
+					if (!use_tls)
+						tls = util::Socket::TLS::NoTLS;
+					else if (m_insecure)
+						tls = util::Socket::TLS::TLSNoVerify;
+					else
+						tls = util::Socket::TLS::TLS;
+
+					DeckLogger::log_message(L, DeckLogger::Level::Debug, "ConnectorHttp ", m_base_url.get_connection_string(), " connecting to server");
+					conn.socket.set_tls(tls);
+					conn.socket.start_connect(m_base_url.get_host(), port);
+					conn.next_connect_attempt = clock + 1000;
+					conn.last_activity        = clock;
+					++conn.total_connects;
+				}
+			}
+			break;
+
+		case util::Socket::State::Connecting:
+			break;
+
+		case util::Socket::State::TLSHandshaking:
+			conn.socket.tls_handshake();
+			break;
+
+		case util::Socket::State::Connected:
+			if (!m_enabled)
+			{
+				DeckLogger::log_message(L, DeckLogger::Level::Debug, "ConnectorHttp ", m_base_url.get_connection_string(), " disabled, closing socket");
+				conn.socket.shutdown();
+				reset_connection(L, conn);
+			}
+			else if (conn.requests.empty() && m_queue.empty() && clock >= conn.last_activity + m_keepalive_timeout)
+			{
+				DeckLogger::log_message(L, DeckLogger::Level::Debug, "ConnectorHttp ", m_base_url.get_connection_string(), " connection idle, closing socket");
+				conn.socket.shutdown();
+				reset_connection(L, conn);
+			}
+			break;
+	}
+}
+
+void ConnectorHttp::dispatch_requests(lua_Integer clock)
+{
+	std::size_t const num_connections = std::min(m_pool_size, m_connections.size());
+
+	// Idle connections first, so a slow request never holds up the others while a connection is free
+	for (std::size_t i = 0; i < num_connections && !m_queue.empty(); ++i)
+	{
+		Connection& conn = *m_connections[i];
+		if (conn.socket.get_state() == util::Socket::State::Connected && conn.requests.empty())
+			send_next_request(conn, clock);
+	}
+
+	if (!m_pipelining)
+		return;
+
+	bool progress = true;
+	while (progress && !m_queue.empty())
+	{
+		progress = false;
+		for (std::size_t i = 0; i < num_connections && !m_queue.empty(); ++i)
+		{
+			Connection& conn = *m_connections[i];
+			if (conn.socket.get_state() == util::Socket::State::Connected && can_send_next_request(conn))
+			{
+				send_next_request(conn, clock);
+				progress = true;
+			}
+		}
+	}
+}
+
+bool ConnectorHttp::can_send_next_request(Connection const& conn) const
+{
+	if (conn.requests.empty())
+		return true;
+
+	// Only pipeline once the server has shown it keeps connections open, and never around a non-idempotent request
+	if (!m_pipelining || conn.requests.size() >= MAX_PIPELINE_DEPTH || conn.responses_on_connection == 0)
+		return false;
+
+	return conn.requests.back().idempotent && m_queue.front().idempotent;
+}
+
+void ConnectorHttp::send_next_request(Connection& conn, lua_Integer clock)
+{
+	util::BlobBuffer& outbuf = m_queue.front().payload;
+	if (!outbuf.empty())
+	{
+		conn.socket.write(outbuf.data(), outbuf.size());
+		conn.total_bytes_sent += outbuf.size();
+		outbuf.advance(outbuf.size());
+	}
+
+	if (conn.requests.empty())
+		conn.request_started_at = clock;
+
+	conn.last_activity = clock;
+	conn.requests.push_back(std::move(m_queue.front()));
+	m_queue.pop_front();
+}
+
+void ConnectorHttp::deliver_stream(lua_State* L, Connection& conn, int promise, lua_Integer clock)
+{
+	if (conn.stream_mode == StreamMode::Pending)
+	{
+		if (!conn.parser.has_headers())
+			return;
+
+		// Error responses are kept whole so the caller gets to see them in the final response
+		int const code = conn.parser.get_status_code();
+		if (code < 200 || code >= 300)
+		{
+			conn.stream_mode = StreamMode::Disabled;
+			return;
+		}
+
+		std::string_view const content_type = conn.parser.find_header(g_content_type);
+		if (is_content_type(content_type, "text/event-stream"))
+		{
+			conn.stream_mode = StreamMode::Events;
+			conn.splitter.reset(util::HttpStreamSplitter::Format::ServerSentEvents);
+		}
+		else if (is_content_type(content_type, "application/x-ndjson") || is_content_type(content_type, "application/ndjson") || is_content_type(content_type, "application/jsonl"))
+		{
+			conn.stream_mode = StreamMode::Lines;
+			conn.splitter.reset(util::HttpStreamSplitter::Format::Lines);
+		}
+		else
+		{
+			conn.stream_mode = StreamMode::Raw;
+		}
+	}
+
+	if (conn.stream_mode == StreamMode::Disabled)
+		return;
+
+	std::string& body = conn.parser.get_body();
+	bool const done   = conn.parser.is_done();
+	if (body.empty() && !done)
+		return;
+
+	// Take the data out first, the callbacks may well end up in this connector again
+	std::string data;
+	data.swap(body);
+
+	LuaHelpers::push_instance_table(L, 1);
+	lua_pushlightuserdata(L, (void*)&g_stream_callbacks_key);
+	lua_rawget(L, -2);
+	lua_replace(L, -2);
+
+	auto const callback = [L, promise](std::string_view const& record, std::string_view const& event) {
+		lua_rawgeti(L, -1, promise);
+		if (lua_type(L, -1) != LUA_TFUNCTION)
+		{
+			lua_pop(L, 1);
+			return;
+		}
+
+		lua_pushlstring(L, record.data(), record.size());
+		if (event.empty())
+		{
+			LuaHelpers::yieldable_call(L, 1);
+		}
+		else
+		{
+			lua_pushlstring(L, event.data(), event.size());
+			LuaHelpers::yieldable_call(L, 2);
+		}
+	};
+
+	if (conn.stream_mode == StreamMode::Raw)
+	{
+		if (!data.empty())
+			callback(data, std::string_view());
+	}
+	else
+	{
+		conn.splitter.feed(data, callback);
+		if (done)
+			conn.splitter.finish(callback);
+	}
+
+	lua_pop(L, 1);
+
+	// A stream that keeps delivering is not timing out
+	conn.request_started_at = clock;
+}
+
+void ConnectorHttp::complete_request(lua_State* L, int promise, int have_message)
+{
+	LuaHelpers::push_instance_table(L, 1);
+	lua_pushlightuserdata(L, (void*)&g_stream_callbacks_key);
+	lua_rawget(L, -2);
+	lua_pushnil(L);
+	lua_rawseti(L, -2, promise);
+	lua_pop(L, 2);
+
+	DeckPromiseList* promise_list = push_promise_list(L);
+	lua_pushinteger(L, promise);
+	lua_pushvalue(L, -3);
+
+	if (!promise_list->fulfill_promise(L))
+	{
+		if (have_message < 0)
+		{
+			lua_getfield(L, -2, "error");
+			LuaHelpers::emit_event(L, 1, "on_request_failed", LuaHelpers::StackValue(L, -1));
+		}
+		else
+		{
+			lua_pushvalue(L, -2);
+			LuaHelpers::emit_event(L, 1, "on_response", LuaHelpers::StackValue(L, -1));
+		}
+	}
+
+	lua_pop(L, 3);
+}
+
+void ConnectorHttp::reset_connection(lua_State* L, Connection& conn)
+{
+	conn.socket.close();
+
+	// Only requests that are safe to repeat go back to the queue, the server may already have acted on the others
+	std::deque<Request> failed;
+	while (!conn.requests.empty())
+	{
+		if (conn.requests.back().idempotent)
+		{
+			conn.requests.back().payload.rewind();
+			m_queue.push_front(std::move(conn.requests.back()));
+		}
+		else
+		{
+			failed.push_front(std::move(conn.requests.back()));
+		}
+		conn.requests.pop_back();
+	}
+
+	conn.request_started_at      = 0;
+	conn.responses_on_connection = 0;
+	conn.stream_mode             = StreamMode::Pending;
+	conn.response.clear();
+	conn.parser.reset();
+
+	if (failed.empty())
+		return;
+
+	conn.total_failures += failed.size();
+	push_error_response(L, "Connection closed by peer");
+	for (Request const& request : failed)
+	{
+		lua_pushvalue(L, -1);
+		complete_request(L, request.promise, -1);
+	}
+	lua_pop(L, 1);
+}
+
+void ConnectorHttp::push_connection_stats(lua_State* L) const
+{
+	lua_createtable(L, m_connections.size(), 0);
+	for (std::size_t i = 0; i < m_connections.size(); ++i)
+	{
+		Connection const& conn = *m_connections[i];
+
+		lua_createtable(L, 0, 8);
+
+		lua_pushboolean(L, conn.socket.get_state() == util::Socket::State::Connected);
+		lua_setfield(L, -2, "connected");
+
+		lua_pushboolean(L, conn.socket.is_tls_resumed());
+		lua_setfield(L, -2, "tls_resumed");
+
+		lua_pushinteger(L, lua_Integer(conn.requests.size()));
+		lua_setfield(L, -2, "in_flight");
+
+		lua_pushinteger(L, lua_Integer(conn.total_connects));
+		lua_setfield(L, -2, "connects");
+
+		lua_pushinteger(L, lua_Integer(conn.total_responses));
+		lua_setfield(L, -2, "responses");
+
+		lua_pushinteger(L, lua_Integer(conn.total_failures));
+		lua_setfield(L, -2, "failures");
+
+		lua_pushinteger(L, lua_Integer(conn.total_bytes_sent));
+		lua_setfield(L, -2, "bytes_sent");
+
+		lua_pushinteger(L, lua_Integer(conn.total_bytes_received));
+		lua_setfield(L, -2, "bytes_received");
+
+		lua_rawseti(L, -2, int(i + 1));
+	}
+}
@@ -21,9 +21,12 @@
 
 #include "connector_base.h"
 #include "util_blob.h"
+#include "util_http_parser.h"
 #include "util_socket.h"
 #include "util_url.h"
-#include <queue>
+#include <cstdint>
+#include <deque>
+#include <memory>
 #include <utility>
 #include <vector>
 
@@ -55,25 +58,77 @@ private:
 	{
 		util::BlobBuffer payload;
 		int promise;
+		bool idempotent;
+		bool streaming;
+	};
+
+	enum class StreamMode : char
+	{
+		Pending,
+		Disabled,
+		Raw,
+		Lines,
+		Events,
+	};
+
+	struct Connection
+	{
+		Connection(std::shared_ptr<util::SocketSet> const& socketset);
+
+		util::Socket socket;
+		util::BlobBuffer response;
+		util::HttpResponseParser parser;
+		util::HttpStreamSplitter splitter;
+		StreamMode stream_mode;
+		std::deque<Request> requests;
+		lua_Integer request_started_at;
+		lua_Integer last_activity;
+		lua_Integer next_connect_attempt;
+		int connect_attempts;
+		int responses_on_connection;
+
+		std::size_t total_connects;
+		std::size_t total_responses;
+		std::size_t total_failures;
+		std::size_t total_bytes_sent;
+		std::size_t total_bytes_received;
+	};
+
+	struct CompressionStats
+	{
+		std::uint64_t received          = 0;
+		std::uint64_t received_inflated = 0;
 	};
 
 	using HeadersVector = std::vector<std::pair<std::string, std::string>>;
+	using ConnectionPtr = std::unique_ptr<Connection>;
 
 	util::BlobBuffer compose_payload(lua_State* L, std::string_view const& path, std::string_view const& method, int headers_idx, std::string_view const& mimetype, std::string_view const& body);
-	int queue_request(lua_State* L, util::BlobBuffer&& payload);
+	int queue_request(lua_State* L, util::BlobBuffer&& payload, bool idempotent, int callback_idx);
+	void tick_inputs(lua_State* L, lua_Integer clock, Connection& conn);
+	void tick_outputs(lua_State* L, lua_Integer clock, Connection& conn, bool wanted);
+	void dispatch_requests(lua_Integer clock);
+	bool can_send_next_request(Connection const& conn) const;
+	void send_next_request(Connection& conn, lua_Integer clock);
+	void deliver_stream(lua_State* L, Connection& conn, int promise, lua_Integer clock);
+	void complete_request(lua_State* L, int promise, int have_message);
+	void reset_connection(lua_State* L, Connection& conn);
+	void push_connection_stats(lua_State* L) const;
 
-	util::Socket m_socket;
+	std::shared_ptr<util::SocketSet> m_socketset;
+	std::vector<ConnectionPtr> m_connections;
 	util::URL m_base_url;
 	HeadersVector m_default_headers;
-	std::queue<Request> m_queue;
-	util::Blob m_response;
+	std::deque<Request> m_queue;
+	CompressionStats m_compression_stats;
 	lua_Integer m_request_timeout;
-	lua_Integer m_request_started_at;
-	lua_Integer m_next_connect_attempt;
+	lua_Integer m_keepalive_timeout;
+	std::size_t m_pool_size;
 	int m_request_counter;
-	int m_connect_attempts;
 	bool m_enabled;
 	bool m_insecure;
+	bool m_pipelining;
+	bool m_compression;
 };
 
 #endif // DECK_ASSISTANT_CONNECTOR_HTTP_H
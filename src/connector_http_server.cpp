@@ -0,0 +1,1026 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "connector_http_server.h"
+#include "deck_logger.h"
+#include "deck_util.h"
+#include "lua_helpers.h"
+#include "util_blob.h"
+#include "util_http_parser.h"
+#include "util_paths.h"
+#include <algorithm>
+#include <cassert>
+#include <charconv>
+#include <fstream>
+
+namespace
+{
+
+// Same as the idle time the Http connector keeps its connections around for
+constexpr lua_Integer const DEFAULT_KEEPALIVE_TIMEOUT = 15000;
+
+// Overlay pages post small forms and JSON, not uploads
+constexpr std::size_t const DEFAULT_MAX_BODY_SIZE = 1024 * 1024;
+
+// Request line plus headers, browsers stay well below this
+constexpr std::size_t const MAX_HEADER_SIZE = 16 * 1024;
+
+// Static files up to this size are kept in memory and served without touching the disk
+constexpr std::uintmax_t const MAX_CACHED_FILE_SIZE = 1024 * 1024;
+
+// Total size of the static file cache
+constexpr std::size_t const MAX_FILE_CACHE_SIZE = 32 * 1024 * 1024;
+
+// Larger files are streamed, topping up the socket whenever it drops below this
+constexpr std::size_t const FILE_STREAM_HIGH_WATER = 256 * 1024;
+constexpr std::size_t const FILE_STREAM_CHUNK_SIZE = 64 * 1024;
+
+// Address used as key for the table of route handlers in the instance table
+char const g_routes_key = 0;
+
+bool has_body(int status_code)
+{
+	return status_code >= 200 && status_code != 204 && status_code != 304;
+}
+
+bool is_valid_header_text(std::string_view const& text)
+{
+	return text.find_first_of("\r\n") == std::string_view::npos;
+}
+
+void append_hex(std::string& output, std::uint64_t value)
+{
+	char buffer[24];
+	auto [ptr, ec] = std::to_chars(buffer, buffer + sizeof(buffer), value, 16);
+	output.append(buffer, ptr);
+}
+
+} // namespace
+
+struct ConnectorHttpServer::Client
+{
+	Client(util::Socket&& client_socket, lua_Integer clock)
+	    : socket(std::move(client_socket))
+	    , file_remaining(0)
+	    , last_pending(0)
+	    , last_activity(clock)
+	    , keep_alive(false)
+	    , head_only(false)
+	    , continue_sent(false)
+	    , close_when_done(false)
+	{
+	}
+
+	bool is_connected() const
+	{
+		return socket.get_state() == util::Socket::State::Connected;
+	}
+
+	// Returns the number of bytes received, or -1 when the connection is gone
+	int receive()
+	{
+		if (!is_connected())
+			return -1;
+
+		if (!socket.is_readable())
+			return 0;
+
+		return socket.read_available(received);
+	}
+
+	util::Socket socket;
+	util::BlobBuffer received;
+	std::ifstream file;
+	std::uint64_t file_remaining;
+	std::size_t last_pending;
+	lua_Integer last_activity;
+	bool keep_alive;
+	bool head_only;
+	bool continue_sent;
+	bool close_when_done;
+};
+
+char const* ConnectorHttpServer::LUA_TYPENAME = "deck:ConnectorHttpServer";
+
+ConnectorHttpServer::ConnectorHttpServer(std::shared_ptr<util::SocketSet> const& socketset)
+    : m_socket(socketset)
+    , m_server_state(State::Disconnected)
+    , m_wanted_port(0)
+    , m_active_port(0)
+    , m_enabled(true)
+    , m_listen_last_attempt(-5000)
+    , m_keepalive_timeout(DEFAULT_KEEPALIVE_TIMEOUT)
+    , m_cache_max_age(0)
+    , m_max_body_size(DEFAULT_MAX_BODY_SIZE)
+    , m_static_path("/")
+    , m_file_cache_size(0)
+{
+}
+
+ConnectorHttpServer::~ConnectorHttpServer()
+{
+	m_enabled = false;
+}
+
+void ConnectorHttpServer::tick_inputs(lua_State* L, lua_Integer clock)
+{
+	tick_server_input(L, clock);
+	tick_clients_input(L, clock);
+}
+
+void ConnectorHttpServer::tick_outputs(lua_State* L, lua_Integer clock)
+{
+	tick_server_output(L, clock);
+	tick_clients_output(L, clock);
+}
+
+void ConnectorHttpServer::shutdown(lua_State* L)
+{
+	m_socket.close();
+	m_server_state = State::Disconnected;
+	m_active_port  = 0;
+
+	for (std::unique_ptr<Client>& client : m_clients)
+		client->socket.close();
+
+	m_clients.clear();
+	m_file_cache.clear();
+	m_file_cache_size = 0;
+}
+
+void ConnectorHttpServer::tick_server_input(lua_State* L, lua_Integer clock)
+{
+	if (m_server_state == State::Disconnected)
+	{
+		if (!m_enabled || clock < m_listen_last_attempt + 5000)
+			return;
+
+		m_listen_last_attempt = clock;
+
+		if (m_wanted_port == 0)
+		{
+			m_enabled = false;
+
+			std::string_view message = "HttpServer has not been assigned a port";
+			DeckLogger::log_message(L, DeckLogger::Level::Error, message);
+			LuaHelpers::emit_event(L, 1, "on_connect_failed", message);
+			return;
+		}
+
+		m_active_port = m_wanted_port;
+		m_socket.start_connect(std::string_view(), m_active_port);
+		m_server_state = State::Binding;
+	}
+
+	if (m_server_state == State::Binding)
+	{
+		util::Socket::State const socket_state = m_socket.get_state();
+		switch (socket_state)
+		{
+			case util::Socket::State::Disconnected:
+				m_server_state = State::Disconnected;
+				DeckLogger::log_message(L, DeckLogger::Level::Debug, "HttpServer binding to port ", m_active_port, " failed: ", m_socket.get_last_error());
+				m_active_port = 0;
+				LuaHelpers::emit_event(L, 1, "on_connect_failed", m_socket.get_last_error());
+				break;
+
+			case util::Socket::State::Connecting:
+				break;
+
+			case util::Socket::State::TLSHandshaking:
+				assert(false && "HttpServer does not do TLSHandshaking");
+				break;
+
+			case util::Socket::State::Connected:
+				m_server_state = State::Listening;
+				DeckLogger::log_message(L, DeckLogger::Level::Debug, "HttpServer bound to port ", m_active_port, ", now listening for connections");
+				LuaHelpers::emit_event(L, 1, "on_connect");
+				break;
+		}
+	}
+
+	if (m_server_state == State::Listening)
+	{
+		// Clients never become visible to lua, only the requests that are routed to it
+		m_socket.accept_pending([this, L, clock](util::Socket&& client_socket) {
+			std::unique_ptr<Client>& client = m_clients.emplace_back(std::make_unique<Client>(std::move(client_socket), clock));
+			DeckLogger::log_message(L, DeckLogger::Level::Trace, "HttpServer on port ", m_active_port, " accepted connection from ", client->socket.get_remote_host(), ':', client->socket.get_remote_port());
+		});
+
+		if (m_socket.get_state() == util::Socket::State::Disconnected)
+		{
+			std::string message  = "HttpServer on port ";
+			message             += std::to_string(m_active_port);
+			message             += " closed: ";
+			message             += m_socket.get_last_error();
+
+			m_server_state = State::Disconnected;
+			m_active_port  = 0;
+			DeckLogger::log_message(L, DeckLogger::Level::Debug, message);
+			LuaHelpers::emit_event(L, 1, "on_disconnect", message);
+			return;
+		}
+	}
+}
+
+void ConnectorHttpServer::tick_clients_input(lua_State* L, lua_Integer clock)
+{
+	// Handlers can't reach the client list, so it is safe to walk it while calling into lua
+	for (std::unique_ptr<Client>& client : m_clients)
+	{
+		int const received = client->receive();
+		if (received > 0)
+			client->last_activity = clock;
+
+		if (received >= 0 && !client->received.empty())
+			process_requests(L, *client);
+	}
+
+	std::erase_if(m_clients, [](std::unique_ptr<Client> const& client) { return !client->is_connected(); });
+}
+
+void ConnectorHttpServer::tick_server_output(lua_State* L, lua_Integer clock)
+{
+	if (m_server_state == State::Listening && !m_enabled)
+	{
+		std::string message  = "HttpServer on port ";
+		message             += std::to_string(m_active_port);
+		message             += " disabled, closing port.";
+
+		m_socket.close();
+		m_server_state = State::Disconnected;
+		m_active_port  = 0;
+		DeckLogger::log_message(L, DeckLogger::Level::Debug, message);
+		LuaHelpers::emit_event(L, 1, "on_disconnect", message);
+	}
+}
+
+void ConnectorHttpServer::tick_clients_output(lua_State* L, lua_Integer clock)
+{
+	lua_Integer const idle_timeout = m_keepalive_timeout > 0 ? m_keepalive_timeout : DEFAULT_KEEPALIVE_TIMEOUT;
+
+	for (std::unique_ptr<Client>& client : m_clients)
+	{
+		if (client->file_remaining > 0)
+			pump_file(*client);
+
+		// Queued output is flushed by the socket set, a shrinking queue means the client is still reading
+		std::size_t const pending = client->socket.get_pending_write_size();
+		if (pending != client->last_pending)
+		{
+			client->last_pending  = pending;
+			client->last_activity = clock;
+		}
+
+		if (client->file_remaining == 0 && pending == 0)
+		{
+			if (client->close_when_done)
+				client->socket.close();
+			else if (!client->received.empty())
+				process_requests(L, *client);
+		}
+
+		if (client->is_connected() && clock >= client->last_activity + idle_timeout)
+		{
+			DeckLogger::log_message(L, DeckLogger::Level::Trace, "HttpServer on port ", m_active_port, " closing idle connection from ", client->socket.get_remote_host(), ':', client->socket.get_remote_port());
+			client->socket.close();
+		}
+	}
+
+	std::erase_if(m_clients, [](std::unique_ptr<Client> const& client) { return !client->is_connected(); });
+}
+
+void ConnectorHttpServer::process_requests(lua_State* L, Client& client)
+{
+	// A streamed file has to go out in full before the next pipelined response can follow
+	while (client.is_connected() && !client.close_when_done && client.file_remaining == 0)
+	{
+		std::string_view const received(reinterpret_cast<char const*>(client.received.data()), client.received.size());
+
+		std::size_t const headers_end = received.find("\r\n\r\n");
+		if (headers_end == std::string_view::npos || headers_end > MAX_HEADER_SIZE)
+		{
+			if (received.size() > MAX_HEADER_SIZE)
+				send_error(client, 431, true);
+			break;
+		}
+
+		util::HttpMessage request = util::parse_http_message(received.substr(0, headers_end + 4));
+		if (!request || !request.error.empty() || request.response_status_code != 0)
+		{
+			send_error(client, 400, true);
+			break;
+		}
+
+		if (request.http_version != "HTTP/1.1" && request.http_version != "HTTP/1.0")
+		{
+			send_error(client, 505, true);
+			break;
+		}
+
+		// Without chunked request bodies there is no way to find the next request
+		if (!util::http_find_header(request, "Transfer-Encoding").empty())
+		{
+			send_error(client, 501, true);
+			break;
+		}
+
+		std::size_t content_length            = 0;
+		std::string_view const length_header = util::trim(util::http_find_header(request, "Content-Length"));
+		if (!length_header.empty())
+		{
+			auto [ptr, ec] = std::from_chars(length_header.data(), length_header.data() + length_header.size(), content_length, 10);
+			if (ec != std::errc() || ptr != length_header.data() + length_header.size())
+			{
+				send_error(client, 400, true);
+				break;
+			}
+		}
+
+		if (content_length > m_max_body_size)
+		{
+			send_error(client, 413, true);
+			break;
+		}
+
+		std::size_t const request_size = headers_end + 4 + content_length;
+		if (received.size() < request_size)
+		{
+			// curl and friends hold back larger bodies until we say we want them
+			if (!client.continue_sent && request.http_version == "HTTP/1.1" && util::nocase_equals(util::http_find_header(request, "Expect"), "100-continue"))
+			{
+				static constexpr std::string_view const response = "HTTP/1.1 100 Continue\r\n\r\n";
+				client.socket.write(response.data(), int(response.size()));
+				client.continue_sent = true;
+			}
+			break;
+		}
+
+		std::string_view const connection = util::http_find_header(request, "Connection");
+		if (request.http_version == "HTTP/1.1")
+			client.keep_alive = !util::http_has_token(connection, "close");
+		else
+			client.keep_alive = util::http_has_token(connection, "keep-alive");
+
+		client.keep_alive    = client.keep_alive && m_keepalive_timeout > 0;
+		client.head_only     = request.request_method == "HEAD";
+		client.continue_sent = false;
+
+		++m_stats.requests;
+		handle_request(L, client, request, received.substr(headers_end + 4, content_length));
+
+		if (!client.keep_alive)
+		{
+			client.close_when_done = true;
+			client.received.clear();
+			break;
+		}
+
+		client.received.advance(request_size);
+	}
+
+	if (client.received.empty())
+		client.received.clear();
+}
+
+void ConnectorHttpServer::handle_request(lua_State* L, Client& client, util::HttpMessage const& request, std::string_view const& body)
+{
+	auto const [raw_path, query] = util::split1(request.request_path, "?", false);
+
+	std::string path;
+	if (!util::http_decode_path(raw_path, path) || !path.starts_with('/'))
+	{
+		send_error(client, 400, true);
+		return;
+	}
+
+	// Handlers may add routes, which reorders the list, so don't hold on to an entry across the call
+	std::string const* matched_route = match_route(path);
+	if (matched_route)
+	{
+		std::string const route = *matched_route;
+		if (call_route(L, client, route, request, path, query, body))
+			return;
+	}
+
+	bool const is_get = request.request_method == "GET" || request.request_method == "HEAD";
+	if (is_get && !m_static_root.empty() && path.starts_with(m_static_path))
+	{
+		if (serve_static(client, path, request))
+			return;
+	}
+
+	send_error(client, 404, false);
+}
+
+std::string const* ConnectorHttpServer::match_route(std::string_view const& path) const
+{
+	// Routes are kept longest first, so the most specific one wins
+	for (std::string const& route : m_routes)
+	{
+		if (route.back() == '/' ? path.starts_with(route) : path == route)
+			return &route;
+	}
+	return nullptr;
+}
+
+bool ConnectorHttpServer::call_route(lua_State* L, Client& client, std::string const& route, util::HttpMessage const& request, std::string_view const& path, std::string_view const& query, std::string_view const& body)
+{
+	int const top = lua_gettop(L);
+
+	LuaHelpers::push_instance_table(L, 1);
+	lua_pushlightuserdata(L, (void*)&g_routes_key);
+	lua_rawget(L, -2);
+	lua_pushlstring(L, route.data(), route.size());
+	lua_rawget(L, -2);
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+
+	if (lua_type(L, -1) != LUA_TFUNCTION)
+	{
+		lua_settop(L, top);
+		return false;
+	}
+
+	lua_pushvalue(L, 1);
+
+	lua_createtable(L, 0, 10);
+	lua_pushlstring(L, request.request_method.data(), request.request_method.size());
+	lua_setfield(L, -2, "method");
+	lua_pushlstring(L, path.data(), path.size());
+	lua_setfield(L, -2, "path");
+	lua_pushlstring(L, query.data(), query.size());
+	lua_setfield(L, -2, "query");
+	lua_pushlstring(L, request.request_path.data(), request.request_path.size());
+	lua_setfield(L, -2, "target");
+	lua_pushlstring(L, request.http_version.data(), request.http_version.size());
+	lua_setfield(L, -2, "http_version");
+	lua_pushlstring(L, route.data(), route.size());
+	lua_setfield(L, -2, "route");
+
+	lua_createtable(L, 0, int(request.headers.size()));
+	for (auto const& [key, value] : request.headers)
+	{
+		lua_pushlstring(L, key.data(), key.size());
+		lua_pushlstring(L, value.data(), value.size());
+		lua_settable(L, -3);
+	}
+	lua_setfield(L, -2, "headers");
+
+	lua_pushlstring(L, body.data(), body.size());
+	lua_setfield(L, -2, "body");
+
+	std::string const& remote_host = client.socket.get_remote_host();
+	lua_pushlstring(L, remote_host.data(), remote_host.size());
+	lua_setfield(L, -2, "remote_host");
+	lua_pushinteger(L, client.socket.get_remote_port());
+	lua_setfield(L, -2, "remote_port");
+
+	if (!LuaHelpers::pcall(L, 2, 3))
+	{
+		lua_settop(L, top);
+		send_error(client, 500, false);
+		return true;
+	}
+
+	// Handlers return either: nothing to decline, a body, a body and headers, or a status, body and headers
+	int const first = top + 1;
+	if (lua_type(L, first) == LUA_TNIL)
+	{
+		lua_settop(L, top);
+		return false;
+	}
+
+	int status_code = 200;
+	int body_idx    = first;
+	if (lua_type(L, first) == LUA_TNUMBER)
+	{
+		status_code = int(lua_tointeger(L, first));
+		body_idx    = first + 1;
+	}
+
+	int const headers_idx = body_idx + 1;
+	bool valid            = status_code >= 200 && status_code <= 599;
+	valid                 = valid && (lua_type(L, body_idx) == LUA_TSTRING || lua_type(L, body_idx) == LUA_TNIL);
+	valid                 = valid && (lua_type(L, headers_idx) == LUA_TTABLE || lua_type(L, headers_idx) == LUA_TNIL);
+
+	std::string headers;
+	bool have_content_type = false;
+
+	if (valid && lua_type(L, headers_idx) == LUA_TTABLE)
+	{
+		lua_pushnil(L);
+		while (valid && lua_next(L, headers_idx))
+		{
+			if (lua_type(L, -2) == LUA_TSTRING)
+			{
+				std::string_view const key   = LuaHelpers::to_string_view(L, -2);
+				std::string_view const value = LuaHelpers::push_converted_to_string(L, -1);
+				valid                        = !key.empty() && is_valid_header_text(key) && is_valid_header_text(value) && key.find(':') == std::string_view::npos;
+
+				// Framing is our business
+				bool const is_framing = util::nocase_equals(key, "Content-Length") || util::nocase_equals(key, "Transfer-Encoding") || util::nocase_equals(key, "Connection");
+				if (valid && !is_framing)
+				{
+					have_content_type = have_content_type || util::nocase_equals(key, "Content-Type");
+					headers.append(key);
+					headers.append(": ");
+					headers.append(value);
+					headers.append("\r\n");
+				}
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
+		}
+	}
+
+	if (!valid)
+	{
+		DeckLogger::log_message(L, DeckLogger::Level::Error, "HttpServer route ", route, " returned an invalid response");
+		lua_settop(L, top);
+		send_error(client, 500, false);
+		return true;
+	}
+
+	std::string_view const response_body = LuaHelpers::to_string_view(L, body_idx);
+	if (!have_content_type && !response_body.empty())
+		headers.append("Content-Type: text/plain; charset=utf-8\r\n");
+
+	++m_stats.dynamic;
+	send_response(client, status_code, headers, response_body);
+
+	lua_settop(L, top);
+	return true;
+}
+
+bool ConnectorHttpServer::serve_static(Client& client, std::string_view const& path, util::HttpMessage const& request)
+{
+	auto const [raw_path, query] = util::split1(request.request_path, "?", false);
+
+	std::string_view relative = path.substr(m_static_path.size());
+
+	// Only plain names, no way out of the static directory and nothing Windows would interpret
+	bool valid = true;
+	util::for_each_split(relative, "/", [&valid](std::size_t, std::string_view const& segment) -> bool {
+		valid = segment != "." && segment != ".." && segment.find_first_of("\\:") == std::string_view::npos;
+		return !valid;
+	});
+
+	// A leading slash would make the relative path absolute and replace the static root
+	if (!valid || (!relative.empty() && relative.front() == '/'))
+		return false;
+
+	std::filesystem::path file = m_static_root / std::filesystem::path(relative);
+	if (relative.empty() || relative.back() == '/')
+		file /= "index.html";
+
+	std::error_code ec;
+	std::filesystem::file_status const status = std::filesystem::status(file, ec);
+	if (ec)
+		return false;
+
+	// Symlinks may point anywhere, only serve or redirect to what really lives below the static directory
+	std::filesystem::path canonical = std::filesystem::canonical(file, ec);
+	if (ec || !util::Paths::verify_path_contains_path(canonical, m_static_root))
+		return false;
+
+	if (std::filesystem::is_directory(status))
+	{
+		std::string headers  = "Location: ";
+		headers             += raw_path;
+		headers             += '/';
+		if (!query.empty())
+		{
+			headers += '?';
+			headers += query;
+		}
+		headers += "\r\n";
+		send_response(client, 301, headers, std::string_view());
+		return true;
+	}
+
+	if (!std::filesystem::is_regular_file(status))
+		return false;
+
+	std::uintmax_t const size = std::filesystem::file_size(canonical, ec);
+	if (ec)
+		return false;
+
+	std::filesystem::file_time_type const modified = std::filesystem::last_write_time(canonical, ec);
+	if (ec)
+		return false;
+
+	std::string etag = "\"";
+	append_hex(etag, size);
+	etag += '-';
+	append_hex(etag, std::uint64_t(modified.time_since_epoch().count()));
+	etag += '"';
+
+	std::string headers  = "ETag: ";
+	headers             += etag;
+	headers             += "\r\n";
+
+	if (m_cache_max_age > 0)
+	{
+		headers += "Cache-Control: max-age=";
+		headers += std::to_string(m_cache_max_age);
+		headers += "\r\n";
+	}
+	else
+	{
+		headers += "Cache-Control: no-cache\r\n";
+	}
+
+	if (util::http_etag_matches(util::http_find_header(request, "If-None-Match"), etag))
+	{
+		++m_stats.not_modified;
+		send_response(client, 304, headers, std::string_view());
+		return true;
+	}
+
+	headers += "Content-Type: ";
+	headers += util::http_content_type(canonical.filename().string());
+	headers += "\r\n";
+
+	++m_stats.static_files;
+
+	if (size <= MAX_CACHED_FILE_SIZE)
+	{
+		CachedFile const* cached = load_cached_file(canonical, size, modified);
+		if (!cached)
+		{
+			send_error(client, 500, false);
+			return true;
+		}
+
+		send_response(client, 200, headers, cached->data);
+		return true;
+	}
+
+	client.file.open(canonical, std::ios::binary | std::ios::in);
+	if (!client.file.is_open())
+	{
+		send_error(client, 500, false);
+		return true;
+	}
+
+	begin_response(client, 200, headers, size);
+	finish_response(client);
+
+	if (client.head_only)
+	{
+		client.file.close();
+	}
+	else
+	{
+		client.file_remaining = size;
+		pump_file(client);
+	}
+	return true;
+}
+
+ConnectorHttpServer::CachedFile const* ConnectorHttpServer::load_cached_file(std::filesystem::path const& file, std::uintmax_t size, std::filesystem::file_time_type modified)
+{
+	std::string const key = file.string();
+
+	auto iter = m_file_cache.find(key);
+	if (iter != m_file_cache.end())
+	{
+		if (iter->second.size == size && iter->second.modified == modified)
+		{
+			++m_stats.cache_hits;
+			return &iter->second;
+		}
+
+		m_file_cache_size -= iter->second.data.size();
+		m_file_cache.erase(iter);
+	}
+
+	std::string err;
+	std::string data = util::load_file(file, err);
+	if (!err.empty() || data.size() != size)
+		return nullptr;
+
+	// Pages change rarely, so simply drop entries until the new file fits
+	while (!m_file_cache.empty() && m_file_cache_size + data.size() > MAX_FILE_CACHE_SIZE)
+	{
+		m_file_cache_size -= m_file_cache.begin()->second.data.size();
+		m_file_cache.erase(m_file_cache.begin());
+	}
+
+	m_file_cache_size += data.size();
+
+	CachedFile& cached = m_file_cache[key];
+	cached.size        = size;
+	cached.modified    = modified;
+	cached.data        = std::move(data);
+	return &cached;
+}
+
+void ConnectorHttpServer::pump_file(Client& client)
+{
+	if (m_file_buffer.size() < FILE_STREAM_CHUNK_SIZE)
+		m_file_buffer.resize(FILE_STREAM_CHUNK_SIZE);
+
+	while (client.file_remaining > 0 && client.is_connected() && client.socket.get_pending_write_size() < FILE_STREAM_HIGH_WATER)
+	{
+		std::size_t const wanted = std::size_t(std::min<std::uint64_t>(client.file_remaining, FILE_STREAM_CHUNK_SIZE));
+		client.file.read(m_file_buffer.data(), std::streamsize(wanted));
+
+		std::size_t const count = std::size_t(client.file.gcount());
+		if (count == 0 || !client.socket.write(m_file_buffer.data(), int(count)))
+		{
+			// The file shrunk underneath us, the promised length can't be honoured any more
+			client.file_remaining = 0;
+			client.socket.close();
+			break;
+		}
+
+		client.file_remaining -= count;
+	}
+
+	if (client.file_remaining == 0)
+		client.file.close();
+}
+
+void ConnectorHttpServer::begin_response(Client const& client, int status_code, std::string_view const& headers, std::uint64_t content_length)
+{
+	m_response.clear();
+	m_response += "HTTP/1.1 ";
+	m_response += std::to_string(status_code);
+	m_response += ' ';
+	m_response += util::http_status_message(status_code);
+	m_response += "\r\nServer: deck-assistant\r\n";
+	m_response += headers;
+
+	if (has_body(status_code))
+	{
+		m_response += "Content-Length: ";
+		m_response += std::to_string(content_length);
+		m_response += "\r\n";
+	}
+
+	m_response += client.keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+}
+
+void ConnectorHttpServer::finish_response(Client& client)
+{
+	client.socket.write(m_response.data(), int(m_response.size()));
+	m_response.clear();
+}
+
+void ConnectorHttpServer::send_response(Client& client, int status_code, std::string_view const& headers, std::string_view const& body)
+{
+	begin_response(client, status_code, headers, body.size());
+	if (!client.head_only && has_body(status_code))
+		m_response += body;
+	finish_response(client);
+}
+
+void ConnectorHttpServer::send_error(Client& client, int status_code, bool close_connection)
+{
+	if (close_connection)
+	{
+		// The rest of the input can't be trusted to start with a new request
+		client.keep_alive      = false;
+		client.close_when_done = true;
+		client.received.clear();
+	}
+
+	++m_stats.errors;
+	std::string_view const message = util::http_status_message(status_code);
+	send_response(client, status_code, "Content-Type: text/plain; charset=utf-8\r\n", message);
+}
+
+void ConnectorHttpServer::init_class_table(lua_State* L)
+{
+	Super::init_class_table(L);
+
+	lua_pushcfunction(L, &_lua_route);
+	lua_setfield(L, -2, "route");
+
+	lua_pushcfunction(L, &_lua_reset_timer);
+	lua_setfield(L, -2, "reset_timer");
+}
+
+void ConnectorHttpServer::init_instance_table(lua_State* L)
+{
+	lua_pushlightuserdata(L, (void*)&g_routes_key);
+	lua_createtable(L, 0, 0);
+	lua_rawset(L, -3);
+
+	LuaHelpers::create_callback_warning(L, "on_connect");
+	LuaHelpers::create_callback_warning(L, "on_connect_failed");
+	LuaHelpers::create_callback_warning(L, "on_disconnect");
+}
+
+int ConnectorHttpServer::index(lua_State* L, std::string_view const& key) const
+{
+	if (key == "enabled")
+	{
+		lua_pushboolean(L, m_enabled);
+	}
+	else if (key == "port")
+	{
+		if (m_active_port != 0)
+			lua_pushinteger(L, m_active_port);
+		else
+			lua_pushinteger(L, m_wanted_port);
+	}
+	else if (key == "static_dir")
+	{
+		if (!m_static_dir.empty())
+			lua_pushlstring(L, m_static_dir.data(), m_static_dir.size());
+	}
+	else if (key == "static_path")
+	{
+		lua_pushlstring(L, m_static_path.data(), m_static_path.size());
+	}
+	else if (key == "cache_max_age")
+	{
+		lua_pushinteger(L, m_cache_max_age);
+	}
+	else if (key == "keepalive_timeout")
+	{
+		lua_pushinteger(L, m_keepalive_timeout);
+	}
+	else if (key == "max_body_size")
+	{
+		lua_pushinteger(L, lua_Integer(m_max_body_size));
+	}
+	else if (key == "num_clients")
+	{
+		lua_pushinteger(L, lua_Integer(m_clients.size()));
+	}
+	else if (key == "stats")
+	{
+		lua_createtable(L, 0, 8);
+		lua_pushinteger(L, lua_Integer(m_stats.requests));
+		lua_setfield(L, -2, "requests");
+		lua_pushinteger(L, lua_Integer(m_stats.dynamic));
+		lua_setfield(L, -2, "dynamic");
+		lua_pushinteger(L, lua_Integer(m_stats.static_files));
+		lua_setfield(L, -2, "static");
+		lua_pushinteger(L, lua_Integer(m_stats.not_modified));
+		lua_setfield(L, -2, "not_modified");
+		lua_pushinteger(L, lua_Integer(m_stats.cache_hits));
+		lua_setfield(L, -2, "cache_hits");
+		lua_pushinteger(L, lua_Integer(m_stats.errors));
+		lua_setfield(L, -2, "errors");
+		lua_pushinteger(L, lua_Integer(m_file_cache.size()));
+		lua_setfield(L, -2, "cached_files");
+		lua_pushinteger(L, lua_Integer(m_file_cache_size));
+		lua_setfield(L, -2, "cached_bytes");
+	}
+	return lua_gettop(L) == 2 ? 0 : 1;
+}
+
+int ConnectorHttpServer::newindex(lua_State* L, std::string_view const& key)
+{
+	if (key == "num_clients" || key == "stats")
+	{
+		luaL_error(L, "key %s is readonly for %s", key.data(), LUA_TYPENAME);
+	}
+	else if (key == "enabled")
+	{
+		luaL_checktype(L, 3, LUA_TBOOLEAN);
+		m_enabled = lua_toboolean(L, 3);
+	}
+	else if (key == "port")
+	{
+		int value = LuaHelpers::check_arg_int(L, 3);
+		luaL_argcheck(L, (value > 0 && value < 65536), 3, "invalid value for port (out of range)");
+
+		if (value != m_wanted_port)
+		{
+			if (m_server_state != State::Disconnected)
+				DeckLogger::log_message(L, DeckLogger::Level::Warning, "HttpServer already active on port ", m_active_port, ", active port may not change immediately");
+
+			m_wanted_port = value;
+		}
+	}
+	else if (key == "static_dir")
+	{
+		m_file_cache.clear();
+		m_file_cache_size = 0;
+
+		std::string_view const value = lua_isnil(L, 3) ? std::string_view() : LuaHelpers::check_arg_string(L, 3, true);
+		if (value.empty())
+		{
+			m_static_dir.clear();
+			m_static_root.clear();
+			return 0;
+		}
+
+		std::filesystem::path const request_path(value);
+		luaL_argcheck(L, !request_path.is_absolute(), 3, "absolute paths not allowed");
+
+		DeckUtil* deck_util = DeckUtil::push_global_instance(L);
+		lua_pop(L, 1);
+		if (!deck_util)
+			luaL_error(L, "no sandbox available to serve files from");
+
+		std::error_code ec;
+		std::filesystem::path const sandbox = std::filesystem::weakly_canonical(deck_util->get_paths().get_sandbox_dir(), ec);
+		std::filesystem::path const root    = std::filesystem::weakly_canonical(sandbox / request_path, ec);
+		if (ec || !util::Paths::verify_path_contains_path(root, sandbox))
+			luaL_argerror(L, 3, "access denied");
+
+		if (!std::filesystem::is_directory(root, ec))
+			luaL_argerror(L, 3, "not a directory");
+
+		m_static_dir  = value;
+		m_static_root = root;
+	}
+	else if (key == "static_path")
+	{
+		std::string_view const value = LuaHelpers::check_arg_string(L, 3);
+		luaL_argcheck(L, value.starts_with('/'), 3, "static_path must start with a /");
+
+		m_static_path = value;
+		if (m_static_path.back() != '/')
+			m_static_path += '/';
+	}
+	else if (key == "cache_max_age")
+	{
+		lua_Integer value = LuaHelpers::check_arg_int(L, 3);
+		luaL_argcheck(L, (value >= 0), 3, "cache_max_age must not be negative");
+		m_cache_max_age = value;
+	}
+	else if (key == "keepalive_timeout")
+	{
+		lua_Integer value = LuaHelpers::check_arg_int(L, 3);
+		luaL_argcheck(L, (value >= 0), 3, "keepalive_timeout must not be negative");
+		m_keepalive_timeout = value;
+	}
+	else if (key == "max_body_size")
+	{
+		lua_Integer value = LuaHelpers::check_arg_int(L, 3);
+		luaL_argcheck(L, (value >= 0), 3, "max_body_size must not be negative");
+		m_max_body_size = std::size_t(value);
+	}
+	else if (key.starts_with("on_"))
+	{
+		if (lua_type(L, 3) != LUA_TNIL)
+			luaL_argcheck(L, (lua_type(L, 3) == LUA_TFUNCTION), 3, "event handlers must be functions");
+
+		LuaHelpers::newindex_store_in_instance_table(L);
+	}
+	else
+	{
+		LuaHelpers::newindex_store_in_instance_table(L);
+	}
+	return 0;
+}
+
+int ConnectorHttpServer::_lua_route(lua_State* L)
+{
+	ConnectorHttpServer* self = from_stack(L, 1);
+	std::string_view path     = LuaHelpers::check_arg_string(L, 2);
+	luaL_argcheck(L, path.starts_with('/'), 2, "route path must start with a /");
+	if (lua_type(L, 3) != LUA_TNIL)
+		luaL_checktype(L, 3, LUA_TFUNCTION);
+
+	LuaHelpers::push_instance_table(L, 1);
+	lua_pushlightuserdata(L, (void*)&g_routes_key);
+	lua_rawget(L, -2);
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, 3);
+	lua_rawset(L, -3);
+	lua_pop(L, 2);
+
+	auto iter = std::find(self->m_routes.begin(), self->m_routes.end(), path);
+	if (iter != self->m_routes.end())
+		self->m_routes.erase(iter);
+
+	if (lua_type(L, 3) != LUA_TNIL)
+	{
+		self->m_routes.emplace_back(path);
+		std::stable_sort(self->m_routes.begin(), self->m_routes.end(), [](std::string const& lhs, std::string const& rhs) { return lhs.size() > rhs.size(); });
+	}
+
+	return 0;
+}
+
+int ConnectorHttpServer::_lua_reset_timer(lua_State* L)
+{
+	ConnectorHttpServer* self  = from_stack(L, 1);
+	self->m_listen_last_attempt -= 5000;
+	self->m_enabled              = true;
+	return 0;
+}
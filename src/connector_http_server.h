@@ -0,0 +1,118 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef DECK_ASSISTANT_CONNECTOR_HTTP_SERVER_H
+#define DECK_ASSISTANT_CONNECTOR_HTTP_SERVER_H
+
+#include "connector_base.h"
+#include "util_socket.h"
+#include "util_text.h"
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class ConnectorHttpServer : public ConnectorBase<ConnectorHttpServer>
+{
+public:
+	ConnectorHttpServer(std::shared_ptr<util::SocketSet> const& socketset);
+	~ConnectorHttpServer();
+
+	void tick_inputs(lua_State* L, lua_Integer clock) override;
+	void tick_outputs(lua_State* L, lua_Integer clock) override;
+	void shutdown(lua_State* L) override;
+
+	void tick_server_input(lua_State* L, lua_Integer clock);
+	void tick_clients_input(lua_State* L, lua_Integer clock);
+	void tick_server_output(lua_State* L, lua_Integer clock);
+	void tick_clients_output(lua_State* L, lua_Integer clock);
+
+	static char const* LUA_TYPENAME;
+	static void init_class_table(lua_State* L);
+	void init_instance_table(lua_State* L);
+	int index(lua_State* L, std::string_view const& key) const;
+	int newindex(lua_State* L, std::string_view const& key);
+
+private:
+	struct Client;
+
+	struct CachedFile
+	{
+		std::uintmax_t size;
+		std::filesystem::file_time_type modified;
+		std::string data;
+	};
+
+	struct Stats
+	{
+		std::uint64_t requests     = 0;
+		std::uint64_t dynamic      = 0;
+		std::uint64_t static_files = 0;
+		std::uint64_t not_modified = 0;
+		std::uint64_t cache_hits   = 0;
+		std::uint64_t errors       = 0;
+	};
+
+	void process_requests(lua_State* L, Client& client);
+	void handle_request(lua_State* L, Client& client, util::HttpMessage const& request, std::string_view const& body);
+	std::string const* match_route(std::string_view const& path) const;
+	bool call_route(lua_State* L, Client& client, std::string const& route, util::HttpMessage const& request, std::string_view const& path, std::string_view const& query, std::string_view const& body);
+	bool serve_static(Client& client, std::string_view const& path, util::HttpMessage const& request);
+	CachedFile const* load_cached_file(std::filesystem::path const& file, std::uintmax_t size, std::filesystem::file_time_type modified);
+	void pump_file(Client& client);
+
+	void begin_response(Client const& client, int status_code, std::string_view const& headers, std::uint64_t content_length);
+	void finish_response(Client& client);
+	void send_response(Client& client, int status_code, std::string_view const& headers, std::string_view const& body);
+	void send_error(Client& client, int status_code, bool close_connection);
+
+	static int _lua_route(lua_State* L);
+	static int _lua_reset_timer(lua_State* L);
+
+private:
+	enum class State : char
+	{
+		Disconnected,
+		Binding,
+		Listening,
+	};
+
+	util::Socket m_socket;
+	State m_server_state;
+	unsigned short m_wanted_port;
+	unsigned short m_active_port;
+	bool m_enabled;
+	lua_Integer m_listen_last_attempt;
+	lua_Integer m_keepalive_timeout;
+	lua_Integer m_cache_max_age;
+	std::size_t m_max_body_size;
+	std::vector<std::unique_ptr<Client>> m_clients;
+	std::vector<std::string> m_routes;
+	std::string m_static_dir;
+	std::string m_static_path;
+	std::filesystem::path m_static_root;
+	std::unordered_map<std::string, CachedFile> m_file_cache;
+	std::size_t m_file_cache_size;
+	std::string m_response;
+	std::vector<char> m_file_buffer;
+	Stats m_stats;
+};
+
+#endif // DECK_ASSISTANT_CONNECTOR_HTTP_SERVER_H
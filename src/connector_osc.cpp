@@ -0,0 +1,543 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "connector_osc.h"
+#include "deck_logger.h"
+#include "lua_helpers.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace
+{
+
+// Enough for a busy control surface, without starving the rest of the tick
+constexpr int const MAX_DATAGRAMS_PER_TICK = 1024;
+
+// Type tags accepted in explicit {type=, value=} arguments
+constexpr std::string_view const SEND_TYPES = "ifsSbhtdcrmTFNI";
+
+char const g_routes_key = 0;
+
+void push_argument(lua_State* L, util::osc::Argument const& argument)
+{
+	switch (argument.type)
+	{
+		case 'i':
+		case 'h':
+		case 't':
+		case 'c':
+		case 'r':
+		case 'm':
+			lua_pushinteger(L, lua_Integer(argument.integer));
+			break;
+
+		case 'f':
+		case 'd':
+			lua_pushnumber(L, argument.number);
+			break;
+
+		case 's':
+		case 'S':
+		case 'b':
+			lua_pushlstring(L, argument.data.data(), argument.data.size());
+			break;
+
+		case 'T':
+		case 'I':
+			lua_pushboolean(L, true);
+			break;
+
+		case 'F':
+			lua_pushboolean(L, false);
+			break;
+
+		default:
+			lua_pushnil(L);
+			break;
+	}
+}
+
+} // namespace
+
+char const* ConnectorOsc::LUA_TYPENAME = "deck:ConnectorOsc";
+
+ConnectorOsc::ConnectorOsc()
+    : m_wanted_port(0)
+    , m_enabled(true)
+    , m_open_last_attempt(-5000)
+    , m_remote_port(0)
+{
+}
+
+ConnectorOsc::~ConnectorOsc()
+{
+	m_enabled = false;
+}
+
+void ConnectorOsc::tick_inputs(lua_State* L, lua_Integer clock)
+{
+	if (!m_socket.is_open())
+	{
+		if (!m_enabled || clock < m_open_last_attempt + 5000)
+			return;
+
+		m_open_last_attempt = clock;
+
+		if (!m_socket.open(m_wanted_port))
+		{
+			DeckLogger::log_message(L, DeckLogger::Level::Debug, "Osc binding to port ", m_wanted_port, " failed: ", m_socket.get_last_error());
+			LuaHelpers::emit_event(L, 1, "on_connect_failed", m_socket.get_last_error());
+			return;
+		}
+
+		DeckLogger::log_message(L, DeckLogger::Level::Debug, "Osc bound to port ", m_socket.get_local_port(), ", now receiving messages");
+		LuaHelpers::emit_event(L, 1, "on_connect");
+	}
+
+	m_socket.receive([this, L](std::string_view const& data, std::string const& host, int port) { handle_datagram(L, data, host, port); }, MAX_DATAGRAMS_PER_TICK);
+}
+
+void ConnectorOsc::tick_outputs(lua_State* L, lua_Integer clock)
+{
+	if (!m_socket.is_open())
+		return;
+
+	bool const port_changed = m_wanted_port != 0 && m_wanted_port != m_socket.get_local_port();
+	if (m_enabled && !port_changed)
+		return;
+
+	std::string message  = "Osc on port ";
+	message             += std::to_string(m_socket.get_local_port());
+	message             += m_enabled ? " changing port, closing port." : " disabled, closing port.";
+
+	// Rebinding a datagram socket is cheap, so a new port is picked up on the next tick
+	m_socket.close();
+	if (m_enabled)
+		m_open_last_attempt = clock - 5000;
+
+	DeckLogger::log_message(L, DeckLogger::Level::Debug, message);
+	LuaHelpers::emit_event(L, 1, "on_disconnect", message);
+}
+
+void ConnectorOsc::shutdown(lua_State* L)
+{
+	m_socket.close();
+	m_messages.clear();
+}
+
+void ConnectorOsc::handle_datagram(lua_State* L, std::string_view const& data, std::string const& host, int port)
+{
+	++m_stats.received;
+
+	// A malformed bundle is dropped as a whole rather than half delivered
+	m_messages.clear();
+	if (!util::osc::decode_packet(data, m_messages, m_decode_error))
+	{
+		++m_stats.decode_errors;
+		DeckLogger::log_message(L, DeckLogger::Level::Debug, "Osc dropped packet from ", host, ':', port, ": ", m_decode_error);
+		return;
+	}
+
+	// Bundle time tags are passed on, but bundles are delivered immediately
+	for (util::osc::Message const& message : m_messages)
+		dispatch(L, message, host, port);
+}
+
+void ConnectorOsc::dispatch(lua_State* L, util::osc::Message const& message, std::string const& host, int port)
+{
+	++m_stats.messages;
+
+	int const top         = lua_gettop(L);
+	bool matched          = false;
+	bool const is_pattern = message.address.find_first_of("?*[{") != std::string_view::npos;
+
+	// Handlers may add or remove routes, so don't hold on to anything in the list across calls
+	for (std::size_t idx = 0; idx < m_routes.size(); ++idx)
+	{
+		std::string const& route = m_routes[idx];
+
+		// Senders may use patterns too, the specification matches those against our addresses
+		bool const match = is_pattern ? util::osc::match_address(message.address, route) : util::osc::match_address(route, message.address);
+		if (!match)
+			continue;
+
+		if (!matched)
+		{
+			push_message(L, message, host, port);
+			matched = true;
+		}
+
+		LuaHelpers::push_instance_table(L, 1);
+		lua_pushlightuserdata(L, (void*)&g_routes_key);
+		lua_rawget(L, -2);
+		lua_pushlstring(L, route.data(), route.size());
+		lua_rawget(L, -2);
+		lua_replace(L, -3);
+		lua_pop(L, 1);
+
+		if (lua_type(L, -1) != LUA_TFUNCTION)
+		{
+			lua_pop(L, 1);
+			continue;
+		}
+
+		++m_stats.dispatched;
+		lua_pushvalue(L, 1);
+		lua_pushvalue(L, top + 1);
+		LuaHelpers::yieldable_call(L, 2);
+	}
+
+	if (!matched)
+	{
+		++m_stats.unmatched;
+
+		lua_getfield(L, 1, "on_message");
+		if (lua_type(L, -1) == LUA_TFUNCTION)
+		{
+			lua_pushvalue(L, 1);
+			push_message(L, message, host, port);
+			LuaHelpers::yieldable_call(L, 2);
+		}
+	}
+
+	lua_settop(L, top);
+}
+
+void ConnectorOsc::push_message(lua_State* L, util::osc::Message const& message, std::string const& host, int port)
+{
+	lua_createtable(L, int(message.arguments.size()), 5);
+
+	lua_pushlstring(L, message.address.data(), message.address.size());
+	lua_setfield(L, -2, "address");
+
+	std::string types;
+	types.reserve(message.arguments.size());
+	for (util::osc::Argument const& argument : message.arguments)
+		types.push_back(argument.type);
+
+	lua_pushlstring(L, types.data(), types.size());
+	lua_setfield(L, -2, "types");
+
+	lua_pushlstring(L, host.data(), host.size());
+	lua_setfield(L, -2, "host");
+	lua_pushinteger(L, port);
+	lua_setfield(L, -2, "port");
+
+	if (message.time_tag != util::osc::TIME_IMMEDIATELY)
+	{
+		lua_pushinteger(L, lua_Integer(message.time_tag));
+		lua_setfield(L, -2, "time_tag");
+	}
+
+	for (std::size_t idx = 0; idx < message.arguments.size(); ++idx)
+	{
+		push_argument(L, message.arguments[idx]);
+		lua_rawseti(L, -2, int(idx + 1));
+	}
+}
+
+int ConnectorOsc::send_message(lua_State* L, std::string_view const& host, int port, int address_idx)
+{
+	std::string_view const address = LuaHelpers::check_arg_string(L, address_idx);
+	luaL_argcheck(L, address.starts_with('/'), address_idx, "OSC address must start with a /");
+
+	int const top = lua_gettop(L);
+	if (!lua_checkstack(L, 2 * (top - address_idx) + 2))
+		luaL_error(L, "too many OSC arguments");
+
+	// Strings are referenced straight from the stack, so explicit values stay there until the packet is encoded
+	m_arguments.clear();
+	for (int idx = address_idx + 1; idx <= top; ++idx)
+	{
+		util::osc::Argument& argument = m_arguments.emplace_back();
+
+		if (lua_type(L, idx) == LUA_TTABLE)
+		{
+			lua_getfield(L, idx, "type");
+			std::string_view const type = lua_type(L, -1) == LUA_TSTRING ? LuaHelpers::to_string_view(L, -1) : std::string_view();
+			luaL_argcheck(L, type.size() == 1 && SEND_TYPES.find(type[0]) != std::string_view::npos, idx, "invalid OSC argument type");
+
+			argument.type = type[0];
+			lua_getfield(L, idx, "value");
+
+			switch (argument.type)
+			{
+				case 'i':
+				case 'h':
+				case 't':
+				case 'c':
+				case 'r':
+				case 'm':
+					luaL_argcheck(L, lua_type(L, -1) == LUA_TNUMBER, idx, "OSC argument value must be a number");
+					argument.integer = lua_tointeger(L, -1);
+					break;
+
+				case 'f':
+				case 'd':
+					luaL_argcheck(L, lua_type(L, -1) == LUA_TNUMBER, idx, "OSC argument value must be a number");
+					argument.number = lua_tonumber(L, -1);
+					break;
+
+				case 's':
+				case 'S':
+				case 'b':
+					luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, idx, "OSC argument value must be a string");
+					argument.data = LuaHelpers::to_string_view(L, -1);
+					break;
+
+				default:
+					break;
+			}
+			continue;
+		}
+
+		switch (lua_type(L, idx))
+		{
+			case LUA_TNUMBER:
+			{
+				// Whole numbers go out as int32, anything else as float; use {type='f', value=1} to force
+				double const value = lua_tonumber(L, idx);
+				if (value == std::floor(value) && value >= INT32_MIN && value <= INT32_MAX)
+				{
+					argument.type    = 'i';
+					argument.integer = std::int64_t(value);
+				}
+				else
+				{
+					argument.type   = 'f';
+					argument.number = value;
+				}
+				break;
+			}
+
+			case LUA_TSTRING:
+				argument.type = 's';
+				argument.data = LuaHelpers::to_string_view(L, idx);
+				break;
+
+			case LUA_TBOOLEAN:
+				argument.type = lua_toboolean(L, idx) ? 'T' : 'F';
+				break;
+
+			case LUA_TNIL:
+				argument.type = 'N';
+				break;
+
+			default:
+				luaL_argerror(L, idx, "unsupported OSC argument");
+				break;
+		}
+	}
+
+	m_packet.clear();
+	util::osc::encode_message(m_packet, address, m_arguments);
+	lua_settop(L, top);
+
+	if (!m_socket.send_to(host, port, m_packet.data(), int(m_packet.size())))
+	{
+		++m_stats.send_errors;
+		lua_pushboolean(L, false);
+		lua_pushlstring(L, m_socket.get_last_error().data(), m_socket.get_last_error().size());
+		return 2;
+	}
+
+	++m_stats.sent;
+	lua_pushboolean(L, true);
+	return 1;
+}
+
+void ConnectorOsc::init_class_table(lua_State* L)
+{
+	Super::init_class_table(L);
+
+	lua_pushcfunction(L, &_lua_route);
+	lua_setfield(L, -2, "route");
+
+	lua_pushcfunction(L, &_lua_send);
+	lua_setfield(L, -2, "send");
+
+	lua_pushcfunction(L, &_lua_send_to);
+	lua_setfield(L, -2, "send_to");
+
+	lua_pushcfunction(L, &_lua_broadcast);
+	lua_setfield(L, -2, "broadcast");
+
+	lua_pushcfunction(L, &_lua_reset_timer);
+	lua_setfield(L, -2, "reset_timer");
+}
+
+void ConnectorOsc::init_instance_table(lua_State* L)
+{
+	lua_pushlightuserdata(L, (void*)&g_routes_key);
+	lua_createtable(L, 0, 0);
+	lua_rawset(L, -3);
+
+	LuaHelpers::create_callback_warning(L, "on_connect");
+	LuaHelpers::create_callback_warning(L, "on_connect_failed");
+	LuaHelpers::create_callback_warning(L, "on_disconnect");
+}
+
+int ConnectorOsc::index(lua_State* L, std::string_view const& key) const
+{
+	if (key == "enabled")
+	{
+		lua_pushboolean(L, m_enabled);
+	}
+	else if (key == "port")
+	{
+		if (m_socket.is_open())
+			lua_pushinteger(L, m_socket.get_local_port());
+		else
+			lua_pushinteger(L, m_wanted_port);
+	}
+	else if (key == "remote_host")
+	{
+		if (!m_remote_host.empty())
+			lua_pushlstring(L, m_remote_host.data(), m_remote_host.size());
+	}
+	else if (key == "remote_port")
+	{
+		lua_pushinteger(L, m_remote_port);
+	}
+	else if (key == "stats")
+	{
+		lua_createtable(L, 0, 8);
+		lua_pushinteger(L, lua_Integer(m_stats.received));
+		lua_setfield(L, -2, "received");
+		lua_pushinteger(L, lua_Integer(m_socket.get_truncated_count()));
+		lua_setfield(L, -2, "truncated");
+		lua_pushinteger(L, lua_Integer(m_stats.decode_errors));
+		lua_setfield(L, -2, "decode_errors");
+		lua_pushinteger(L, lua_Integer(m_stats.messages));
+		lua_setfield(L, -2, "messages");
+		lua_pushinteger(L, lua_Integer(m_stats.dispatched));
+		lua_setfield(L, -2, "dispatched");
+		lua_pushinteger(L, lua_Integer(m_stats.unmatched));
+		lua_setfield(L, -2, "unmatched");
+		lua_pushinteger(L, lua_Integer(m_stats.sent));
+		lua_setfield(L, -2, "sent");
+		lua_pushinteger(L, lua_Integer(m_stats.send_errors));
+		lua_setfield(L, -2, "send_errors");
+	}
+	return lua_gettop(L) == 2 ? 0 : 1;
+}
+
+int ConnectorOsc::newindex(lua_State* L, std::string_view const& key)
+{
+	if (key == "stats")
+	{
+		luaL_error(L, "key %s is readonly for %s", key.data(), LUA_TYPENAME);
+	}
+	else if (key == "enabled")
+	{
+		luaL_checktype(L, 3, LUA_TBOOLEAN);
+		m_enabled = lua_toboolean(L, 3);
+	}
+	else if (key == "port")
+	{
+		int value = LuaHelpers::check_arg_int(L, 3);
+		luaL_argcheck(L, (value >= 0 && value < 65536), 3, "invalid value for port (out of range)");
+		m_wanted_port = value;
+	}
+	else if (key == "remote_host")
+	{
+		m_remote_host = lua_isnil(L, 3) ? std::string_view() : LuaHelpers::check_arg_string(L, 3);
+	}
+	else if (key == "remote_port")
+	{
+		int value = LuaHelpers::check_arg_int(L, 3);
+		luaL_argcheck(L, (value >= 0 && value < 65536), 3, "invalid value for remote_port (out of range)");
+		m_remote_port = value;
+	}
+	else if (key.starts_with("on_"))
+	{
+		if (lua_type(L, 3) != LUA_TNIL)
+			luaL_argcheck(L, (lua_type(L, 3) == LUA_TFUNCTION), 3, "event handlers must be functions");
+
+		LuaHelpers::newindex_store_in_instance_table(L);
+	}
+	else
+	{
+		LuaHelpers::newindex_store_in_instance_table(L);
+	}
+	return 0;
+}
+
+int ConnectorOsc::_lua_route(lua_State* L)
+{
+	ConnectorOsc* self       = from_stack(L, 1);
+	std::string_view pattern = LuaHelpers::check_arg_string(L, 2);
+	luaL_argcheck(L, pattern.starts_with('/'), 2, "route pattern must start with a /");
+	if (lua_type(L, 3) != LUA_TNIL)
+		luaL_checktype(L, 3, LUA_TFUNCTION);
+
+	LuaHelpers::push_instance_table(L, 1);
+	lua_pushlightuserdata(L, (void*)&g_routes_key);
+	lua_rawget(L, -2);
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, 3);
+	lua_rawset(L, -3);
+	lua_pop(L, 2);
+
+	// Every matching route gets the message, in the order they were added
+	auto iter = std::find(self->m_routes.begin(), self->m_routes.end(), pattern);
+	if (iter != self->m_routes.end())
+		self->m_routes.erase(iter);
+
+	if (lua_type(L, 3) != LUA_TNIL)
+		self->m_routes.emplace_back(pattern);
+
+	return 0;
+}
+
+int ConnectorOsc::_lua_send(lua_State* L)
+{
+	ConnectorOsc* self = from_stack(L, 1);
+	if (self->m_remote_host.empty() || self->m_remote_port == 0)
+		luaL_error(L, "Osc has no remote_host and remote_port to send to");
+
+	return self->send_message(L, self->m_remote_host, self->m_remote_port, 2);
+}
+
+int ConnectorOsc::_lua_send_to(lua_State* L)
+{
+	ConnectorOsc* self    = from_stack(L, 1);
+	std::string_view host = LuaHelpers::check_arg_string(L, 2);
+	int port              = LuaHelpers::check_arg_int(L, 3);
+	luaL_argcheck(L, (port > 0 && port < 65536), 3, "invalid value for port (out of range)");
+
+	return self->send_message(L, host, port, 4);
+}
+
+int ConnectorOsc::_lua_broadcast(lua_State* L)
+{
+	ConnectorOsc* self = from_stack(L, 1);
+	int port           = LuaHelpers::check_arg_int(L, 2);
+	luaL_argcheck(L, (port > 0 && port < 65536), 2, "invalid value for port (out of range)");
+
+	return self->send_message(L, "255.255.255.255", port, 3);
+}
+
+int ConnectorOsc::_lua_reset_timer(lua_State* L)
+{
+	ConnectorOsc* self         = from_stack(L, 1);
+	self->m_open_last_attempt -= 5000;
+	self->m_enabled            = true;
+	return 0;
+}
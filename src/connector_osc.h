@@ -0,0 +1,84 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DECK_ASSISTANT_CONNECTOR_OSC_H
+#define DECK_ASSISTANT_CONNECTOR_OSC_H
+
+#include "connector_base.h"
+#include "util_osc.h"
+#include "util_socket.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class ConnectorOsc : public ConnectorBase<ConnectorOsc>
+{
+public:
+	ConnectorOsc();
+	~ConnectorOsc();
+
+	void tick_inputs(lua_State* L, lua_Integer clock) override;
+	void tick_outputs(lua_State* L, lua_Integer clock) override;
+	void shutdown(lua_State* L) override;
+
+	static char const* LUA_TYPENAME;
+	static void init_class_table(lua_State* L);
+	void init_instance_table(lua_State* L);
+	int index(lua_State* L, std::string_view const& key) const;
+	int newindex(lua_State* L, std::string_view const& key);
+
+private:
+	struct Stats
+	{
+		std::uint64_t received      = 0;
+		std::uint64_t messages      = 0;
+		std::uint64_t dispatched    = 0;
+		std::uint64_t unmatched     = 0;
+		std::uint64_t decode_errors = 0;
+		std::uint64_t sent          = 0;
+		std::uint64_t send_errors   = 0;
+	};
+
+	void handle_datagram(lua_State* L, std::string_view const& data, std::string const& host, int port);
+	void dispatch(lua_State* L, util::osc::Message const& message, std::string const& host, int port);
+	void push_message(lua_State* L, util::osc::Message const& message, std::string const& host, int port);
+	int send_message(lua_State* L, std::string_view const& host, int port, int address_idx);
+
+	static int _lua_route(lua_State* L);
+	static int _lua_send(lua_State* L);
+	static int _lua_send_to(lua_State* L);
+	static int _lua_broadcast(lua_State* L);
+	static int _lua_reset_timer(lua_State* L);
+
+private:
+	util::DatagramSocket m_socket;
+	unsigned short m_wanted_port;
+	bool m_enabled;
+	lua_Integer m_open_last_attempt;
+	std::string m_remote_host;
+	unsigned short m_remote_port;
+	std::vector<std::string> m_routes;
+	std::vector<util::osc::Message> m_messages;
+	std::vector<util::osc::Argument> m_arguments;
+	std::string m_decode_error;
+	std::string m_packet;
+	Stats m_stats;
+};
+
+#endif // DECK_ASSISTANT_CONNECTOR_OSC_H
@@ -33,7 +33,6 @@ ConnectorServerSocket::ConnectorServerSocket(std::shared_ptr<util::SocketSet> co
     , m_listen_last_attempt(-5000)
     , m_num_clients(0)
 {
-	m_read_buffer.assign(4096, 0);
 }
 
 ConnectorServerSocket::~ConnectorServerSocket()
@@ -134,10 +133,8 @@ void ConnectorServerSocket::tick_server_input(lua_State* L, lua_Integer clock)
 
 	if (m_server_state == State::Listening)
 	{
-		std::optional<util::Socket> maybe_client = m_socket.accept_nonblock();
-		if (maybe_client.has_value())
-		{
-			ConnectorServerSocketClient* client = ConnectorServerSocketClient::push_new(L, std::move(maybe_client).value());
+		m_socket.accept_pending([this, L](util::Socket&& client_socket) {
+			ConnectorServerSocketClient* client = ConnectorServerSocketClient::push_new(L, std::move(client_socket));
 
 			LuaHelpers::push_instance_table(L, 1);
 			lua_pushlightuserdata(L, this);
@@ -150,7 +147,7 @@ void ConnectorServerSocket::tick_server_input(lua_State* L, lua_Integer clock)
 			DeckLogger::log_message(L, DeckLogger::Level::Debug, "ServerSocket on port ", m_active_port, " accepted client from ", client->get_remote_host(), ':', client->get_remote_port());
 			LuaHelpers::emit_event(L, 1, "on_accept", LuaHelpers::StackValue(L, -1));
 			lua_pop(L, 1);
-		}
+		});
 
 		if (m_socket.get_state() == util::Socket::State::Disconnected)
 		{
@@ -182,12 +179,15 @@ void ConnectorServerSocket::tick_clients_input(lua_State* L, lua_Integer clock)
 		ConnectorServerSocketClient* client = ConnectorServerSocketClient::from_stack(L, -1, false);
 		if (client)
 		{
-			if (client->is_connected())
+			if (client->is_connected() && client->is_readable())
 			{
-				int read_len = client->read_nonblock(m_read_buffer.data(), m_read_buffer.size());
-				if (read_len > 0)
+				// Drain the client first so a burst of data reaches Lua as one event
+				m_read_buffer.clear();
+				client->read_available(m_read_buffer);
+
+				if (!m_read_buffer.empty())
 				{
-					std::string_view read_buf(m_read_buffer.data(), read_len);
+					std::string_view read_buf(reinterpret_cast<char const*>(m_read_buffer.data()), m_read_buffer.size());
 					LuaHelpers::emit_event(L, 1, "on_receive", LuaHelpers::StackValue(L, -1), read_buf);
 				}
 			}
@@ -239,6 +239,26 @@ void ConnectorServerSocket::tick_server_output(lua_State* L, lua_Integer clock)
 
 void ConnectorServerSocket::tick_clients_output(lua_State* L, lua_Integer clock)
 {
+	if (!m_num_clients)
+		return;
+
+	LuaHelpers::push_instance_table(L, 1);
+	lua_pushlightuserdata(L, this);
+	lua_rawget(L, -2);
+
+	for (unsigned int ref = 1; ref <= m_num_clients; ++ref)
+	{
+		lua_rawgeti(L, -1, ref);
+
+		// Queued data is flushed by the socket set as soon as the client accepts it
+		ConnectorServerSocketClient* client = ConnectorServerSocketClient::from_stack(L, -1, false);
+		if (client && client->check_drained())
+			LuaHelpers::emit_event(L, 1, "on_drain", LuaHelpers::StackValue(L, -1));
+
+		lua_pop(L, 1);
+	}
+
+	lua_pop(L, 2);
 }
 
 void ConnectorServerSocket::init_class_table(lua_State* L)
@@ -262,6 +282,7 @@ void ConnectorServerSocket::init_instance_table(lua_State* L)
 	LuaHelpers::create_callback_warning(L, "on_accept");
 	LuaHelpers::create_callback_warning(L, "on_receive");
 	LuaHelpers::create_callback_warning(L, "on_close");
+	LuaHelpers::create_callback_warning(L, "on_drain");
 }
 
 int ConnectorServerSocket::index(lua_State* L, std::string_view const& key) const
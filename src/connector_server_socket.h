@@ -20,8 +20,8 @@
 #define DECK_ASSISTANT_CONNECTOR_SERVER_SOCKET_H
 
 #include "connector_base.h"
+#include "util_blob.h"
 #include "util_socket.h"
-#include <vector>
 
 class ConnectorServerSocket : public ConnectorBase<ConnectorServerSocket>
 {
@@ -62,7 +62,7 @@ private:
 	bool m_enabled;
 	lua_Integer m_listen_last_attempt;
 	unsigned int m_num_clients;
-	std::vector<char> m_read_buffer;
+	util::BlobBuffer m_read_buffer;
 };
 
 #endif // DECK_ASSISTANT_CONNECTOR_SERVER_SOCKET_H
@@ -20,10 +20,20 @@
 #include "deck_logger.h"
 #include "lua_helpers.h"
 
+namespace
+{
+
+// Queued output above which send() asks the script to hold off until on_drain
+constexpr std::size_t const DEFAULT_WRITE_HIGH_WATER = 256 * 1024;
+
+} // namespace
+
 char const* ConnectorServerSocketClient::LUA_TYPENAME = "deck:ConnectorServerSocketClient";
 
 ConnectorServerSocketClient::ConnectorServerSocketClient(util::Socket&& client_socket)
     : m_socket(std::move(client_socket))
+    , m_write_high_water(DEFAULT_WRITE_HIGH_WATER)
+    , m_write_blocked(false)
 {
 }
 
@@ -63,15 +73,29 @@ int ConnectorServerSocketClient::index(lua_State* L, std::string_view const& key
 		int const rport = get_remote_port();
 		lua_pushinteger(L, rport);
 	}
+	else if (key == "pending_write")
+	{
+		lua_pushinteger(L, lua_Integer(m_socket.get_pending_write_size()));
+	}
+	else if (key == "write_high_water")
+	{
+		lua_pushinteger(L, lua_Integer(m_write_high_water));
+	}
 	return lua_gettop(L) == 2 ? 0 : 1;
 }
 
 int ConnectorServerSocketClient::newindex(lua_State* L, std::string_view const& key)
 {
-	if (key == "connected" || key == "host" || key == "remote_host" || key == "port" || key == "remote_port")
+	if (key == "connected" || key == "host" || key == "remote_host" || key == "port" || key == "remote_port" || key == "pending_write")
 	{
 		luaL_error(L, "key %s is readonly for %s", key.data(), LUA_TYPENAME);
 	}
+	else if (key == "write_high_water")
+	{
+		lua_Integer value = LuaHelpers::check_arg_int(L, 3);
+		luaL_argcheck(L, (value > 0), 3, "invalid value for write_high_water (must be positive)");
+		m_write_high_water = std::size_t(value);
+	}
 	else if (key.starts_with("on_"))
 	{
 		if (lua_type(L, 3) != LUA_TNIL)
@@ -96,9 +120,14 @@ int ConnectorServerSocketClient::get_remote_port() const
 	return m_socket.get_remote_port();
 }
 
-int ConnectorServerSocketClient::read_nonblock(void* data, int maxlen)
+int ConnectorServerSocketClient::read_available(util::BlobBuffer& buffer)
 {
-	return m_socket.read_nonblock(data, maxlen);
+	return m_socket.read_available(buffer);
+}
+
+bool ConnectorServerSocketClient::is_readable() const
+{
+	return m_socket.is_readable();
 }
 
 bool ConnectorServerSocketClient::is_connected() const
@@ -106,6 +135,16 @@ bool ConnectorServerSocketClient::is_connected() const
 	return m_socket.get_state() == util::Socket::State::Connected;
 }
 
+bool ConnectorServerSocketClient::check_drained()
+{
+	// Wait until the queue is well below the mark so scripts don't flap between states
+	if (!m_write_blocked || m_socket.get_pending_write_size() > m_write_high_water / 2)
+		return false;
+
+	m_write_blocked = false;
+	return is_connected();
+}
+
 void ConnectorServerSocketClient::close()
 {
 	m_socket.close();
@@ -116,14 +155,19 @@ int ConnectorServerSocketClient::_lua_send(lua_State* L)
 	ConnectorServerSocketClient* self = ConnectorServerSocketClient::from_stack(L, 1);
 	std::string_view data             = LuaHelpers::check_arg_string(L, 2, true);
 
-	if (!data.empty())
+	if (!self->m_socket.write(data.data(), int(data.size())))
 	{
-		int const count = self->m_socket.write(data.data(), data.size());
-		lua_pushinteger(L, count);
-		return 1;
+		lua_pushboolean(L, false);
+		lua_pushlstring(L, self->m_socket.get_last_error().data(), self->m_socket.get_last_error().size());
+		return 2;
 	}
 
-	return 0;
+	// Everything is queued regardless; false tells the script to wait for on_drain
+	if (self->m_socket.get_pending_write_size() >= self->m_write_high_water)
+		self->m_write_blocked = true;
+
+	lua_pushboolean(L, !self->m_write_blocked);
+	return 1;
 }
 
 int ConnectorServerSocketClient::_lua_close(lua_State* L)
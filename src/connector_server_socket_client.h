@@ -20,6 +20,7 @@
 #define DECK_ASSISTANT_CONNECTOR_SERVER_SOCKET_CLIENT_H
 
 #include "lua_class.h"
+#include "util_blob.h"
 #include "util_socket.h"
 
 class ConnectorServerSocketClient : public LuaClass<ConnectorServerSocketClient>
@@ -37,8 +38,10 @@ public:
 	std::string const& get_remote_host() const;
 	int get_remote_port() const;
 
-	int read_nonblock(void* data, int maxlen);
+	int read_available(util::BlobBuffer& buffer);
+	bool is_readable() const;
 	bool is_connected() const;
+	bool check_drained();
 	void close();
 
 private:
@@ -47,6 +50,8 @@ private:
 
 private:
 	util::Socket m_socket;
+	std::size_t m_write_high_water;
+	bool m_write_blocked;
 };
 
 #endif // DECK_ASSISTANT_CONNECTOR_SERVER_SOCKET_CLIENT_H
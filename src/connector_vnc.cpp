@@ -26,6 +26,7 @@
 #include <algorithm>
 #include <cassert>
 #include <charconv>
+#include <chrono>
 #include <cstring>
 
 #ifdef _WIN32
@@ -36,6 +37,12 @@
 
 #include <rfb/rfb.h>
 
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+#define VNC_HAVE_THREADS 1
+#else
+#define VNC_HAVE_THREADS 0
+#endif
+
 namespace
 {
 
@@ -45,6 +52,122 @@ enum DirtyFlags : unsigned char
 	DirtyMax,
 };
 
+constexpr int const TILE_SIZE = 64;
+
+// libvncserver waits this long after a change before sending it out, which is also the default
+constexpr int const DEFAULT_DEFER_UPDATE_TIME = 5;
+
+struct EncodingName
+{
+	std::string_view name;
+	int encoding;
+};
+
+// Only encodings the server side of libvncserver can produce
+constexpr EncodingName const ENCODINGS[] = {
+	{ "raw", rfbEncodingRaw },
+	{ "rre", rfbEncodingRRE },
+	{ "corre", rfbEncodingCoRRE },
+	{ "hextile", rfbEncodingHextile },
+	{ "ultra", rfbEncodingUltra },
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+	{ "zlib", rfbEncodingZlib },
+	{ "zlibhex", rfbEncodingZlibHex },
+	{ "zrle", rfbEncodingZRLE },
+	{ "zywrle", rfbEncodingZYWRLE },
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+	{ "tight", rfbEncodingTight },
+#endif
+#endif
+};
+
+std::string_view encoding_to_name(int encoding)
+{
+	for (EncodingName const& item : ENCODINGS)
+		if (item.encoding == encoding)
+			return item.name;
+
+	return "unknown";
+}
+
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+// Same mapping libvncserver applies when a client requests a tight quality level
+constexpr int const TIGHT_TO_TURBO_QUALITY[10]   = { 15, 29, 41, 42, 62, 77, 79, 86, 92, 100 };
+constexpr int const TIGHT_TO_TURBO_SUBSAMPLE[10] = { 1, 1, 1, 2, 2, 2, 0, 0, 0, 0 };
+#endif
+
+bool is_framebuffer_compatible(SDL_Surface const* surface, SDL_Surface const* screen_surface)
+{
+	SDL_PixelFormat const* format        = surface->format;
+	SDL_PixelFormat const* screen_format = screen_surface->format;
+
+	return surface->w == screen_surface->w
+	    && surface->h == screen_surface->h
+	    && format->BytesPerPixel == screen_format->BytesPerPixel
+	    && format->Rmask == screen_format->Rmask
+	    && format->Gmask == screen_format->Gmask
+	    && format->Bmask == screen_format->Bmask;
+}
+
+// libvncserver holds a client's sendMutex for as long as it encodes an update from the framebuffer, so
+// holding all of them keeps the client threads out while the framebuffer is written or replaced.
+// Clients that connect meanwhile can't have requested an update yet.
+class ClientSendLock
+{
+public:
+	ClientSendLock(rfbScreenInfoPtr screen_info, bool threaded)
+	    : m_iterator(nullptr)
+	{
+#if VNC_HAVE_THREADS
+		if (!threaded)
+			return;
+
+		m_iterator = rfbGetClientIterator(screen_info);
+		while (rfbClientPtr cl = rfbClientIteratorNext(m_iterator))
+		{
+			LOCK(cl->sendMutex);
+			m_clients.push_back(cl);
+		}
+#endif
+	}
+
+	~ClientSendLock()
+	{
+#if VNC_HAVE_THREADS
+		for (auto iter = m_clients.rbegin(); iter != m_clients.rend(); ++iter)
+			UNLOCK((*iter)->sendMutex);
+
+		// The iterator keeps a reference on the clients, so release it last
+		if (m_iterator)
+			rfbReleaseClientIterator(m_iterator);
+#endif
+	}
+
+	ClientSendLock(ClientSendLock const&)            = delete;
+	ClientSendLock& operator=(ClientSendLock const&) = delete;
+
+private:
+	rfbClientIteratorPtr m_iterator;
+	std::vector<rfbClientPtr> m_clients;
+};
+
+struct ClientData
+{
+	bool displaying;
+	std::chrono::steady_clock::time_point display_start;
+
+	// What libvncserver picked from the client's SetEncodings, and what we last replaced it with
+	int client_encoding;
+	int forced_encoding;
+
+	// Updated on the client thread in threaded mode, read from the main thread
+	std::atomic<int> encoding;
+	std::atomic<int> bytes_sent;
+	std::atomic<int> raw_bytes_sent;
+	std::atomic<int> frames_sent;
+	std::atomic<std::uint64_t> update_time_usec; // Encoding and sending, the socket writes block
+};
+
 template <std::size_t N>
 inline std::string_view to_string_view(std::array<char, N> const& arr)
 {
@@ -84,6 +207,56 @@ void ptr_event_hook(int buttonMask, int x, int y, struct _rfbClientRec* cl)
 	connector->notify_ptr_event(buttonMask, x, y);
 }
 
+void display_hook(struct _rfbClientRec* cl)
+{
+	ConnectorVnc* connector = reinterpret_cast<ConnectorVnc*>(cl->screen->screenData);
+	ClientData* client_data = reinterpret_cast<ClientData*>(cl->clientData);
+	if (!connector || !client_data || client_data->displaying)
+		return;
+
+	client_data->displaying    = true;
+	client_data->display_start = std::chrono::steady_clock::now();
+	connector->notify_display_started(cl);
+	client_data->encoding.store(cl->preferredEncoding);
+}
+
+void display_finished_hook(struct _rfbClientRec* cl, int result)
+{
+	ConnectorVnc* connector = reinterpret_cast<ConnectorVnc*>(cl->screen->screenData);
+	ClientData* client_data = reinterpret_cast<ClientData*>(cl->clientData);
+	if (!connector || !client_data || !client_data->displaying)
+		return;
+
+	auto const elapsed = std::chrono::steady_clock::now() - client_data->display_start;
+
+	client_data->displaying = false;
+	client_data->update_time_usec.fetch_add(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+	client_data->bytes_sent.store(rfbStatGetSentBytes(cl));
+	client_data->raw_bytes_sent.store(rfbStatGetSentBytesIfRaw(cl));
+	client_data->frames_sent.store(rfbStatGetMessageCountSent(cl, rfbFramebufferUpdate));
+}
+
+void client_gone_hook(struct _rfbClientRec* cl)
+{
+	display_finished_hook(cl, 0);
+
+	delete reinterpret_cast<ClientData*>(cl->clientData);
+	cl->clientData = nullptr;
+}
+
+enum rfbNewClientAction new_client_hook(struct _rfbClientRec* cl)
+{
+	ClientData* client_data      = new ClientData();
+	client_data->displaying      = false;
+	client_data->client_encoding = cl->preferredEncoding;
+	client_data->forced_encoding = cl->preferredEncoding;
+	client_data->encoding.store(cl->preferredEncoding);
+
+	cl->clientData     = client_data;
+	cl->clientGoneHook = &client_gone_hook;
+	return RFB_CLIENT_ACCEPT;
+}
+
 } // namespace
 
 char const* ConnectorVnc::LUA_TYPENAME = "deck:ConnectorVnc";
@@ -93,7 +266,16 @@ ConnectorVnc::ConnectorVnc()
     , m_screen_surface(nullptr)
     , m_screen_width(1600)
     , m_screen_height(900)
+    , m_pointer_queue(256)
+    , m_resize_request(0)
+    , m_encoding(-1)
+    , m_quality_level(-1)
+    , m_compress_level(-1)
     , m_bind_port(0)
+    , m_max_fps(0)
+    , m_threaded(false)
+    , m_running_threaded(false)
+    , m_raw_motion(false)
     , m_card(nullptr)
 {
 	m_title.fill(0);
@@ -107,11 +289,7 @@ ConnectorVnc::ConnectorVnc()
 
 ConnectorVnc::~ConnectorVnc()
 {
-	if (m_screen_info)
-		rfbScreenCleanup(m_screen_info);
-
-	if (m_screen_surface)
-		SDL_FreeSurface(m_screen_surface);
+	close_vnc();
 }
 
 void ConnectorVnc::initial_setup(lua_State* L, bool is_reload)
@@ -128,7 +306,16 @@ void ConnectorVnc::tick_inputs(lua_State* L, lua_Integer clock)
 	if (!m_screen_info)
 		return;
 
-	pump_events();
+	if (!m_running_threaded)
+		pump_events();
+
+	if (std::uint64_t resize_request = m_resize_request.exchange(0); resize_request)
+	{
+		m_screen_width  = int(resize_request >> 32);
+		m_screen_height = int(resize_request & 0xffffffff);
+	}
+
+	m_pointer_queue.drain(m_pointer_events);
 
 	if (m_screen_surface && (m_screen_surface->w != m_screen_width || m_screen_surface->h != m_screen_height))
 	{
@@ -138,8 +325,19 @@ void ConnectorVnc::tick_inputs(lua_State* L, lua_Integer clock)
 
 	if (!m_pointer_events.empty())
 	{
-		for (PointerState const& pointer_event : m_pointer_events)
+		int previous_mask = m_pointer_state.button_mask;
+
+		for (std::size_t idx = 0; idx < m_pointer_events.size(); ++idx)
 		{
+			PointerState const& pointer_event = m_pointer_events[idx];
+			bool const is_transition          = pointer_event.button_mask != previous_mask;
+			previous_mask                     = pointer_event.button_mask;
+
+			// Button changes are always reported where they happened. Unless raw motion is requested,
+			// a run of motion with the same buttons held only reports its last position.
+			if (!m_raw_motion && !is_transition && idx + 1 < m_pointer_events.size() && m_pointer_events[idx + 1].button_mask == pointer_event.button_mask)
+				continue;
+
 			int pointer_x = pointer_event.x;
 			int pointer_y = pointer_event.y;
 			if (m_screen_surface && m_card)
@@ -219,9 +417,15 @@ void ConnectorVnc::tick_outputs(lua_State* L, lua_Integer clock)
 		if (!m_screen_info)
 			return;
 
-		m_screen_info->screenData         = this;
-		m_screen_info->setDesktopSizeHook = &set_desktop_size_hook;
-		m_screen_info->ptrAddEvent        = &ptr_event_hook;
+		m_screen_info->screenData          = this;
+		m_screen_info->setDesktopSizeHook  = &set_desktop_size_hook;
+		m_screen_info->ptrAddEvent         = &ptr_event_hook;
+		m_screen_info->newClientHook       = &new_client_hook;
+		m_screen_info->displayHook         = &display_hook;
+		m_screen_info->displayFinishedHook = &display_finished_hook;
+		m_screen_info->deferUpdateTime     = m_max_fps ? std::max(1000 / m_max_fps, 1) : DEFAULT_DEFER_UPDATE_TIME;
+
+		m_running_threaded = m_threaded && VNC_HAVE_THREADS;
 
 		std::fill(m_dirty_flags.begin(), m_dirty_flags.end(), true);
 	}
@@ -241,27 +445,47 @@ void ConnectorVnc::tick_outputs(lua_State* L, lua_Integer clock)
 		if (!had_surface)
 			LuaHelpers::emit_event(L, 1, "on_resize", m_screen_width, m_screen_height);
 
-		m_dirty_flags[DirtyCard] = false;
-		if (m_card)
+		std::size_t const pixel_count = std::size_t(m_screen_width) * m_screen_height;
+		m_framebuffer.assign(pixel_count, 0);
+		m_changed_rects.clear();
+
+		if (m_running_threaded)
 		{
-			SDL_Surface* surface = m_card->get_surface();
-			SDL_BlitScaled(surface, nullptr, m_screen_surface, nullptr);
+			// The client threads encode from the front buffer, which must not go away underneath them
+			ClientSendLock lock(m_screen_info, true);
+			m_front_buffer.assign(pixel_count, 0);
+			rfbNewFramebuffer(m_screen_info, (char*)m_front_buffer.data(), m_screen_width, m_screen_height, 8, 3, 4);
+		}
+		else
+		{
+			rfbNewFramebuffer(m_screen_info, (char*)m_framebuffer.data(), m_screen_width, m_screen_height, 8, 3, 4);
 		}
 
-		rfbNewFramebuffer(m_screen_info, (char*)m_screen_surface->pixels, m_screen_width, m_screen_height, 8, 3, 4);
+		m_dirty_flags[DirtyCard] = true;
 
 		if (!had_framebuffer)
+		{
 			rfbInitServer(m_screen_info);
+			if (m_running_threaded)
+				rfbRunEventLoop(m_screen_info, -1, TRUE);
+		}
 	}
 
 	if (m_dirty_flags[DirtyCard] && m_card)
 	{
 		m_dirty_flags[DirtyCard] = false;
 
+		// Cards of the right size are compared directly against the framebuffer: their pixel layout is
+		// the same as the framebuffer's, so only the changed tiles get copied and nothing is converted
 		SDL_Surface* surface = m_card->get_surface();
-		SDL_BlitScaled(surface, nullptr, m_screen_surface, nullptr);
+		if (!is_framebuffer_compatible(surface, m_screen_surface))
+		{
+			SDL_BlitScaled(surface, nullptr, m_screen_surface, nullptr);
+			surface = m_screen_surface;
+		}
 
-		rfbMarkRectAsModified(m_screen_info, 0, 0, m_screen_width, m_screen_height);
+		collect_changed_tiles(surface);
+		publish_changed_tiles();
 	}
 }
 
@@ -315,13 +539,48 @@ int ConnectorVnc::index(lua_State* L, std::string_view const& key) const
 	{
 		lua_pushinteger(L, m_screen_height);
 	}
+	else if (key == "threaded")
+	{
+		lua_pushboolean(L, m_threaded);
+	}
+	else if (key == "raw_motion")
+	{
+		lua_pushboolean(L, m_raw_motion);
+	}
+	else if (key == "encoding")
+	{
+		int encoding = m_encoding.load();
+		if (encoding >= 0)
+		{
+			std::string_view name = encoding_to_name(encoding);
+			lua_pushlstring(L, name.data(), name.size());
+		}
+	}
+	else if (key == "quality")
+	{
+		if (int quality_level = m_quality_level.load(); quality_level >= 0)
+			lua_pushinteger(L, quality_level);
+	}
+	else if (key == "compression")
+	{
+		if (int compress_level = m_compress_level.load(); compress_level >= 0)
+			lua_pushinteger(L, compress_level);
+	}
+	else if (key == "max_fps")
+	{
+		lua_pushinteger(L, m_max_fps);
+	}
+	else if (key == "clients")
+	{
+		push_clients(L);
+	}
 
 	return lua_gettop(L) == 2 ? 0 : 1;
 }
 
 int ConnectorVnc::newindex(lua_State* L, std::string_view const& key)
 {
-	if (key == "connected" || key == "pixel_width" || key == "pixel_height")
+	if (key == "connected" || key == "pixel_width" || key == "pixel_height" || key == "clients")
 	{
 		luaL_error(L, "key %s is readonly for %s", key.data(), LUA_TYPENAME);
 	}
@@ -345,6 +604,54 @@ int ConnectorVnc::newindex(lua_State* L, std::string_view const& key)
 			m_bind_port = value;
 		}
 	}
+	else if (key == "threaded")
+	{
+		bool value = LuaHelpers::check_arg_bool(L, 3);
+		if (m_threaded != value)
+		{
+			close_vnc();
+			m_threaded = value;
+		}
+	}
+	else if (key == "raw_motion")
+	{
+		m_raw_motion = LuaHelpers::check_arg_bool(L, 3);
+	}
+	else if (key == "encoding")
+	{
+		int encoding = -1;
+		if (!lua_isnoneornil(L, 3))
+		{
+			std::string_view value = LuaHelpers::check_arg_string(L, 3);
+			for (EncodingName const& item : ENCODINGS)
+				if (item.name == value)
+					encoding = item.encoding;
+
+			luaL_argcheck(L, (encoding >= 0), 3, "unknown or unsupported encoding");
+		}
+		m_encoding.store(encoding);
+	}
+	else if (key == "quality")
+	{
+		int value = lua_isnoneornil(L, 3) ? -1 : LuaHelpers::check_arg_int(L, 3);
+		luaL_argcheck(L, (value >= -1 && value <= 9), 3, "quality must be between 0 and 9");
+		m_quality_level.store(value);
+	}
+	else if (key == "compression")
+	{
+		int value = lua_isnoneornil(L, 3) ? -1 : LuaHelpers::check_arg_int(L, 3);
+		luaL_argcheck(L, (value >= -1 && value <= 9), 3, "compression must be between 0 and 9");
+		m_compress_level.store(value);
+	}
+	else if (key == "max_fps")
+	{
+		int value = LuaHelpers::check_arg_int(L, 3);
+		luaL_argcheck(L, (value >= 0 && value <= 1000), 3, "max_fps must be between 0 and 1000");
+		m_max_fps = value;
+
+		if (m_screen_info)
+			m_screen_info->deferUpdateTime = m_max_fps ? std::max(1000 / m_max_fps, 1) : DEFAULT_DEFER_UPDATE_TIME;
+	}
 	else if (key == "title")
 	{
 		std::string_view value = LuaHelpers::check_arg_string(L, 3);
@@ -404,13 +711,90 @@ int ConnectorVnc::newindex(lua_State* L, std::string_view const& key)
 
 void ConnectorVnc::notify_resize_request(int new_width, int new_height)
 {
-	m_screen_width  = new_width;
-	m_screen_height = new_height;
+	m_resize_request.store((std::uint64_t(new_width) << 32) | std::uint32_t(new_height));
 }
 
 void ConnectorVnc::notify_ptr_event(int button_mask, int x, int y)
 {
-	m_pointer_events.emplace_back(PointerState { button_mask, x, y });
+	// Should the main loop fall behind, only motion with the same buttons held gets folded together
+	m_pointer_queue.push(PointerState { button_mask, x, y }, [](PointerState const& previous, PointerState const& value) { return previous.button_mask == value.button_mask; });
+}
+
+void ConnectorVnc::notify_display_started(_rfbClientRec* cl)
+{
+	ClientData* client_data = reinterpret_cast<ClientData*>(cl->clientData);
+
+	// Anything other than what we set last time means the client sent a new SetEncodings
+	if (cl->preferredEncoding != client_data->forced_encoding)
+		client_data->client_encoding = cl->preferredEncoding;
+
+	// RFB does not allow an encoding the client did not advertise. libvncserver only keeps the client's
+	// first choice, so besides that only raw is known to be supported: every client must accept it.
+	int const encoding = m_encoding.load();
+	if (encoding >= 0 && (encoding == rfbEncodingRaw || encoding == client_data->client_encoding))
+		cl->preferredEncoding = encoding;
+	else
+		cl->preferredEncoding = client_data->client_encoding;
+
+	client_data->forced_encoding = cl->preferredEncoding;
+
+	// Quality and compression levels are only hints, every client copes with those
+
+#if defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG)
+	if (int quality_level = m_quality_level.load(); quality_level >= 0)
+	{
+		cl->tightQualityLevel = quality_level;
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+		cl->turboQualityLevel = TIGHT_TO_TURBO_QUALITY[quality_level];
+		cl->turboSubsampLevel = TIGHT_TO_TURBO_SUBSAMPLE[quality_level];
+#endif
+	}
+#endif
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+	if (int compress_level = m_compress_level.load(); compress_level >= 0)
+	{
+		cl->zlibCompressLevel = compress_level;
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+		cl->tightCompressLevel = compress_level;
+#endif
+	}
+#endif
+}
+
+void ConnectorVnc::push_clients(lua_State* L) const
+{
+	lua_createtable(L, 0, 0);
+	if (!m_screen_info)
+		return;
+
+	int idx = 0;
+
+	rfbClientIteratorPtr iterator = rfbGetClientIterator(m_screen_info);
+	while (rfbClientPtr cl = rfbClientIteratorNext(iterator))
+	{
+		ClientData const* client_data = reinterpret_cast<ClientData const*>(cl->clientData);
+		if (!client_data)
+			continue;
+
+		std::string_view encoding = encoding_to_name(client_data->encoding.load());
+
+		lua_createtable(L, 0, 6);
+		lua_pushstring(L, cl->host ? cl->host : "");
+		lua_setfield(L, -2, "host");
+		lua_pushlstring(L, encoding.data(), encoding.size());
+		lua_setfield(L, -2, "encoding");
+		lua_pushinteger(L, client_data->bytes_sent.load());
+		lua_setfield(L, -2, "bytes_sent");
+		lua_pushinteger(L, client_data->raw_bytes_sent.load());
+		lua_setfield(L, -2, "raw_bytes_sent");
+		lua_pushinteger(L, client_data->frames_sent.load());
+		lua_setfield(L, -2, "frames_sent");
+		lua_pushnumber(L, client_data->update_time_usec.load() / 1000.0);
+		lua_setfield(L, -2, "update_time");
+		lua_rawseti(L, -2, ++idx);
+	}
+	rfbReleaseClientIterator(iterator);
 }
 
 void ConnectorVnc::pump_events()
@@ -425,18 +809,114 @@ void ConnectorVnc::close_vnc()
 {
 	if (m_screen_info)
 	{
+		// In threaded mode this also stops and joins the background event loop
 		rfbShutdownServer(m_screen_info, true);
-		pump_events();
+		if (!m_running_threaded)
+			pump_events();
 
 		rfbScreenCleanup(m_screen_info);
 		m_screen_info = nullptr;
 	}
 
+	m_running_threaded = false;
+	m_resize_request.store(0);
+
 	if (m_screen_surface)
 	{
 		SDL_FreeSurface(m_screen_surface);
 		m_screen_surface = nullptr;
 	}
+
+	m_framebuffer.clear();
+	m_front_buffer.clear();
+	m_changed_rects.clear();
+}
+
+void ConnectorVnc::collect_changed_tiles(SDL_Surface* surface)
+{
+	assert(surface && surface->format->BytesPerPixel == sizeof(std::uint32_t));
+	assert(m_framebuffer.size() == std::size_t(surface->w) * surface->h);
+
+	int const width  = surface->w;
+	int const height = surface->h;
+
+	unsigned char const* pixels = reinterpret_cast<unsigned char const*>(surface->pixels);
+
+	for (int tile_y = 0; tile_y < height; tile_y += TILE_SIZE)
+	{
+		int const tile_h = std::min(TILE_SIZE, height - tile_y);
+
+		// Adjacent changed tiles in the same tile row are reported as one rectangle
+		int changed_x1 = -1;
+		int changed_x2 = -1;
+
+		for (int tile_x = 0; tile_x < width; tile_x += TILE_SIZE)
+		{
+			int const tile_w            = std::min(TILE_SIZE, width - tile_x);
+			std::size_t const row_bytes = tile_w * sizeof(std::uint32_t);
+
+			int y = tile_y;
+			for (; y < tile_y + tile_h; ++y)
+			{
+				std::uint32_t const* current  = reinterpret_cast<std::uint32_t const*>(pixels + y * surface->pitch) + tile_x;
+				std::uint32_t const* previous = m_framebuffer.data() + std::size_t(y) * width + tile_x;
+				if (std::memcmp(current, previous, row_bytes) != 0)
+					break;
+			}
+
+			if (y == tile_y + tile_h)
+			{
+				if (changed_x1 >= 0)
+				{
+					m_changed_rects.push_back(SDL_Rect { changed_x1, tile_y, changed_x2 - changed_x1, tile_h });
+					changed_x1 = -1;
+				}
+				continue;
+			}
+
+			// Rows above the first difference are already identical
+			for (; y < tile_y + tile_h; ++y)
+			{
+				std::uint32_t const* current = reinterpret_cast<std::uint32_t const*>(pixels + y * surface->pitch) + tile_x;
+				std::uint32_t* previous      = m_framebuffer.data() + std::size_t(y) * width + tile_x;
+				std::memcpy(previous, current, row_bytes);
+			}
+
+			if (changed_x1 < 0)
+				changed_x1 = tile_x;
+			changed_x2 = tile_x + tile_w;
+		}
+
+		if (changed_x1 >= 0)
+			m_changed_rects.push_back(SDL_Rect { changed_x1, tile_y, changed_x2 - changed_x1, tile_h });
+	}
+}
+
+void ConnectorVnc::publish_changed_tiles()
+{
+	if (m_changed_rects.empty())
+		return;
+
+	if (m_running_threaded)
+	{
+		// Only this copy has to wait for clients that are busy sending an update, the diff above did not
+		ClientSendLock lock(m_screen_info, true);
+
+		int const width = m_screen_surface->w;
+		for (SDL_Rect const& rect : m_changed_rects)
+		{
+			for (int y = rect.y; y < rect.y + rect.h; ++y)
+			{
+				std::size_t const offset = std::size_t(y) * width + rect.x;
+				std::memcpy(m_front_buffer.data() + offset, m_framebuffer.data() + offset, rect.w * sizeof(std::uint32_t));
+			}
+		}
+	}
+
+	for (SDL_Rect const& rect : m_changed_rects)
+		rfbMarkRectAsModified(m_screen_info, rect.x, rect.y, rect.x + rect.w, rect.y + rect.h);
+
+	m_changed_rects.clear();
 }
 
 int ConnectorVnc::_lua_redraw(lua_State* L)
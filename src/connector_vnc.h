@@ -22,8 +22,11 @@
 #ifdef HAVE_VNC
 
 #include "connector_base.h"
+#include "util_ring_queue.h"
 #include <SDL.h>
 #include <array>
+#include <atomic>
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -31,6 +34,7 @@ class DeckCard;
 class DeckRectangleList;
 
 struct _rfbScreenInfo;
+struct _rfbClientRec;
 typedef struct _rfbScreenInfo* rfbScreenInfoPtr;
 
 class ConnectorVnc : public ConnectorBase<ConnectorVnc>
@@ -52,16 +56,23 @@ public:
 
 	void notify_resize_request(int new_width, int new_height);
 	void notify_ptr_event(int button_mask, int x, int y);
+	void notify_display_started(_rfbClientRec* cl);
 
 private:
 	void pump_events();
 	void close_vnc();
+	void push_clients(lua_State* L) const;
+	void collect_changed_tiles(SDL_Surface* surface);
+	void publish_changed_tiles();
 
 	static int _lua_redraw(lua_State* L);
 
 private:
 	rfbScreenInfoPtr m_screen_info;
 	SDL_Surface* m_screen_surface;
+	std::vector<std::uint32_t> m_framebuffer;
+	std::vector<std::uint32_t> m_front_buffer; // Encoded from by the client threads in threaded mode
+	std::vector<SDL_Rect> m_changed_rects;
 	int m_screen_width;
 	int m_screen_height;
 
@@ -74,10 +85,23 @@ private:
 	PointerState m_pointer_state;
 	std::vector<PointerState> m_pointer_events;
 
+	// Written from the libvncserver client threads in threaded mode
+	util::SpillingRingQueue<PointerState> m_pointer_queue;
+	std::atomic<std::uint64_t> m_resize_request;
+
+	// Applied to every client just before it sends an update, -1 leaves the choice to the client
+	std::atomic<int> m_encoding;
+	std::atomic<int> m_quality_level;
+	std::atomic<int> m_compress_level;
+
 	std::array<char, 64> m_title;
 	std::array<char, 64> m_password;
 	std::array<char, 64> m_bind_address;
 	int m_bind_port;
+	int m_max_fps;
+	bool m_threaded;
+	bool m_running_threaded;
+	bool m_raw_motion;
 
 	// Deck-related
 	std::vector<bool> m_dirty_flags;
@@ -21,61 +21,26 @@
 #include "lua_helpers.h"
 #include "util_blob.h"
 #include "util_text.h"
+#include "util_tls_session.h"
+#include "util_websocket.h"
 #include <algorithm>
+#include <charconv>
 #include <cstring>
 #include <random>
 
-namespace
-{
+using namespace util::websocket;
 
-enum CloseReason : std::uint16_t
-{
-	CLOSE_None            = 0,
-	CLOSE_Normal          = 1000,
-	CLOSE_GoingAway       = 1001,
-	CLOSE_ProtocolError   = 1002,
-	CLOSE_Unacceptable    = 1003,
-	CLOSE_InvalidFormat   = 1007,
-	CLOSE_PolicyViolated  = 1008,
-	CLOSE_MessageTooLarge = 1009,
-	CLOSE_ExtensionFailed = 1010,
-	CLOSE_InternalError   = 1011,
-	CLOSE_HandshakeFailed = 1015,
-};
-
-#if (defined HAVE_GNUTLS || defined HAVE_OPENSSL)
-
-util::Blob make_websocket_key_nonce()
-{
-	return util::Blob::from_random(16);
-}
-
-util::Blob make_websocket_accept_nonce(util::Blob const& key)
+namespace
 {
-	constexpr std::string_view websocket_uuid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
-	util::Blob blob(60);
-	blob += key.to_base64();
-	blob += websocket_uuid;
-	return blob.sha1();
-}
+// Large enough for OBS screenshots, small enough to not be a memory exhaustion hazard
+constexpr std::size_t const DEFAULT_MAX_MESSAGE_SIZE = 64 * 1024 * 1024;
 
-#else
+// Upper bound on what a single tick drains from the socket, so a flood can't stall the main loop
+constexpr std::size_t const RECEIVE_MAX_PER_TICK = 16 * 1024 * 1024;
 
-// Hardcoded due to absence of SHA1
-
-util::Blob make_websocket_key_nonce()
-{
-	return util::Blob::from_literal("DeckAssistantWS!");
-}
-
-util::Blob make_websocket_accept_nonce(util::Blob const&)
-{
-	bool ok;
-	return util::Blob::from_base64("H3P/IhOIXOMiE9YV+WG5Jqe3G08=", ok);
-}
-
-#endif
+// Socket::write takes an int, so very large queues leave in slices
+constexpr std::size_t const SEND_MAX_SLICE = 1024 * 1024 * 1024;
 
 } // namespace
 
@@ -88,12 +53,17 @@ ConnectorWebsocket::ConnectorWebsocket(std::shared_ptr<util::SocketSet> const& s
     , m_enabled(true)
     , m_insecure(false)
     , m_close_sent(false)
-    , m_pending_opcode(0)
+    , m_stream_fragments(false)
+    , m_compression(util::Deflate::is_available())
+    , m_compression_active(false)
+    , m_server_no_context_takeover(false)
+    , m_client_no_context_takeover(false)
+    , m_client_max_window_bits(15)
+    , m_max_message_size(DEFAULT_MAX_MESSAGE_SIZE)
     , m_random(std::chrono::system_clock::now().time_since_epoch().count())
 {
 	m_connect_url.set_schema("ws");
-	m_receive_buffer.assign(4096, '\0');
-	m_received.reserve(8192);
+	m_frame_reader.set_max_message_size(m_max_message_size);
 }
 
 ConnectorWebsocket::~ConnectorWebsocket()
@@ -109,6 +79,8 @@ void ConnectorWebsocket::tick_inputs(lua_State* L, lua_Integer clock)
 
 		m_connect_last_attempt = clock;
 		m_close_sent           = false;
+		m_compression_active   = false;
+		m_send_queue.clear();
 
 		std::string_view schema = m_connect_url.get_schema();
 		std::string_view host   = m_connect_url.get_host();
@@ -164,7 +136,7 @@ void ConnectorWebsocket::tick_inputs(lua_State* L, lua_Integer clock)
 				DeckLogger::log_message(L, DeckLogger::Level::Debug, "Websocket connected, starting handshake");
 				std::string_view host = m_connect_url.get_host();
 
-				m_websocket_key = make_websocket_key_nonce();
+				m_websocket_key = make_key_nonce();
 
 				std::string http;
 				http.reserve(512);
@@ -188,6 +160,8 @@ void ConnectorWebsocket::tick_inputs(lua_State* L, lua_Integer clock)
 					http += m_accepted_protocols;
 					http += "\r\n";
 				}
+				if (m_compression)
+					http += "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n";
 				http += "\r\n";
 
 				m_socket.write(http.data(), http.size());
@@ -196,14 +170,15 @@ void ConnectorWebsocket::tick_inputs(lua_State* L, lua_Integer clock)
 		}
 	}
 
-	int received = m_socket.read_nonblock(m_receive_buffer.data(), m_receive_buffer.size());
+	// Drain everything the socket has into the receive buffer
+	int const received = m_socket.read_available(m_received, RECEIVE_MAX_PER_TICK);
 	if (received < 0)
 	{
+		char const* function_name = (m_connect_state == State::Handshaking) ? "on_connect_failed" : "on_disconnect";
+
 		m_connect_state = State::Disconnected;
-		m_received.clear();
+		reset_receive_buffer();
 		DeckLogger::log_message(L, DeckLogger::Level::Debug, "Websocket disconnected: ", m_socket.get_last_error());
-
-		char const* function_name = (m_connect_state == State::Handshaking) ? "on_connect_failed" : "on_disconnect";
 		LuaHelpers::emit_event(L, 1, function_name, m_socket.get_last_error());
 
 		return;
@@ -212,21 +187,20 @@ void ConnectorWebsocket::tick_inputs(lua_State* L, lua_Integer clock)
 	if (received == 0)
 		return;
 
-	std::string_view received_data(m_receive_buffer.data(), received);
 	DeckLogger::log_message(L, DeckLogger::Level::Trace, "== Received ", received, " bytes from websocket ==");
-	DeckLogger::log_message(L, DeckLogger::Level::Trace, received_data);
-
-	m_received += received_data;
+	DeckLogger::log_message(L, DeckLogger::Level::Trace, std::string_view(reinterpret_cast<char const*>(m_received.data() + m_received.size() - received), received));
 
 	if (m_connect_state == State::Handshaking)
 	{
-		std::size_t headers_end = m_received.find("\r\n\r\n");
+		std::string_view const received_view(reinterpret_cast<char const*>(m_received.data()), m_received.size());
+
+		std::size_t headers_end = received_view.find("\r\n\r\n");
 		if (headers_end == std::string::npos)
 		{
 			if (m_received.size() > 2048)
 			{
 				m_socket.close();
-				m_received.clear();
+				reset_receive_buffer();
 				m_connect_state = State::Disconnected;
 
 				DeckLogger::log_message(L, DeckLogger::Level::Debug, "Websocket upgrade failed");
@@ -235,11 +209,11 @@ void ConnectorWebsocket::tick_inputs(lua_State* L, lua_Integer clock)
 			return;
 		}
 
-		std::string_view headers = std::string_view(m_received).substr(0, headers_end + 2);
+		std::string_view headers = received_view.substr(0, headers_end + 2);
 		if (!verify_http_upgrade_headers(headers))
 		{
 			m_socket.close();
-			m_received.clear();
+			reset_receive_buffer();
 			m_connect_state = State::Disconnected;
 
 			DeckLogger::log_message(L, DeckLogger::Level::Debug, "Websocket upgrade failed");
@@ -248,20 +222,30 @@ void ConnectorWebsocket::tick_inputs(lua_State* L, lua_Integer clock)
 			return;
 		}
 
-		m_received      = m_received.substr(headers_end + 4);
+		m_received.advance(headers_end + 4);
 		m_connect_state = State::Connected;
 
 		DeckLogger::log_message(L, DeckLogger::Level::Debug, "Websocket handshake complete using protocol ", m_active_protocol);
+		if (m_compression_active)
+			DeckLogger::log_message(L, DeckLogger::Level::Debug, "Websocket compression enabled");
 		LuaHelpers::emit_event(L, 1, "on_connect", m_active_protocol);
 	}
 
 	Frame frame;
+	FrameKind frame_kind;
 	std::uint16_t close_reason;
-	while (check_for_complete_frame(frame, close_reason))
+	while (m_frame_reader.next_frame(m_received, frame, frame_kind, close_reason))
 	{
 		DeckLogger::log_message(L, DeckLogger::Level::Trace, "== Websocket frame with opcode ", int(frame.first), " ==");
 		DeckLogger::log_message(L, DeckLogger::Level::Trace, frame.second);
 
+		if (frame_kind != FrameKind::Complete)
+		{
+			if (!m_close_sent && m_enabled)
+				LuaHelpers::emit_event(L, 1, "on_message_fragment", frame.second, int(frame.first), frame_kind == FrameKind::LastFragment);
+			continue;
+		}
+
 		// Connection close
 		if (frame.first == 8)
 		{
@@ -282,7 +266,7 @@ void ConnectorWebsocket::tick_inputs(lua_State* L, lua_Integer clock)
 
 			m_socket.shutdown();
 			m_socket.close();
-			m_received.clear();
+			reset_receive_buffer();
 			m_connect_state = State::Disconnected;
 
 			if (!m_close_sent)
@@ -325,6 +309,9 @@ void ConnectorWebsocket::tick_inputs(lua_State* L, lua_Integer clock)
 			LuaHelpers::emit_event(L, 1, "on_message", frame.second, int(frame.first));
 	}
 
+	// The last frame handed out may still point into the buffer until here
+	m_frame_reader.release(m_received);
+
 	if (close_reason != CLOSE_None)
 	{
 		if (!m_close_sent)
@@ -352,6 +339,9 @@ void ConnectorWebsocket::tick_outputs(lua_State* L, lua_Integer clock)
 		DeckLogger::log_message(L, DeckLogger::Level::Debug, error_message);
 		LuaHelpers::emit_event(L, 1, "on_disconnect", error_message);
 	}
+
+	// Everything queued during this tick leaves in a single write
+	flush_send_queue();
 }
 
 void ConnectorWebsocket::shutdown(lua_State* L)
@@ -363,7 +353,7 @@ void ConnectorWebsocket::shutdown(lua_State* L)
 	}
 
 	m_socket.close();
-	m_received.clear();
+	reset_receive_buffer();
 	m_connect_state = State::Disconnected;
 	m_enabled       = false;
 }
@@ -384,6 +374,7 @@ void ConnectorWebsocket::init_instance_table(lua_State* L)
 	LuaHelpers::create_callback_warning(L, "on_connect_failed");
 	LuaHelpers::create_callback_warning(L, "on_disconnect");
 	LuaHelpers::create_callback_warning(L, "on_message");
+	LuaHelpers::create_callback_warning(L, "on_message_fragment");
 }
 
 int ConnectorWebsocket::index(lua_State* L, std::string_view const& key) const
@@ -444,12 +435,53 @@ int ConnectorWebsocket::index(lua_State* L, std::string_view const& key) const
 	{
 		lua_pushlstring(L, m_accepted_protocols.data(), m_accepted_protocols.size());
 	}
+	else if (key == "max_message_size")
+	{
+		lua_pushinteger(L, lua_Integer(m_max_message_size));
+	}
+	else if (key == "stream_fragments")
+	{
+		lua_pushboolean(L, m_stream_fragments);
+	}
+	else if (key == "compression")
+	{
+		lua_pushboolean(L, m_compression);
+	}
+	else if (key == "queued_bytes")
+	{
+		lua_pushinteger(L, lua_Integer(get_queued_bytes()));
+	}
+	else if (key == "compression_active")
+	{
+		lua_pushboolean(L, m_compression_active);
+	}
+	else if (key == "tls_resumed")
+	{
+		lua_pushboolean(L, m_socket.is_tls_resumed());
+	}
+	else if (key == "compression_stats")
+	{
+		std::uint64_t const compressed   = m_frame_reader.get_received_compressed() + m_compression_stats.sent;
+		std::uint64_t const uncompressed = m_frame_reader.get_received_inflated() + m_compression_stats.sent_before_deflate;
+
+		lua_createtable(L, 0, 5);
+		lua_pushinteger(L, lua_Integer(m_frame_reader.get_received_compressed()));
+		lua_setfield(L, -2, "received");
+		lua_pushinteger(L, lua_Integer(m_frame_reader.get_received_inflated()));
+		lua_setfield(L, -2, "received_inflated");
+		lua_pushinteger(L, lua_Integer(m_compression_stats.sent));
+		lua_setfield(L, -2, "sent");
+		lua_pushinteger(L, lua_Integer(m_compression_stats.sent_before_deflate));
+		lua_setfield(L, -2, "sent_before_deflate");
+		lua_pushnumber(L, compressed ? double(uncompressed) / double(compressed) : 1.0);
+		lua_setfield(L, -2, "ratio");
+	}
 	return lua_gettop(L) == 2 ? 0 : 1;
 }
 
 int ConnectorWebsocket::newindex(lua_State* L, std::string_view const& key)
 {
-	if (key == "error" || key == "connected")
+	if (key == "error" || key == "connected" || key == "tls_resumed" || key == "compression_active" || key == "compression_stats" || key == "queued_bytes")
 	{
 		luaL_error(L, "key %s is readonly for %s", key.data(), LUA_TYPENAME);
 	}
@@ -483,6 +515,11 @@ int ConnectorWebsocket::newindex(lua_State* L, std::string_view const& key)
 	else if (key == "insecure")
 	{
 		bool value = LuaHelpers::check_arg_bool(L, 3);
+
+		// Sessions cached under the old setting are not reused, connects start with a full handshake again
+		if (value != m_insecure)
+			util::TLSSession::flush_session_cache();
+
 		m_insecure = value;
 	}
 	else if (key == "tls")
@@ -509,6 +546,24 @@ int ConnectorWebsocket::newindex(lua_State* L, std::string_view const& key)
 		std::string_view value = LuaHelpers::check_arg_string(L, 3, true);
 		m_accepted_protocols   = value;
 	}
+	else if (key == "max_message_size")
+	{
+		lua_Integer value = luaL_checkinteger(L, 3);
+		luaL_argcheck(L, (value > 0), 3, "max_message_size must be positive");
+		m_max_message_size = std::size_t(value);
+		m_frame_reader.set_max_message_size(m_max_message_size);
+	}
+	else if (key == "stream_fragments")
+	{
+		m_stream_fragments = LuaHelpers::check_arg_bool(L, 3);
+		m_frame_reader.set_stream_fragments(m_stream_fragments);
+	}
+	else if (key == "compression")
+	{
+		bool value = LuaHelpers::check_arg_bool(L, 3);
+		luaL_argcheck(L, (!value || util::Deflate::is_available()), 3, "compression is not supported by this build");
+		m_compression = value;
+	}
 	else if (key.starts_with("on_"))
 	{
 		if (lua_type(L, 3) != LUA_TNIL)
@@ -534,6 +589,7 @@ bool ConnectorWebsocket::verify_http_upgrade_headers(std::string_view const& hea
 	bool has_upgrade         = false;
 	bool has_accept          = false;
 	std::string_view protocol;
+	std::string_view extensions;
 
 	while (offset < headers_end)
 	{
@@ -570,7 +626,7 @@ bool ConnectorWebsocket::verify_http_upgrade_headers(std::string_view const& hea
 
 		if (key == "Sec-WebSocket-Accept")
 		{
-			util::Blob expected = make_websocket_accept_nonce(m_websocket_key);
+			util::Blob expected = make_accept_nonce(m_websocket_key.to_base64());
 			if (value != expected.to_base64())
 				return false;
 
@@ -579,167 +635,179 @@ bool ConnectorWebsocket::verify_http_upgrade_headers(std::string_view const& hea
 
 		if (key == "Sec-WebSocket-Protocol")
 			protocol = value;
+
+		if (key == "Sec-WebSocket-Extensions")
+			extensions = value;
 	}
 
 	if (!has_switch_protocol || !has_connection || !has_upgrade || !has_accept)
 		return false;
 
+	if (!accept_extensions(extensions))
+		return false;
+
 	m_active_protocol = protocol;
 	return true;
 }
 
-bool ConnectorWebsocket::check_for_complete_frame(Frame& frame_data, std::uint16_t& close_reason)
+bool ConnectorWebsocket::accept_extensions(std::string_view const& extensions)
 {
-	close_reason = CLOSE_None;
-
-	if (m_received.size() < 2)
-		return false;
+	m_frame_reader.disable_inflate();
 
-	unsigned char* cursor = (unsigned char*)m_received.data();
+	m_compression_active         = false;
+	m_server_no_context_takeover = false;
+	m_client_no_context_takeover = false;
+	m_client_max_window_bits     = 15;
 
-	unsigned char fin    = *cursor & 0x80;
-	unsigned char resv   = *cursor & 0x70;
-	unsigned char opcode = *cursor & 0x0f;
-	++cursor;
-	unsigned char masked      = *cursor & 0x80;
-	unsigned char payload_len = *cursor & 0xff;
-	++cursor;
+	if (extensions.empty())
+		return true;
 
-	if (resv != 0)
-	{
-		close_reason = CLOSE_ProtocolError;
+	// Only permessage-deflate is ever offered, anything else means the server is confused
+	if (!m_compression || extensions.find(',') != std::string_view::npos)
 		return false;
-	}
 
-	if (payload_len == 127)
-	{
-		close_reason = CLOSE_MessageTooLarge;
+	std::vector<std::string_view> params = util::split(extensions, ";");
+	if (util::trim(params[0]) != "permessage-deflate")
 		return false;
-	}
 
-	std::uint16_t payload_real_len;
-	std::uint32_t full_len = 2;
-
-	if (payload_len == 126)
+	for (std::size_t i = 1; i < params.size(); ++i)
 	{
-		if (m_received.size() < 4)
-			return false;
+		auto [key, value] = util::split1(params[i], "=");
 
-		payload_real_len = (*cursor << 8);
-		++cursor;
-		payload_real_len += *cursor;
-		++cursor;
+		if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+			value = value.substr(1, value.size() - 2);
 
-		full_len += 2;
-	}
-	else
-	{
-		payload_real_len = payload_len;
-	}
+		if (key == "server_no_context_takeover")
+		{
+			m_server_no_context_takeover = true;
+		}
+		else if (key == "client_no_context_takeover")
+		{
+			m_client_no_context_takeover = true;
+		}
+		else if (key == "server_max_window_bits" || key == "client_max_window_bits")
+		{
+			// The inflater always runs with the largest window, so only the client limit matters
+			int bits       = 0;
+			auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), bits, 10);
+			if (ec != std::errc() || ptr != value.data() + value.size() || bits < 8 || bits > 15)
+				return false;
 
-	if (masked)
-		full_len += 4;
+			if (key == "client_max_window_bits")
+				m_client_max_window_bits = bits;
+		}
+		else
+		{
+			return false;
+		}
+	}
 
-	full_len += payload_real_len;
+	if (!m_frame_reader.enable_inflate(m_server_no_context_takeover))
+		return false;
 
-	if (m_received.size() < full_len)
+	// zlib can't produce an 8 bit window; compressing is optional per message so then we just send uncompressed
+	if (m_client_max_window_bits < 9)
+		m_deflate.deinit();
+	else if (!m_deflate.init(util::Deflate::Format::Raw, m_client_max_window_bits))
 		return false;
 
-	if (opcode != 0)
-	{
-		m_pending_opcode = opcode;
-		m_pending_frame.clear();
-	}
+	m_compression_active = true;
+	return true;
+}
 
-	if (masked)
-	{
-		unsigned char mask[4];
-		std::memcpy(mask, cursor, 4);
-		cursor += 4;
+void ConnectorWebsocket::reset_receive_buffer()
+{
+	m_received.clear();
+	m_frame_reader.reset();
+}
 
-		for (std::size_t i = 0; i < payload_real_len; ++i)
-		{
-			m_pending_frame.push_back(*cursor ^ mask[i & 3]);
-			++cursor;
-		}
-	}
-	else
-	{
-		std::copy_n(cursor, payload_real_len, std::back_inserter(m_pending_frame));
-	}
+bool ConnectorWebsocket::send_message(unsigned char opcode, std::string_view const& message)
+{
+	if (m_connect_state != State::Connected || m_close_sent)
+		return false;
 
-	if (m_received.size() == full_len)
-		m_received.clear();
-	else
-		m_received = m_received.substr(full_len);
+	Frame frame;
+	frame.first  = opcode;
+	frame.second = message;
 
-	if (fin)
-	{
-		frame_data.first  = m_pending_opcode;
-		frame_data.second = m_pending_frame;
-		return true;
-	}
+	if (!m_compression_active || !m_deflate)
+		return send_frame(frame);
 
-	return false;
-}
+	m_deflated.clear();
+	if (!m_deflate.write(message.data(), message.size(), m_deflated, util::Deflate::Flush::Sync) || m_deflated.size() < sizeof(DEFLATE_TRAILER))
+		return false;
 
-bool ConnectorWebsocket::send_frame(Frame const& frame)
-{
-	std::uint32_t const full_mask   = m_random();
-	std::uint16_t const data_size   = frame.second.size();
-	unsigned char const* const mask = (unsigned char*)&full_mask;
+	if (m_client_no_context_takeover)
+		m_deflate.reset();
 
-	std::vector<unsigned char> block;
-	block.reserve(frame.second.size() + 8);
+	frame.second = std::string_view(reinterpret_cast<char const*>(m_deflated.data()), m_deflated.size() - sizeof(DEFLATE_TRAILER));
 
-	block.push_back(0x80 + frame.first);
+	m_compression_stats.sent                += frame.second.size();
+	m_compression_stats.sent_before_deflate += message.size();
 
-	if (data_size >= 126)
-	{
-		block.push_back(0xfe);
-		block.push_back(data_size >> 8);
-		block.push_back(data_size & 0xff);
-	}
-	else
-	{
-		block.push_back(0x80 + data_size);
-	}
+	return send_frame(frame, true);
+}
 
-	block.push_back(mask[0]);
-	block.push_back(mask[1]);
-	block.push_back(mask[2]);
-	block.push_back(mask[3]);
+bool ConnectorWebsocket::send_frame(Frame const& frame, bool compressed)
+{
+	if (m_connect_state != State::Connected)
+		return false;
 
-	for (std::uint16_t i = 0; i < data_size; ++i)
-		block.push_back(frame.second[i] ^ mask[i & 3]);
+	std::uint32_t const full_mask   = m_random();
+	unsigned char const* const mask = (unsigned char const*)&full_mask;
 
-	return m_socket.write(block.data(), block.size());
+	append_frame(m_send_queue, frame.first, frame.second, compressed, mask);
+	return true;
 }
 
 void ConnectorWebsocket::send_close_frame(std::uint16_t close_code)
 {
 	char buf[2];
-	buf[0] = close_code << 8;
+	buf[0] = close_code >> 8;
 	buf[1] = close_code & 0xff;
 
 	Frame frame;
 	frame.first  = 0x08;
-	frame.second = buf;
+	frame.second = std::string_view(buf, 2);
 
+	// The connection usually goes down right after, so this can't wait for the end of the tick
 	send_frame(frame);
+	flush_send_queue();
 	// m_socket.shutdown();
 }
 
+bool ConnectorWebsocket::flush_send_queue()
+{
+	if (m_send_queue.empty())
+		return true;
+
+	bool success = true;
+	while (success && !m_send_queue.empty())
+	{
+		std::size_t const slice  = std::min(m_send_queue.size(), SEND_MAX_SLICE);
+		success                  = m_socket.write(m_send_queue.data(), int(slice));
+		m_send_queue.advance(slice);
+	}
+
+	m_send_queue.clear();
+	return success;
+}
+
+std::size_t ConnectorWebsocket::get_queued_bytes() const
+{
+	return m_send_queue.size() + m_socket.get_pending_write_size();
+}
+
 int ConnectorWebsocket::_lua_send_message(lua_State* L)
 {
 	ConnectorWebsocket* self = from_stack(L, 1);
 	std::string_view message = LuaHelpers::check_arg_string(L, 2);
 
-	Frame frame;
-	frame.first  = 1;
-	frame.second = message;
-	bool success = self->send_frame(frame);
+	// The backlog is returned so scripts can hold off when the connection can't keep up
+	if (self->send_message(1, message))
+		lua_pushinteger(L, lua_Integer(self->get_queued_bytes()));
+	else
+		lua_pushboolean(L, false);
 
-	lua_pushboolean(L, success);
 	return 1;
 }
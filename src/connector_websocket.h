@@ -21,8 +21,10 @@
 
 #include "connector_base.h"
 #include "util_blob.h"
+#include "util_deflate.h"
 #include "util_socket.h"
 #include "util_url.h"
+#include "util_websocket.h"
 #include <random>
 #include <string>
 #include <utility>
@@ -44,16 +46,27 @@ public:
 	int newindex(lua_State* L, std::string_view const& key);
 
 private:
-	using Frame = std::pair<unsigned char, std::string_view>;
+	using Frame     = util::websocket::Frame;
+	using FrameKind = util::websocket::FrameKind;
 
 	bool verify_http_upgrade_headers(std::string_view const& headers);
-	bool check_for_complete_frame(Frame& frame, std::uint16_t& close_reason);
-	bool send_frame(Frame const& frame);
+	bool accept_extensions(std::string_view const& extensions);
+	void reset_receive_buffer();
+	bool send_message(unsigned char opcode, std::string_view const& message);
+	bool send_frame(Frame const& frame, bool compressed = false);
 	void send_close_frame(std::uint16_t close_code);
+	bool flush_send_queue();
+	std::size_t get_queued_bytes() const;
 
 	static int _lua_send_message(lua_State* L);
 
 private:
+	struct CompressionStats
+	{
+		std::uint64_t sent                = 0;
+		std::uint64_t sent_before_deflate = 0;
+	};
+
 	enum class State : char
 	{
 		Disconnected,
@@ -69,14 +82,23 @@ private:
 	bool m_enabled;
 	bool m_insecure;
 	bool m_close_sent;
+	bool m_stream_fragments;
+	bool m_compression;
+	bool m_compression_active;
+	bool m_server_no_context_takeover;
+	bool m_client_no_context_takeover;
+	int m_client_max_window_bits;
+	std::size_t m_max_message_size;
 	std::string m_accepted_protocols;
 	std::string m_active_protocol;
 	std::string m_remote_server_name;
-	std::string m_receive_buffer;
-	std::string m_received;
+	util::BlobBuffer m_received;
+	util::websocket::FrameReader m_frame_reader;
 	util::Blob m_websocket_key;
-	unsigned char m_pending_opcode;
-	std::string m_pending_frame;
+	util::Deflate m_deflate;
+	util::BlobBuffer m_deflated;
+	util::BlobBuffer m_send_queue;
+	CompressionStats m_compression_stats;
 	std::mt19937 m_random;
 };
 
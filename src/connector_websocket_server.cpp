@@ -0,0 +1,490 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "connector_websocket_server.h"
+#include "deck_logger.h"
+#include "lua_helpers.h"
+#include "util_websocket.h"
+#include <cassert>
+
+using namespace util::websocket;
+
+namespace
+{
+
+// Same default as the websocket client
+constexpr std::size_t const DEFAULT_MAX_MESSAGE_SIZE = 64 * 1024 * 1024;
+
+// Roughly a second of a busy dashboard feed; beyond this a client is considered stuck
+constexpr std::size_t const DEFAULT_MAX_QUEUED_BYTES = 8 * 1024 * 1024;
+
+// Connections that never finish the upgrade are dropped after this long
+constexpr lua_Integer const DEFAULT_HANDSHAKE_TIMEOUT = 10000;
+
+} // namespace
+
+char const* ConnectorWebsocketServer::LUA_TYPENAME = "deck:ConnectorWebsocketServer";
+
+ConnectorWebsocketServer::ConnectorWebsocketServer(std::shared_ptr<util::SocketSet> const& socketset)
+    : m_socket(socketset)
+    , m_server_state(State::Disconnected)
+    , m_wanted_port(0)
+    , m_active_port(0)
+    , m_enabled(true)
+    , m_listen_last_attempt(-5000)
+    , m_num_clients(0)
+    , m_handshake_timeout(DEFAULT_HANDSHAKE_TIMEOUT)
+    , m_idle_timeout(0)
+    , m_max_message_size(DEFAULT_MAX_MESSAGE_SIZE)
+    , m_max_queued_bytes(DEFAULT_MAX_QUEUED_BYTES)
+    , m_slow_client_policy(SlowClientPolicy::Disconnect)
+{
+}
+
+ConnectorWebsocketServer::~ConnectorWebsocketServer()
+{
+	m_enabled = false;
+}
+
+void ConnectorWebsocketServer::tick_inputs(lua_State* L, lua_Integer clock)
+{
+	tick_server_input(L, clock);
+	tick_clients_input(L, clock);
+}
+
+void ConnectorWebsocketServer::tick_outputs(lua_State* L, lua_Integer clock)
+{
+	tick_server_output(L, clock);
+	tick_clients_output(L, clock);
+}
+
+void ConnectorWebsocketServer::shutdown(lua_State* L)
+{
+	m_socket.close();
+	m_server_state = State::Disconnected;
+	m_active_port  = 0;
+
+	if (m_num_clients)
+	{
+		LuaHelpers::push_instance_table(L, 1);
+		lua_pushlightuserdata(L, this);
+		lua_rawget(L, -2);
+
+		for (unsigned int ref = 1; ref <= m_num_clients; ++ref)
+		{
+			lua_rawgeti(L, -1, ref);
+			ConnectorWebsocketServerClient* client = ConnectorWebsocketServerClient::from_stack(L, -1, false);
+			if (client)
+				client->close(CLOSE_GoingAway);
+			lua_pop(L, 1);
+			lua_pushnil(L);
+			lua_rawseti(L, -2, ref);
+		}
+
+		lua_pop(L, 2);
+		m_num_clients = 0;
+	}
+}
+
+void ConnectorWebsocketServer::tick_server_input(lua_State* L, lua_Integer clock)
+{
+	if (m_server_state == State::Disconnected)
+	{
+		if (!m_enabled || clock < m_listen_last_attempt + 5000)
+			return;
+
+		m_listen_last_attempt = clock;
+
+		if (m_wanted_port == 0)
+		{
+			m_enabled = false;
+
+			std::string_view message = "WebsocketServer has not been assigned a port";
+			DeckLogger::log_message(L, DeckLogger::Level::Error, message);
+			LuaHelpers::emit_event(L, 1, "on_connect_failed", message);
+			return;
+		}
+
+		m_active_port = m_wanted_port;
+		m_socket.start_connect(std::string_view(), m_active_port);
+		m_server_state = State::Binding;
+	}
+
+	if (m_server_state == State::Binding)
+	{
+		util::Socket::State const socket_state = m_socket.get_state();
+		switch (socket_state)
+		{
+			case util::Socket::State::Disconnected:
+				m_server_state = State::Disconnected;
+				DeckLogger::log_message(L, DeckLogger::Level::Debug, "WebsocketServer binding to port ", m_active_port, " failed: ", m_socket.get_last_error());
+				m_active_port = 0;
+				LuaHelpers::emit_event(L, 1, "on_connect_failed", m_socket.get_last_error());
+				break;
+
+			case util::Socket::State::Connecting:
+				break;
+
+			case util::Socket::State::TLSHandshaking:
+				assert(false && "WebsocketServer does not do TLSHandshaking");
+				break;
+
+			case util::Socket::State::Connected:
+				m_server_state = State::Listening;
+				DeckLogger::log_message(L, DeckLogger::Level::Debug, "WebsocketServer bound to port ", m_active_port, ", now listening for connections");
+				LuaHelpers::emit_event(L, 1, "on_connect");
+				break;
+		}
+	}
+
+	if (m_server_state == State::Listening)
+	{
+		// Clients only become visible to lua once their handshake completes
+		m_socket.accept_pending([this, L, clock](util::Socket&& client_socket) {
+			ConnectorWebsocketServerClient* client = ConnectorWebsocketServerClient::push_new(L, std::move(client_socket), clock);
+			client->set_send_limits(m_max_queued_bytes, m_slow_client_policy);
+
+			LuaHelpers::push_instance_table(L, 1);
+			lua_pushlightuserdata(L, this);
+			lua_gettable(L, -2);
+			lua_pushvalue(L, -3);
+			++m_num_clients;
+			lua_rawseti(L, -2, m_num_clients);
+			lua_pop(L, 3);
+
+			DeckLogger::log_message(L, DeckLogger::Level::Trace, "WebsocketServer on port ", m_active_port, " accepted connection from ", client->get_remote_host(), ':', client->get_remote_port());
+		});
+
+		if (m_socket.get_state() == util::Socket::State::Disconnected)
+		{
+			std::string message  = "WebsocketServer on port ";
+			message             += std::to_string(m_active_port);
+			message             += " closed: ";
+			message             += m_socket.get_last_error();
+
+			m_server_state = State::Disconnected;
+			m_active_port  = 0;
+			DeckLogger::log_message(L, DeckLogger::Level::Debug, message);
+			LuaHelpers::emit_event(L, 1, "on_disconnect", message);
+			return;
+		}
+	}
+}
+
+void ConnectorWebsocketServer::tick_clients_input(lua_State* L, lua_Integer clock)
+{
+	LuaHelpers::push_instance_table(L, 1);
+	lua_pushlightuserdata(L, this);
+	lua_rawget(L, -2);
+
+	unsigned int last_ok_ref = 0;
+	for (unsigned int ref = 1; ref <= m_num_clients; ++ref)
+	{
+		lua_rawgeti(L, -1, ref);
+
+		ConnectorWebsocketServerClient* client = ConnectorWebsocketServerClient::from_stack(L, -1, false);
+		if (client)
+		{
+			client->receive(clock);
+
+			if (client->handshake(m_accepted_protocols, m_allowed_origins))
+			{
+				DeckLogger::log_message(L, DeckLogger::Level::Debug, "WebsocketServer on port ", m_active_port, " accepted client from ", client->get_remote_host(), ':', client->get_remote_port());
+				LuaHelpers::emit_event(L, 1, "on_accept", LuaHelpers::StackValue(L, -1), client->get_protocol());
+			}
+
+			ConnectorWebsocketServerClient::Frame frame;
+			while (client->next_message(frame, m_max_message_size))
+				LuaHelpers::emit_event(L, 1, "on_message", LuaHelpers::StackValue(L, -1), frame.second, int(frame.first));
+
+			// Silent or trickling connections hold a socket each, so they can't be allowed to pile up
+			lua_Integer const idle = clock - client->get_last_activity();
+			if (client->is_connected() && !client->was_accepted() && clock - client->get_accepted_at() > m_handshake_timeout)
+			{
+				DeckLogger::log_message(L, DeckLogger::Level::Trace, "WebsocketServer on port ", m_active_port, " dropped connection from ", client->get_remote_host(), ':', client->get_remote_port(), " without a handshake");
+				client->close(CLOSE_GoingAway);
+			}
+			else if (client->is_connected() && m_idle_timeout > 0 && idle > m_idle_timeout)
+			{
+				client->close(CLOSE_GoingAway);
+			}
+
+			if (client->is_connected())
+			{
+				++last_ok_ref;
+				if (ref > last_ok_ref)
+				{
+					lua_pushvalue(L, -1);
+					lua_rawseti(L, -3, last_ok_ref);
+				}
+			}
+			else if (client->was_accepted())
+			{
+				DeckLogger::log_message(L, DeckLogger::Level::Debug, "WebsocketServer on port ", m_active_port, " closed client from ", client->get_remote_host(), ':', client->get_remote_port());
+				LuaHelpers::emit_event(L, 1, "on_close", LuaHelpers::StackValue(L, -1));
+			}
+		}
+
+		lua_pop(L, 1);
+
+		if (ref > last_ok_ref)
+		{
+			lua_pushnil(L);
+			lua_rawseti(L, -2, ref);
+		}
+	}
+
+	lua_pop(L, 2);
+	m_num_clients = last_ok_ref;
+}
+
+void ConnectorWebsocketServer::tick_server_output(lua_State* L, lua_Integer clock)
+{
+	if (m_server_state == State::Listening && !m_enabled)
+	{
+		std::string message  = "WebsocketServer on port ";
+		message             += std::to_string(m_active_port);
+		message             += " disabled, closing port.";
+
+		m_socket.close();
+		m_server_state = State::Disconnected;
+		m_active_port  = 0;
+		DeckLogger::log_message(L, DeckLogger::Level::Debug, message);
+		LuaHelpers::emit_event(L, 1, "on_disconnect", message);
+	}
+}
+
+void ConnectorWebsocketServer::tick_clients_output(lua_State* L, lua_Integer clock)
+{
+	if (!m_num_clients)
+		return;
+
+	LuaHelpers::push_instance_table(L, 1);
+	lua_pushlightuserdata(L, this);
+	lua_rawget(L, -2);
+
+	for (unsigned int ref = 1; ref <= m_num_clients; ++ref)
+	{
+		lua_rawgeti(L, -1, ref);
+		ConnectorWebsocketServerClient* client = ConnectorWebsocketServerClient::from_stack(L, -1, false);
+		if (client)
+		{
+			client->set_send_limits(m_max_queued_bytes, m_slow_client_policy);
+			client->flush();
+		}
+		lua_pop(L, 1);
+	}
+
+	lua_pop(L, 2);
+}
+
+void ConnectorWebsocketServer::init_class_table(lua_State* L)
+{
+	Super::init_class_table(L);
+
+	lua_pushcfunction(L, &_lua_broadcast);
+	lua_setfield(L, -2, "broadcast");
+
+	lua_pushcfunction(L, &_lua_reset_timer);
+	lua_setfield(L, -2, "reset_timer");
+}
+
+void ConnectorWebsocketServer::init_instance_table(lua_State* L)
+{
+	lua_pushlightuserdata(L, this);
+	lua_createtable(L, 8, 0);
+	lua_settable(L, -3);
+
+	LuaHelpers::create_callback_warning(L, "on_connect");
+	LuaHelpers::create_callback_warning(L, "on_connect_failed");
+	LuaHelpers::create_callback_warning(L, "on_disconnect");
+
+	LuaHelpers::create_callback_warning(L, "on_accept");
+	LuaHelpers::create_callback_warning(L, "on_message");
+	LuaHelpers::create_callback_warning(L, "on_close");
+}
+
+int ConnectorWebsocketServer::index(lua_State* L, std::string_view const& key) const
+{
+	if (key == "enabled")
+	{
+		lua_pushboolean(L, m_enabled);
+	}
+	else if (key == "port")
+	{
+		if (m_active_port != 0)
+			lua_pushinteger(L, m_active_port);
+		else
+			lua_pushinteger(L, m_wanted_port);
+	}
+	else if (key == "accepted_protocols" || key == "protocols")
+	{
+		lua_pushlstring(L, m_accepted_protocols.data(), m_accepted_protocols.size());
+	}
+	else if (key == "allowed_origins")
+	{
+		lua_pushlstring(L, m_allowed_origins.data(), m_allowed_origins.size());
+	}
+	else if (key == "handshake_timeout")
+	{
+		lua_pushinteger(L, m_handshake_timeout);
+	}
+	else if (key == "idle_timeout")
+	{
+		lua_pushinteger(L, m_idle_timeout);
+	}
+	else if (key == "num_clients")
+	{
+		lua_pushinteger(L, m_num_clients);
+	}
+	else if (key == "max_message_size")
+	{
+		lua_pushinteger(L, lua_Integer(m_max_message_size));
+	}
+	else if (key == "max_queued_bytes")
+	{
+		lua_pushinteger(L, lua_Integer(m_max_queued_bytes));
+	}
+	else if (key == "slow_client_policy")
+	{
+		if (m_slow_client_policy == SlowClientPolicy::Drop)
+			lua_pushliteral(L, "drop");
+		else
+			lua_pushliteral(L, "disconnect");
+	}
+	return lua_gettop(L) == 2 ? 0 : 1;
+}
+
+int ConnectorWebsocketServer::newindex(lua_State* L, std::string_view const& key)
+{
+	if (key == "num_clients")
+	{
+		luaL_error(L, "key %s is readonly for %s", key.data(), LUA_TYPENAME);
+	}
+	else if (key == "enabled")
+	{
+		luaL_checktype(L, 3, LUA_TBOOLEAN);
+		m_enabled = lua_toboolean(L, 3);
+	}
+	else if (key == "port")
+	{
+		int value = LuaHelpers::check_arg_int(L, 3);
+		luaL_argcheck(L, (value > 0 && value < 65536), 3, "invalid value for port (out of range)");
+
+		if (value != m_wanted_port)
+		{
+			if (m_server_state != State::Disconnected)
+				DeckLogger::log_message(L, DeckLogger::Level::Warning, "WebsocketServer already active on port ", m_active_port, ", active port may not change immediately");
+
+			m_wanted_port = value;
+		}
+	}
+	else if (key == "accepted_protocols" || key == "protocols")
+	{
+		std::string_view value = LuaHelpers::check_arg_string(L, 3, true);
+		m_accepted_protocols   = value;
+	}
+	else if (key == "allowed_origins")
+	{
+		std::string_view value = LuaHelpers::check_arg_string(L, 3, true);
+		m_allowed_origins      = value;
+	}
+	else if (key == "handshake_timeout")
+	{
+		lua_Integer value = luaL_checkinteger(L, 3);
+		luaL_argcheck(L, (value > 0), 3, "handshake_timeout must be positive");
+		m_handshake_timeout = value;
+	}
+	else if (key == "idle_timeout")
+	{
+		lua_Integer value = luaL_checkinteger(L, 3);
+		luaL_argcheck(L, (value >= 0), 3, "idle_timeout must not be negative");
+		m_idle_timeout = value;
+	}
+	else if (key == "max_message_size")
+	{
+		lua_Integer value = luaL_checkinteger(L, 3);
+		luaL_argcheck(L, (value > 0), 3, "max_message_size must be positive");
+		m_max_message_size = std::size_t(value);
+	}
+	else if (key == "max_queued_bytes")
+	{
+		lua_Integer value = luaL_checkinteger(L, 3);
+		luaL_argcheck(L, (value > 0), 3, "max_queued_bytes must be positive");
+		m_max_queued_bytes = std::size_t(value);
+	}
+	else if (key == "slow_client_policy")
+	{
+		std::string_view value = LuaHelpers::check_arg_string(L, 3);
+		if (value == "drop")
+			m_slow_client_policy = SlowClientPolicy::Drop;
+		else if (value == "disconnect")
+			m_slow_client_policy = SlowClientPolicy::Disconnect;
+		else
+			luaL_argerror(L, 3, "slow_client_policy must be one of: drop, disconnect");
+	}
+	else if (key.starts_with("on_"))
+	{
+		if (lua_type(L, 3) != LUA_TNIL)
+			luaL_argcheck(L, (lua_type(L, 3) == LUA_TFUNCTION), 3, "event handlers must be functions");
+
+		LuaHelpers::newindex_store_in_instance_table(L);
+	}
+	else
+	{
+		LuaHelpers::newindex_store_in_instance_table(L);
+	}
+	return 0;
+}
+
+int ConnectorWebsocketServer::_lua_broadcast(lua_State* L)
+{
+	ConnectorWebsocketServer* self = from_stack(L, 1);
+	std::string_view message       = LuaHelpers::check_arg_string(L, 2);
+	bool const binary              = lua_toboolean(L, 3);
+
+	// Encoded once, every client queue holds a reference to the same frame
+	ConnectorWebsocketServerClient::SharedFrame frame = ConnectorWebsocketServerClient::make_frame(binary ? 2 : 1, message);
+
+	LuaHelpers::push_instance_table(L, 1);
+	lua_pushlightuserdata(L, self);
+	lua_rawget(L, -2);
+
+	lua_Integer queued = 0;
+	for (unsigned int ref = 1; ref <= self->m_num_clients; ++ref)
+	{
+		lua_rawgeti(L, -1, ref);
+		ConnectorWebsocketServerClient* client = ConnectorWebsocketServerClient::from_stack(L, -1, false);
+		if (client && client->queue_frame(frame))
+			++queued;
+		lua_pop(L, 1);
+	}
+
+	lua_pop(L, 2);
+	lua_pushinteger(L, queued);
+	return 1;
+}
+
+int ConnectorWebsocketServer::_lua_reset_timer(lua_State* L)
+{
+	ConnectorWebsocketServer* self  = from_stack(L, 1);
+	self->m_listen_last_attempt    -= 5000;
+	self->m_enabled                 = true;
+	return 0;
+}
@@ -0,0 +1,450 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "connector_websocket_server_client.h"
+#include "deck_logger.h"
+#include "lua_helpers.h"
+#include "util_http_parser.h"
+#include "util_text.h"
+#include "util_websocket.h"
+
+using namespace util::websocket;
+
+namespace
+{
+
+// Browsers send a few hundred bytes, anything this large is not a websocket client
+constexpr std::size_t const MAX_HANDSHAKE_SIZE = 8192;
+
+} // namespace
+
+char const* ConnectorWebsocketServerClient::LUA_TYPENAME = "deck:ConnectorWebsocketServerClient";
+
+ConnectorWebsocketServerClient::ConnectorWebsocketServerClient(util::Socket&& client_socket, lua_Integer clock)
+    : m_socket(std::move(client_socket))
+    , m_state(State::Handshaking)
+    , m_accepted(false)
+    , m_accepted_at(clock)
+    , m_last_activity(clock)
+    , m_send_queue_bytes(0)
+    , m_dropped_messages(0)
+    , m_max_queued_bytes(SIZE_MAX)
+    , m_slow_client_policy(SlowClientPolicy::Disconnect)
+{
+	// Clients must mask, and no extension is ever negotiated that gives the reserved bits a meaning
+	m_frame_reader.set_require_masked(true);
+}
+
+ConnectorWebsocketServerClient::~ConnectorWebsocketServerClient()
+{
+}
+
+void ConnectorWebsocketServerClient::init_class_table(lua_State* L)
+{
+	lua_pushcfunction(L, &_lua_send);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -3, "write");
+	lua_setfield(L, -2, "send");
+
+	lua_pushcfunction(L, &_lua_close);
+	lua_setfield(L, -2, "close");
+}
+
+void ConnectorWebsocketServerClient::finalize(lua_State* L)
+{
+	DeckLogger::log_message(L, DeckLogger::Level::Trace, "ConnectorWebsocketServerClient for ", get_remote_host(), ':', get_remote_port(), " finalized");
+}
+
+int ConnectorWebsocketServerClient::index(lua_State* L, std::string_view const& key) const
+{
+	if (key == "connected")
+	{
+		lua_pushboolean(L, is_open());
+	}
+	else if (key == "host" || key == "remote_host")
+	{
+		std::string const& rhost = get_remote_host();
+		lua_pushlstring(L, rhost.data(), rhost.size());
+	}
+	else if (key == "port" || key == "remote_port")
+	{
+		int const rport = get_remote_port();
+		lua_pushinteger(L, rport);
+	}
+	else if (key == "path")
+	{
+		lua_pushlstring(L, m_path.data(), m_path.size());
+	}
+	else if (key == "protocol")
+	{
+		lua_pushlstring(L, m_protocol.data(), m_protocol.size());
+	}
+	else if (key == "origin")
+	{
+		if (!m_origin.empty())
+			lua_pushlstring(L, m_origin.data(), m_origin.size());
+	}
+	else if (key == "queued_bytes")
+	{
+		lua_pushinteger(L, lua_Integer(get_queued_bytes()));
+	}
+	else if (key == "dropped_messages")
+	{
+		lua_pushinteger(L, lua_Integer(m_dropped_messages));
+	}
+	return lua_gettop(L) == 2 ? 0 : 1;
+}
+
+int ConnectorWebsocketServerClient::newindex(lua_State* L, std::string_view const& key)
+{
+	if (key == "connected" || key == "host" || key == "remote_host" || key == "port" || key == "remote_port" || key == "path" || key == "protocol" || key == "origin" || key == "queued_bytes" || key == "dropped_messages")
+	{
+		luaL_error(L, "key %s is readonly for %s", key.data(), LUA_TYPENAME);
+	}
+	else if (key.starts_with("on_"))
+	{
+		if (lua_type(L, 3) != LUA_TNIL)
+			luaL_argcheck(L, (lua_type(L, 3) == LUA_TFUNCTION), 3, "event handlers must be functions");
+
+		LuaHelpers::newindex_store_in_instance_table(L);
+	}
+	else
+	{
+		LuaHelpers::newindex_store_in_instance_table(L);
+	}
+	return 0;
+}
+
+std::string const& ConnectorWebsocketServerClient::get_remote_host() const
+{
+	return m_socket.get_remote_host();
+}
+
+int ConnectorWebsocketServerClient::get_remote_port() const
+{
+	return m_socket.get_remote_port();
+}
+
+std::string_view ConnectorWebsocketServerClient::get_protocol() const
+{
+	return m_protocol;
+}
+
+lua_Integer ConnectorWebsocketServerClient::get_accepted_at() const
+{
+	return m_accepted_at;
+}
+
+lua_Integer ConnectorWebsocketServerClient::get_last_activity() const
+{
+	return m_last_activity;
+}
+
+bool ConnectorWebsocketServerClient::is_open() const
+{
+	return m_state == State::Open && is_connected();
+}
+
+bool ConnectorWebsocketServerClient::is_connected() const
+{
+	return m_socket.get_state() == util::Socket::State::Connected;
+}
+
+bool ConnectorWebsocketServerClient::was_accepted() const
+{
+	return m_accepted;
+}
+
+bool ConnectorWebsocketServerClient::receive(lua_Integer clock)
+{
+	if (!is_connected())
+		return false;
+
+	if (!m_socket.is_readable())
+		return true;
+
+	int const received = m_socket.read_available(m_received);
+	if (received < 0)
+	{
+		m_state = State::Closed;
+		return false;
+	}
+
+	if (received > 0)
+		m_last_activity = clock;
+
+	return true;
+}
+
+bool ConnectorWebsocketServerClient::handshake(std::string_view const& accepted_protocols, std::string_view const& allowed_origins)
+{
+	if (m_state != State::Handshaking)
+		return false;
+
+	std::string_view const received_view(reinterpret_cast<char const*>(m_received.data()), m_received.size());
+
+	std::size_t const headers_end = received_view.find("\r\n\r\n");
+	if (headers_end == std::string_view::npos)
+	{
+		if (m_received.size() > MAX_HANDSHAKE_SIZE)
+			reject_handshake("431 Request Header Fields Too Large");
+		return false;
+	}
+
+	util::HttpMessage request = util::parse_http_message(received_view.substr(0, headers_end + 4));
+
+	std::string_view const upgrade    = util::http_find_header(request, "Upgrade");
+	std::string_view const connection = util::http_find_header(request, "Connection");
+	std::string_view const version    = util::http_find_header(request, "Sec-WebSocket-Version");
+	std::string_view const key        = util::http_find_header(request, "Sec-WebSocket-Key");
+
+	if (!request || !request.error.empty() || request.request_method != "GET" || !util::http_has_token(upgrade, "websocket") || !util::http_has_token(connection, "upgrade") || key.empty())
+	{
+		reject_handshake("400 Bad Request");
+		return false;
+	}
+
+	if (version != "13")
+	{
+		reject_handshake("426 Upgrade Required\r\nSec-WebSocket-Version: 13");
+		return false;
+	}
+
+	// Browsers always send an Origin, so any web page can reach a local server unless it is checked
+	std::string_view const origin = util::http_find_header(request, "Origin");
+	if (!origin.empty() && !allowed_origins.empty() && !util::http_has_token(allowed_origins, origin))
+	{
+		reject_handshake("403 Forbidden");
+		return false;
+	}
+
+	m_origin = origin;
+
+	// Pick the first protocol the client offers that we accept as well
+	m_protocol.clear();
+	std::string_view const offered_protocols = util::http_find_header(request, "Sec-WebSocket-Protocol");
+	for (std::string_view const& offered : util::split(offered_protocols, ","))
+	{
+		std::string_view const protocol = util::trim(offered);
+		if (!protocol.empty() && util::http_has_token(accepted_protocols, protocol))
+		{
+			m_protocol = protocol;
+			break;
+		}
+	}
+
+	m_path = request.request_path;
+
+	util::Blob accept = make_accept_nonce(key);
+
+	std::string http;
+	http.reserve(256);
+	http  = "HTTP/1.1 101 Switching Protocols\r\n";
+	http += "Upgrade: websocket\r\n";
+	http += "Connection: Upgrade\r\n";
+	http += "Sec-WebSocket-Accept: ";
+	http += accept.to_base64();
+	http += "\r\n";
+	if (!m_protocol.empty())
+	{
+		http += "Sec-WebSocket-Protocol: ";
+		http += m_protocol;
+		http += "\r\n";
+	}
+	http += "\r\n";
+
+	m_received.advance(headers_end + 4);
+
+	if (!m_socket.write(http.data(), http.size()))
+	{
+		m_state = State::Closed;
+		return false;
+	}
+
+	m_state    = State::Open;
+	m_accepted = true;
+	return true;
+}
+
+bool ConnectorWebsocketServerClient::next_message(Frame& frame_data, std::size_t max_message_size)
+{
+	if (m_state != State::Open)
+		return false;
+
+	m_frame_reader.set_max_message_size(max_message_size);
+
+	FrameKind frame_kind;
+	std::uint16_t close_reason;
+	while (m_frame_reader.next_frame(m_received, frame_data, frame_kind, close_reason))
+	{
+		// Connection close, answered and closed right away
+		if (frame_data.first == 8)
+		{
+			close(CLOSE_Normal);
+			return false;
+		}
+
+		// Ping
+		if (frame_data.first == 9)
+		{
+			queue_control_frame(10, frame_data.second);
+			continue;
+		}
+
+		// Pong
+		if (frame_data.first == 10)
+			continue;
+
+		return true;
+	}
+
+	if (close_reason != CLOSE_None)
+		close(close_reason);
+
+	return false;
+}
+
+ConnectorWebsocketServerClient::SharedFrame ConnectorWebsocketServerClient::make_frame(unsigned char opcode, std::string_view const& payload)
+{
+	unsigned char header[MAX_HEADER_SIZE];
+	std::size_t const header_size = encode_frame_header(header, opcode, payload.size(), false, nullptr);
+
+	std::shared_ptr<util::Blob> frame = std::make_shared<util::Blob>(header_size + payload.size());
+	frame->write(header, header_size);
+	frame->write(payload.data(), payload.size());
+	return frame;
+}
+
+void ConnectorWebsocketServerClient::set_send_limits(std::size_t max_queued_bytes, SlowClientPolicy policy)
+{
+	m_max_queued_bytes   = max_queued_bytes;
+	m_slow_client_policy = policy;
+}
+
+bool ConnectorWebsocketServerClient::queue_frame(SharedFrame const& frame)
+{
+	if (!is_open())
+		return false;
+
+	// A client that can't keep up loses messages or the connection, it never holds up the others
+	std::size_t const queued = get_queued_bytes();
+	if (queued + frame->size() > m_max_queued_bytes && queued > 0)
+	{
+		if (m_slow_client_policy == SlowClientPolicy::Drop)
+		{
+			++m_dropped_messages;
+			return false;
+		}
+
+		m_socket.close();
+		m_state = State::Closed;
+		m_send_queue.clear();
+		m_send_queue_bytes = 0;
+		return false;
+	}
+
+	m_send_queue.push_back(frame);
+	m_send_queue_bytes += frame->size();
+	return true;
+}
+
+void ConnectorWebsocketServerClient::flush()
+{
+	// Frames are handed over one by one as the socket drains, so at most one frame is ever copied into the socket
+	while (!m_send_queue.empty() && m_socket.get_pending_write_size() == 0)
+	{
+		SharedFrame const frame = std::move(m_send_queue.front());
+		m_send_queue.pop_front();
+		m_send_queue_bytes -= frame->size();
+
+		if (!m_socket.write(frame->data(), int(frame->size())))
+		{
+			m_state = State::Closed;
+			m_send_queue.clear();
+			m_send_queue_bytes = 0;
+			return;
+		}
+	}
+}
+
+std::size_t ConnectorWebsocketServerClient::get_queued_bytes() const
+{
+	return m_send_queue_bytes + m_socket.get_pending_write_size();
+}
+
+void ConnectorWebsocketServerClient::close(std::uint16_t close_code)
+{
+	if (m_state == State::Open && is_connected())
+	{
+		char buf[2];
+		buf[0] = close_code >> 8;
+		buf[1] = close_code & 0xff;
+
+		queue_control_frame(8, std::string_view(buf, 2));
+		flush();
+	}
+
+	m_socket.close();
+	m_state = State::Closed;
+	m_send_queue.clear();
+	m_send_queue_bytes = 0;
+	m_frame_reader.reset();
+}
+
+void ConnectorWebsocketServerClient::reject_handshake(std::string_view const& status)
+{
+	std::string http;
+	http  = "HTTP/1.1 ";
+	http += status;
+	http += "\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+
+	m_socket.write(http.data(), http.size());
+	m_socket.close();
+	m_state = State::Closed;
+}
+
+void ConnectorWebsocketServerClient::queue_control_frame(unsigned char opcode, std::string_view const& payload)
+{
+	// Control frames are tiny and bypass the slow client policy
+	SharedFrame frame = make_frame(opcode, payload);
+	m_send_queue.push_back(frame);
+	m_send_queue_bytes += frame->size();
+}
+
+int ConnectorWebsocketServerClient::_lua_send(lua_State* L)
+{
+	ConnectorWebsocketServerClient* self = ConnectorWebsocketServerClient::from_stack(L, 1);
+	std::string_view message             = LuaHelpers::check_arg_string(L, 2);
+	bool const binary                    = lua_toboolean(L, 3);
+
+	// The backlog is returned so scripts can hold off when the client can't keep up
+	if (self->queue_frame(make_frame(binary ? 2 : 1, message)))
+		lua_pushinteger(L, lua_Integer(self->get_queued_bytes()));
+	else
+		lua_pushboolean(L, false);
+
+	return 1;
+}
+
+int ConnectorWebsocketServerClient::_lua_close(lua_State* L)
+{
+	ConnectorWebsocketServerClient* self = ConnectorWebsocketServerClient::from_stack(L, 1);
+	self->close(CLOSE_Normal);
+	return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DECK_ASSISTANT_CONNECTOR_WEBSOCKET_SERVER_CLIENT_H
+#define DECK_ASSISTANT_CONNECTOR_WEBSOCKET_SERVER_CLIENT_H
+
+#include "lua_class.h"
+#include "util_blob.h"
+#include "util_socket.h"
+#include "util_websocket.h"
+#include <deque>
+#include <memory>
+#include <string>
+#include <utility>
+
+class ConnectorWebsocketServerClient : public LuaClass<ConnectorWebsocketServerClient>
+{
+public:
+	using Frame       = util::websocket::Frame;
+	using SharedFrame = std::shared_ptr<util::Blob const>;
+
+	enum class State : char
+	{
+		Handshaking,
+		Open,
+		Closed,
+	};
+
+	// What happens to a client whose send queue would grow beyond the limit
+	enum class SlowClientPolicy : char
+	{
+		Drop,
+		Disconnect,
+	};
+
+public:
+	ConnectorWebsocketServerClient(util::Socket&& client_socket, lua_Integer clock);
+	~ConnectorWebsocketServerClient();
+
+	static char const* LUA_TYPENAME;
+	static void init_class_table(lua_State* L);
+	void finalize(lua_State* L);
+	int index(lua_State* L, std::string_view const& key) const;
+	int newindex(lua_State* L, std::string_view const& key);
+
+	std::string const& get_remote_host() const;
+	int get_remote_port() const;
+	std::string_view get_protocol() const;
+	lua_Integer get_accepted_at() const;
+	lua_Integer get_last_activity() const;
+
+	bool is_open() const;
+	bool is_connected() const;
+	bool was_accepted() const;
+
+	bool receive(lua_Integer clock);
+	bool handshake(std::string_view const& accepted_protocols, std::string_view const& allowed_origins);
+	bool next_message(Frame& frame, std::size_t max_message_size);
+
+	static SharedFrame make_frame(unsigned char opcode, std::string_view const& payload);
+	void set_send_limits(std::size_t max_queued_bytes, SlowClientPolicy policy);
+	bool queue_frame(SharedFrame const& frame);
+	void flush();
+	std::size_t get_queued_bytes() const;
+	void close(std::uint16_t close_code);
+
+private:
+	void reject_handshake(std::string_view const& status);
+	void queue_control_frame(unsigned char opcode, std::string_view const& payload);
+
+	static int _lua_send(lua_State* L);
+	static int _lua_close(lua_State* L);
+
+private:
+	util::Socket m_socket;
+	State m_state;
+	bool m_accepted;
+	util::BlobBuffer m_received;
+	util::websocket::FrameReader m_frame_reader;
+	std::string m_path;
+	std::string m_protocol;
+	std::string m_origin;
+	lua_Integer m_accepted_at;
+	lua_Integer m_last_activity;
+	std::deque<SharedFrame> m_send_queue;
+	std::size_t m_send_queue_bytes;
+	std::size_t m_dropped_messages;
+	std::size_t m_max_queued_bytes;
+	SlowClientPolicy m_slow_client_policy;
+};
+
+#endif // DECK_ASSISTANT_CONNECTOR_WEBSOCKET_SERVER_CLIENT_H
@@ -43,6 +43,20 @@ void adjust_coordinates_for_scale(SDL_Window const* window, DeckCard const* card
 	}
 }
 
+// Past this many damaged areas it is cheaper to just redraw the whole window
+constexpr std::size_t const MAX_DAMAGED_RECTS = 32;
+
+SDL_Rect map_rect_to_surface(SDL_Rect const& rect, SDL_Surface const* from, SDL_Surface const* to)
+{
+	// Round outwards so that scaled pixels on the edges are always included
+	int const x1 = rect.x * to->w / from->w;
+	int const y1 = rect.y * to->h / from->h;
+	int const x2 = ((rect.x + rect.w) * to->w + from->w - 1) / from->w;
+	int const y2 = ((rect.y + rect.h) * to->h + from->h - 1) / from->h;
+
+	return DeckRectangle::clip(SDL_Rect { x1, y1, x2 - x1, y2 - y1 }, SDL_Rect { 0, 0, to->w, to->h });
+}
+
 void dispatch_key_event(lua_State* L, SDL_KeyboardEvent const& event, char const* name)
 {
 	lua_getfield(L, 1, name);
@@ -68,16 +82,21 @@ ConnectorWindow::ConnectorWindow()
     , m_wanted_height(900)
     , m_wanted_visible(true)
     , m_exit_on_close(true)
+    , m_raw_motion(false)
+    , m_use_renderer(false)
+    , m_vsync(true)
+    , m_renderer(nullptr)
+    , m_texture(nullptr)
     , m_event_size_changed(false)
     , m_event_surface_dirty(false)
+    , m_pending_events(1024)
     , m_card(nullptr)
 {
 }
 
 ConnectorWindow::~ConnectorWindow()
 {
-	if (m_window)
-		SDL_DestroyWindow(m_window);
+	destroy_window();
 }
 
 void ConnectorWindow::initial_setup(lua_State* L, bool is_reload)
@@ -88,13 +107,27 @@ void ConnectorWindow::initial_setup(lua_State* L, bool is_reload)
 
 void ConnectorWindow::tick_inputs(lua_State* L, lua_Integer clock)
 {
-	std::lock_guard guard(m_mutex);
-
 	if (!m_window && !attempt_create_window(L))
 		return;
 
-	for (SDL_Event const& event : m_pending_events)
+	std::optional<SDL_MouseMotionEvent> pending_motion;
+
+	m_pending_events.drain(m_events);
+	for (SDL_Event const& event : m_events)
 	{
+		// Unless raw motion is requested, only the last position before anything else happens gets reported
+		if (event.type == SDL_MOUSEMOTION && !m_raw_motion)
+		{
+			pending_motion = event.motion;
+			continue;
+		}
+
+		if (pending_motion.has_value())
+		{
+			handle_motion_event(L, pending_motion.value());
+			pending_motion.reset();
+		}
+
 		switch (event.type)
 		{
 			case SDL_WINDOWEVENT:
@@ -122,10 +155,24 @@ void ConnectorWindow::tick_inputs(lua_State* L, lua_Integer clock)
 			case SDL_TEXTEDITING_EXT:
 				SDL_free(event.editExt.text);
 				break;
+			case SDL_RENDER_DEVICE_RESET:
+				if (m_texture)
+				{
+					SDL_DestroyTexture(m_texture);
+					m_texture = nullptr;
+				}
+				m_event_surface_dirty = true;
+				break;
+			case SDL_RENDER_TARGETS_RESET:
+				m_event_surface_dirty = true;
+				break;
 		}
 	}
 
-	m_pending_events.clear();
+	m_events.clear();
+
+	if (pending_motion.has_value())
+		handle_motion_event(L, pending_motion.value());
 
 	if (m_event_size_changed)
 	{
@@ -176,9 +223,14 @@ void ConnectorWindow::tick_outputs(lua_State* L, lua_Integer clock)
 		m_wanted_visible.reset();
 	}
 
-	if (m_event_surface_dirty)
+	if (m_renderer)
+	{
+		redraw_renderer();
+	}
+	else if (m_event_surface_dirty)
 	{
 		m_event_surface_dirty = false;
+		m_damaged_rects.clear();
 
 		SDL_Surface* surface      = SDL_GetWindowSurface(m_window);
 		SDL_Surface* card_surface = m_card ? m_card->get_surface() : nullptr;
@@ -190,16 +242,33 @@ void ConnectorWindow::tick_outputs(lua_State* L, lua_Integer clock)
 
 		SDL_UpdateWindowSurface(m_window);
 	}
+	else if (!m_damaged_rects.empty())
+	{
+		SDL_Surface* surface      = SDL_GetWindowSurface(m_window);
+		SDL_Surface* card_surface = m_card ? m_card->get_surface() : nullptr;
+
+		if (surface && card_surface)
+		{
+			for (SDL_Rect& rect : m_damaged_rects)
+			{
+				rect = map_rect_to_surface(rect, card_surface, surface);
+
+				// Blitting the whole card through a clip rectangle keeps the scaling identical to a full redraw
+				SDL_SetClipRect(surface, &rect);
+				SDL_BlitScaled(card_surface, nullptr, surface, nullptr);
+			}
+			SDL_SetClipRect(surface, nullptr);
+
+			SDL_UpdateWindowSurfaceRects(m_window, m_damaged_rects.data(), int(m_damaged_rects.size()));
+		}
+
+		m_damaged_rects.clear();
+	}
 }
 
 void ConnectorWindow::shutdown(lua_State* L)
 {
-	if (m_window)
-	{
-		SDL_DelEventWatch(&_sdl_event_filter, this);
-		SDL_DestroyWindow(m_window);
-		m_window = nullptr;
-	}
+	destroy_window();
 }
 
 void ConnectorWindow::init_class_table(lua_State* L)
@@ -302,13 +371,31 @@ int ConnectorWindow::index(lua_State* L, std::string_view const& key) const
 	{
 		lua_pushboolean(L, m_exit_on_close);
 	}
+	else if (key == "raw_motion")
+	{
+		lua_pushboolean(L, m_raw_motion);
+	}
+	else if (key == "renderer")
+	{
+		lua_pushboolean(L, m_use_renderer);
+	}
+	else if (key == "renderer_name")
+	{
+		SDL_RendererInfo info;
+		if (m_renderer && SDL_GetRendererInfo(m_renderer, &info) == 0)
+			lua_pushstring(L, info.name);
+	}
+	else if (key == "vsync")
+	{
+		lua_pushboolean(L, m_vsync);
+	}
 
 	return lua_gettop(L) == 2 ? 0 : 1;
 }
 
 int ConnectorWindow::newindex(lua_State* L, std::string_view const& key)
 {
-	if (key == "connected" || key == "pixel_width" || key == "pixel_height")
+	if (key == "connected" || key == "pixel_width" || key == "pixel_height" || key == "renderer_name")
 	{
 		luaL_error(L, "key %s is readonly for %s", key.data(), LUA_TYPENAME);
 	}
@@ -339,6 +426,30 @@ int ConnectorWindow::newindex(lua_State* L, std::string_view const& key)
 		luaL_argcheck(L, (lua_type(L, 3) == LUA_TBOOLEAN), 3, "exit_on_close must be a boolean");
 		m_exit_on_close = lua_toboolean(L, 3);
 	}
+	else if (key == "raw_motion")
+	{
+		m_raw_motion = LuaHelpers::check_arg_bool(L, 3);
+	}
+	else if (key == "renderer")
+	{
+		bool value = LuaHelpers::check_arg_bool(L, 3);
+		if (m_use_renderer != value)
+		{
+			// A window cannot switch between its own surface and a renderer, so recreate it
+			m_use_renderer = value;
+			destroy_window();
+		}
+	}
+	else if (key == "vsync")
+	{
+		bool value = LuaHelpers::check_arg_bool(L, 3);
+		if (m_vsync != value)
+		{
+			m_vsync = value;
+			if (m_renderer)
+				SDL_RenderSetVSync(m_renderer, m_vsync ? 1 : 0);
+		}
+	}
 	else if (key == "card")
 	{
 		DeckCard* card;
@@ -392,6 +503,9 @@ bool ConnectorWindow::attempt_create_window(lua_State* L)
 		}
 		else
 		{
+			if (m_use_renderer)
+				attempt_create_renderer(L);
+
 			SDL_AddEventWatch(&_sdl_event_filter, this);
 			m_event_size_changed  = true;
 			m_event_surface_dirty = true;
@@ -401,23 +515,154 @@ bool ConnectorWindow::attempt_create_window(lua_State* L)
 	return m_window;
 }
 
+void ConnectorWindow::attempt_create_renderer(lua_State* L)
+{
+	Uint32 const vsync_flag = m_vsync ? SDL_RENDERER_PRESENTVSYNC : 0;
+
+	// Prefer the GPU, but the software renderer still beats blitting on the main thread (and works headless)
+	m_renderer = SDL_CreateRenderer(m_window, -1, SDL_RENDERER_ACCELERATED | vsync_flag);
+	if (!m_renderer)
+		m_renderer = SDL_CreateRenderer(m_window, -1, SDL_RENDERER_SOFTWARE);
+
+	if (!m_renderer)
+	{
+		DeckLogger::log_message(L, DeckLogger::Level::Warning, "failed to create window renderer, using the window surface instead: ", SDL_GetError());
+		return;
+	}
+
+	SDL_RendererInfo info;
+	if (SDL_GetRendererInfo(m_renderer, &info) == 0)
+		DeckLogger::log_message(L, DeckLogger::Level::Debug, "Window using renderer ", info.name);
+}
+
+void ConnectorWindow::destroy_window()
+{
+	if (m_texture)
+	{
+		SDL_DestroyTexture(m_texture);
+		m_texture = nullptr;
+	}
+
+	if (m_renderer)
+	{
+		SDL_DestroyRenderer(m_renderer);
+		m_renderer = nullptr;
+	}
+
+	if (m_window)
+	{
+		// Make sure a recreated window comes back looking the same
+		int width;
+		int height;
+		SDL_GetWindowSize(m_window, &width, &height);
+
+		if (!m_wanted_title.has_value())
+			m_wanted_title = SDL_GetWindowTitle(m_window);
+		if (!m_wanted_width.has_value())
+			m_wanted_width = width;
+		if (!m_wanted_height.has_value())
+			m_wanted_height = height;
+		if (!m_wanted_visible.has_value())
+			m_wanted_visible = (SDL_GetWindowFlags(m_window) & SDL_WINDOW_SHOWN) != 0;
+
+		SDL_DelEventWatch(&_sdl_event_filter, this);
+		SDL_DestroyWindow(m_window);
+		m_window = nullptr;
+	}
+
+	m_damaged_rects.clear();
+}
+
+void ConnectorWindow::redraw_renderer()
+{
+	SDL_Surface* card_surface = m_card ? m_card->get_surface() : nullptr;
+
+	if (m_texture && card_surface)
+	{
+		Uint32 format;
+		int width;
+		int height;
+		SDL_QueryTexture(m_texture, &format, nullptr, &width, &height);
+
+		if (format != card_surface->format->format || width != card_surface->w || height != card_surface->h)
+		{
+			SDL_DestroyTexture(m_texture);
+			m_texture = nullptr;
+		}
+	}
+
+	if (!m_texture && card_surface)
+	{
+		m_texture = SDL_CreateTexture(m_renderer, card_surface->format->format, SDL_TEXTUREACCESS_STREAMING, card_surface->w, card_surface->h);
+		if (!m_texture)
+		{
+			DeckLogger::log_message(nullptr, DeckLogger::Level::Error, "failed to create window texture: ", SDL_GetError());
+			return;
+		}
+		m_event_surface_dirty = true;
+	}
+
+	if (!m_event_surface_dirty && m_damaged_rects.empty())
+		return;
+
+	if (card_surface)
+	{
+		// Only the changed areas of the card are sent to the texture; the renderer does all the scaling
+		if (m_event_surface_dirty)
+		{
+			SDL_UpdateTexture(m_texture, nullptr, card_surface->pixels, card_surface->pitch);
+		}
+		else
+		{
+			for (SDL_Rect const& rect : m_damaged_rects)
+			{
+				unsigned char const* pixels = reinterpret_cast<unsigned char const*>(card_surface->pixels) + rect.y * card_surface->pitch + rect.x * card_surface->format->BytesPerPixel;
+				SDL_UpdateTexture(m_texture, &rect, pixels, card_surface->pitch);
+			}
+		}
+	}
+
+	m_event_surface_dirty = false;
+	m_damaged_rects.clear();
+
+	SDL_SetRenderDrawColor(m_renderer, 0, 0, 0, 255);
+	SDL_RenderClear(m_renderer);
+	if (card_surface)
+		SDL_RenderCopy(m_renderer, m_texture, nullptr, nullptr);
+
+	// With vsync enabled this waits for the next frame, which also throttles redraws to the display rate
+	SDL_RenderPresent(m_renderer);
+}
+
 int ConnectorWindow::_lua_redraw(lua_State* L)
 {
 	ConnectorWindow* self = from_stack(L, 1);
-	// DeckRectangle* rect = nullptr;
+	DeckRectangle* rect   = nullptr;
 
 	if (!lua_isnoneornil(L, 2))
-		/*rect =*/DeckRectangle::from_stack(L, 2);
+		rect = DeckRectangle::from_stack(L, 2);
+
+	if (!rect || !self->m_card)
+	{
+		self->m_event_surface_dirty = true;
+	}
+	else if (!self->m_event_surface_dirty)
+	{
+		SDL_Surface const* card_surface = self->m_card->get_surface();
+		SDL_Rect const damaged          = DeckRectangle::clip(rect->get_rectangle(), SDL_Rect { 0, 0, card_surface->w, card_surface->h });
 
-	std::lock_guard guard(self->m_mutex);
-	self->m_event_surface_dirty = true;
+		if (self->m_damaged_rects.size() >= MAX_DAMAGED_RECTS)
+			self->m_event_surface_dirty = true;
+		else if (damaged.w > 0 && damaged.h > 0)
+			self->m_damaged_rects.push_back(damaged);
+	}
 
 	return 0;
 }
 
 int ConnectorWindow::_sdl_event_filter(void* userdata, SDL_Event* event)
 {
-	// This may run out of context, so we must catch and queue these events locally using atomics
+	// This may run out of context, so we must catch and queue these events locally without locking
 
 	ConnectorWindow* self  = reinterpret_cast<ConnectorWindow*>(userdata);
 	Uint32 const window_id = self->m_window ? SDL_GetWindowID(self->m_window) : -1;
@@ -425,56 +670,57 @@ int ConnectorWindow::_sdl_event_filter(void* userdata, SDL_Event* event)
 	if (event->type == SDL_MOUSEMOTION && event->motion.windowID == window_id)
 	{
 		// DeckLogger::log_message(nullptr, DeckLogger::Level::Trace, "Window mouse motion at ", event->motion.x, ',', event->motion.y);
-		std::lock_guard guard(self->m_mutex);
-		self->m_pending_events.push_back(*event);
+		self->queue_event(*event);
 	}
 	else if (event->type == SDL_MOUSEBUTTONDOWN && event->button.windowID == window_id)
 	{
 		DeckLogger::log_message(nullptr, DeckLogger::Level::Trace, "Window mouse button ", int(event->button.button), " down at ", event->button.x, ',', event->button.y);
-		std::lock_guard guard(self->m_mutex);
-		self->m_pending_events.push_back(*event);
+		self->queue_event(*event);
 	}
 	else if (event->type == SDL_MOUSEBUTTONUP && event->button.windowID == window_id)
 	{
 		DeckLogger::log_message(nullptr, DeckLogger::Level::Trace, "Window mouse button ", int(event->button.button), " up at ", event->button.x, ',', event->button.y);
-		std::lock_guard guard(self->m_mutex);
-		self->m_pending_events.push_back(*event);
+		self->queue_event(*event);
 	}
 	else if (event->type == SDL_MOUSEWHEEL && event->wheel.windowID == window_id)
 	{
 		DeckLogger::log_message(nullptr, DeckLogger::Level::Trace, "Window mouse wheel ", event->wheel.x, ',', -event->wheel.y, " at ", event->wheel.x, ',', event->wheel.y);
-		std::lock_guard guard(self->m_mutex);
-		self->m_pending_events.push_back(*event);
+		self->queue_event(*event);
 	}
 	else if (event->type == SDL_WINDOWEVENT && event->window.windowID == window_id)
 	{
-		std::lock_guard guard(self->m_mutex);
-		self->m_pending_events.push_back(*event);
+		self->queue_event(*event);
 	}
 	else if (event->type == SDL_TEXTINPUT && event->text.windowID == window_id)
 	{
-		std::lock_guard guard(self->m_mutex);
-		self->m_pending_events.push_back(*event);
+		self->queue_event(*event);
 	}
 	else if (event->type == SDL_TEXTEDITING && event->edit.windowID == window_id)
 	{
-		std::lock_guard guard(self->m_mutex);
-		self->m_pending_events.push_back(*event);
+		self->queue_event(*event);
 	}
 	else if (event->type == SDL_TEXTEDITING_EXT && event->editExt.windowID == window_id)
 	{
-		std::lock_guard guard(self->m_mutex);
-		self->m_pending_events.push_back(*event);
+		self->queue_event(*event);
 	}
 	else if ((event->type == SDL_KEYUP || event->type == SDL_KEYDOWN) && event->key.windowID == window_id)
 	{
-		std::lock_guard guard(self->m_mutex);
-		self->m_pending_events.push_back(*event);
+		self->queue_event(*event);
+	}
+	else if ((event->type == SDL_RENDER_TARGETS_RESET || event->type == SDL_RENDER_DEVICE_RESET) && self->m_renderer)
+	{
+		self->queue_event(*event);
 	}
 
 	return 0;
 }
 
+void ConnectorWindow::queue_event(SDL_Event const& event)
+{
+	// Should the main loop fall behind, only runs of motion get folded together
+	m_pending_events.push(event, [](SDL_Event const& previous, SDL_Event const& value) { return previous.type == SDL_MOUSEMOTION && value.type == SDL_MOUSEMOTION; });
+}
+
 void ConnectorWindow::handle_window_event(lua_State* L, SDL_WindowEvent const& event)
 {
 	switch (event.event)
@@ -20,8 +20,8 @@
 #define DECK_ASSISTANT_CONNECTOR_WINDOW_H
 
 #include "connector_base.h"
+#include "util_ring_queue.h"
 #include <SDL.h>
-#include <mutex>
 #include <optional>
 #include <string>
 #include <vector>
@@ -48,10 +48,14 @@ public:
 
 private:
 	bool attempt_create_window(lua_State* L);
+	void attempt_create_renderer(lua_State* L);
+	void destroy_window();
+	void redraw_renderer();
 
 	static int _lua_redraw(lua_State* L);
 
 	static int _sdl_event_filter(void* userdata, SDL_Event* event);
+	void queue_event(SDL_Event const& event);
 	void handle_window_event(lua_State* L, SDL_WindowEvent const& event);
 	void handle_motion_event(lua_State* L, SDL_MouseMotionEvent const& event);
 	void handle_button_event(lua_State* L, SDL_MouseButtonEvent const& event);
@@ -67,11 +71,19 @@ private:
 	std::optional<int> m_wanted_height;
 	std::optional<bool> m_wanted_visible;
 	bool m_exit_on_close;
+	bool m_raw_motion;
+
+	// Optional accelerated output, falls back to the window surface
+	bool m_use_renderer;
+	bool m_vsync;
+	SDL_Renderer* m_renderer;
+	SDL_Texture* m_texture;
 
-	std::recursive_mutex m_mutex;
 	bool m_event_size_changed;
 	bool m_event_surface_dirty;
-	std::vector<SDL_Event> m_pending_events;
+	std::vector<SDL_Rect> m_damaged_rects;
+	util::SpillingRingQueue<SDL_Event> m_pending_events;
+	std::vector<SDL_Event> m_events;
 
 	// Deck-related
 	DeckCard* m_card;
@@ -19,10 +19,13 @@
 #include "deck_connector_factory.h"
 #include "connector_elgato_streamdeck.h"
 #include "connector_http.h"
+#include "connector_http_server.h"
+#include "connector_osc.h"
 #include "connector_server_socket.h"
 #include "connector_spout.h"
 #include "connector_vnc.h"
 #include "connector_websocket.h"
+#include "connector_websocket_server.h"
 #include "connector_window.h"
 #include "deck_module.h"
 #include "lua_helpers.h"
@@ -73,6 +76,12 @@ void DeckConnectorFactory::init_class_table(lua_State* L)
 	lua_pushcfunction(L, &new_socket_connector<ConnectorHttp>);
 	lua_setfield(L, -2, "Http");
 
+	lua_pushcfunction(L, &new_socket_connector<ConnectorHttpServer>);
+	lua_setfield(L, -2, "HttpServer");
+
+	lua_pushcfunction(L, &new_connector<ConnectorOsc>);
+	lua_setfield(L, -2, "Osc");
+
 	lua_pushcfunction(L, &new_socket_connector<ConnectorServerSocket>);
 	lua_pushvalue(L, -1);
 	lua_setfield(L, -3, "ServerSocket");
@@ -97,6 +106,14 @@ void DeckConnectorFactory::init_class_table(lua_State* L)
 	lua_pushcfunction(L, &new_socket_connector<ConnectorWebsocket>);
 	lua_setfield(L, -2, "Websocket");
 
+#if (defined HAVE_GNUTLS || defined HAVE_OPENSSL)
+	lua_pushcfunction(L, &new_socket_connector<ConnectorWebsocketServer>);
+#else
+	lua_pushliteral(L, "WebsocketServer connector not available, recompile with OpenSSL or GnuTLS support");
+	lua_pushcclosure(L, &no_connector, 1);
+#endif
+	lua_setfield(L, -2, "WebsocketServer");
+
 	lua_pushcfunction(L, &new_connector<ConnectorWindow>);
 	lua_setfield(L, -2, "Window");
 }
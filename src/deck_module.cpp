@@ -28,6 +28,7 @@
 #include "deck_rectangle.h"
 #include "deck_rectangle_list.h"
 #include "lua_helpers.h"
+#include "util_tls_session.h"
 #include <SDL_image.h>
 #include <cassert>
 
@@ -43,7 +44,7 @@ constexpr int const g_connector_container_idx    = 1;
 char const* DeckModule::LUA_TYPENAME = "deck:DeckModule";
 
 DeckModule::DeckModule()
-    : m_socketset(util::SocketSet::create(32))
+    : m_socketset(util::SocketSet::create())
     , m_last_clock(0)
     , m_last_delta(0)
     , m_reload_requested(false)
@@ -213,6 +214,46 @@ int DeckModule::index(lua_State* L, std::string_view const& key) const
 	{
 		lua_pushinteger(L, m_last_delta);
 	}
+	else if (key == "resolver_stats")
+	{
+		util::SocketSet::ResolverStats const stats = m_socketset->get_resolver_stats();
+
+		lua_createtable(L, 0, 9);
+		lua_pushinteger(L, lua_Integer(stats.lookups));
+		lua_setfield(L, -2, "lookups");
+		lua_pushinteger(L, lua_Integer(stats.cache_hits));
+		lua_setfield(L, -2, "cache_hits");
+		lua_pushinteger(L, lua_Integer(stats.negative_hits));
+		lua_setfield(L, -2, "negative_hits");
+		lua_pushinteger(L, lua_Integer(stats.coalesced));
+		lua_setfield(L, -2, "coalesced");
+		lua_pushinteger(L, lua_Integer(stats.queries));
+		lua_setfield(L, -2, "queries");
+		lua_pushinteger(L, lua_Integer(stats.failures));
+		lua_setfield(L, -2, "failures");
+		lua_pushinteger(L, lua_Integer(stats.cached_hosts));
+		lua_setfield(L, -2, "cached_hosts");
+		lua_pushinteger(L, lua_Integer(stats.pending));
+		lua_setfield(L, -2, "pending");
+		lua_pushinteger(L, lua_Integer(stats.threads));
+		lua_setfield(L, -2, "threads");
+	}
+	else if (key == "tls_session_stats")
+	{
+		util::TLSSession::ResumptionStats const stats = util::TLSSession::get_resumption_stats();
+
+		lua_createtable(L, 0, 5);
+		lua_pushinteger(L, lua_Integer(stats.handshakes));
+		lua_setfield(L, -2, "handshakes");
+		lua_pushinteger(L, lua_Integer(stats.offered));
+		lua_setfield(L, -2, "offered");
+		lua_pushinteger(L, lua_Integer(stats.resumed));
+		lua_setfield(L, -2, "resumed");
+		lua_pushinteger(L, lua_Integer(stats.stored));
+		lua_setfield(L, -2, "stored");
+		lua_pushinteger(L, lua_Integer(stats.cached));
+		lua_setfield(L, -2, "cached");
+	}
 	else
 	{
 		lua_pushnil(L);
@@ -33,6 +33,9 @@ public:
 	DeckUtil(util::Paths const& paths);
 
 	static char const* LUA_TYPENAME;
+	static constexpr bool const LUA_IS_GLOBAL = true;
+
+	inline util::Paths const& get_paths() const { return m_paths; }
 
 	static void init_class_table(lua_State* L);
 	void init_instance_table(lua_State* L);
@@ -19,11 +19,15 @@
 #include "lua_class.hpp"
 #include "connector_elgato_streamdeck.h"
 #include "connector_http.h"
+#include "connector_http_server.h"
+#include "connector_osc.h"
 #include "connector_server_socket.h"
 #include "connector_server_socket_client.h"
 #include "connector_spout.h"
 #include "connector_vnc.h"
 #include "connector_websocket.h"
+#include "connector_websocket_server.h"
+#include "connector_websocket_server_client.h"
 #include "connector_window.h"
 #include "deck_card.h"
 #include "deck_colour.h"
@@ -41,9 +45,13 @@
 
 template class LuaClass<ConnectorElgatoStreamDeck>;
 template class LuaClass<ConnectorHttp>;
+template class LuaClass<ConnectorHttpServer>;
+template class LuaClass<ConnectorOsc>;
 template class LuaClass<ConnectorServerSocketClient>;
 template class LuaClass<ConnectorServerSocket>;
 template class LuaClass<ConnectorWebsocket>;
+template class LuaClass<ConnectorWebsocketServerClient>;
+template class LuaClass<ConnectorWebsocketServer>;
 template class LuaClass<ConnectorWindow>;
 template class LuaClass<DeckCard>;
 template class LuaClass<DeckConnectorContainer>;
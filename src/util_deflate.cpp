@@ -0,0 +1,343 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "util_deflate.h"
+#include "util_blob.h"
+#include <algorithm>
+#include <climits>
+
+#if (defined HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+using namespace util;
+
+namespace
+{
+
+// Output space offered to zlib per round, grown further for large inputs
+constexpr std::size_t const MIN_OUTPUT_CHUNK = 4096;
+
+// zlib counts in uInt, so larger inputs are fed in slices
+constexpr std::size_t const MAX_INPUT_SLICE = 1024 * 1024 * 1024;
+
+#if (defined HAVE_ZLIB)
+
+int to_zlib_window_bits(Deflate::Format format, int window_bits)
+{
+	switch (format)
+	{
+		case Deflate::Format::Raw:
+			return -window_bits;
+		case Deflate::Format::Zlib:
+			return window_bits;
+		case Deflate::Format::Gzip:
+			return window_bits + 16;
+	}
+	return window_bits;
+}
+
+void ensure_output_space(BlobBuffer& output, std::size_t wanted)
+{
+	if (output.space() < MIN_OUTPUT_CHUNK)
+		output.reserve(output.capacity() + std::max(wanted, MIN_OUTPUT_CHUNK));
+}
+
+#endif
+
+} // namespace
+
+struct util::Deflate::State
+{
+#if (defined HAVE_ZLIB)
+	z_stream stream = {};
+
+	~State()
+	{
+		deflateEnd(&stream);
+	}
+#endif
+};
+
+struct util::Inflate::State
+{
+	bool finished = false;
+
+#if (defined HAVE_ZLIB)
+	z_stream stream = {};
+
+	~State()
+	{
+		inflateEnd(&stream);
+	}
+#endif
+};
+
+Deflate::Deflate()
+    : m_total_in(0)
+    , m_total_out(0)
+{
+}
+
+Deflate::Deflate(Deflate&&) = default;
+
+Deflate::~Deflate() = default;
+
+Deflate& Deflate::operator=(Deflate&&) = default;
+
+Deflate::operator bool() const
+{
+	return m_state.get();
+}
+
+bool Deflate::operator!() const
+{
+	return !m_state;
+}
+
+bool Deflate::is_available()
+{
+#if (defined HAVE_ZLIB)
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool Deflate::init(Format format, int window_bits, int level)
+{
+	m_state.reset();
+	m_total_in  = 0;
+	m_total_out = 0;
+
+#if (defined HAVE_ZLIB)
+	// zlib refuses a raw window of 8 bits, 9 is the smallest it will produce
+	window_bits = std::clamp(window_bits, 9, 15);
+
+	std::unique_ptr<State> state(new State);
+	if (deflateInit2(&state->stream, level, Z_DEFLATED, to_zlib_window_bits(format, window_bits), 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+
+	m_state = std::move(state);
+	return true;
+#else
+	return false;
+#endif
+}
+
+void Deflate::deinit()
+{
+	m_state.reset();
+}
+
+void Deflate::reset()
+{
+#if (defined HAVE_ZLIB)
+	if (m_state)
+		deflateReset(&m_state->stream);
+#endif
+}
+
+bool Deflate::write(void const* data, std::size_t len, BlobBuffer& output, Flush flush)
+{
+	if (!m_state)
+		return false;
+
+#if (defined HAVE_ZLIB)
+	z_stream& stream          = m_state->stream;
+	unsigned char const* next = static_cast<unsigned char const*>(data);
+	std::size_t remaining     = len;
+
+	for (;;)
+	{
+		std::size_t const slice = std::min(remaining, MAX_INPUT_SLICE);
+		bool const last_slice   = (slice == remaining);
+
+		int mode = Z_NO_FLUSH;
+		if (last_slice && flush == Flush::Sync)
+			mode = Z_SYNC_FLUSH;
+		else if (last_slice && flush == Flush::Finish)
+			mode = Z_FINISH;
+
+		stream.next_in  = const_cast<Bytef*>(next);
+		stream.avail_in = uInt(slice);
+
+		int result;
+		do
+		{
+			ensure_output_space(output, slice / 2);
+
+			stream.next_out  = output.tail();
+			stream.avail_out = uInt(std::min<std::size_t>(output.space(), UINT_MAX));
+
+			std::size_t const offered = stream.avail_out;
+			result                    = deflate(&stream, mode);
+
+			std::size_t const produced = offered - stream.avail_out;
+			output.added_to_tail(produced);
+			m_total_out += produced;
+
+			if (result == Z_STREAM_ERROR)
+				return false;
+		}
+		while (stream.avail_out == 0 || (mode == Z_FINISH && result != Z_STREAM_END));
+
+		next      += slice;
+		remaining -= slice;
+
+		if (last_slice)
+			break;
+	}
+
+	m_total_in += len;
+	return true;
+#else
+	return false;
+#endif
+}
+
+Inflate::Inflate()
+    : m_total_in(0)
+    , m_total_out(0)
+{
+}
+
+Inflate::Inflate(Inflate&&) = default;
+
+Inflate::~Inflate() = default;
+
+Inflate& Inflate::operator=(Inflate&&) = default;
+
+Inflate::operator bool() const
+{
+	return m_state.get();
+}
+
+bool Inflate::operator!() const
+{
+	return !m_state;
+}
+
+bool Inflate::init(Format format, int window_bits)
+{
+	m_state.reset();
+	m_total_in  = 0;
+	m_total_out = 0;
+
+#if (defined HAVE_ZLIB)
+	window_bits = std::clamp(window_bits, 8, 15);
+
+	std::unique_ptr<State> state(new State);
+	if (inflateInit2(&state->stream, to_zlib_window_bits(format, window_bits)) != Z_OK)
+		return false;
+
+	m_state = std::move(state);
+	return true;
+#else
+	return false;
+#endif
+}
+
+void Inflate::deinit()
+{
+	m_state.reset();
+}
+
+void Inflate::reset()
+{
+	if (!m_state)
+		return;
+
+	m_state->finished = false;
+#if (defined HAVE_ZLIB)
+	inflateReset(&m_state->stream);
+#endif
+}
+
+bool Inflate::write(void const* data, std::size_t len, BlobBuffer& output, std::size_t max_output)
+{
+	if (!m_state)
+		return false;
+
+#if (defined HAVE_ZLIB)
+	z_stream& stream          = m_state->stream;
+	unsigned char const* next = static_cast<unsigned char const*>(data);
+	std::size_t remaining     = len;
+	std::size_t total_output  = 0;
+
+	while (remaining > 0 && !m_state->finished)
+	{
+		std::size_t const slice = std::min(remaining, MAX_INPUT_SLICE);
+
+		stream.next_in  = const_cast<Bytef*>(next);
+		stream.avail_in = uInt(slice);
+
+		int result;
+		do
+		{
+			// Compressed data typically expands a few times over
+			ensure_output_space(output, std::min(slice * 4, max_output - total_output));
+
+			// Offer one byte beyond the limit so an overflow can be told apart from an exact fit
+			std::size_t const allowed = std::min(max_output - total_output, std::size_t(UINT_MAX - 1)) + 1;
+			stream.next_out           = output.tail();
+			stream.avail_out          = uInt(std::min(output.space(), allowed));
+
+			std::size_t const offered = stream.avail_out;
+			result                    = inflate(&stream, Z_NO_FLUSH);
+
+			std::size_t const produced = offered - stream.avail_out;
+			output.added_to_tail(produced);
+			total_output += produced;
+			m_total_out  += produced;
+
+			if (result == Z_NEED_DICT || result == Z_DATA_ERROR || result == Z_MEM_ERROR || result == Z_STREAM_ERROR)
+				return false;
+
+			if (total_output > max_output)
+				return false;
+
+			if (result == Z_STREAM_END)
+			{
+				m_state->finished = true;
+				break;
+			}
+		}
+		while (stream.avail_out == 0);
+
+		std::size_t const used  = slice - stream.avail_in;
+		next                   += used;
+		remaining              -= used;
+		m_total_in             += used;
+
+		// No progress possible without more input
+		if (used == 0 && !m_state->finished)
+			break;
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool Inflate::is_finished() const
+{
+	return m_state && m_state->finished;
+}
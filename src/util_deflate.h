@@ -0,0 +1,115 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DECK_ASSISTANT_UTIL_DEFLATE_H
+#define DECK_ASSISTANT_UTIL_DEFLATE_H
+
+#include <cstdint>
+#include <memory>
+
+namespace util
+{
+
+class BlobBuffer;
+
+// Streaming zlib compression. Without zlib available init() fails and the objects stay empty.
+class Deflate
+{
+public:
+	enum class Format : char
+	{
+		Raw,
+		Zlib,
+		Gzip,
+	};
+
+	enum class Flush : char
+	{
+		None,
+		Sync,
+		Finish,
+	};
+
+public:
+	Deflate();
+	Deflate(Deflate const&) = delete;
+	Deflate(Deflate&&);
+	~Deflate();
+
+	Deflate& operator=(Deflate const&) = delete;
+	Deflate& operator=(Deflate&&);
+	operator bool() const;
+	bool operator!() const;
+
+	static bool is_available();
+
+	bool init(Format format, int window_bits = 15, int level = -1);
+	void deinit();
+	void reset();
+
+	bool write(void const* data, std::size_t len, BlobBuffer& output, Flush flush = Flush::None);
+
+	inline std::uint64_t get_total_in() const { return m_total_in; }
+	inline std::uint64_t get_total_out() const { return m_total_out; }
+
+private:
+	struct State;
+	std::unique_ptr<State> m_state;
+	std::uint64_t m_total_in;
+	std::uint64_t m_total_out;
+};
+
+// Streaming zlib decompression, the counterpart of Deflate
+class Inflate
+{
+public:
+	using Format = Deflate::Format;
+
+public:
+	Inflate();
+	Inflate(Inflate const&) = delete;
+	Inflate(Inflate&&);
+	~Inflate();
+
+	Inflate& operator=(Inflate const&) = delete;
+	Inflate& operator=(Inflate&&);
+	operator bool() const;
+	bool operator!() const;
+
+	bool init(Format format, int window_bits = 15);
+	void deinit();
+	void reset();
+
+	// Fails on corrupt input or when the output would grow beyond max_output bytes
+	bool write(void const* data, std::size_t len, BlobBuffer& output, std::size_t max_output = SIZE_MAX);
+	bool is_finished() const;
+
+	inline std::uint64_t get_total_in() const { return m_total_in; }
+	inline std::uint64_t get_total_out() const { return m_total_out; }
+
+private:
+	struct State;
+	std::unique_ptr<State> m_state;
+	std::uint64_t m_total_in;
+	std::uint64_t m_total_out;
+};
+
+} // namespace util
+
+#endif // DECK_ASSISTANT_UTIL_DEFLATE_H
@@ -0,0 +1,146 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "util_blob.h"
+#include "util_deflate.h"
+#include <catch2/catch_test_macros.hpp>
+#include <string>
+#include <string_view>
+
+using namespace util;
+
+namespace
+{
+
+std::string_view to_view(BlobBuffer const& buffer)
+{
+	return std::string_view(reinterpret_cast<char const*>(buffer.data()), buffer.size());
+}
+
+std::string make_text(std::size_t len)
+{
+	std::string text;
+	text.reserve(len);
+	while (text.size() < len)
+		text += "{\"op\":7,\"d\":{\"eventType\":\"InputVolumeMeters\",\"eventIntent\":65536}}";
+	text.resize(len);
+	return text;
+}
+
+} // namespace
+
+TEST_CASE("Deflate", "[util]")
+{
+	Deflate deflate;
+	Inflate inflate;
+
+	REQUIRE(deflate.init(Deflate::Format::Raw) == Deflate::is_available());
+	REQUIRE(inflate.init(Inflate::Format::Raw) == Deflate::is_available());
+
+	if (!Deflate::is_available())
+		return;
+
+	SECTION("Raw roundtrip")
+	{
+		std::string const text = make_text(100000);
+
+		BlobBuffer compressed;
+		REQUIRE(deflate.write(text.data(), text.size(), compressed, Deflate::Flush::Sync));
+		REQUIRE(compressed.size() < text.size() / 10);
+		REQUIRE(deflate.get_total_in() == text.size());
+		REQUIRE(deflate.get_total_out() == compressed.size());
+
+		// A sync flush always ends in an empty stored block
+		REQUIRE(to_view(compressed).ends_with(std::string_view("\x00\x00\xff\xff", 4)));
+
+		BlobBuffer decompressed;
+		REQUIRE(inflate.write(compressed.data(), compressed.size(), decompressed));
+		REQUIRE(to_view(decompressed) == text);
+		REQUIRE(!inflate.is_finished());
+	}
+
+	SECTION("Context takeover")
+	{
+		std::string const text = make_text(1000);
+
+		BlobBuffer first;
+		REQUIRE(deflate.write(text.data(), text.size(), first, Deflate::Flush::Sync));
+
+		// The second message refers back to the first and compresses to almost nothing
+		BlobBuffer second;
+		REQUIRE(deflate.write(text.data(), text.size(), second, Deflate::Flush::Sync));
+		REQUIRE(second.size() < first.size());
+
+		BlobBuffer decompressed;
+		REQUIRE(inflate.write(first.data(), first.size(), decompressed));
+		decompressed.clear();
+		REQUIRE(inflate.write(second.data(), second.size(), decompressed));
+		REQUIRE(to_view(decompressed) == text);
+
+		// Without the shared history the second message can't be decoded
+		Inflate fresh;
+		REQUIRE(fresh.init(Inflate::Format::Raw));
+		decompressed.clear();
+		bool const ok = fresh.write(second.data(), second.size(), decompressed);
+		REQUIRE((!ok || to_view(decompressed) != text));
+	}
+
+	SECTION("Gzip roundtrip")
+	{
+		std::string const text = make_text(5000);
+
+		REQUIRE(deflate.init(Deflate::Format::Gzip));
+		REQUIRE(inflate.init(Inflate::Format::Gzip));
+
+		BlobBuffer compressed;
+		REQUIRE(deflate.write(text.data(), text.size(), compressed, Deflate::Flush::Finish));
+		REQUIRE(compressed.size() > 2);
+		REQUIRE(compressed.data()[0] == 0x1f);
+		REQUIRE(compressed.data()[1] == 0x8b);
+
+		BlobBuffer decompressed;
+		REQUIRE(inflate.write(compressed.data(), compressed.size(), decompressed));
+		REQUIRE(inflate.is_finished());
+		REQUIRE(to_view(decompressed) == text);
+	}
+
+	SECTION("Output limit")
+	{
+		std::string const text = make_text(10000);
+
+		BlobBuffer compressed;
+		REQUIRE(deflate.write(text.data(), text.size(), compressed, Deflate::Flush::Sync));
+
+		BlobBuffer decompressed;
+		REQUIRE(!inflate.write(compressed.data(), compressed.size(), decompressed, 9999));
+
+		REQUIRE(inflate.init(Inflate::Format::Raw));
+		decompressed.clear();
+		REQUIRE(inflate.write(compressed.data(), compressed.size(), decompressed, 10000));
+		REQUIRE(decompressed.size() == 10000);
+	}
+
+	SECTION("Corrupt input")
+	{
+		unsigned char const garbage[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+		BlobBuffer decompressed;
+		REQUIRE(!inflate.write(garbage, sizeof(garbage), decompressed));
+	}
+}
@@ -0,0 +1,144 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "util_hid.h"
+#include <SDL_error.h>
+#include <SDL_hidapi.h>
+#include <codecvt>
+#include <locale>
+
+namespace
+{
+
+std::string convert(wchar_t const* wstr)
+{
+	if (!wstr)
+		return std::string();
+
+	static std::wstring_convert<std::codecvt_utf8<wchar_t>> convert;
+	return convert.to_bytes(wstr);
+}
+
+class SdlHidDevice : public util::HidDevice
+{
+public:
+	SdlHidDevice(SDL_hid_device* device)
+	    : m_device(device)
+	{
+	}
+
+	~SdlHidDevice()
+	{
+		SDL_hid_close(m_device);
+	}
+
+	int write(unsigned char const* data, std::size_t length) override
+	{
+		return SDL_hid_write(m_device, data, length);
+	}
+
+	int read_timeout(unsigned char* data, std::size_t length, int milliseconds) override
+	{
+		return SDL_hid_read_timeout(m_device, data, length, milliseconds);
+	}
+
+	int send_feature_report(unsigned char const* data, std::size_t length) override
+	{
+		return SDL_hid_send_feature_report(m_device, data, length);
+	}
+
+private:
+	SDL_hid_device* m_device;
+};
+
+class SdlHidBackend : public util::HidBackend
+{
+public:
+	std::uint32_t get_change_count() override
+	{
+		return SDL_hid_device_change_count();
+	}
+
+	std::vector<util::HidDeviceInfo> enumerate(unsigned short vendor_id, unsigned short product_id) override
+	{
+		std::vector<util::HidDeviceInfo> result;
+
+		SDL_hid_device_info* device_list = SDL_hid_enumerate(vendor_id, product_id);
+		for (SDL_hid_device_info* info = device_list; info; info = info->next)
+		{
+			util::HidDeviceInfo& device = result.emplace_back();
+			device.path                 = info->path;
+			device.serial_number        = convert(info->serial_number);
+			device.vendor_id            = info->vendor_id;
+			device.product_id           = info->product_id;
+		}
+		SDL_hid_free_enumeration(device_list);
+
+		return result;
+	}
+
+	std::unique_ptr<util::HidDevice> open(util::HidDeviceInfo const& info) override
+	{
+		SDL_hid_device* device = SDL_hid_open_path(info.path.c_str(), false);
+		if (!device)
+			return nullptr;
+
+		return std::make_unique<SdlHidDevice>(device);
+	}
+
+	std::string_view get_last_error() const override
+	{
+		return SDL_GetError();
+	}
+};
+
+} // namespace
+
+namespace util
+{
+
+HidDevice::~HidDevice() = default;
+
+HidBackend::HidBackend()
+    : m_devices_change_count(-1)
+    , m_devices_vendor_id(0)
+{
+}
+
+HidBackend::~HidBackend() = default;
+
+std::vector<HidDeviceInfo> const& HidBackend::get_devices(unsigned short vendor_id)
+{
+	std::uint32_t const changes = get_change_count();
+	if (changes != m_devices_change_count || vendor_id != m_devices_vendor_id)
+	{
+		m_devices_change_count = changes;
+		m_devices_vendor_id    = vendor_id;
+		m_devices              = enumerate(vendor_id, 0);
+	}
+	return m_devices;
+}
+
+std::shared_ptr<HidBackend> HidBackend::get_default()
+{
+	static std::shared_ptr<HidBackend> instance = std::make_shared<SdlHidBackend>();
+	return instance;
+}
+
+} // namespace util
@@ -0,0 +1,75 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DECK_ASSISTANT_UTIL_HID_H
+#define DECK_ASSISTANT_UTIL_HID_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace util
+{
+
+struct HidDeviceInfo
+{
+	std::string path;
+	std::string serial_number;
+	unsigned short vendor_id;
+	unsigned short product_id;
+};
+
+class HidDevice
+{
+public:
+	virtual ~HidDevice();
+
+	// Semantics follow SDL_hid: number of bytes transferred, or -1 on error
+	virtual int write(unsigned char const* data, std::size_t length)                   = 0;
+	virtual int read_timeout(unsigned char* data, std::size_t length, int milliseconds) = 0;
+	virtual int send_feature_report(unsigned char const* data, std::size_t length)     = 0;
+};
+
+class HidBackend
+{
+public:
+	HidBackend();
+	virtual ~HidBackend();
+
+	// Enumeration shared by all users of this backend, rescanned only when the device change count moves
+	std::vector<HidDeviceInfo> const& get_devices(unsigned short vendor_id);
+
+	virtual std::uint32_t get_change_count()                                                          = 0;
+	virtual std::vector<HidDeviceInfo> enumerate(unsigned short vendor_id, unsigned short product_id) = 0;
+	virtual std::unique_ptr<HidDevice> open(HidDeviceInfo const& info)                                = 0;
+	virtual std::string_view get_last_error() const                                                   = 0;
+
+	static std::shared_ptr<HidBackend> get_default();
+
+private:
+	std::uint32_t m_devices_change_count;
+	unsigned short m_devices_vendor_id;
+	std::vector<HidDeviceInfo> m_devices;
+};
+
+} // namespace util
+
+#endif // DECK_ASSISTANT_UTIL_HID_H
@@ -0,0 +1,359 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "util_hid_mock.h"
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+
+constexpr unsigned short const ELGATO_VENDOR_ID = 0x0fd9;
+constexpr std::size_t const PACKET_SIZE         = 1024;
+constexpr std::size_t const PACKET_HEADER_SIZE  = 8;
+constexpr std::size_t const INPUT_REPORT_SIZE   = 512;
+
+// Only the button count differs, every model is held to the V2/XL report formats the connector sends
+struct MockModel
+{
+	unsigned short product_id;
+	unsigned char button_count;
+};
+
+constexpr MockModel const MODELS[] = {
+	{0x0060,  15},
+	{ 0x006d, 15},
+	{ 0x0063, 6 },
+	{ 0x006c, 32},
+};
+
+MockModel const* find_model(unsigned short product_id)
+{
+	for (MockModel const& model : MODELS)
+		if (model.product_id == product_id)
+			return &model;
+	return nullptr;
+}
+
+} // namespace
+
+namespace util
+{
+
+class HidMock::DeviceHandle : public HidDevice
+{
+public:
+	DeviceHandle(std::shared_ptr<Device> device)
+	    : m_device(std::move(device))
+	{
+	}
+
+	int write(unsigned char const* data, std::size_t length) override
+	{
+		return m_device->handle_write(data, length);
+	}
+
+	int read_timeout(unsigned char* data, std::size_t length, int milliseconds) override
+	{
+		return m_device->handle_read(data, length);
+	}
+
+	int send_feature_report(unsigned char const* data, std::size_t length) override
+	{
+		return m_device->handle_feature_report(data, length);
+	}
+
+private:
+	std::shared_ptr<Device> m_device;
+};
+
+HidMock::Device::Device(unsigned short product_id, std::string_view const& serial_number)
+    : m_product_id(product_id)
+    , m_button_count(0)
+    , m_serial_number(serial_number)
+    , m_plugged(true)
+    , m_record_packets(true)
+    , m_replay_interval(Clock::duration::zero())
+    , m_brightness(-1)
+    , m_packets_written(0)
+    , m_bytes_written(0)
+    , m_protocol_errors(0)
+    , m_reports_delivered(0)
+    , m_total_input_latency(Clock::duration::zero())
+    , m_max_input_latency(Clock::duration::zero())
+{
+	MockModel const* model = find_model(product_id);
+	if (model)
+		m_button_count = model->button_count;
+
+	m_button_states.resize(m_button_count, false);
+}
+
+void HidMock::Device::set_replay_rate(unsigned int reports_per_second)
+{
+	if (reports_per_second == 0)
+		m_replay_interval = Clock::duration::zero();
+	else
+		m_replay_interval = std::chrono::duration_cast<Clock::duration>(std::chrono::seconds(1)) / reports_per_second;
+}
+
+void HidMock::Device::queue_button_states(std::vector<bool> const& states)
+{
+	Clock::time_point available = Clock::now();
+	if (!m_pending_reports.empty() && m_pending_reports.back().available + m_replay_interval > available)
+		available = m_pending_reports.back().available + m_replay_interval;
+	else if (m_last_report_available + m_replay_interval > available)
+		available = m_last_report_available + m_replay_interval;
+
+	PendingReport& report = m_pending_reports.emplace_back();
+	report.available      = available;
+	report.states         = states;
+	report.states.resize(m_button_count, false);
+	m_button_states = report.states;
+}
+
+void HidMock::Device::queue_press(unsigned char button)
+{
+	std::vector<bool> states = m_button_states;
+	if (button < states.size())
+		states[button] = true;
+	queue_button_states(states);
+}
+
+void HidMock::Device::queue_release(unsigned char button)
+{
+	std::vector<bool> states = m_button_states;
+	if (button < states.size())
+		states[button] = false;
+	queue_button_states(states);
+}
+
+void HidMock::Device::set_record_packets(bool record)
+{
+	m_record_packets = record;
+}
+
+void HidMock::Device::clear_recording()
+{
+	m_packets.clear();
+	m_images.clear();
+	m_packets_written     = 0;
+	m_bytes_written       = 0;
+	m_protocol_errors     = 0;
+	m_reports_delivered   = 0;
+	m_total_input_latency = Clock::duration::zero();
+	m_max_input_latency   = Clock::duration::zero();
+}
+
+int HidMock::Device::handle_write(unsigned char const* data, std::size_t length)
+{
+	if (!m_plugged)
+		return -1;
+
+	Clock::time_point const now = Clock::now();
+
+	++m_packets_written;
+	m_bytes_written += length;
+
+	if (m_record_packets)
+	{
+		Packet& packet   = m_packets.emplace_back();
+		packet.timestamp = now;
+		packet.data.assign(data, data + length);
+	}
+
+	if (length != PACKET_SIZE || data[0] != 0x02 || data[1] != 0x07 || data[2] >= m_button_count)
+	{
+		++m_protocol_errors;
+		return length;
+	}
+
+	unsigned char const button       = data[2];
+	bool const last_packet           = data[3] != 0;
+	std::uint16_t const slice_length = data[4] | (data[5] << 8);
+	std::uint16_t const iteration    = data[6] | (data[7] << 8);
+
+	if (slice_length > PACKET_SIZE - PACKET_HEADER_SIZE)
+	{
+		++m_protocol_errors;
+		return length;
+	}
+
+	auto partial = std::find_if(m_partial_uploads.begin(), m_partial_uploads.end(), [button](PartialUpload const& item) { return item.upload.button == button; });
+	if (iteration == 0)
+	{
+		// A new upload for the same button silently replaces any unfinished one, like the hardware does
+		if (partial == m_partial_uploads.end())
+			partial = m_partial_uploads.emplace(m_partial_uploads.end());
+
+		partial->next_iteration = 0;
+		partial->upload.button  = button;
+		partial->upload.started = now;
+		partial->upload.data.clear();
+	}
+	else if (partial == m_partial_uploads.end() || partial->next_iteration != iteration)
+	{
+		++m_protocol_errors;
+		return length;
+	}
+
+	partial->upload.data.insert(partial->upload.data.end(), data + PACKET_HEADER_SIZE, data + PACKET_HEADER_SIZE + slice_length);
+	++partial->next_iteration;
+
+	if (last_packet)
+	{
+		partial->upload.completed = now;
+		m_images.push_back(std::move(partial->upload));
+		m_partial_uploads.erase(partial);
+	}
+
+	return length;
+}
+
+int HidMock::Device::handle_read(unsigned char* data, std::size_t length)
+{
+	if (!m_plugged)
+		return -1;
+
+	if (m_pending_reports.empty())
+		return 0;
+
+	Clock::time_point const now = Clock::now();
+	PendingReport& report       = m_pending_reports.front();
+	if (report.available > now)
+		return 0;
+
+	std::size_t const report_size = std::min(length, INPUT_REPORT_SIZE);
+	std::memset(data, 0, report_size);
+
+	if (report_size >= 4)
+	{
+		data[0] = 0x01;
+		data[1] = 0x00;
+		data[2] = m_button_count & 0xff;
+		data[3] = m_button_count >> 8;
+
+		for (std::size_t idx = 0; idx < report.states.size() && 4 + idx < report_size; ++idx)
+			data[4 + idx] = report.states[idx] ? 1 : 0;
+	}
+
+	Clock::duration const latency  = now - report.available;
+	m_total_input_latency         += latency;
+	m_max_input_latency            = std::max(m_max_input_latency, latency);
+	m_last_report_available        = report.available;
+	++m_reports_delivered;
+
+	m_pending_reports.pop_front();
+	return report_size;
+}
+
+int HidMock::Device::handle_feature_report(unsigned char const* data, std::size_t length)
+{
+	if (!m_plugged)
+		return -1;
+
+	if (length < 3 || data[0] != 0x03 || data[1] != 0x08 || data[2] > 100)
+		++m_protocol_errors;
+	else
+		m_brightness = data[2];
+
+	return length;
+}
+
+HidMock::HidMock()
+    : m_change_count(0)
+    , m_enumerate_count(0)
+{
+}
+
+HidMock::~HidMock() = default;
+
+bool HidMock::is_supported_model(unsigned short product_id)
+{
+	return find_model(product_id) != nullptr;
+}
+
+std::shared_ptr<HidMock::Device> HidMock::add_device(unsigned short product_id, std::string_view const& serial_number)
+{
+	std::shared_ptr<Device> device = std::make_shared<Device>(product_id, serial_number);
+	m_devices.push_back(device);
+	++m_change_count;
+	return device;
+}
+
+void HidMock::remove_device(std::shared_ptr<Device> const& device)
+{
+	auto iter = std::find(m_devices.begin(), m_devices.end(), device);
+	if (iter != m_devices.end())
+	{
+		(*iter)->m_plugged = false;
+		m_devices.erase(iter);
+		++m_change_count;
+	}
+}
+
+std::uint32_t HidMock::get_change_count()
+{
+	return m_change_count;
+}
+
+std::vector<HidDeviceInfo> HidMock::enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	++m_enumerate_count;
+
+	std::vector<HidDeviceInfo> result;
+	if (vendor_id != 0 && vendor_id != ELGATO_VENDOR_ID)
+		return result;
+
+	for (std::shared_ptr<Device> const& device : m_devices)
+	{
+		if (product_id != 0 && product_id != device->m_product_id)
+			continue;
+
+		HidDeviceInfo& info = result.emplace_back();
+		info.path           = "mock:" + device->m_serial_number;
+		info.serial_number  = device->m_serial_number;
+		info.vendor_id      = ELGATO_VENDOR_ID;
+		info.product_id     = device->m_product_id;
+	}
+
+	return result;
+}
+
+std::unique_ptr<HidDevice> HidMock::open(HidDeviceInfo const& info)
+{
+	for (std::shared_ptr<Device> const& device : m_devices)
+	{
+		if ("mock:" + device->m_serial_number == info.path)
+		{
+			m_last_error.clear();
+			return std::make_unique<DeviceHandle>(device);
+		}
+	}
+
+	m_last_error = "No such mock device: " + info.path;
+	return nullptr;
+}
+
+std::string_view HidMock::get_last_error() const
+{
+	return m_last_error;
+}
+
+} // namespace util
@@ -0,0 +1,165 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DECK_ASSISTANT_UTIL_HID_MOCK_H
+#define DECK_ASSISTANT_UTIL_HID_MOCK_H
+
+#include "util_hid.h"
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace util
+{
+
+/**
+ * HID backend emulating Elgato Stream Deck devices without any hardware attached.
+ *
+ * Every packet written to a device is validated and recorded, and scripted button reports are
+ * replayed at a configurable rate so that upload throughput and input latency can be measured
+ * in headless tests. Like the connector, the mock speaks the V2/XL protocol (1024 byte image
+ * packets, 0x03 0x08 brightness reports) to every model; the models differ in button count
+ * only, the older report layouts of the Original and Mini are not emulated.
+ */
+class HidMock : public HidBackend
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	struct Packet
+	{
+		Clock::time_point timestamp;
+		std::vector<unsigned char> data;
+	};
+
+	struct ImageUpload
+	{
+		unsigned char button;
+		std::vector<unsigned char> data;
+		Clock::time_point started;
+		Clock::time_point completed;
+	};
+
+	class DeviceHandle;
+
+	class Device
+	{
+	public:
+		Device(unsigned short product_id, std::string_view const& serial_number);
+
+		inline unsigned short get_product_id() const { return m_product_id; }
+		inline std::string const& get_serial_number() const { return m_serial_number; }
+		inline unsigned char get_button_count() const { return m_button_count; }
+		inline bool is_plugged() const { return m_plugged; }
+
+		// Scripted input, buttons are zero-based like the HID reports
+		void set_replay_rate(unsigned int reports_per_second);
+		void queue_button_states(std::vector<bool> const& states);
+		void queue_press(unsigned char button);
+		void queue_release(unsigned char button);
+		inline std::size_t get_pending_reports() const { return m_pending_reports.size(); }
+
+		// Recorded output
+		void set_record_packets(bool record);
+		void clear_recording();
+		inline std::vector<Packet> const& get_packets() const { return m_packets; }
+		inline std::vector<ImageUpload> const& get_images() const { return m_images; }
+		inline int get_brightness() const { return m_brightness; }
+		inline std::size_t get_packets_written() const { return m_packets_written; }
+		inline std::size_t get_bytes_written() const { return m_bytes_written; }
+		inline std::size_t get_protocol_errors() const { return m_protocol_errors; }
+
+		// Input statistics, latency is measured from the moment a report becomes available until it is read
+		inline std::size_t get_reports_delivered() const { return m_reports_delivered; }
+		inline Clock::duration get_total_input_latency() const { return m_total_input_latency; }
+		inline Clock::duration get_max_input_latency() const { return m_max_input_latency; }
+
+	private:
+		friend class HidMock;
+		friend class DeviceHandle;
+
+		struct PendingReport
+		{
+			Clock::time_point available;
+			std::vector<bool> states;
+		};
+
+		struct PartialUpload
+		{
+			std::uint16_t next_iteration;
+			ImageUpload upload;
+		};
+
+		int handle_write(unsigned char const* data, std::size_t length);
+		int handle_read(unsigned char* data, std::size_t length);
+		int handle_feature_report(unsigned char const* data, std::size_t length);
+
+		unsigned short m_product_id;
+		unsigned char m_button_count;
+		std::string m_serial_number;
+		bool m_plugged;
+		bool m_record_packets;
+
+		Clock::duration m_replay_interval;
+		Clock::time_point m_last_report_available;
+		std::vector<bool> m_button_states;
+		std::deque<PendingReport> m_pending_reports;
+
+		int m_brightness;
+		std::vector<Packet> m_packets;
+		std::vector<PartialUpload> m_partial_uploads;
+		std::vector<ImageUpload> m_images;
+		std::size_t m_packets_written;
+		std::size_t m_bytes_written;
+		std::size_t m_protocol_errors;
+
+		std::size_t m_reports_delivered;
+		Clock::duration m_total_input_latency;
+		Clock::duration m_max_input_latency;
+	};
+
+public:
+	HidMock();
+	~HidMock();
+
+	static bool is_supported_model(unsigned short product_id);
+
+	std::shared_ptr<Device> add_device(unsigned short product_id, std::string_view const& serial_number);
+	void remove_device(std::shared_ptr<Device> const& device);
+	inline std::size_t get_enumerate_count() const { return m_enumerate_count; }
+
+	std::uint32_t get_change_count() override;
+	std::vector<HidDeviceInfo> enumerate(unsigned short vendor_id, unsigned short product_id) override;
+	std::unique_ptr<HidDevice> open(HidDeviceInfo const& info) override;
+	std::string_view get_last_error() const override;
+
+private:
+	std::vector<std::shared_ptr<Device>> m_devices;
+	std::uint32_t m_change_count;
+	std::size_t m_enumerate_count;
+	std::string m_last_error;
+};
+
+} // namespace util
+
+#endif // DECK_ASSISTANT_UTIL_HID_MOCK_H
@@ -0,0 +1,692 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "util_http_parser.h"
+#include "util_text.h"
+#include <charconv>
+
+namespace
+{
+
+// Longest status, header or chunk size line accepted before giving up on the response
+constexpr std::size_t const MAX_LINE_SIZE = 64 * 1024;
+
+// Refuse to inflate a compressed body beyond this, protects against decompression bombs
+constexpr std::size_t const MAX_INFLATED_BODY_SIZE = 512 * 1024 * 1024;
+
+} // namespace
+
+namespace util
+{
+
+HttpResponseParser::HttpResponseParser()
+    : m_decompress(false)
+    , m_inflate_format(Inflate::Format::Gzip)
+{
+	reset();
+}
+
+void HttpResponseParser::reset()
+{
+	m_state            = State::StatusLine;
+	m_started          = false;
+	m_headers_complete = false;
+	m_chunked          = false;
+	m_until_eof        = false;
+	m_compressed       = false;
+	m_status_code      = 0;
+	m_remaining        = 0;
+	m_body_received    = 0;
+	m_body_decoded     = 0;
+	m_http_version.clear();
+	m_status_message.clear();
+	m_error.clear();
+	m_headers.clear();
+	m_body.clear();
+}
+
+std::size_t HttpResponseParser::feed(std::string_view const& input)
+{
+	std::size_t offset = 0;
+
+	while (offset < input.size())
+	{
+		switch (m_state)
+		{
+			case State::StatusLine:
+			case State::Headers:
+			case State::ChunkSize:
+			case State::ChunkDataEnd:
+			case State::Trailers:
+			{
+				std::size_t const eol = input.find('\n', offset);
+				if (eol == std::string_view::npos)
+				{
+					if (input.size() - offset > MAX_LINE_SIZE)
+						set_error("HTTP line too long");
+
+					return offset;
+				}
+
+				std::string_view line = input.substr(offset, eol - offset);
+				if (line.ends_with('\r'))
+					line.remove_suffix(1);
+
+				offset = eol + 1;
+				parse_line(line);
+				break;
+			}
+
+			case State::Body:
+			case State::ChunkData:
+			{
+				std::size_t len = input.size() - offset;
+				if (!m_until_eof && len > m_remaining)
+					len = m_remaining;
+
+				append_body(input.data() + offset, len);
+				offset += len;
+
+				if (!m_until_eof && m_state != State::Error)
+				{
+					m_remaining -= len;
+					if (m_remaining == 0)
+					{
+						if (m_chunked)
+							m_state = State::ChunkDataEnd;
+						else
+							body_complete();
+					}
+				}
+				break;
+			}
+
+			case State::Done:
+			case State::Error:
+				return offset;
+		}
+	}
+
+	return offset;
+}
+
+void HttpResponseParser::feed_eof()
+{
+	if (m_state == State::Done || m_state == State::Error)
+		return;
+
+	if (m_state == State::Body && m_until_eof)
+		body_complete();
+	else if (is_idle())
+		set_error("Connection closed by peer");
+	else
+		set_error("EOF before response finished");
+}
+
+std::string_view HttpResponseParser::find_header(std::string_view const& name) const
+{
+	for (auto const& header : m_headers)
+	{
+		if (nocase_equals(header.first, name))
+			return header.second;
+	}
+	return std::string_view();
+}
+
+bool HttpResponseParser::is_keep_alive() const
+{
+	// Without a length the end of the body is the end of the connection
+	if (m_until_eof)
+		return false;
+
+	std::string_view const connection = find_header("Connection");
+	if (m_http_version == "HTTP/1.0")
+		return http_has_token(connection, "keep-alive");
+
+	return !http_has_token(connection, "close");
+}
+
+void HttpResponseParser::parse_line(std::string_view const& line)
+{
+	switch (m_state)
+	{
+		case State::StatusLine:
+			parse_status_line(line);
+			break;
+
+		case State::Headers:
+			parse_header_line(line);
+			break;
+
+		case State::ChunkSize:
+			parse_chunk_size(line);
+			break;
+
+		case State::ChunkDataEnd:
+			if (line.empty())
+				m_state = State::ChunkSize;
+			else
+				set_error("Invalid chunk terminator");
+			break;
+
+		case State::Trailers:
+			// Trailer fields are not interesting to anyone here
+			if (line.empty())
+				body_complete();
+			break;
+
+		default:
+			break;
+	}
+}
+
+void HttpResponseParser::parse_status_line(std::string_view const& line)
+{
+	// Be lenient about stray empty lines between responses
+	if (line.empty() && !m_started)
+		return;
+
+	m_started = true;
+
+	auto [version, remainder] = split1(line, " ", false);
+	auto [code, message]      = split1(remainder, " ", false);
+
+	if (!version.starts_with("HTTP/") || code.size() != 3)
+	{
+		set_error("Invalid HTTP start line");
+		return;
+	}
+
+	char const* first = code.data();
+	char const* last  = first + code.size();
+	auto result       = std::from_chars(first, last, m_status_code, 10);
+	if (result.ec != std::errc() || result.ptr != last)
+	{
+		set_error("Invalid HTTP status code");
+		return;
+	}
+
+	m_http_version   = version;
+	m_status_message = message;
+	m_state          = State::Headers;
+}
+
+void HttpResponseParser::parse_header_line(std::string_view const& line)
+{
+	if (line.empty())
+	{
+		headers_complete();
+		return;
+	}
+
+	// Obsolete line folding continues the previous value
+	if (line.front() == ' ' || line.front() == '\t')
+	{
+		if (m_headers.empty())
+		{
+			set_error("Invalid HTTP header");
+			return;
+		}
+
+		m_headers.back().second += ' ';
+		m_headers.back().second += trim(line);
+		return;
+	}
+
+	std::size_t const colon = line.find(':');
+	if (colon == 0 || colon == std::string_view::npos || line.substr(0, colon).find_first_of(" \t") != std::string_view::npos)
+	{
+		set_error("Invalid HTTP header");
+		return;
+	}
+
+	m_headers.emplace_back(line.substr(0, colon), trim(line.substr(colon + 1)));
+}
+
+void HttpResponseParser::parse_chunk_size(std::string_view const& line)
+{
+	std::string_view const size_str = trim(line.substr(0, line.find(';')));
+
+	std::uint64_t size = 0;
+	char const* first  = size_str.data();
+	char const* last   = first + size_str.size();
+	auto result        = std::from_chars(first, last, size, 16);
+	if (size_str.empty() || result.ec != std::errc() || result.ptr != last)
+	{
+		set_error("Invalid chunk size");
+		return;
+	}
+
+	if (size == 0)
+	{
+		m_state = State::Trailers;
+	}
+	else
+	{
+		m_remaining = size;
+		m_state     = State::ChunkData;
+	}
+}
+
+void HttpResponseParser::headers_complete()
+{
+	// Interim responses (100 Continue, 103 Early Hints) are followed by the real one
+	if (m_status_code >= 100 && m_status_code < 200 && m_status_code != 101)
+	{
+		m_headers.clear();
+		m_status_code = 0;
+		m_state       = State::StatusLine;
+		return;
+	}
+
+	m_headers_complete = true;
+
+	if (m_status_code == 101 || m_status_code == 204 || m_status_code == 304)
+	{
+		m_state = State::Done;
+		return;
+	}
+
+	if (m_decompress)
+	{
+		std::string_view const encoding = trim(find_header("Content-Encoding"));
+
+		Inflate::Format format = m_inflate_format;
+		if (nocase_equals(encoding, "gzip") || nocase_equals(encoding, "x-gzip"))
+		{
+			format       = Inflate::Format::Gzip;
+			m_compressed = true;
+		}
+		else if (nocase_equals(encoding, "deflate"))
+		{
+			format       = Inflate::Format::Zlib;
+			m_compressed = true;
+		}
+
+		if (m_compressed)
+		{
+			// Keep the zlib state around for the next response on this connection
+			if (m_inflate && format == m_inflate_format)
+			{
+				m_inflate.reset();
+			}
+			else if (m_inflate.init(format))
+			{
+				m_inflate_format = format;
+			}
+			else
+			{
+				set_error("Failed to initialise decompression");
+				return;
+			}
+		}
+	}
+
+	if (http_has_token(find_header("Transfer-Encoding"), "chunked"))
+	{
+		m_chunked = true;
+		m_state   = State::ChunkSize;
+		return;
+	}
+
+	std::string_view const content_length = find_header("Content-Length");
+	if (content_length.empty())
+	{
+		m_until_eof = true;
+		m_state     = State::Body;
+		return;
+	}
+
+	char const* first = content_length.data();
+	char const* last  = first + content_length.size();
+	auto result       = std::from_chars(first, last, m_remaining, 10);
+	if (result.ec != std::errc() || result.ptr != last)
+	{
+		set_error("Invalid Content-Length in response");
+		return;
+	}
+
+	m_state = m_remaining > 0 ? State::Body : State::Done;
+}
+
+void HttpResponseParser::append_body(char const* data, std::size_t len)
+{
+	m_body_received += len;
+
+	if (!m_compressed)
+	{
+		m_body.append(data, len);
+		m_body_decoded += len;
+		return;
+	}
+
+	m_inflated.clear();
+	if (!m_inflate.write(data, len, m_inflated, MAX_INFLATED_BODY_SIZE - m_body_decoded))
+	{
+		set_error("Invalid compressed response body");
+		return;
+	}
+
+	m_body.append(reinterpret_cast<char const*>(m_inflated.data()), m_inflated.size());
+	m_body_decoded += m_inflated.size();
+}
+
+void HttpResponseParser::body_complete()
+{
+	if (m_compressed && !m_inflate.is_finished())
+		set_error("Truncated compressed response body");
+	else
+		m_state = State::Done;
+}
+
+void HttpResponseParser::set_error(std::string_view const& error)
+{
+	m_error = error;
+	m_state = State::Error;
+}
+
+HttpStreamSplitter::HttpStreamSplitter()
+{
+	reset(Format::Lines);
+}
+
+void HttpStreamSplitter::reset(Format format)
+{
+	m_format   = format;
+	m_has_data = false;
+	m_partial.clear();
+	m_data.clear();
+	m_event.clear();
+}
+
+void HttpStreamSplitter::feed(std::string_view const& input, Callback const& callback)
+{
+	std::size_t offset = 0;
+
+	for (;;)
+	{
+		std::size_t const eol = input.find('\n', offset);
+		if (eol == std::string_view::npos)
+			break;
+
+		std::string_view line = input.substr(offset, eol - offset);
+		offset                = eol + 1;
+
+		if (!m_partial.empty())
+		{
+			m_partial += line;
+			line = m_partial;
+		}
+
+		if (line.ends_with('\r'))
+			line.remove_suffix(1);
+
+		process_line(line, callback);
+		m_partial.clear();
+	}
+
+	m_partial.append(input.substr(offset));
+}
+
+void HttpStreamSplitter::finish(Callback const& callback)
+{
+	if (!m_partial.empty())
+	{
+		std::string line;
+		line.swap(m_partial);
+		process_line(line, callback);
+	}
+
+	if (m_format == Format::ServerSentEvents)
+		dispatch_event(callback);
+}
+
+void HttpStreamSplitter::process_line(std::string_view const& line, Callback const& callback)
+{
+	if (m_format == Format::Lines)
+	{
+		if (!trim(line).empty())
+			callback(line, std::string_view());
+		return;
+	}
+
+	if (line.empty())
+	{
+		dispatch_event(callback);
+		return;
+	}
+
+	// Comment, commonly used as keep-alive
+	if (line.front() == ':')
+		return;
+
+	auto [field, value] = split1(line, ":", false);
+	if (value.starts_with(' '))
+		value.remove_prefix(1);
+
+	if (field == "data")
+	{
+		if (m_has_data)
+			m_data += '\n';
+
+		m_data += value;
+		m_has_data = true;
+	}
+	else if (field == "event")
+	{
+		m_event = value;
+	}
+}
+
+void HttpStreamSplitter::dispatch_event(Callback const& callback)
+{
+	if (m_has_data)
+		callback(m_data, m_event.empty() ? std::string_view("message") : std::string_view(m_event));
+
+	m_has_data = false;
+	m_data.clear();
+	m_event.clear();
+}
+
+bool http_decode_path(std::string_view const& path, std::string& decoded)
+{
+	decoded.clear();
+	decoded.reserve(path.size());
+
+	for (std::size_t idx = 0; idx < path.size(); ++idx)
+	{
+		char const ch = path[idx];
+		if (ch != '%')
+		{
+			decoded += ch;
+			continue;
+		}
+
+		bool ok = idx + 2 < path.size();
+		if (ok)
+		{
+			unsigned char const value = hex_to_char(path.data() + idx + 1, ok);
+			if (ok && value != 0)
+				decoded += char(value);
+			else
+				ok = false;
+		}
+
+		if (!ok)
+			return false;
+
+		idx += 2;
+	}
+
+	return true;
+}
+
+std::string_view http_content_type(std::string_view const& file_name)
+{
+	static constexpr std::pair<std::string_view, std::string_view> const types[] = {
+		{ ".html", "text/html; charset=utf-8" },
+		{ ".htm", "text/html; charset=utf-8" },
+		{ ".css", "text/css; charset=utf-8" },
+		{ ".js", "text/javascript; charset=utf-8" },
+		{ ".mjs", "text/javascript; charset=utf-8" },
+		{ ".json", "application/json" },
+		{ ".txt", "text/plain; charset=utf-8" },
+		{ ".xml", "application/xml" },
+		{ ".svg", "image/svg+xml" },
+		{ ".png", "image/png" },
+		{ ".jpg", "image/jpeg" },
+		{ ".jpeg", "image/jpeg" },
+		{ ".gif", "image/gif" },
+		{ ".webp", "image/webp" },
+		{ ".ico", "image/x-icon" },
+		{ ".woff", "font/woff" },
+		{ ".woff2", "font/woff2" },
+		{ ".ttf", "font/ttf" },
+		{ ".otf", "font/otf" },
+		{ ".mp3", "audio/mpeg" },
+		{ ".ogg", "audio/ogg" },
+		{ ".wav", "audio/wav" },
+		{ ".mp4", "video/mp4" },
+		{ ".webm", "video/webm" },
+		{ ".wasm", "application/wasm" },
+		{ ".lua", "text/plain; charset=utf-8" },
+	};
+
+	std::size_t const dot = file_name.rfind('.');
+	if (dot != std::string_view::npos && file_name.find('/', dot) == std::string_view::npos)
+	{
+		std::string_view const extension = file_name.substr(dot);
+		for (auto const& [type_extension, content_type] : types)
+		{
+			if (nocase_equals(extension, type_extension))
+				return content_type;
+		}
+	}
+
+	return "application/octet-stream";
+}
+
+std::string_view http_find_header(HttpMessage const& message, std::string_view const& name)
+{
+	for (auto const& [key, value] : message.headers)
+	{
+		if (nocase_equals(key, name))
+			return value;
+	}
+	return std::string_view();
+}
+
+bool http_has_token(std::string_view const& list, std::string_view const& token)
+{
+	bool found = false;
+	for_each_split(list, ",", [&](std::size_t, std::string_view const& part) -> bool {
+		found = nocase_equals(trim(part), token);
+		return found;
+	});
+	return found;
+}
+
+bool http_etag_matches(std::string_view const& if_none_match, std::string_view const& etag)
+{
+	bool found = false;
+	for_each_split(if_none_match, ",", [&](std::size_t, std::string_view const& part) -> bool {
+		std::string_view candidate = trim(part);
+
+		// Weak comparison is what If-None-Match asks for
+		if (candidate.starts_with("W/"))
+			candidate.remove_prefix(2);
+
+		found = candidate == "*" || candidate == etag;
+		return found;
+	});
+	return found;
+}
+
+std::string_view http_status_message(int status_code)
+{
+	switch (status_code)
+	{
+		case 200:
+			return "OK";
+		case 201:
+			return "Created";
+		case 202:
+			return "Accepted";
+		case 204:
+			return "No Content";
+		case 301:
+			return "Moved Permanently";
+		case 302:
+			return "Found";
+		case 303:
+			return "See Other";
+		case 304:
+			return "Not Modified";
+		case 307:
+			return "Temporary Redirect";
+		case 308:
+			return "Permanent Redirect";
+		case 400:
+			return "Bad Request";
+		case 401:
+			return "Unauthorized";
+		case 403:
+			return "Forbidden";
+		case 404:
+			return "Not Found";
+		case 405:
+			return "Method Not Allowed";
+		case 408:
+			return "Request Timeout";
+		case 409:
+			return "Conflict";
+		case 411:
+			return "Length Required";
+		case 413:
+			return "Content Too Large";
+		case 415:
+			return "Unsupported Media Type";
+		case 429:
+			return "Too Many Requests";
+		case 431:
+			return "Request Header Fields Too Large";
+		case 500:
+			return "Internal Server Error";
+		case 501:
+			return "Not Implemented";
+		case 502:
+			return "Bad Gateway";
+		case 503:
+			return "Service Unavailable";
+		case 505:
+			return "HTTP Version Not Supported";
+		default:
+			break;
+	}
+
+	if (status_code >= 200 && status_code < 300)
+		return "OK";
+	if (status_code >= 300 && status_code < 400)
+		return "Redirect";
+	if (status_code >= 400 && status_code < 500)
+		return "Client Error";
+	return "Server Error";
+}
+
+} // namespace util
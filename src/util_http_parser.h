@@ -0,0 +1,179 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DECK_ASSISTANT_UTIL_HTTP_PARSER_H
+#define DECK_ASSISTANT_UTIL_HTTP_PARSER_H
+
+#include "util_blob.h"
+#include "util_deflate.h"
+#include "util_text.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace util
+{
+
+// Resumable HTTP/1.x response parser. Input is fed as it arrives, every byte is looked at only once
+// and chunked or gzip/deflate encoded bodies are decoded on the fly. The parser stops at the end of
+// a response so pipelined responses can follow in the same buffer.
+class HttpResponseParser
+{
+public:
+	enum class State : char
+	{
+		StatusLine,
+		Headers,
+		Body,
+		ChunkSize,
+		ChunkData,
+		ChunkDataEnd,
+		Trailers,
+		Done,
+		Error,
+	};
+
+	using Headers = std::vector<std::pair<std::string, std::string>>;
+
+public:
+	HttpResponseParser();
+
+	void reset();
+
+	// Inflate gzip or deflate content encodings, needs zlib. Stays in effect across resets.
+	inline void set_decompression(bool enabled) { m_decompress = enabled; }
+
+	// Returns the number of bytes consumed, the rest is either an incomplete line or the next response
+	std::size_t feed(std::string_view const& input);
+
+	// The peer closed the connection, finishes an EOF-delimited body or fails the response
+	void feed_eof();
+
+	inline State get_state() const { return m_state; }
+	inline bool is_idle() const { return m_state == State::StatusLine && !m_started; }
+	inline bool is_done() const { return m_state == State::Done; }
+	inline bool has_error() const { return m_state == State::Error; }
+	inline bool has_headers() const { return m_headers_complete; }
+	inline bool is_chunked() const { return m_chunked; }
+	inline bool is_compressed() const { return m_compressed; }
+
+	// Body bytes as sent over the wire (without chunk framing) and after decompression
+	inline std::uint64_t get_body_received() const { return m_body_received; }
+	inline std::uint64_t get_body_decoded() const { return m_body_decoded; }
+
+	inline std::string const& get_error() const { return m_error; }
+	inline std::string const& get_http_version() const { return m_http_version; }
+	inline int get_status_code() const { return m_status_code; }
+	inline std::string const& get_status_message() const { return m_status_message; }
+	inline Headers const& get_headers() const { return m_headers; }
+
+	std::string_view find_header(std::string_view const& name) const;
+	bool is_keep_alive() const;
+
+	// Decoded body received so far. Callers streaming the body may take the contents out as it grows.
+	inline std::string& get_body() { return m_body; }
+
+private:
+	void parse_line(std::string_view const& line);
+	void parse_status_line(std::string_view const& line);
+	void parse_header_line(std::string_view const& line);
+	void parse_chunk_size(std::string_view const& line);
+	void headers_complete();
+	void append_body(char const* data, std::size_t len);
+	void body_complete();
+	void set_error(std::string_view const& error);
+
+	State m_state;
+	bool m_started;
+	bool m_headers_complete;
+	bool m_chunked;
+	bool m_until_eof;
+	bool m_decompress;
+	bool m_compressed;
+	int m_status_code;
+	std::uint64_t m_remaining;
+	std::uint64_t m_body_received;
+	std::uint64_t m_body_decoded;
+	std::string m_http_version;
+	std::string m_status_message;
+	std::string m_error;
+	Headers m_headers;
+	std::string m_body;
+	Inflate m_inflate;
+	Inflate::Format m_inflate_format;
+	BlobBuffer m_inflated;
+};
+
+// Splits a streamed body into newline-delimited records (NDJSON) or server-sent events
+class HttpStreamSplitter
+{
+public:
+	enum class Format : char
+	{
+		Lines,
+		ServerSentEvents,
+	};
+
+	// Receives one record, the event name is only set for server-sent events
+	using Callback = std::function<void(std::string_view const& data, std::string_view const& event)>;
+
+public:
+	HttpStreamSplitter();
+
+	void reset(Format format);
+	void feed(std::string_view const& input, Callback const& callback);
+
+	// Delivers whatever is left without a terminating newline
+	void finish(Callback const& callback);
+
+private:
+	void process_line(std::string_view const& line, Callback const& callback);
+	void dispatch_event(Callback const& callback);
+
+	Format m_format;
+	bool m_has_data;
+	std::string m_partial;
+	std::string m_data;
+	std::string m_event;
+};
+
+// Looks up a request header, ignoring case
+std::string_view http_find_header(HttpMessage const& message, std::string_view const& name);
+
+// Checks a comma separated header value, such as Connection, for a token while ignoring case
+bool http_has_token(std::string_view const& list, std::string_view const& token);
+
+// Decodes %XX escapes in a request path. Fails on malformed escapes and encoded NUL bytes.
+bool http_decode_path(std::string_view const& path, std::string& decoded);
+
+// Content-Type for a static file, based on its extension
+std::string_view http_content_type(std::string_view const& file_name);
+
+// Checks an entity tag against the value of an If-None-Match header
+bool http_etag_matches(std::string_view const& if_none_match, std::string_view const& etag);
+
+// Reason phrase to go with a response status code
+std::string_view http_status_message(int status_code);
+
+} // namespace util
+
+#endif // DECK_ASSISTANT_UTIL_HTTP_PARSER_H
@@ -0,0 +1,301 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "util_blob.h"
+#include "util_deflate.h"
+#include "util_http_parser.h"
+#include <catch2/catch_test_macros.hpp>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace util;
+
+TEST_CASE("HttpResponseParser", "[util]")
+{
+	HttpResponseParser parser;
+
+	SECTION("Content-Length")
+	{
+		std::string_view const response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\ncontent-length: 5\r\n\r\nHelloHTTP/1.1";
+
+		REQUIRE(parser.is_idle());
+		std::size_t const consumed = parser.feed(response);
+		REQUIRE(parser.is_done());
+		REQUIRE(consumed == response.size() - 8);
+		REQUIRE(parser.get_http_version() == "HTTP/1.1");
+		REQUIRE(parser.get_status_code() == 200);
+		REQUIRE(parser.get_status_message() == "OK");
+		REQUIRE(parser.get_headers().size() == 2);
+		REQUIRE(parser.find_header("Content-Length") == "5");
+		REQUIRE(parser.get_body() == "Hello");
+		REQUIRE(parser.is_keep_alive());
+	}
+
+	SECTION("Byte by byte")
+	{
+		std::string_view const response = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nHello\r\n7;ext=1\r\n, world\r\n0\r\nTrailer: yes\r\n\r\n";
+
+		std::string buffer;
+		for (char ch : response)
+		{
+			REQUIRE(!parser.is_done());
+			buffer += ch;
+			std::size_t const consumed = parser.feed(buffer);
+			buffer.erase(0, consumed);
+		}
+
+		REQUIRE(parser.is_done());
+		REQUIRE(buffer.empty());
+		REQUIRE(parser.is_chunked());
+		REQUIRE(parser.get_body() == "Hello, world");
+		REQUIRE(parser.find_header("Trailer").empty());
+	}
+
+	SECTION("Bodiless statuses")
+	{
+		std::string_view const response = "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 204 No Content\r\nContent-Length: 10\r\n\r\n";
+		REQUIRE(parser.feed(response) == response.size());
+		REQUIRE(parser.is_done());
+		REQUIRE(parser.get_status_code() == 204);
+		REQUIRE(parser.get_body().empty());
+	}
+
+	SECTION("Body until EOF")
+	{
+		std::string_view const response = "HTTP/1.0 200 OK\r\n\r\nsome data";
+		REQUIRE(parser.feed(response) == response.size());
+		REQUIRE(!parser.is_done());
+		REQUIRE(!parser.is_keep_alive());
+
+		parser.feed_eof();
+		REQUIRE(parser.is_done());
+		REQUIRE(parser.get_body() == "some data");
+	}
+
+	SECTION("Keep-alive")
+	{
+		parser.feed("HTTP/1.1 200 OK\r\nConnection: Close\r\nContent-Length: 0\r\n\r\n");
+		REQUIRE(parser.is_done());
+		REQUIRE(!parser.is_keep_alive());
+
+		parser.reset();
+		parser.feed("HTTP/1.0 200 OK\r\nConnection: keep-alive\r\nContent-Length: 0\r\n\r\n");
+		REQUIRE(parser.is_done());
+		REQUIRE(parser.is_keep_alive());
+	}
+
+	SECTION("Errors")
+	{
+		parser.feed("HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nshort");
+		parser.feed_eof();
+		REQUIRE(parser.has_error());
+		REQUIRE(parser.get_error() == "EOF before response finished");
+
+		parser.reset();
+		parser.feed_eof();
+		REQUIRE(parser.get_error() == "Connection closed by peer");
+
+		parser.reset();
+		parser.feed("SSH-2.0-OpenSSH\r\n");
+		REQUIRE(parser.has_error());
+
+		parser.reset();
+		parser.feed("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n");
+		REQUIRE(parser.get_error() == "Invalid chunk size");
+
+		parser.reset();
+		parser.feed("HTTP/1.1 200 OK\r\nContent-Length: -1\r\n\r\n");
+		REQUIRE(parser.get_error() == "Invalid Content-Length in response");
+	}
+}
+
+TEST_CASE("HttpResponseParser compression", "[util]")
+{
+	if (!Deflate::is_available())
+		return;
+
+	std::string text;
+	while (text.size() < 50000)
+		text += "{\"id\":12345,\"login\":\"someone\",\"type\":\"user\"},";
+
+	Deflate deflate;
+	REQUIRE(deflate.init(Deflate::Format::Gzip));
+
+	BlobBuffer compressed;
+	REQUIRE(deflate.write(text.data(), text.size(), compressed, Deflate::Flush::Finish));
+	std::string_view const body(reinterpret_cast<char const*>(compressed.data()), compressed.size());
+
+	HttpResponseParser parser;
+	parser.set_decompression(true);
+
+	SECTION("Chunked gzip")
+	{
+		std::string response = "HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\nTransfer-Encoding: chunked\r\n\r\n";
+		for (std::size_t offset = 0; offset < body.size(); offset += 100)
+		{
+			std::string_view const chunk = body.substr(offset, 100);
+			char size[16];
+			std::snprintf(size, sizeof(size), "%zx\r\n", chunk.size());
+			response += size;
+			response += chunk;
+			response += "\r\n";
+		}
+		response += "0\r\n\r\n";
+
+		std::size_t offset = 0;
+		while (offset < response.size() && !parser.is_done())
+			offset += parser.feed(std::string_view(response).substr(offset, 1000 + offset % 1000));
+
+		REQUIRE(parser.is_done());
+		REQUIRE(parser.is_compressed());
+		REQUIRE(parser.get_body() == text);
+		REQUIRE(parser.get_body_received() == body.size());
+		REQUIRE(parser.get_body_decoded() == text.size());
+	}
+
+	SECTION("Truncated")
+	{
+		std::string response = "HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\n\r\n";
+		response += body.substr(0, body.size() / 2);
+
+		parser.feed(response);
+		parser.feed_eof();
+		REQUIRE(parser.get_error() == "Truncated compressed response body");
+	}
+
+	SECTION("Corrupt")
+	{
+		parser.feed("HTTP/1.1 200 OK\r\nContent-Encoding: deflate\r\nContent-Length: 10\r\n\r\n0123456789");
+		REQUIRE(parser.get_error() == "Invalid compressed response body");
+	}
+
+	SECTION("Disabled")
+	{
+		parser.set_decompression(false);
+
+		std::string response = "HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+		response += body;
+
+		parser.feed(response);
+		REQUIRE(parser.is_done());
+		REQUIRE(!parser.is_compressed());
+		REQUIRE(parser.get_body() == body);
+	}
+}
+
+TEST_CASE("HttpStreamSplitter", "[util]")
+{
+	HttpStreamSplitter splitter;
+	std::vector<std::string> records;
+	std::vector<std::string> events;
+
+	auto const callback = [&](std::string_view const& data, std::string_view const& event) {
+		records.emplace_back(data);
+		events.emplace_back(event);
+	};
+
+	SECTION("Lines")
+	{
+		splitter.reset(HttpStreamSplitter::Format::Lines);
+		splitter.feed("{\"a\":1}\n{\"b\"", callback);
+		REQUIRE(records.size() == 1);
+		splitter.feed(":2}\r\n\n{\"c\":3}", callback);
+		REQUIRE(records.size() == 2);
+		splitter.finish(callback);
+
+		REQUIRE(records == std::vector<std::string> { "{\"a\":1}", "{\"b\":2}", "{\"c\":3}" });
+	}
+
+	SECTION("Server-sent events")
+	{
+		splitter.reset(HttpStreamSplitter::Format::ServerSentEvents);
+		splitter.feed(": ping\n\ndata: first\n\nevent: update\ndata: line 1\nda", callback);
+		splitter.feed("ta: line 2\n\ndata: [DONE]", callback);
+		REQUIRE(records.size() == 2);
+		splitter.finish(callback);
+
+		REQUIRE(records == std::vector<std::string> { "first", "line 1\nline 2", "[DONE]" });
+		REQUIRE(events == std::vector<std::string> { "message", "update", "message" });
+	}
+}
+
+TEST_CASE("HTTP server helpers", "[util]")
+{
+	SECTION("http_decode_path")
+	{
+		std::string decoded;
+		REQUIRE(http_decode_path("/plain/path.html", decoded));
+		REQUIRE(decoded == "/plain/path.html");
+		REQUIRE(http_decode_path("/with%20space/%C3%A9t%c3%a9", decoded));
+		REQUIRE(decoded == "/with space/\xC3\xA9t\xC3\xA9");
+		REQUIRE(http_decode_path("/%2e%2E/secret", decoded));
+		REQUIRE(decoded == "/../secret");
+
+		REQUIRE(!http_decode_path("/truncated%2", decoded));
+		REQUIRE(!http_decode_path("/bad%zzescape", decoded));
+		REQUIRE(!http_decode_path("/nul%00byte", decoded));
+	}
+
+	SECTION("http_content_type")
+	{
+		REQUIRE(http_content_type("index.html") == "text/html; charset=utf-8");
+		REQUIRE(http_content_type("/static/app.JS") == "text/javascript; charset=utf-8");
+		REQUIRE(http_content_type("icon.svg") == "image/svg+xml");
+		REQUIRE(http_content_type("archive.tar.gz") == "application/octet-stream");
+		REQUIRE(http_content_type("dir.d/README") == "application/octet-stream");
+		REQUIRE(http_content_type("") == "application/octet-stream");
+	}
+
+	SECTION("http_find_header")
+	{
+		HttpMessage const request = parse_http_message("GET / HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive, Upgrade\r\n\r\n");
+		REQUIRE(http_find_header(request, "connection") == "keep-alive, Upgrade");
+		REQUIRE(http_find_header(request, "HOST") == "localhost");
+		REQUIRE(http_find_header(request, "Upgrade").empty());
+	}
+
+	SECTION("http_has_token")
+	{
+		REQUIRE(http_has_token("keep-alive, Upgrade", "upgrade"));
+		REQUIRE(http_has_token("close", "close"));
+		REQUIRE(!http_has_token("keep-alive, Upgrade", "close"));
+		REQUIRE(!http_has_token("upgrade-insecure", "upgrade"));
+		REQUIRE(!http_has_token("", "close"));
+	}
+
+	SECTION("http_etag_matches")
+	{
+		REQUIRE(http_etag_matches("\"abc\"", "\"abc\""));
+		REQUIRE(http_etag_matches("\"xyz\", W/\"abc\"", "\"abc\""));
+		REQUIRE(http_etag_matches("*", "\"abc\""));
+		REQUIRE(!http_etag_matches("\"abcd\"", "\"abc\""));
+		REQUIRE(!http_etag_matches("", "\"abc\""));
+	}
+
+	SECTION("http_status_message")
+	{
+		REQUIRE(http_status_message(200) == "OK");
+		REQUIRE(http_status_message(304) == "Not Modified");
+		REQUIRE(http_status_message(404) == "Not Found");
+		REQUIRE(http_status_message(418) == "Client Error");
+		REQUIRE(http_status_message(599) == "Server Error");
+	}
+}
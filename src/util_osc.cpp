@@ -0,0 +1,478 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "util_osc.h"
+#include <bit>
+
+namespace
+{
+
+// Bundles may nest, but not without end
+constexpr int const MAX_BUNDLE_DEPTH = 8;
+
+constexpr std::string_view const BUNDLE_TAG("#bundle\0", 8);
+
+inline std::size_t padded_size(std::size_t len)
+{
+	return (len + 3) & ~std::size_t(3);
+}
+
+struct Reader
+{
+	Reader(std::string_view const& data)
+	    : ptr(reinterpret_cast<unsigned char const*>(data.data()))
+	    , end(ptr + data.size())
+	{
+	}
+
+	inline std::size_t remaining() const { return end - ptr; }
+
+	bool read_u32(std::uint32_t& value)
+	{
+		if (remaining() < 4)
+			return false;
+
+		value  = (std::uint32_t(ptr[0]) << 24) | (std::uint32_t(ptr[1]) << 16) | (std::uint32_t(ptr[2]) << 8) | std::uint32_t(ptr[3]);
+		ptr   += 4;
+		return true;
+	}
+
+	bool read_u64(std::uint64_t& value)
+	{
+		std::uint32_t high;
+		std::uint32_t low;
+		if (remaining() < 8 || !read_u32(high) || !read_u32(low))
+			return false;
+
+		value = (std::uint64_t(high) << 32) | low;
+		return true;
+	}
+
+	// Strings are NUL terminated and padded with more NULs to a multiple of four bytes
+	bool read_string(std::string_view& value)
+	{
+		unsigned char const* terminator = ptr;
+		while (terminator < end && *terminator != 0)
+			++terminator;
+
+		if (terminator == end)
+			return false;
+
+		std::size_t const len = terminator - ptr;
+		if (remaining() < padded_size(len + 1))
+			return false;
+
+		value  = std::string_view(reinterpret_cast<char const*>(ptr), len);
+		ptr   += padded_size(len + 1);
+		return true;
+	}
+
+	bool read_blob(std::string_view& value)
+	{
+		std::uint32_t len;
+		if (!read_u32(len) || remaining() < padded_size(len))
+			return false;
+
+		value  = std::string_view(reinterpret_cast<char const*>(ptr), len);
+		ptr   += padded_size(len);
+		return true;
+	}
+
+	unsigned char const* ptr;
+	unsigned char const* end;
+};
+
+void append_u32(std::string& output, std::uint32_t value)
+{
+	char const bytes[4] = { char(value >> 24), char(value >> 16), char(value >> 8), char(value) };
+	output.append(bytes, 4);
+}
+
+void append_u64(std::string& output, std::uint64_t value)
+{
+	append_u32(output, std::uint32_t(value >> 32));
+	append_u32(output, std::uint32_t(value));
+}
+
+void append_padding(std::string& output)
+{
+	output.append(padded_size(output.size()) - output.size(), '\0');
+}
+
+void append_string(std::string& output, std::string_view const& value)
+{
+	output.append(value);
+	output.push_back('\0');
+	append_padding(output);
+}
+
+bool decode_message(std::string_view const& packet, std::uint64_t time_tag, std::vector<util::osc::Message>& messages, std::string& error)
+{
+	Reader reader(packet);
+
+	util::osc::Message message;
+	message.time_tag = time_tag;
+
+	if (!reader.read_string(message.address) || !message.address.starts_with('/'))
+	{
+		error = "Invalid OSC address";
+		return false;
+	}
+
+	// Very old senders leave out the type tags, which means no arguments
+	std::string_view tags;
+	if (reader.remaining() > 0 && (!reader.read_string(tags) || !tags.starts_with(',')))
+	{
+		error = "Invalid OSC type tags";
+		return false;
+	}
+
+	if (!tags.empty())
+		tags.remove_prefix(1);
+
+	message.arguments.reserve(tags.size());
+
+	for (char const tag : tags)
+	{
+		util::osc::Argument argument;
+		argument.type = tag;
+
+		std::uint32_t value32;
+		std::uint64_t value64;
+		bool ok = true;
+
+		switch (tag)
+		{
+			case 'i':
+				ok               = reader.read_u32(value32);
+				argument.integer = std::int32_t(value32);
+				break;
+
+			case 'c':
+			case 'r':
+			case 'm':
+				ok               = reader.read_u32(value32);
+				argument.integer = value32;
+				break;
+
+			case 'f':
+				ok              = reader.read_u32(value32);
+				argument.number = std::bit_cast<float>(value32);
+				break;
+
+			case 'h':
+			case 't':
+				ok               = reader.read_u64(value64);
+				argument.integer = std::int64_t(value64);
+				break;
+
+			case 'd':
+				ok              = reader.read_u64(value64);
+				argument.number = std::bit_cast<double>(value64);
+				break;
+
+			case 's':
+			case 'S':
+				ok = reader.read_string(argument.data);
+				break;
+
+			case 'b':
+				ok = reader.read_blob(argument.data);
+				break;
+
+			case 'T':
+				argument.integer = 1;
+				break;
+
+			case 'F':
+			case 'N':
+			case 'I':
+				break;
+
+			case '[':
+			case ']':
+				continue;
+
+			default:
+				error  = "Unsupported OSC type tag ";
+				error += tag;
+				return false;
+		}
+
+		if (!ok)
+		{
+			error = "Truncated OSC message";
+			return false;
+		}
+
+		message.arguments.push_back(argument);
+	}
+
+	messages.push_back(std::move(message));
+	return true;
+}
+
+bool decode_element(std::string_view const& packet, std::uint64_t time_tag, int depth, std::vector<util::osc::Message>& messages, std::string& error)
+{
+	if (packet.starts_with('/'))
+		return decode_message(packet, time_tag, messages, error);
+
+	if (!packet.starts_with(BUNDLE_TAG))
+	{
+		error = "Not an OSC packet";
+		return false;
+	}
+
+	if (depth >= MAX_BUNDLE_DEPTH)
+	{
+		error = "OSC bundles nested too deep";
+		return false;
+	}
+
+	Reader reader(packet.substr(BUNDLE_TAG.size()));
+	if (!reader.read_u64(time_tag))
+	{
+		error = "Truncated OSC bundle";
+		return false;
+	}
+
+	while (reader.remaining() > 0)
+	{
+		std::uint32_t size;
+		if (!reader.read_u32(size) || size > reader.remaining())
+		{
+			error = "Truncated OSC bundle";
+			return false;
+		}
+
+		std::string_view const element(reinterpret_cast<char const*>(reader.ptr), size);
+		reader.ptr += size;
+
+		if (!decode_element(element, time_tag, depth + 1, messages, error))
+			return false;
+	}
+
+	return true;
+}
+
+bool match_char_class(std::string_view set, char ch)
+{
+	bool const negate = set.starts_with('!');
+	if (negate)
+		set.remove_prefix(1);
+
+	bool found = false;
+	for (std::size_t idx = 0; idx < set.size() && !found; ++idx)
+	{
+		if (idx + 2 < set.size() && set[idx + 1] == '-')
+		{
+			found  = ch >= set[idx] && ch <= set[idx + 2];
+			idx   += 2;
+		}
+		else
+		{
+			found = ch == set[idx];
+		}
+	}
+
+	return found != negate;
+}
+
+} // namespace
+
+namespace util
+{
+
+namespace osc
+{
+
+bool decode_packet(std::string_view const& packet, std::vector<Message>& messages, std::string& error)
+{
+	if (packet.empty() || packet.size() % 4 != 0)
+	{
+		error = "Invalid OSC packet size";
+		return false;
+	}
+
+	return decode_element(packet, TIME_IMMEDIATELY, 0, messages, error);
+}
+
+void encode_message(std::string& output, std::string_view const& address, std::vector<Argument> const& arguments)
+{
+	std::size_t const start = output.size();
+
+	output.append(address);
+	output.push_back('\0');
+	output.append(padded_size(output.size() - start) - (output.size() - start), '\0');
+
+	output.push_back(',');
+	for (Argument const& argument : arguments)
+	{
+		switch (argument.type)
+		{
+			case 'i':
+			case 'c':
+			case 'r':
+			case 'm':
+			case 'f':
+			case 'h':
+			case 't':
+			case 'd':
+			case 's':
+			case 'S':
+			case 'b':
+			case 'T':
+			case 'F':
+			case 'N':
+			case 'I':
+				output.push_back(argument.type);
+				break;
+
+			default:
+				output.push_back('N');
+				break;
+		}
+	}
+	output.push_back('\0');
+	output.append(padded_size(output.size() - start) - (output.size() - start), '\0');
+
+	for (Argument const& argument : arguments)
+	{
+		switch (argument.type)
+		{
+			case 'i':
+			case 'c':
+			case 'r':
+			case 'm':
+				append_u32(output, std::uint32_t(argument.integer));
+				break;
+
+			case 'f':
+				append_u32(output, std::bit_cast<std::uint32_t>(float(argument.number)));
+				break;
+
+			case 'h':
+			case 't':
+				append_u64(output, std::uint64_t(argument.integer));
+				break;
+
+			case 'd':
+				append_u64(output, std::bit_cast<std::uint64_t>(argument.number));
+				break;
+
+			case 's':
+			case 'S':
+				append_string(output, argument.data.substr(0, argument.data.find('\0')));
+				break;
+
+			case 'b':
+				append_u32(output, std::uint32_t(argument.data.size()));
+				output.append(argument.data);
+				output.append(padded_size(argument.data.size()) - argument.data.size(), '\0');
+				break;
+
+			default:
+				break;
+		}
+	}
+}
+
+bool match_address(std::string_view const& pattern, std::string_view const& address)
+{
+	std::string_view pattern_left = pattern;
+	std::string_view address_left = address;
+
+	while (!pattern_left.empty())
+	{
+		char const ch = pattern_left.front();
+
+		if (ch == '*')
+		{
+			while (pattern_left.starts_with('*'))
+				pattern_left.remove_prefix(1);
+
+			// Wildcards never cross into the next part of the address
+			for (std::size_t len = 0;; ++len)
+			{
+				if (match_address(pattern_left, address_left.substr(len)))
+					return true;
+
+				if (len >= address_left.size() || address_left[len] == '/')
+					return false;
+			}
+		}
+
+		if (ch == '{')
+		{
+			std::size_t const close = pattern_left.find('}');
+			if (close == std::string_view::npos)
+				return false;
+
+			std::string_view alternatives = pattern_left.substr(1, close - 1);
+			std::string_view const rest   = pattern_left.substr(close + 1);
+
+			for (;;)
+			{
+				std::size_t const comma          = alternatives.find(',');
+				std::string_view const candidate = alternatives.substr(0, comma);
+
+				if (address_left.starts_with(candidate) && match_address(rest, address_left.substr(candidate.size())))
+					return true;
+
+				if (comma == std::string_view::npos)
+					return false;
+
+				alternatives.remove_prefix(comma + 1);
+			}
+		}
+
+		if (address_left.empty())
+			return false;
+
+		if (ch == '?')
+		{
+			if (address_left.front() == '/')
+				return false;
+
+			pattern_left.remove_prefix(1);
+		}
+		else if (ch == '[')
+		{
+			std::size_t const close = pattern_left.find(']', 1);
+			if (close == std::string_view::npos || address_left.front() == '/' || !match_char_class(pattern_left.substr(1, close - 1), address_left.front()))
+				return false;
+
+			pattern_left.remove_prefix(close + 1);
+		}
+		else
+		{
+			if (address_left.front() != ch)
+				return false;
+
+			pattern_left.remove_prefix(1);
+		}
+
+		address_left.remove_prefix(1);
+	}
+
+	return address_left.empty();
+}
+
+} // namespace osc
+
+} // namespace util
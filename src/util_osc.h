@@ -0,0 +1,66 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef DECK_ASSISTANT_UTIL_OSC_H
+#define DECK_ASSISTANT_UTIL_OSC_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace util
+{
+
+// Open Sound Control 1.0 packets, as spoken by lighting desks, mixers and TouchOSC
+namespace osc
+{
+
+// Bundle time tag meaning "immediately"
+constexpr std::uint64_t const TIME_IMMEDIATELY = 1;
+
+struct Argument
+{
+	char type = 'N';
+	std::int64_t integer = 0; // i h t c r m, and 1 or 0 for T and F
+	double number        = 0; // f d
+	std::string_view data;    // s S b, points into the packet or the caller's data
+};
+
+struct Message
+{
+	std::string_view address;
+	std::vector<Argument> arguments;
+	std::uint64_t time_tag = TIME_IMMEDIATELY;
+};
+
+// Decodes a message or a (nested) bundle into its messages, appended in packet order.
+// Arrays are flattened. Views point into the packet. On error the messages decoded so far remain.
+bool decode_packet(std::string_view const& packet, std::vector<Message>& messages, std::string& error);
+
+// Appends an encoded message, arguments of unknown type are sent as nil
+void encode_message(std::string& output, std::string_view const& address, std::vector<Argument> const& arguments);
+
+// Matches an address against a pattern with ? * [a-z] [!abc] and {foo,bar}
+bool match_address(std::string_view const& pattern, std::string_view const& address);
+
+} // namespace osc
+
+} // namespace util
+
+#endif // DECK_ASSISTANT_UTIL_OSC_H
@@ -0,0 +1,197 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "util_osc.h"
+#include <catch2/catch_test_macros.hpp>
+
+using namespace util;
+using namespace std::literals;
+
+TEST_CASE("Osc", "[util]")
+{
+	SECTION("Decode message")
+	{
+		// From the OSC 1.0 specification examples
+		std::string_view const packet("/foo\0\0\0\0,iisff\0\0\0\0\x03\xe8\xff\xff\xff\xff"
+		                              "hello\0\0\0\x3f\x9d\xf3\xb6\x40\xb5\xb2\x2d"sv);
+
+		std::vector<osc::Message> messages;
+		std::string error;
+		REQUIRE(osc::decode_packet(packet, messages, error));
+		REQUIRE(messages.size() == 1);
+
+		osc::Message const& message = messages[0];
+		REQUIRE(message.address == "/foo");
+		REQUIRE(message.time_tag == osc::TIME_IMMEDIATELY);
+		REQUIRE(message.arguments.size() == 5);
+		REQUIRE(message.arguments[0].type == 'i');
+		REQUIRE(message.arguments[0].integer == 1000);
+		REQUIRE(message.arguments[1].integer == -1);
+		REQUIRE(message.arguments[2].type == 's');
+		REQUIRE(message.arguments[2].data == "hello");
+		REQUIRE(message.arguments[3].type == 'f');
+		REQUIRE(message.arguments[3].number > 1.2339);
+		REQUIRE(message.arguments[3].number < 1.2341);
+		REQUIRE(message.arguments[4].number > 5.6779);
+		REQUIRE(message.arguments[4].number < 5.6781);
+	}
+
+	SECTION("Decode without type tags")
+	{
+		std::vector<osc::Message> messages;
+		std::string error;
+		REQUIRE(osc::decode_packet("/ping\0\0\0"sv, messages, error));
+		REQUIRE(messages.size() == 1);
+		REQUIRE(messages[0].address == "/ping");
+		REQUIRE(messages[0].arguments.empty());
+	}
+
+	SECTION("Encode roundtrip")
+	{
+		std::vector<osc::Argument> arguments(9);
+		arguments[0].type    = 'i';
+		arguments[0].integer = -123456;
+		arguments[1].type    = 'f';
+		arguments[1].number  = 0.5;
+		arguments[2].type    = 's';
+		arguments[2].data    = "four";
+		arguments[3].type    = 'b';
+		arguments[3].data    = "\x01\x02\x03"sv;
+		arguments[4].type    = 'h';
+		arguments[4].integer = -5000000000LL;
+		arguments[5].type    = 'd';
+		arguments[5].number  = 3.25;
+		arguments[6].type    = 'T';
+		arguments[7].type    = 'F';
+		arguments[8].type    = '?';
+
+		std::string packet;
+		osc::encode_message(packet, "/mixer/fader1", arguments);
+		REQUIRE(packet.size() % 4 == 0);
+		REQUIRE(packet.starts_with("/mixer/fader1\0\0\0,ifsbhdTFN\0\0"sv));
+
+		std::vector<osc::Message> messages;
+		std::string error;
+		REQUIRE(osc::decode_packet(packet, messages, error));
+		REQUIRE(messages.size() == 1);
+
+		std::vector<osc::Argument> const& decoded = messages[0].arguments;
+		REQUIRE(messages[0].address == "/mixer/fader1");
+		REQUIRE(decoded.size() == 9);
+		REQUIRE(decoded[0].integer == -123456);
+		REQUIRE(decoded[1].number == 0.5);
+		REQUIRE(decoded[2].data == "four");
+		REQUIRE(decoded[3].data == "\x01\x02\x03"sv);
+		REQUIRE(decoded[4].integer == -5000000000LL);
+		REQUIRE(decoded[5].number == 3.25);
+		REQUIRE(decoded[6].type == 'T');
+		REQUIRE(decoded[6].integer == 1);
+		REQUIRE(decoded[7].type == 'F');
+		REQUIRE(decoded[8].type == 'N');
+	}
+
+	SECTION("Bundles")
+	{
+		std::string first;
+		std::string second;
+		osc::encode_message(first, "/a", {});
+		osc::encode_message(second, "/b/c", {});
+
+		auto append_u32 = [](std::string& output, std::uint32_t value) {
+			output += char(value >> 24);
+			output += char(value >> 16);
+			output += char(value >> 8);
+			output += char(value);
+		};
+
+		std::string inner("#bundle\0"sv);
+		append_u32(inner, 0);
+		append_u32(inner, 42);
+		append_u32(inner, std::uint32_t(second.size()));
+		inner += second;
+
+		std::string packet("#bundle\0"sv);
+		append_u32(packet, 0);
+		append_u32(packet, osc::TIME_IMMEDIATELY);
+		append_u32(packet, std::uint32_t(first.size()));
+		packet += first;
+		append_u32(packet, std::uint32_t(inner.size()));
+		packet += inner;
+
+		std::vector<osc::Message> messages;
+		std::string error;
+		REQUIRE(osc::decode_packet(packet, messages, error));
+		REQUIRE(messages.size() == 2);
+		REQUIRE(messages[0].address == "/a");
+		REQUIRE(messages[0].time_tag == osc::TIME_IMMEDIATELY);
+		REQUIRE(messages[1].address == "/b/c");
+		REQUIRE(messages[1].time_tag == 42);
+
+		// Element claiming more bytes than there are
+		packet[28] = char(0x40);
+		messages.clear();
+		REQUIRE(!osc::decode_packet(packet, messages, error));
+		REQUIRE(!error.empty());
+	}
+
+	SECTION("Malformed packets")
+	{
+		std::vector<osc::Message> messages;
+		std::string error;
+
+		REQUIRE(!osc::decode_packet(""sv, messages, error));
+		REQUIRE(!osc::decode_packet("/foo"sv, messages, error));
+		REQUIRE(!osc::decode_packet("foo\0"sv, messages, error));
+		REQUIRE(!osc::decode_packet("/foo\0\0\0\0,i\0\0"sv, messages, error));
+		REQUIRE(!osc::decode_packet("/foo\0\0\0\0,s\0\0abcd"sv, messages, error));
+		REQUIRE(!osc::decode_packet("/foo\0\0\0\0,x\0\0"sv, messages, error));
+		REQUIRE(!osc::decode_packet("/foo\0\0\0\0i\0\0\0"sv, messages, error));
+		REQUIRE(messages.empty());
+	}
+
+	SECTION("Address patterns")
+	{
+		REQUIRE(osc::match_address("/fader/1", "/fader/1"));
+		REQUIRE(!osc::match_address("/fader/1", "/fader/10"));
+		REQUIRE(!osc::match_address("/fader/10", "/fader/1"));
+
+		REQUIRE(osc::match_address("/fader/?", "/fader/7"));
+		REQUIRE(!osc::match_address("/fader/?", "/fader/"));
+		REQUIRE(!osc::match_address("/fader?1", "/fader/1"));
+
+		REQUIRE(osc::match_address("/fader/*", "/fader/12"));
+		REQUIRE(osc::match_address("/fader/*", "/fader/"));
+		REQUIRE(osc::match_address("/*/1", "/fader/1"));
+		REQUIRE(osc::match_address("/f*r/**", "/fader/x"));
+		REQUIRE(!osc::match_address("/fader/*", "/fader/1/touch"));
+		REQUIRE(!osc::match_address("/*", "/fader/1"));
+
+		REQUIRE(osc::match_address("/fader/[1-4]", "/fader/3"));
+		REQUIRE(!osc::match_address("/fader/[1-4]", "/fader/5"));
+		REQUIRE(osc::match_address("/fader/[!1-4]", "/fader/5"));
+		REQUIRE(osc::match_address("/fader/[a-]", "/fader/-"));
+		REQUIRE(!osc::match_address("/fader/[1-4", "/fader/1"));
+
+		REQUIRE(osc::match_address("/{fader,knob}/1", "/knob/1"));
+		REQUIRE(osc::match_address("/{fader,fade}r/1", "/fader/1"));
+		REQUIRE(!osc::match_address("/{fader,knob}/1", "/button/1"));
+		REQUIRE(osc::match_address("/mute{,d}", "/mute"));
+		REQUIRE(osc::match_address("/mute{,d}", "/muted"));
+	}
+}
@@ -0,0 +1,230 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DECK_ASSISTANT_UTIL_RING_QUEUE_H
+#define DECK_ASSISTANT_UTIL_RING_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace util
+{
+
+/**
+ * Bounded lock-free queue for handing small values between threads.
+ *
+ * Any number of threads may push and pop concurrently. Pushing into a full
+ * queue fails instead of blocking, so producers decide what to drop.
+ * The capacity is rounded up to a power of two.
+ */
+template <typename T>
+class RingQueue
+{
+public:
+	explicit RingQueue(std::size_t capacity)
+	{
+		std::size_t actual_capacity = 2;
+		while (actual_capacity < capacity)
+			actual_capacity <<= 1;
+
+		m_cells = std::make_unique<Cell[]>(actual_capacity);
+		m_mask  = actual_capacity - 1;
+
+		for (std::size_t idx = 0; idx < actual_capacity; ++idx)
+			m_cells[idx].sequence.store(idx, std::memory_order_relaxed);
+
+		m_push_pos.store(0, std::memory_order_relaxed);
+		m_pop_pos.store(0, std::memory_order_relaxed);
+	}
+
+	RingQueue(RingQueue const&)            = delete;
+	RingQueue& operator=(RingQueue const&) = delete;
+
+	inline std::size_t capacity() const { return m_mask + 1; }
+
+	template <typename V>
+	bool try_push(V&& value)
+	{
+		std::size_t pos = m_push_pos.load(std::memory_order_relaxed);
+		Cell* cell;
+
+		for (;;)
+		{
+			cell                 = &m_cells[pos & m_mask];
+			std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			std::ptrdiff_t diff  = std::ptrdiff_t(sequence) - std::ptrdiff_t(pos);
+
+			if (diff == 0)
+			{
+				if (m_push_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = m_push_pos.load(std::memory_order_relaxed);
+			}
+		}
+
+		cell->value = std::forward<V>(value);
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool try_pop(T& value)
+	{
+		std::size_t pos = m_pop_pos.load(std::memory_order_relaxed);
+		Cell* cell;
+
+		for (;;)
+		{
+			cell                 = &m_cells[pos & m_mask];
+			std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			std::ptrdiff_t diff  = std::ptrdiff_t(sequence) - std::ptrdiff_t(pos + 1);
+
+			if (diff == 0)
+			{
+				if (m_pop_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = m_pop_pos.load(std::memory_order_relaxed);
+			}
+		}
+
+		value = std::move(cell->value);
+		cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	struct Cell
+	{
+		std::atomic<std::size_t> sequence;
+		T value;
+	};
+
+	std::unique_ptr<Cell[]> m_cells;
+	std::size_t m_mask;
+
+	// Keep the producer and consumer positions on separate cache lines
+	alignas(64) std::atomic<std::size_t> m_push_pos;
+	alignas(64) std::atomic<std::size_t> m_pop_pos;
+};
+
+/**
+ * RingQueue for events that must not be lost, such as button transitions.
+ *
+ * Pushes go through the lock-free ring until it fills up. From then on they
+ * spill into a locked list until the consumer has drained it, which keeps
+ * every producer's events in order. A run of spilled values that each merely
+ * continue the one before, like motion with the same buttons held, collapses
+ * into its first and last value, so a stalled consumer only costs memory for
+ * the events that actually matter.
+ */
+template <typename T>
+class SpillingRingQueue
+{
+public:
+	explicit SpillingRingQueue(std::size_t capacity)
+	    : m_ring(capacity)
+	    , m_spilling(false)
+	    , m_spill_back_continues(false)
+	{
+	}
+
+	SpillingRingQueue(SpillingRingQueue const&)            = delete;
+	SpillingRingQueue& operator=(SpillingRingQueue const&) = delete;
+
+	inline std::size_t capacity() const { return m_ring.capacity(); }
+
+	// is_continuation(T const& previous, T const& value) tells whether value may stand in for previous
+	template <typename Continues>
+	void push(T const& value, Continues&& is_continuation)
+	{
+		if (!m_spilling.load(std::memory_order_acquire) && m_ring.try_push(value))
+			return;
+
+		std::lock_guard lock(m_spill_mutex);
+
+		// The consumer may have caught up in the meantime
+		if (!m_spilling.load(std::memory_order_relaxed) && m_ring.try_push(value))
+			return;
+
+		m_spilling.store(true, std::memory_order_release);
+
+		bool const continues = !m_spill.empty() && is_continuation(m_spill.back(), value);
+		if (continues && m_spill_back_continues)
+		{
+			m_spill.back() = value;
+		}
+		else
+		{
+			m_spill.push_back(value);
+			m_spill_back_continues = continues;
+		}
+	}
+
+	// Appends every queued value to out in order, only one thread may drain at a time
+	void drain(std::vector<T>& out)
+	{
+		T value;
+		while (m_ring.try_pop(value))
+			out.push_back(std::move(value));
+
+		if (!m_spilling.load(std::memory_order_acquire))
+			return;
+
+		std::lock_guard lock(m_spill_mutex);
+
+		// Anything still in the ring was pushed before the spill started
+		while (m_ring.try_pop(value))
+			out.push_back(std::move(value));
+
+		for (T& spilled : m_spill)
+			out.push_back(std::move(spilled));
+
+		m_spill.clear();
+		m_spill_back_continues = false;
+		m_spilling.store(false, std::memory_order_release);
+	}
+
+private:
+	RingQueue<T> m_ring;
+	std::atomic<bool> m_spilling;
+	std::mutex m_spill_mutex;
+	std::vector<T> m_spill;
+	bool m_spill_back_continues;
+};
+
+} // namespace util
+
+#endif // DECK_ASSISTANT_UTIL_RING_QUEUE_H
@@ -0,0 +1,142 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "util_ring_queue.h"
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+
+using namespace util;
+
+TEST_CASE("RingQueue", "[util]")
+{
+	SECTION("Capacity")
+	{
+		REQUIRE(RingQueue<int>(0).capacity() == 2);
+		REQUIRE(RingQueue<int>(8).capacity() == 8);
+		REQUIRE(RingQueue<int>(9).capacity() == 16);
+	}
+
+	SECTION("Single thread")
+	{
+		RingQueue<int> queue(4);
+		int value = 0;
+
+		REQUIRE(!queue.try_pop(value));
+
+		REQUIRE(queue.try_push(1));
+		REQUIRE(queue.try_push(2));
+		REQUIRE(queue.try_push(3));
+		REQUIRE(queue.try_push(4));
+		REQUIRE(!queue.try_push(5));
+
+		REQUIRE(queue.try_pop(value));
+		REQUIRE(value == 1);
+		REQUIRE(queue.try_push(5));
+
+		for (int expected = 2; expected <= 5; ++expected)
+		{
+			REQUIRE(queue.try_pop(value));
+			REQUIRE(value == expected);
+		}
+		REQUIRE(!queue.try_pop(value));
+	}
+
+	SECTION("Multiple producers")
+	{
+		constexpr int const num_producers = 4;
+		constexpr int const num_values    = 10000;
+
+		RingQueue<int> queue(64);
+		std::vector<std::thread> producers;
+
+		for (int producer = 0; producer < num_producers; ++producer)
+		{
+			producers.emplace_back([&queue] {
+				for (int value = 1; value <= num_values; ++value)
+					while (!queue.try_push(value))
+						std::this_thread::yield();
+			});
+		}
+
+		long long total = 0;
+		int received    = 0;
+		while (received < num_producers * num_values)
+		{
+			int value;
+			if (queue.try_pop(value))
+			{
+				total += value;
+				++received;
+			}
+		}
+
+		for (std::thread& producer : producers)
+			producer.join();
+
+		REQUIRE(total == num_producers * (long long)num_values * (num_values + 1) / 2);
+	}
+}
+
+TEST_CASE("SpillingRingQueue", "[util]")
+{
+	auto const same_parity = [](int previous, int value) -> bool { return (previous & 1) == (value & 1); };
+
+	SECTION("Nothing is lost when full")
+	{
+		SpillingRingQueue<int> queue(4);
+		for (int value = 1; value <= 10; ++value)
+			queue.push(value, [](int, int) { return false; });
+
+		std::vector<int> values;
+		queue.drain(values);
+		REQUIRE(values == std::vector<int> { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 });
+
+		values.clear();
+		queue.drain(values);
+		REQUIRE(values.empty());
+	}
+
+	SECTION("Spilled runs collapse")
+	{
+		SpillingRingQueue<int> queue(2);
+		for (int value : { 1, 2, 3, 5, 7, 9, 4, 6, 8, 11 })
+			queue.push(value, same_parity);
+
+		// The ring keeps everything, a run in the spill keeps its first and last value
+		std::vector<int> values;
+		queue.drain(values);
+		REQUIRE(values == std::vector<int> { 1, 2, 3, 9, 4, 8, 11 });
+	}
+
+	SECTION("Back to the ring after draining")
+	{
+		SpillingRingQueue<int> queue(2);
+		for (int value = 1; value <= 4; ++value)
+			queue.push(value, same_parity);
+
+		std::vector<int> values;
+		queue.drain(values);
+
+		queue.push(5, same_parity);
+		queue.push(7, same_parity);
+		queue.drain(values);
+		REQUIRE(values == std::vector<int> { 1, 2, 3, 4, 5, 7 });
+	}
+}
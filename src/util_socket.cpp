@@ -17,90 +17,603 @@
  */
 
 #include "util_socket.h"
+#include "util_blob.h"
+#include "util_ring_queue.h"
 #include "util_tls_session.h"
-#include <SDL_net.h>
 #include <cassert>
-#include <fcntl.h>
+#include <cctype>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <mutex>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#define SOCKET_USE_EPOLL 1
+#define SOCKET_USE_RECVMMSG 1
+#endif
+#endif
 
 using namespace util;
 
+namespace
+{
+
+#ifdef _WIN32
+using NativeSocket = SOCKET;
+using PollFd       = WSAPOLLFD;
+
+constexpr NativeSocket const INVALID_NATIVE_SOCKET = INVALID_SOCKET;
+
+inline int last_socket_error() { return WSAGetLastError(); }
+inline bool is_would_block(int error) { return error == WSAEWOULDBLOCK; }
+inline bool is_in_progress(int error) { return error == WSAEWOULDBLOCK || error == WSAEINPROGRESS; }
+inline void close_native_socket(NativeSocket fd) { closesocket(fd); }
+inline int poll_native_sockets(PollFd* fds, std::size_t count, int timeout_msec) { return WSAPoll(fds, ULONG(count), timeout_msec); }
+inline bool is_datagram_truncated(int error) { return error == WSAEMSGSIZE; }
+inline bool is_datagram_refused(int error) { return error == WSAECONNRESET; }
+
+inline bool set_nonblocking(NativeSocket fd)
+{
+	u_long mode = 1;
+	return ioctlsocket(fd, FIONBIO, &mode) == 0;
+}
+#else
+using NativeSocket = int;
+using PollFd       = pollfd;
+
+constexpr NativeSocket const INVALID_NATIVE_SOCKET = -1;
+
+inline int last_socket_error() { return errno; }
+inline bool is_would_block(int error) { return error == EAGAIN || error == EWOULDBLOCK; }
+inline bool is_in_progress(int error) { return error == EINPROGRESS; }
+inline void close_native_socket(NativeSocket fd) { ::close(fd); }
+inline int poll_native_sockets(PollFd* fds, std::size_t count, int timeout_msec) { return ::poll(fds, nfds_t(count), timeout_msec); }
+inline bool is_datagram_truncated(int) { return false; }
+inline bool is_datagram_refused(int error) { return error == ECONNREFUSED || error == ECONNRESET; }
+
+inline bool set_nonblocking(NativeSocket fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+#endif
+
+#ifdef MSG_NOSIGNAL
+constexpr int const SEND_FLAGS = MSG_NOSIGNAL;
+#else
+constexpr int const SEND_FLAGS = 0;
+#endif
+
+std::string socket_error_string(int error)
+{
+	return std::system_category().message(error);
+}
+
+bool configure_socket(NativeSocket fd, bool is_stream)
+{
+	if (!set_nonblocking(fd))
+		return false;
+
+	int enable = 1;
+#ifdef SO_NOSIGPIPE
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, reinterpret_cast<char const*>(&enable), sizeof(enable));
+#endif
+	if (is_stream)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char const*>(&enable), sizeof(enable));
+
+	return true;
+}
+
+struct Address
+{
+	sockaddr_storage storage;
+	socklen_t length;
+};
+
+// Reports IPv4 peers of dual-stack sockets as plain IPv4
+bool format_address(sockaddr_storage address, socklen_t address_len, std::string& host, int& port)
+{
+	if (address.ss_family == AF_INET6)
+	{
+		sockaddr_in6 const address6 = *reinterpret_cast<sockaddr_in6 const*>(&address);
+		if (IN6_IS_ADDR_V4MAPPED(&address6.sin6_addr))
+		{
+			sockaddr_in address4;
+			std::memset(&address4, 0, sizeof(address4));
+			address4.sin_family = AF_INET;
+			address4.sin_port   = address6.sin6_port;
+			std::memcpy(&address4.sin_addr, address6.sin6_addr.s6_addr + 12, 4);
+
+			std::memcpy(&address, &address4, sizeof(address4));
+			address_len = sizeof(address4);
+		}
+	}
+
+	char host_buffer[NI_MAXHOST];
+	char port_buffer[NI_MAXSERV];
+	if (getnameinfo(reinterpret_cast<sockaddr*>(&address), address_len, host_buffer, sizeof(host_buffer), port_buffer, sizeof(port_buffer), NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+		return false;
+
+	host = host_buffer;
+	port = std::atoi(port_buffer);
+	return true;
+}
+
+using ResolverClock = std::chrono::steady_clock;
+
+// getaddrinfo() doesn't report record TTLs, so cached lookups live for a fixed time
+constexpr std::chrono::seconds const RESOLVER_CACHE_TTL = std::chrono::seconds(60);
+
+// Failed lookups are remembered briefly so reconnect loops don't hammer a broken resolver
+constexpr std::chrono::seconds const RESOLVER_NEGATIVE_TTL = std::chrono::seconds(10);
+
+// Expired entries are only swept once the cache grows beyond this
+constexpr std::size_t const RESOLVER_CACHE_SWEEP_SIZE = 256;
+
+// Minimum free space offered to each socket read
+constexpr std::size_t const READ_CHUNK_SIZE = 16 * 1024;
+
+// Don't let a connection storm monopolise a single tick
+constexpr int const MAX_ACCEPTS_PER_CALL = 64;
+
+// Lookups can block for many seconds, so a few run in parallel
+constexpr std::size_t const MAX_RESOLVER_THREADS = 4;
+
+// Finished lookups waiting for the main thread; workers stall when it fills up
+constexpr std::size_t const RESOLVER_RESULT_QUEUE_SIZE = 64;
+
+// Largest datagram received in one piece, bigger ones are dropped
+constexpr std::size_t const DATAGRAM_MAX_SIZE = 16384;
+
+// Datagrams fetched per recvmmsg() call
+constexpr std::size_t const DATAGRAM_BATCH_SIZE = 16;
+
+struct ResolveRequest
+{
+	std::string key;
+	std::string host;
+	int port;
+};
+
+struct ResolveResult
+{
+	std::string key;
+	std::vector<Address> addresses;
+	std::string error;
+};
+
+// Requests are rare and workers need to sleep, so they go through a mutex.
+// Results are collected on every poll and come back through a lock-free queue
+// so the main thread never waits for a worker holding the lock.
+struct ResolverQueue
+{
+	ResolverQueue()
+	    : results(RESOLVER_RESULT_QUEUE_SIZE)
+	{
+	}
+
+	std::mutex mutex;
+	std::condition_variable_any condition;
+	std::deque<ResolveRequest> requests;
+	std::size_t idle_workers = 0;
+	RingQueue<ResolveResult> results;
+};
+
+struct ResolveWaiter
+{
+	std::weak_ptr<Socket::SharedState> shared_state;
+	unsigned int generation;
+};
+
+struct ResolverCacheEntry
+{
+	std::vector<Address> addresses;
+	std::string error;
+	ResolverClock::time_point expires;
+	std::vector<ResolveWaiter> waiters;
+	bool pending = false;
+};
+
+std::string make_resolver_key(std::string_view const& host, int port)
+{
+	std::string key;
+	key.reserve(host.size() + 8);
+	for (char ch : host)
+		key += char(std::tolower(static_cast<unsigned char>(ch)));
+
+	key += ':';
+	key += std::to_string(port);
+	return key;
+}
+
+ResolveResult resolve_host(ResolveRequest const& request)
+{
+	ResolveResult result;
+	result.key = request.key;
+
+	addrinfo hints;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	addrinfo* info         = nullptr;
+	std::string const port = std::to_string(request.port);
+
+	int error = getaddrinfo(request.host.c_str(), port.c_str(), &hints, &info);
+	if (error != 0)
+	{
+		result.error  = "Couldn't resolve host name ";
+		result.error += request.host;
+		result.error += ": ";
+		result.error += gai_strerror(error);
+		return result;
+	}
+
+	for (addrinfo* item = info; item; item = item->ai_next)
+	{
+		if (item->ai_addrlen > sizeof(sockaddr_storage))
+			continue;
+
+		Address& address = result.addresses.emplace_back();
+		std::memcpy(&address.storage, item->ai_addr, item->ai_addrlen);
+		address.length = socklen_t(item->ai_addrlen);
+	}
+
+	freeaddrinfo(info);
+
+	if (result.addresses.empty())
+		result.error = "Couldn't resolve host name " + request.host;
+
+	return result;
+}
+
+void resolver_worker(std::stop_token stop_token, std::shared_ptr<ResolverQueue> queue)
+{
+	std::unique_lock guard(queue->mutex);
+
+	for (;;)
+	{
+		++queue->idle_workers;
+		bool const have_request = queue->condition.wait(guard, stop_token, [&queue] { return !queue->requests.empty(); });
+		--queue->idle_workers;
+
+		if (!have_request)
+			break;
+
+		ResolveRequest request = std::move(queue->requests.front());
+		queue->requests.pop_front();
+
+		guard.unlock();
+
+		ResolveResult result = resolve_host(request);
+		while (!queue->results.try_push(std::move(result)))
+		{
+			if (stop_token.stop_requested())
+				return;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		guard.lock();
+	}
+}
+
+} // namespace
+
+struct SocketSet::Reactor
+{
+	Reactor()
+	    : resolver_queue(std::make_shared<ResolverQueue>())
+	{
+#ifdef SOCKET_USE_EPOLL
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		assert(epoll_fd != -1 && "failed to create epoll instance");
+		events.resize(64);
+#endif
+	}
+
+	~Reactor()
+	{
+		assert(sockets.empty() && "SocketSet destroyed while sockets are still registered");
+
+		// Name lookups cannot be interrupted, so don't let a slow DNS server hold up the exit
+		for (std::jthread& thread : resolver_threads)
+		{
+			thread.request_stop();
+			thread.detach();
+		}
+
+#ifdef SOCKET_USE_EPOLL
+		if (epoll_fd != -1)
+			::close(epoll_fd);
+#endif
+	}
+
+	bool add(Socket::SharedState* shared_state, NativeSocket fd);
+	void remove(Socket::SharedState* shared_state, NativeSocket fd);
+	void resolve(std::shared_ptr<Socket::SharedState> const& shared_state, std::string const& host, int port);
+	void forget_resolved(std::string const& host, int port);
+	bool process_resolved();
+
+	std::vector<Socket::SharedState*> sockets;
+	std::shared_ptr<ResolverQueue> resolver_queue;
+	std::vector<std::jthread> resolver_threads;
+	std::unordered_map<std::string, ResolverCacheEntry> resolver_cache;
+	SocketSet::ResolverStats resolver_stats;
+
+#ifdef SOCKET_USE_EPOLL
+	int epoll_fd;
+	std::vector<epoll_event> events;
+#else
+	std::vector<PollFd> pollfds;
+	std::vector<Socket::SharedState*> polled;
+#endif
+};
+
 struct Socket::SharedState : public TLSSession::IO
 {
 	SharedState()
 	    : state(State::Disconnected)
 	    , port(0)
 	    , use_tls(TLS::NoTLS)
-	    , socket(nullptr)
+	    , fd(INVALID_NATIVE_SOCKET)
+	    , read_ready(false)
+	    , write_ready(false)
+	    , generation(0)
 	{
 	}
 
 	~SharedState()
 	{
-		assert(!socket && "socket not closed at SharedState destruction");
+		assert(fd == INVALID_NATIVE_SOCKET && "socket not closed at SharedState destruction");
 	}
 
 	State state;
 	std::string_view last_error;
 	std::string last_error_buffer;
-	std::mutex mutex;
 
 	std::string host;
 	int port;
 	TLS use_tls;
 
-	TCPsocket socket;
+	NativeSocket fd;
+	bool read_ready;
+	bool write_ready;
+	unsigned int generation;
+	std::vector<Address> connect_addresses;
+	BlobBuffer outbuffer;
+
 	std::shared_ptr<SocketSet> socket_set;
 	TLSSession tls_session;
 
+	void set_error(std::string&& message)
+	{
+		last_error_buffer = std::move(message);
+		last_error        = last_error_buffer;
+	}
+
+	void set_socket_error(int error)
+	{
+		set_error(socket_error_string(error));
+	}
+
 	void fill_remote_address()
 	{
-		assert(socket);
+		assert(fd != INVALID_NATIVE_SOCKET);
 
 		host.clear();
 		port = 0;
 
-		IPaddress const* address = SDLNet_TCP_GetPeerAddress(socket);
-		if (address)
+		sockaddr_storage address;
+		socklen_t address_len = sizeof(address);
+		if (getpeername(fd, reinterpret_cast<sockaddr*>(&address), &address_len) != 0)
+			return;
+
+		format_address(address, address_len, host, port);
+	}
+
+	bool open_listener(int listen_port)
+	{
+		sockaddr_in6 address;
+		std::memset(&address, 0, sizeof(address));
+		address.sin6_family = AF_INET6;
+		address.sin6_addr   = in6addr_any;
+		address.sin6_port   = htons(std::uint16_t(listen_port));
+
+		// Prefer a dual-stack socket, but plain IPv4 still works on hosts without IPv6
+		NativeSocket new_fd = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+		if (new_fd != INVALID_NATIVE_SOCKET)
 		{
-			union
+			int disable = 0;
+			setsockopt(new_fd, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<char const*>(&disable), sizeof(disable));
+		}
+
+		sockaddr_in address4;
+		std::memset(&address4, 0, sizeof(address4));
+		address4.sin_family      = AF_INET;
+		address4.sin_addr.s_addr = htonl(INADDR_ANY);
+		address4.sin_port        = htons(std::uint16_t(listen_port));
+
+		sockaddr const* bind_address = reinterpret_cast<sockaddr const*>(&address);
+		socklen_t bind_address_len   = sizeof(address);
+
+		if (new_fd == INVALID_NATIVE_SOCKET)
+		{
+			new_fd           = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+			bind_address     = reinterpret_cast<sockaddr const*>(&address4);
+			bind_address_len = sizeof(address4);
+		}
+
+		if (new_fd == INVALID_NATIVE_SOCKET)
+		{
+			set_socket_error(last_socket_error());
+			return false;
+		}
+
+		int enable = 1;
+		setsockopt(new_fd, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char const*>(&enable), sizeof(enable));
+
+		if (!configure_socket(new_fd, false) || bind(new_fd, bind_address, bind_address_len) != 0 || listen(new_fd, SOMAXCONN) != 0)
+		{
+			set_socket_error(last_socket_error());
+			close_native_socket(new_fd);
+			return false;
+		}
+
+		if (!socket_set->m_reactor->add(this, new_fd))
+		{
+			set_socket_error(last_socket_error());
+			close_native_socket(new_fd);
+			return false;
+		}
+
+		fd    = new_fd;
+		state = State::Connected;
+		return true;
+	}
+
+	bool connect_next_address()
+	{
+		while (!connect_addresses.empty())
+		{
+			Address const address = connect_addresses.front();
+			connect_addresses.erase(connect_addresses.begin());
+
+			close_fd();
+
+			NativeSocket new_fd = socket(address.storage.ss_family, SOCK_STREAM, IPPROTO_TCP);
+			if (new_fd == INVALID_NATIVE_SOCKET || !configure_socket(new_fd, true))
 			{
-				struct
+				set_socket_error(last_socket_error());
+				if (new_fd != INVALID_NATIVE_SOCKET)
+					close_native_socket(new_fd);
+				continue;
+			}
+
+			if (connect(new_fd, reinterpret_cast<sockaddr const*>(&address.storage), address.length) != 0)
+			{
+				int error = last_socket_error();
+				if (!is_in_progress(error))
 				{
-					Uint8 a, b, c, d;
-				} parts;
-				Uint32 ip;
-			} helper;
+					set_socket_error(error);
+					close_native_socket(new_fd);
+					continue;
+				}
+			}
+
+			// Completion (or failure) of the connect shows up as writability
+			if (!socket_set->m_reactor->add(this, new_fd))
+			{
+				set_socket_error(last_socket_error());
+				close_native_socket(new_fd);
+				continue;
+			}
+
+			fd = new_fd;
+			return true;
+		}
 
-			helper.ip = address->host;
+		return false;
+	}
 
-			host.reserve(16);
-			host  = std::to_string(helper.parts.a);
-			host += '.';
-			host += std::to_string(helper.parts.b);
-			host += '.';
-			host += std::to_string(helper.parts.c);
-			host += '.';
-			host += std::to_string(helper.parts.d);
+	void finish_connect()
+	{
+		assert(state == State::Connecting);
 
-			port = SDL_SwapBE16(address->port);
+		int error            = 0;
+		socklen_t error_size = sizeof(error);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &error_size) != 0)
+			error = last_socket_error();
+
+		if (error != 0)
+		{
+			set_socket_error(error);
+			if (!connect_next_address())
+			{
+				// None of the addresses worked, they may well be outdated
+				socket_set->m_reactor->forget_resolved(host, port);
+				close();
+			}
+			return;
+		}
+
+		connect_addresses.clear();
+		last_error = std::string_view();
+		state      = use_tls != TLS::NoTLS ? State::TLSHandshaking : State::Connected;
+	}
+
+	void handle_ready(bool readable, bool writable)
+	{
+		if (readable)
+			read_ready = true;
+
+		if (writable)
+		{
+			write_ready = true;
+
+			if (state == State::Connecting)
+				finish_connect();
+			else if (!outbuffer.empty() && flush() < 0)
+				close();
 		}
 	}
 
 	int read(void* data, int maxlen) override
 	{
-		if (!socket)
+		if (fd == INVALID_NATIVE_SOCKET)
 		{
 			last_error = "Socket is not connected";
 			return -1;
 		}
 
-		if (!SDLNet_SocketReady(socket))
+		// Only touch the socket when the reactor said there is something to read
+		if (!read_ready || state == State::Connecting)
+			return 0;
+
+		int result = recv(fd, reinterpret_cast<char*>(data), maxlen, 0);
+		if (result > 0)
+			return result;
+
+		if (result == 0)
+		{
+			last_error = "Socket EOF";
+			close();
+			return -1;
+		}
+
+		int error = last_socket_error();
+		if (is_would_block(error))
+		{
+			read_ready = false;
 			return 0;
+		}
 
-		int result = SDLNet_TCP_Recv(socket, data, maxlen);
-		return set_result(result);
+		set_socket_error(error);
+		close();
+		return -1;
 	}
 
 	int write(void const* data, int len) override
@@ -108,48 +621,237 @@ struct Socket::SharedState : public TLSSession::IO
 		if (len <= 0)
 			return 0;
 
-		if (!socket)
+		if (fd == INVALID_NATIVE_SOCKET)
 		{
 			last_error = "Socket is not connected";
 			return -1;
 		}
 
-		int result = SDLNet_TCP_Send(socket, data, len);
-		return set_result(result);
+		// Whatever the kernel doesn't take right now is sent by the reactor once the socket is writable
+		int sent = 0;
+		if (outbuffer.empty())
+		{
+			sent = send_some(data, len);
+			if (sent < 0)
+			{
+				close();
+				return -1;
+			}
+		}
+
+		if (sent < len)
+			outbuffer.write(reinterpret_cast<unsigned char const*>(data) + sent, len - sent);
+
+		return len;
 	}
 
-	void close()
+	int flush()
 	{
-		if (socket)
+		int sent = send_some(outbuffer.data(), int(outbuffer.size()));
+		if (sent > 0)
 		{
-			SDLNet_TCP_DelSocket(reinterpret_cast<SDLNet_SocketSet>(socket_set->m_data), socket);
-			SDLNet_TCP_Close(socket);
-			socket = nullptr;
+			outbuffer.advance(sent);
+			if (outbuffer.empty())
+				outbuffer.clear();
 		}
-		state = State::Disconnected;
+		return sent;
+	}
+
+	void close()
+	{
+		// Give anything still queued a last chance to leave
+		if (fd != INVALID_NATIVE_SOCKET && state == State::Connected && !outbuffer.empty())
+			flush();
+
+		close_fd();
+
+		state       = State::Disconnected;
+		read_ready  = false;
+		write_ready = false;
+		++generation;
+		connect_addresses.clear();
+		outbuffer.clear();
 		tls_session.deinit();
 	}
 
 private:
-	int set_result(int result)
+	int send_some(void const* data, int len)
 	{
-		if (result == 0)
+		unsigned char const* ptr = reinterpret_cast<unsigned char const*>(data);
+		int total                = 0;
+
+		while (write_ready && total < len)
 		{
-			last_error = "Socket EOF";
-			close();
+			int result = send(fd, reinterpret_cast<char const*>(ptr + total), len - total, SEND_FLAGS);
+			if (result > 0)
+			{
+				total += result;
+				continue;
+			}
+
+			int error = last_socket_error();
+			if (result < 0 && is_would_block(error))
+			{
+				write_ready = false;
+				break;
+			}
+
+			set_socket_error(error);
 			return -1;
 		}
-		else if (result < 0)
+
+		return total;
+	}
+
+	void close_fd()
+	{
+		if (fd != INVALID_NATIVE_SOCKET)
 		{
-			last_error_buffer = SDLNet_GetError();
-			last_error        = last_error_buffer;
-			close();
-			return -1;
+			socket_set->m_reactor->remove(this, fd);
+			close_native_socket(fd);
+			fd = INVALID_NATIVE_SOCKET;
 		}
-		return result;
+		read_ready  = false;
+		write_ready = false;
 	}
 };
 
+bool SocketSet::Reactor::add(Socket::SharedState* shared_state, NativeSocket fd)
+{
+#ifdef SOCKET_USE_EPOLL
+	epoll_event event;
+	event.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.ptr = shared_state;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+		return false;
+#endif
+
+	sockets.push_back(shared_state);
+	return true;
+}
+
+void SocketSet::Reactor::remove(Socket::SharedState* shared_state, NativeSocket fd)
+{
+#ifdef SOCKET_USE_EPOLL
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+#endif
+
+	for (std::size_t idx = 0; idx < sockets.size(); ++idx)
+	{
+		if (sockets[idx] == shared_state)
+		{
+			sockets[idx] = sockets.back();
+			sockets.pop_back();
+			break;
+		}
+	}
+}
+
+void SocketSet::Reactor::resolve(std::shared_ptr<Socket::SharedState> const& shared_state, std::string const& host, int port)
+{
+	++resolver_stats.lookups;
+
+	std::string key            = make_resolver_key(host, port);
+	ResolverCacheEntry& cached = resolver_cache[key];
+
+	if (!cached.pending && cached.expires > ResolverClock::now())
+	{
+		if (!cached.error.empty())
+		{
+			++resolver_stats.negative_hits;
+			shared_state->set_error(std::string(cached.error));
+			shared_state->close();
+			return;
+		}
+
+		++resolver_stats.cache_hits;
+		shared_state->connect_addresses = cached.addresses;
+		if (!shared_state->connect_next_address())
+			shared_state->close();
+		return;
+	}
+
+	cached.waiters.push_back(ResolveWaiter { shared_state, shared_state->generation });
+
+	// Someone else is already waiting for this host
+	if (cached.pending)
+	{
+		++resolver_stats.coalesced;
+		return;
+	}
+
+	cached.pending = true;
+	++resolver_stats.queries;
+
+	bool need_worker;
+	{
+		std::lock_guard guard(resolver_queue->mutex);
+		resolver_queue->requests.push_back(ResolveRequest { std::move(key), host, port });
+		need_worker = resolver_queue->requests.size() > resolver_queue->idle_workers;
+	}
+
+	if (need_worker && resolver_threads.size() < MAX_RESOLVER_THREADS)
+		resolver_threads.emplace_back(&resolver_worker, resolver_queue);
+
+	resolver_queue->condition.notify_one();
+}
+
+void SocketSet::Reactor::forget_resolved(std::string const& host, int port)
+{
+	auto iter = resolver_cache.find(make_resolver_key(host, port));
+	if (iter != resolver_cache.end() && !iter->second.pending)
+		resolver_cache.erase(iter);
+}
+
+bool SocketSet::Reactor::process_resolved()
+{
+	ResolveResult result;
+	if (!resolver_queue->results.try_pop(result))
+		return false;
+
+	ResolverClock::time_point const now = ResolverClock::now();
+
+	do
+	{
+		ResolverCacheEntry& cached = resolver_cache[result.key];
+		cached.pending             = false;
+		cached.addresses           = std::move(result.addresses);
+		cached.error               = std::move(result.error);
+		cached.expires             = now + (cached.error.empty() ? RESOLVER_CACHE_TTL : RESOLVER_NEGATIVE_TTL);
+
+		if (!cached.error.empty())
+			++resolver_stats.failures;
+
+		std::vector<ResolveWaiter> waiters;
+		waiters.swap(cached.waiters);
+
+		for (ResolveWaiter const& waiter : waiters)
+		{
+			// A socket that was closed or reconnected in the meantime no longer cares
+			std::shared_ptr<Socket::SharedState> shared_state = waiter.shared_state.lock();
+			if (!shared_state || shared_state->generation != waiter.generation || shared_state->state != Socket::State::Connecting)
+				continue;
+
+			if (!cached.error.empty())
+			{
+				shared_state->set_error(std::string(cached.error));
+				shared_state->close();
+				continue;
+			}
+
+			shared_state->connect_addresses = cached.addresses;
+			if (!shared_state->connect_next_address())
+				shared_state->close();
+		}
+	} while (resolver_queue->results.try_pop(result));
+
+	if (resolver_cache.size() > RESOLVER_CACHE_SWEEP_SIZE)
+		std::erase_if(resolver_cache, [now](auto const& item) { return !item.second.pending && item.second.expires <= now; });
+
+	return true;
+}
+
 Socket::Socket(std::shared_ptr<SocketSet> const& socket_set)
     : m_shared_state(new SharedState)
 {
@@ -160,7 +862,6 @@ Socket::Socket(std::shared_ptr<SocketSet> const& socket_set)
 Socket::Socket(Socket&& other)
 {
 	m_shared_state.swap(other.m_shared_state);
-	m_worker_thread.swap(other.m_worker_thread);
 }
 
 Socket::~Socket()
@@ -173,9 +874,13 @@ Socket::TLS Socket::get_tls() const
 	return m_shared_state->use_tls;
 }
 
+bool Socket::is_tls_resumed() const
+{
+	return m_shared_state->use_tls != TLS::NoTLS && m_shared_state->tls_session.is_resumed();
+}
+
 bool Socket::set_tls(TLS use_tls)
 {
-	std::lock_guard guard(m_shared_state->mutex);
 #if (defined HAVE_GNUTLS || defined HAVE_OPENSSL)
 	m_shared_state->use_tls = use_tls;
 	return true;
@@ -187,37 +892,44 @@ bool Socket::set_tls(TLS use_tls)
 
 bool Socket::start_connect(std::string_view const& host, int port)
 {
-	std::lock_guard guard(m_shared_state->mutex);
-
 	if (m_shared_state->state != State::Disconnected)
 	{
 		m_shared_state->last_error = "Socket is busy";
 		return false;
 	}
 
-	if (m_worker_thread.joinable())
-		m_worker_thread.join();
-
 	m_shared_state->host = host;
 	m_shared_state->port = port;
 	m_shared_state->last_error_buffer.clear();
 	m_shared_state->last_error = std::string_view();
-	m_shared_state->state      = State::Connecting;
-	m_worker_thread            = std::jthread(&worker, m_shared_state);
+
+	// An empty host means listening for connections
+	if (host.empty())
+		return m_shared_state->open_listener(port);
+
+	if (m_shared_state->use_tls != TLS::NoTLS)
+	{
+		bool tls_ok = m_shared_state->tls_session.init_as_client(*m_shared_state, host, m_shared_state->use_tls == TLS::TLS, port);
+		if (!tls_ok)
+		{
+			m_shared_state->set_error(std::string(m_shared_state->tls_session.get_last_error()));
+			return false;
+		}
+	}
+
+	m_shared_state->state = State::Connecting;
+	m_shared_state->socket_set->m_reactor->resolve(m_shared_state, m_shared_state->host, port);
 	return true;
 }
 
 void Socket::tls_handshake()
 {
-	std::lock_guard guard(m_shared_state->mutex);
-
 	m_shared_state->tls_session.pump_read();
 	m_shared_state->tls_session.pump_write();
 
 	if (!m_shared_state->tls_session)
 	{
-		m_shared_state->last_error_buffer = m_shared_state->tls_session.get_last_error();
-		m_shared_state->last_error        = m_shared_state->last_error_buffer;
+		m_shared_state->set_error(std::string(m_shared_state->tls_session.get_last_error()));
 		close_impl();
 	}
 	else if (m_shared_state->tls_session.is_connected())
@@ -226,10 +938,13 @@ void Socket::tls_handshake()
 	}
 }
 
-int Socket::read_nonblock(void* data, int maxlen)
+bool Socket::is_readable() const
 {
-	std::lock_guard guard(m_shared_state->mutex);
+	return m_shared_state->read_ready;
+}
 
+int Socket::read_nonblock(void* data, int maxlen)
+{
 	if (m_shared_state->use_tls != TLS::NoTLS)
 	{
 		bool pumped = m_shared_state->tls_session.pump_read();
@@ -244,8 +959,7 @@ int Socket::read_nonblock(void* data, int maxlen)
 
 		if (!m_shared_state->tls_session)
 		{
-			m_shared_state->last_error_buffer = m_shared_state->tls_session.get_last_error();
-			m_shared_state->last_error        = m_shared_state->last_error_buffer;
+			m_shared_state->set_error(std::string(m_shared_state->tls_session.get_last_error()));
 			close_impl();
 			return -1;
 		}
@@ -258,13 +972,36 @@ int Socket::read_nonblock(void* data, int maxlen)
 	}
 }
 
+int Socket::read_available(BlobBuffer& buffer, std::size_t max_len)
+{
+	std::size_t received_total = 0;
+	while (received_total < max_len)
+	{
+		if (buffer.space() < READ_CHUNK_SIZE)
+			buffer.flush();
+
+		if (buffer.space() < READ_CHUNK_SIZE)
+			buffer.reserve(buffer.capacity() + std::max(buffer.capacity(), READ_CHUNK_SIZE));
+
+		int received = read_nonblock(buffer.tail(), int(std::min(buffer.space(), max_len - received_total)));
+		if (received < 0)
+			return -1;
+
+		if (received == 0)
+			break;
+
+		buffer.added_to_tail(received);
+		received_total += received;
+	}
+
+	return int(received_total);
+}
+
 bool Socket::write(void const* data, int len)
 {
 	if (len <= 0)
 		return true;
 
-	std::lock_guard guard(m_shared_state->mutex);
-
 	int written;
 	if (m_shared_state->use_tls != TLS::NoTLS)
 	{
@@ -274,8 +1011,7 @@ bool Socket::write(void const* data, int len)
 
 		if (!m_shared_state->tls_session)
 		{
-			m_shared_state->last_error_buffer = m_shared_state->tls_session.get_last_error();
-			m_shared_state->last_error        = m_shared_state->last_error_buffer;
+			m_shared_state->set_error(std::string(m_shared_state->tls_session.get_last_error()));
 			close_impl();
 		}
 	}
@@ -292,7 +1028,6 @@ void Socket::shutdown()
 {
 	if (m_shared_state)
 	{
-		std::lock_guard guard(m_shared_state->mutex);
 		m_shared_state->tls_session.shutdown();
 		m_shared_state->tls_session.pump_write();
 	}
@@ -301,53 +1036,70 @@ void Socket::shutdown()
 void Socket::close()
 {
 	if (m_shared_state)
-	{
-		std::lock_guard guard(m_shared_state->mutex);
 		close_impl();
-	}
 }
 
 std::optional<Socket> Socket::accept_nonblock()
 {
-	std::lock_guard guard(m_shared_state->mutex);
+	SharedState* shared_state = m_shared_state.get();
 
-	if (!m_shared_state->socket)
+	if (shared_state->fd == INVALID_NATIVE_SOCKET)
 	{
-		m_shared_state->last_error = "Socket is not connected";
+		shared_state->last_error = "Socket is not connected";
 		close_impl();
 		return std::nullopt;
 	}
 
-	if (!SDLNet_SocketReady(m_shared_state->socket))
+	if (!shared_state->read_ready)
 		return std::nullopt;
 
-	TCPsocket new_socket = SDLNet_TCP_Accept(m_shared_state->socket);
-	if (!new_socket)
+	NativeSocket new_fd = accept(shared_state->fd, nullptr, nullptr);
+	if (new_fd == INVALID_NATIVE_SOCKET)
 	{
-		m_shared_state->last_error_buffer = SDLNet_GetError();
-		m_shared_state->last_error        = m_shared_state->last_error_buffer;
-		close_impl();
+		int error = last_socket_error();
+		if (is_would_block(error))
+		{
+			shared_state->read_ready = false;
+		}
+		else
+		{
+			// Failing to accept one client is not a reason to stop listening
+			shared_state->set_socket_error(error);
+		}
 		return std::nullopt;
 	}
 
-	if (SDLNet_TCP_AddSocket(reinterpret_cast<SDLNet_SocketSet>(m_shared_state->socket_set->m_data), new_socket) == -1)
+	std::optional<Socket> client = std::make_optional<Socket>(shared_state->socket_set);
+	SharedState* client_state    = client->m_shared_state.get();
+
+	if (!configure_socket(new_fd, true) || !shared_state->socket_set->m_reactor->add(client_state, new_fd))
 	{
-		SDLNet_TCP_Close(new_socket);
-		m_shared_state->last_error_buffer.clear();
-		m_shared_state->last_error = "unable to accept new client: SocketSet is full";
+		shared_state->set_socket_error(last_socket_error());
+		close_native_socket(new_fd);
 		return std::nullopt;
 	}
 
-	std::optional<Socket> client = std::make_optional<Socket>(m_shared_state->socket_set);
-
-	SharedState* client_state = client->m_shared_state.get();
-	client_state->socket      = new_socket;
+	client_state->fd          = new_fd;
+	client_state->read_ready  = true;
+	client_state->write_ready = true;
+	client_state->state       = State::Connected;
 	client_state->fill_remote_address();
-	client_state->state = State::Connected;
 
 	return client;
 }
 
+void Socket::accept_pending(AcceptCallback const& on_accept)
+{
+	for (int accepted = 0; accepted < MAX_ACCEPTS_PER_CALL; ++accepted)
+	{
+		std::optional<Socket> client = accept_nonblock();
+		if (!client.has_value())
+			break;
+
+		on_accept(std::move(client).value());
+	}
+}
+
 Socket::State Socket::get_state() const
 {
 	return m_shared_state->state;
@@ -368,124 +1120,464 @@ std::string_view Socket::get_last_error() const
 	return m_shared_state->last_error;
 }
 
+std::size_t Socket::get_pending_write_size() const
+{
+	return m_shared_state ? m_shared_state->outbuffer.size() : 0;
+}
+
 void Socket::close_impl()
 {
-	if (m_worker_thread.joinable())
+	m_shared_state->close();
+}
+
+SocketSet::SocketSet()
+    : m_reactor(new Reactor)
+{
+}
+
+SocketSet::~SocketSet()
+{
+}
+
+std::shared_ptr<SocketSet> SocketSet::create()
+{
+	struct enabler : public SocketSet
+	{
+		enabler()
+		    : SocketSet()
+		{
+		}
+	};
+
+	return std::make_shared<enabler>();
+}
+
+SocketSet::ResolverStats SocketSet::get_resolver_stats() const
+{
+	ResolverStats stats = m_reactor->resolver_stats;
+	stats.cached_hosts  = m_reactor->resolver_cache.size();
+	stats.threads       = m_reactor->resolver_threads.size();
+
+	for (auto const& item : m_reactor->resolver_cache)
 	{
-		m_worker_thread.request_stop();
-		m_worker_thread.detach();
+		if (item.second.pending)
+			++stats.pending;
 	}
-	m_shared_state->close();
+
+	return stats;
 }
 
-void Socket::worker(std::stop_token stop_token, std::shared_ptr<SharedState> shared_state)
+void SocketSet::flush_resolver_cache()
 {
-	std::unique_lock guard(shared_state->mutex);
+	std::erase_if(m_reactor->resolver_cache, [](auto const& item) { return !item.second.pending; });
+}
 
-	if (stop_token.stop_requested())
-		return;
+bool SocketSet::poll(int timeout_msec)
+{
+	bool activity = m_reactor->process_resolved();
 
-	std::string host = shared_state->host;
-	int port         = shared_state->port;
+	if (m_reactor->sockets.empty())
+		return activity;
 
-	TCPsocket socket;
-	IPaddress address;
-	int result;
+#ifdef SOCKET_USE_EPOLL
+	std::vector<epoll_event>& events = m_reactor->events;
 
-	bool const is_server = host.empty();
-	if (!is_server)
+	int count = epoll_wait(m_reactor->epoll_fd, events.data(), int(events.size()), activity ? 0 : timeout_msec);
+	for (int idx = 0; idx < count; ++idx)
 	{
-		guard.unlock();
-		result = SDLNet_ResolveHost(&address, host.c_str(), port);
-		guard.lock();
+		Socket::SharedState* shared_state = reinterpret_cast<Socket::SharedState*>(events[idx].data.ptr);
+		std::uint32_t const flags         = events[idx].events;
 
-		if (stop_token.stop_requested())
-			return;
+		bool const readable = flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+		bool const writable = flags & (EPOLLOUT | EPOLLHUP | EPOLLERR);
+		shared_state->handle_ready(readable, writable);
 	}
-	else
+
+	// Edge-triggered events that didn't fit stay queued in the kernel for the next poll
+	if (count == int(events.size()))
+		events.resize(events.size() * 2);
+#else
+	std::vector<PollFd>& pollfds              = m_reactor->pollfds;
+	std::vector<Socket::SharedState*>& polled = m_reactor->polled;
+
+	pollfds.clear();
+	polled = m_reactor->sockets;
+
+	for (Socket::SharedState* shared_state : polled)
 	{
-		address.host = INADDR_ANY;
-		address.port = SDL_SwapBE16(port);
-		result       = 0;
+		PollFd& pollfd = pollfds.emplace_back();
+		pollfd.fd      = shared_state->fd;
+		pollfd.events  = POLLIN;
+		pollfd.revents = 0;
+
+		if (shared_state->state == Socket::State::Connecting || !shared_state->outbuffer.empty())
+			pollfd.events |= POLLOUT;
 	}
 
-	if (result == -1)
+	int count = poll_native_sockets(pollfds.data(), pollfds.size(), activity ? 0 : timeout_msec);
+	for (std::size_t idx = 0; count > 0 && idx < pollfds.size(); ++idx)
+	{
+		short const flags = pollfds[idx].revents;
+		if (!flags)
+			continue;
+
+		// A socket closed earlier in this loop no longer owns this descriptor
+		Socket::SharedState* shared_state = polled[idx];
+		if (shared_state->fd != pollfds[idx].fd)
+			continue;
+
+		bool const readable = flags & (POLLIN | POLLHUP | POLLERR);
+		bool const writable = flags & (POLLOUT | POLLHUP | POLLERR);
+		shared_state->handle_ready(readable, writable);
+	}
+#endif
+
+	return activity || count > 0;
+}
+
+struct DatagramSocket::State
+{
+	State()
+	    : fd(INVALID_NATIVE_SOCKET)
+	    , family(AF_UNSPEC)
+	    , local_port(0)
+	    , truncated(0)
+	    , sender_port(0)
+	    , target_port(0)
 	{
-		shared_state->last_error_buffer = SDLNet_GetError();
-		shared_state->last_error        = shared_state->last_error_buffer;
-		shared_state->state             = State::Disconnected;
-		return;
 	}
 
-	if (shared_state->use_tls != TLS::NoTLS && !is_server)
+	~State()
 	{
-		bool tls_ok = shared_state->tls_session.init_as_client(*shared_state, host, shared_state->use_tls == TLS::TLS);
-		if (!tls_ok)
+		close();
+	}
+
+	NativeSocket fd;
+	int family;
+	int local_port;
+	std::uint64_t truncated;
+	std::string_view last_error;
+	std::string last_error_buffer;
+
+	std::vector<char> buffer;
+	std::string sender_host;
+	int sender_port;
+
+	std::string target_host;
+	int target_port;
+	Address target;
+
+#ifdef SOCKET_USE_RECVMMSG
+	std::vector<mmsghdr> headers;
+	std::vector<iovec> iovecs;
+	std::vector<Address> senders;
+#endif
+
+	void set_error(std::string&& message)
+	{
+		last_error_buffer = std::move(message);
+		last_error        = last_error_buffer;
+	}
+
+	void set_socket_error(int error)
+	{
+		set_error(socket_error_string(error));
+	}
+
+	void deliver(ReceiveCallback const& callback, char const* data, std::size_t len, sockaddr_storage const& address, socklen_t address_len)
+	{
+		if (!format_address(address, address_len, sender_host, sender_port))
 		{
-			shared_state->last_error_buffer = shared_state->tls_session.get_last_error();
-			shared_state->last_error        = shared_state->last_error_buffer;
-			shared_state->state             = State::Disconnected;
-			return;
+			sender_host.clear();
+			sender_port = 0;
 		}
+
+		callback(std::string_view(data, len), sender_host, sender_port);
 	}
 
-	guard.unlock();
-	socket = SDLNet_TCP_Open(&address);
-	guard.lock();
+	// Returns false when there is nothing (more) to receive right now
+	bool handle_receive_error(int error)
+	{
+		if (is_datagram_truncated(error))
+		{
+			++truncated;
+			return true;
+		}
+
+		// An ICMP port unreachable for an earlier send, not a problem with this socket
+		if (is_datagram_refused(error))
+			return true;
+
+		if (!is_would_block(error))
+			set_socket_error(error);
+
+		return false;
+	}
 
-	if (stop_token.stop_requested())
+	void close()
 	{
-		if (socket)
-			SDLNet_TCP_Close(socket);
+		if (fd != INVALID_NATIVE_SOCKET)
+		{
+			close_native_socket(fd);
+			fd = INVALID_NATIVE_SOCKET;
+		}
 
-		return;
+		family      = AF_UNSPEC;
+		local_port  = 0;
+		target_port = 0;
+		target_host.clear();
 	}
+};
+
+DatagramSocket::DatagramSocket()
+    : m_state(new State)
+{
+}
+
+DatagramSocket::~DatagramSocket()
+{
+}
 
-	if (!socket)
+bool DatagramSocket::open(int port)
+{
+	State* state = m_state.get();
+	state->close();
+
+	sockaddr_in6 address;
+	std::memset(&address, 0, sizeof(address));
+	address.sin6_family = AF_INET6;
+	address.sin6_addr   = in6addr_any;
+	address.sin6_port   = htons(std::uint16_t(port));
+
+	sockaddr_in address4;
+	std::memset(&address4, 0, sizeof(address4));
+	address4.sin_family      = AF_INET;
+	address4.sin_addr.s_addr = htonl(INADDR_ANY);
+	address4.sin_port        = htons(std::uint16_t(port));
+
+	sockaddr const* bind_address = reinterpret_cast<sockaddr const*>(&address);
+	socklen_t bind_address_len   = sizeof(address);
+	int family                   = AF_INET6;
+
+	// Same dual-stack preference as the stream listener
+	NativeSocket new_fd = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+	if (new_fd != INVALID_NATIVE_SOCKET)
 	{
-		shared_state->last_error_buffer = SDLNet_GetError();
-		shared_state->last_error        = shared_state->last_error_buffer;
-		shared_state->state             = State::Disconnected;
-		return;
+		int disable = 0;
+		setsockopt(new_fd, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<char const*>(&disable), sizeof(disable));
+	}
+	else
+	{
+		new_fd           = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		bind_address     = reinterpret_cast<sockaddr const*>(&address4);
+		bind_address_len = sizeof(address4);
+		family           = AF_INET;
 	}
 
-	if (SDLNet_TCP_AddSocket(reinterpret_cast<SDLNet_SocketSet>(shared_state->socket_set->m_data), socket) == -1)
+	if (new_fd == INVALID_NATIVE_SOCKET)
 	{
-		SDLNet_TCP_Close(socket);
-		shared_state->last_error = "unable to connect socket: SocketSet is full";
-		return;
+		state->set_socket_error(last_socket_error());
+		return false;
 	}
 
-	shared_state->socket     = socket;
-	shared_state->last_error = std::string_view();
-	shared_state->state      = shared_state->use_tls != TLS::NoTLS ? State::TLSHandshaking : State::Connected;
+	int enable = 1;
+	setsockopt(new_fd, SOL_SOCKET, SO_BROADCAST, reinterpret_cast<char const*>(&enable), sizeof(enable));
+
+	if (!configure_socket(new_fd, false) || bind(new_fd, bind_address, bind_address_len) != 0)
+	{
+		state->set_socket_error(last_socket_error());
+		close_native_socket(new_fd);
+		return false;
+	}
+
+	sockaddr_storage local_address;
+	socklen_t local_address_len = sizeof(local_address);
+	if (getsockname(new_fd, reinterpret_cast<sockaddr*>(&local_address), &local_address_len) == 0)
+	{
+		if (local_address.ss_family == AF_INET6)
+			state->local_port = ntohs(reinterpret_cast<sockaddr_in6 const*>(&local_address)->sin6_port);
+		else if (local_address.ss_family == AF_INET)
+			state->local_port = ntohs(reinterpret_cast<sockaddr_in const*>(&local_address)->sin_port);
+	}
+
+	if (state->buffer.empty())
+	{
+#ifdef SOCKET_USE_RECVMMSG
+		state->buffer.resize(DATAGRAM_BATCH_SIZE * DATAGRAM_MAX_SIZE);
+		state->headers.resize(DATAGRAM_BATCH_SIZE);
+		state->iovecs.resize(DATAGRAM_BATCH_SIZE);
+		state->senders.resize(DATAGRAM_BATCH_SIZE);
+
+		for (std::size_t idx = 0; idx < DATAGRAM_BATCH_SIZE; ++idx)
+		{
+			state->iovecs[idx].iov_base = state->buffer.data() + idx * DATAGRAM_MAX_SIZE;
+			state->iovecs[idx].iov_len  = DATAGRAM_MAX_SIZE;
+
+			msghdr& header    = state->headers[idx].msg_hdr;
+			header            = msghdr();
+			header.msg_name   = &state->senders[idx].storage;
+			header.msg_iov    = &state->iovecs[idx];
+			header.msg_iovlen = 1;
+		}
+#else
+		state->buffer.resize(DATAGRAM_MAX_SIZE);
+#endif
+	}
+
+	state->fd         = new_fd;
+	state->family     = family;
+	state->last_error = std::string_view();
+	return true;
 }
 
-SocketSet::SocketSet(int max_sockets)
+void DatagramSocket::close()
 {
-	assert(max_sockets > 0);
-	m_data = SDLNet_AllocSocketSet(max_sockets);
+	m_state->close();
 }
 
-SocketSet::~SocketSet()
+bool DatagramSocket::is_open() const
 {
-	SDLNet_FreeSocketSet(reinterpret_cast<SDLNet_SocketSet>(m_data));
+	return m_state->fd != INVALID_NATIVE_SOCKET;
 }
 
-std::shared_ptr<SocketSet> SocketSet::create(int max_sockets)
+int DatagramSocket::receive(ReceiveCallback const& callback, int max_count)
 {
-	struct enabler : public SocketSet
+	State* state = m_state.get();
+	int received = 0;
+
+	while (state->fd != INVALID_NATIVE_SOCKET && received < max_count)
 	{
-		enabler(int max_sockets)
-		    : SocketSet(max_sockets)
+#ifdef SOCKET_USE_RECVMMSG
+		unsigned int const batch = unsigned(std::min<std::size_t>(DATAGRAM_BATCH_SIZE, std::size_t(max_count - received)));
+		for (unsigned int idx = 0; idx < batch; ++idx)
 		{
+			// The kernel overwrites these on every call
+			state->headers[idx].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+			state->headers[idx].msg_hdr.msg_flags   = 0;
+			state->headers[idx].msg_len             = 0;
 		}
-	};
 
-	return std::make_shared<enabler>(max_sockets);
+		int const count = recvmmsg(state->fd, state->headers.data(), batch, MSG_DONTWAIT, nullptr);
+		if (count <= 0)
+		{
+			if (count < 0 && state->handle_receive_error(last_socket_error()))
+				continue;
+			break;
+		}
+
+		received += count;
+
+		for (int idx = 0; idx < count && state->fd != INVALID_NATIVE_SOCKET; ++idx)
+		{
+			msghdr const& header = state->headers[idx].msg_hdr;
+			if (header.msg_flags & MSG_TRUNC)
+			{
+				++state->truncated;
+				continue;
+			}
+
+			char const* data = state->buffer.data() + idx * DATAGRAM_MAX_SIZE;
+			state->deliver(callback, data, state->headers[idx].msg_len, state->senders[idx].storage, header.msg_namelen);
+		}
+
+		// A short batch means the queue is empty
+		if (unsigned(count) < batch)
+			break;
+#else
+		sockaddr_storage address;
+		socklen_t address_len = sizeof(address);
+
+		int const len = recvfrom(state->fd, state->buffer.data(), int(state->buffer.size()), 0, reinterpret_cast<sockaddr*>(&address), &address_len);
+		if (len < 0)
+		{
+			if (state->handle_receive_error(last_socket_error()))
+				continue;
+			break;
+		}
+
+		++received;
+		state->deliver(callback, state->buffer.data(), std::size_t(len), address, address_len);
+#endif
+	}
+
+	return received;
+}
+
+bool DatagramSocket::send_to(std::string_view const& host, int port, void const* data, int len)
+{
+	State* state = m_state.get();
+
+	if (state->fd == INVALID_NATIVE_SOCKET)
+	{
+		state->last_error = "Socket is not open";
+		return false;
+	}
+
+	// Control surfaces are usually fed from a single target, so remember the last one
+	if (port != state->target_port || host != state->target_host)
+	{
+		addrinfo hints;
+		std::memset(&hints, 0, sizeof(hints));
+		hints.ai_family   = state->family;
+		hints.ai_socktype = SOCK_DGRAM;
+		hints.ai_protocol = IPPROTO_UDP;
+		hints.ai_flags    = AI_NUMERICHOST | AI_NUMERICSERV;
+		if (state->family == AF_INET6)
+			hints.ai_flags |= AI_V4MAPPED;
+
+		std::string const host_string(host);
+		std::string const port_string = std::to_string(port);
+		addrinfo* info                = nullptr;
+
+		int error = getaddrinfo(host_string.c_str(), port_string.c_str(), &hints, &info);
+		if (error != 0 || !info || info->ai_addrlen > sizeof(sockaddr_storage))
+		{
+			std::string message  = "Invalid address ";
+			message             += host_string;
+			message             += ": ";
+			message             += error != 0 ? gai_strerror(error) : "no usable address";
+			state->set_error(std::move(message));
+
+			if (info)
+				freeaddrinfo(info);
+
+			state->target_port = 0;
+			state->target_host.clear();
+			return false;
+		}
+
+		std::memcpy(&state->target.storage, info->ai_addr, info->ai_addrlen);
+		state->target.length = socklen_t(info->ai_addrlen);
+		state->target_host   = host_string;
+		state->target_port   = port;
+
+		freeaddrinfo(info);
+	}
+
+	if (sendto(state->fd, reinterpret_cast<char const*>(data), len, SEND_FLAGS, reinterpret_cast<sockaddr const*>(&state->target.storage), state->target.length) < 0)
+	{
+		int error = last_socket_error();
+		if (is_would_block(error))
+			state->last_error = "Send buffer full, datagram dropped";
+		else
+			state->set_socket_error(error);
+		return false;
+	}
+
+	return true;
+}
+
+int DatagramSocket::get_local_port() const
+{
+	return m_state->local_port;
+}
+
+std::uint64_t DatagramSocket::get_truncated_count() const
+{
+	return m_state->truncated;
 }
 
-bool SocketSet::poll(int timeout_msec) const
+std::string_view DatagramSocket::get_last_error() const
 {
-	return SDLNet_CheckSockets(reinterpret_cast<SDLNet_SocketSet>(m_data), timeout_msec) > 0;
+	return m_state->last_error;
 }
@@ -19,15 +19,17 @@
 #ifndef DECK_ASSISTANT_UTIL_SOCKET_H
 #define DECK_ASSISTANT_UTIL_SOCKET_H
 
+#include <cstdint>
+#include <functional>
 #include <memory>
 #include <optional>
 #include <string>
 #include <string_view>
-#include <thread>
 
 namespace util
 {
 
+class BlobBuffer;
 class SocketSet;
 
 class Socket
@@ -50,6 +52,11 @@ public:
 
 	struct SharedState;
 
+	using AcceptCallback = std::function<void(Socket&& client)>;
+
+	// Upper bound on what a single read_available() call drains from a client
+	static constexpr std::size_t const DEFAULT_READ_LIMIT = 4 * 1024 * 1024;
+
 public:
 	Socket(std::shared_ptr<SocketSet> const& socket_set);
 	Socket(Socket const&) = delete;
@@ -61,48 +68,121 @@ public:
 
 	TLS get_tls() const;
 	bool set_tls(TLS use_tls);
+	bool is_tls_resumed() const;
 
 	bool start_connect(std::string_view const& host, int port);
 	void tls_handshake();
+	bool is_readable() const;
 	int read_nonblock(void* data, int maxlen);
 	bool write(void const* data, int len);
+
+	// Drains the socket into the buffer, but no more than max_len bytes so a flood can't stall the main loop.
+	// Returns the number of bytes added, or -1 once the connection is gone.
+	int read_available(BlobBuffer& buffer, std::size_t max_len = DEFAULT_READ_LIMIT);
 	void shutdown();
 	void close();
 
 	std::optional<Socket> accept_nonblock();
 
+	// Hands out the connections waiting on a listening socket, a limited number per call
+	void accept_pending(AcceptCallback const& on_accept);
+
 	State get_state() const;
 	std::string const& get_remote_host() const;
 	int get_remote_port() const;
 	std::string_view get_last_error() const;
+	std::size_t get_pending_write_size() const;
 
 private:
 	void close_impl();
-	static void worker(std::stop_token stop_token, std::shared_ptr<SharedState> shared_state);
 
-	std::jthread m_worker_thread;
 	std::shared_ptr<SharedState> m_shared_state;
 };
 
+/**
+ * Non-blocking I/O reactor that owns all sockets created for it.
+ *
+ * Readiness is collected with epoll (edge-triggered) on Linux and poll()
+ * elsewhere, so sockets only touch the network when there is something to do.
+ * Host names are resolved on a small pool of background threads and cached for
+ * a while, connects complete asynchronously; everything else happens on the
+ * thread calling poll().
+ */
 class SocketSet
 {
 private:
-	SocketSet(int max_sockets);
+	SocketSet();
+
+public:
+	struct ResolverStats
+	{
+		std::uint64_t lookups       = 0; // Host lookups requested by connecting sockets
+		std::uint64_t cache_hits    = 0; // Served from the cache without asking the resolver
+		std::uint64_t negative_hits = 0; // Failed straight away on a recently failed lookup
+		std::uint64_t coalesced     = 0; // Joined a lookup for the same host already in progress
+		std::uint64_t queries       = 0; // Passed on to the system resolver
+		std::uint64_t failures      = 0; // Resolver queries that failed
+		std::size_t cached_hosts    = 0;
+		std::size_t pending         = 0;
+		std::size_t threads         = 0;
+	};
 
 public:
 	SocketSet(SocketSet const& other) = delete;
 	SocketSet(SocketSet&& other)      = delete;
 	~SocketSet();
 
-	static std::shared_ptr<SocketSet> create(int max_sockets);
-	bool poll(int timeout_msec = 0) const;
+	static std::shared_ptr<SocketSet> create();
+	bool poll(int timeout_msec = 0);
+
+	ResolverStats get_resolver_stats() const;
+	void flush_resolver_cache();
 
 	SocketSet& operator=(SocketSet const& other) = delete;
 	SocketSet& operator=(SocketSet&& other)      = delete;
 
 private:
 	friend class Socket;
-	void* m_data;
+	struct Reactor;
+	std::unique_ptr<Reactor> m_reactor;
+};
+
+/**
+ * Non-blocking UDP socket for datagram protocols such as OSC.
+ *
+ * It is not part of a SocketSet: the owner drains it with receive() once per
+ * tick. On Linux datagrams are fetched in batches with recvmmsg(), so a burst
+ * from a control surface costs one system call per batch instead of one each.
+ * Sending only takes numeric addresses, there is no resolver on this path.
+ */
+class DatagramSocket
+{
+public:
+	using ReceiveCallback = std::function<void(std::string_view const& data, std::string const& host, int port)>;
+
+public:
+	DatagramSocket();
+	DatagramSocket(DatagramSocket const&) = delete;
+	DatagramSocket(DatagramSocket&&)      = delete;
+	~DatagramSocket();
+
+	DatagramSocket& operator=(DatagramSocket const&) = delete;
+	DatagramSocket& operator=(DatagramSocket&&)      = delete;
+
+	bool open(int port);
+	void close();
+	bool is_open() const;
+
+	int receive(ReceiveCallback const& callback, int max_count);
+	bool send_to(std::string_view const& host, int port, void const* data, int len);
+
+	int get_local_port() const;
+	std::uint64_t get_truncated_count() const;
+	std::string_view get_last_error() const;
+
+private:
+	struct State;
+	std::unique_ptr<State> m_state;
 };
 
 } // namespace util
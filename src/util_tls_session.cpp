@@ -18,7 +18,10 @@
 
 #include "util_tls_session.h"
 #include "util_blob.h"
+#include <chrono>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 
 #if (defined HAVE_GNUTLS)
 #include <gnutls/gnutls.h>
@@ -43,7 +46,10 @@ struct util::TLSSession::State
 {
 	IO* io = nullptr;
 	std::string remote_name;
+	std::string cache_key;
 	bool handshaking;
+	bool session_offered = false;
+	bool session_stored  = false;
 	BlobBuffer inbuffer;
 	BlobBuffer outbuffer;
 
@@ -69,6 +75,110 @@ struct util::TLSSession::State
 
 namespace
 {
+
+// Sessions kept for resumption, the least recently stored one goes first
+constexpr std::size_t const MAX_CACHED_SESSIONS = 64;
+
+// Servers rarely honour tickets older than this anyway
+constexpr std::chrono::hours const MAX_SESSION_AGE = std::chrono::hours(2);
+
+struct CachedSession
+{
+	std::string data;
+	std::chrono::steady_clock::time_point stored;
+};
+
+struct SessionCache
+{
+	std::mutex mutex;
+	std::unordered_map<std::string, CachedSession> sessions;
+	TLSSession::ResumptionStats stats;
+};
+
+SessionCache& get_session_cache()
+{
+	static SessionCache cache;
+	return cache;
+}
+
+std::string make_session_cache_key(std::string_view const& remote_name, int remote_port, bool verify_certificate)
+{
+	// A session from an unverified connection must never be resumed into a verified one
+	std::string key;
+	key.reserve(remote_name.size() + 10);
+	key += remote_name;
+	key += ':';
+	key += std::to_string(remote_port);
+	key += verify_certificate ? "" : "/noverify";
+	return key;
+}
+
+void store_session(std::string const& key, std::string&& data)
+{
+	if (key.empty() || data.empty())
+		return;
+
+	SessionCache& cache = get_session_cache();
+	std::lock_guard guard(cache.mutex);
+
+	if (cache.sessions.size() >= MAX_CACHED_SESSIONS && !cache.sessions.contains(key))
+	{
+		auto oldest = cache.sessions.begin();
+		for (auto iter = cache.sessions.begin(); iter != cache.sessions.end(); ++iter)
+		{
+			if (iter->second.stored < oldest->second.stored)
+				oldest = iter;
+		}
+		cache.sessions.erase(oldest);
+	}
+
+	CachedSession& cached = cache.sessions[key];
+	cached.data           = std::move(data);
+	cached.stored         = std::chrono::steady_clock::now();
+	++cache.stats.stored;
+}
+
+bool load_session(std::string const& key, std::string& data)
+{
+	if (key.empty())
+		return false;
+
+	SessionCache& cache = get_session_cache();
+	std::lock_guard guard(cache.mutex);
+
+	auto iter = cache.sessions.find(key);
+	if (iter == cache.sessions.end())
+		return false;
+
+	if (std::chrono::steady_clock::now() - iter->second.stored > MAX_SESSION_AGE)
+	{
+		cache.sessions.erase(iter);
+		return false;
+	}
+
+	data = iter->second.data;
+	return true;
+}
+
+void forget_session(std::string const& key)
+{
+	SessionCache& cache = get_session_cache();
+	std::lock_guard guard(cache.mutex);
+	cache.sessions.erase(key);
+}
+
+void count_handshake(bool offered, bool resumed)
+{
+	SessionCache& cache = get_session_cache();
+	std::lock_guard guard(cache.mutex);
+
+	++cache.stats.handshakes;
+	if (offered)
+		++cache.stats.offered;
+	if (resumed)
+		++cache.stats.resumed;
+}
+
 #if (defined HAVE_GNUTLS)
 
 int verify_func(gnutls_session_t session)
@@ -144,6 +254,11 @@ int state_init_as_client(TLSSession::State& state, bool verify_certificate)
 
 	gnutls_handshake_set_timeout(state.session, GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
 
+	// Offer a previous session; the server may decline and fall back to a full handshake
+	std::string cached;
+	if (load_session(state.cache_key, cached))
+		state.session_offered = gnutls_session_set_data(state.session, cached.data(), cached.size()) == GNUTLS_E_SUCCESS;
+
 	last_error = gnutls_handshake(state.session);
 	if (last_error == GNUTLS_E_INTERRUPTED || last_error == GNUTLS_E_AGAIN)
 		last_error = GNUTLS_E_SUCCESS;
@@ -151,8 +266,65 @@ int state_init_as_client(TLSSession::State& state, bool verify_certificate)
 	return last_error;
 }
 
+void save_gnutls_session(TLSSession::State& state)
+{
+	gnutls_datum_t data;
+	if (gnutls_session_get_data2(state.session, &data) != GNUTLS_E_SUCCESS)
+		return;
+
+	store_session(state.cache_key, std::string(reinterpret_cast<char const*>(data.data), data.size));
+	gnutls_free(data.data);
+	state.session_stored = true;
+}
+
+void handshake_completed(TLSSession::State& state)
+{
+	count_handshake(state.session_offered, gnutls_session_is_resumed(state.session));
+
+	// TLS 1.3 tickets only arrive after the handshake, see save_pending_session()
+	if (gnutls_protocol_get_version(state.session) != GNUTLS_TLS1_3)
+		save_gnutls_session(state);
+}
+
+void save_pending_session(TLSSession::State& state)
+{
+	if (!state.session_stored && (gnutls_session_get_flags(state.session) & GNUTLS_SFLAGS_SESSION_TICKET))
+		save_gnutls_session(state);
+}
+
 #elif (defined HAVE_OPENSSL)
 
+int new_session_func(SSL* ssl, SSL_SESSION* session)
+{
+	TLSSession::State* state = reinterpret_cast<TLSSession::State*>(SSL_get_app_data(ssl));
+	if (!state || state->cache_key.empty() || !SSL_SESSION_is_resumable(session))
+		return 0;
+
+	int const length = i2d_SSL_SESSION(session, nullptr);
+	if (length <= 0)
+		return 0;
+
+	std::string data(length, '\0');
+	unsigned char* dest = reinterpret_cast<unsigned char*>(data.data());
+	i2d_SSL_SESSION(session, &dest);
+
+	store_session(state->cache_key, std::move(data));
+	state->session_stored = true;
+
+	// We kept a serialised copy, not a reference
+	return 0;
+}
+
+void handshake_completed(TLSSession::State& state)
+{
+	count_handshake(state.session_offered, SSL_session_reused(state.connection));
+}
+
+void save_pending_session(TLSSession::State& state)
+{
+	// OpenSSL hands out new sessions through new_session_func()
+}
+
 bool prepare_ssl_context(SSL_CTX* ctx)
 {
 	int result = SSL_CTX_set_default_verify_paths(ctx);
@@ -205,6 +377,10 @@ SSL_CTX* get_ssl_context()
 			return nullptr;
 		}
 
+		// Sessions are cached by host and port ourselves, see new_session_func()
+		SSL_CTX_set_session_cache_mode(new_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(new_ctx, &new_session_func);
+
 		ctx = new_ctx;
 	}
 	return ctx;
@@ -238,12 +414,25 @@ int state_init_as_client(TLSSession::State& state, bool verify_certificate)
 	}
 
 	SSL_set_bio(state.connection, state.rbio, state.wbio);
+	SSL_set_app_data(state.connection, &state);
 	SSL_set_verify(state.connection, SSL_VERIFY_PEER, verify_certificate ? &yes_verify_func : &no_verify_func);
 	SSL_set_connect_state(state.connection);
 
 	if (!state.remote_name.empty())
 		SSL_set_tlsext_host_name(state.connection, state.remote_name.c_str());
 
+	// Offer a previous session; the server may decline and fall back to a full handshake
+	std::string cached;
+	if (load_session(state.cache_key, cached))
+	{
+		unsigned char const* data = reinterpret_cast<unsigned char const*>(cached.data());
+		if (SSL_SESSION* session = d2i_SSL_SESSION(nullptr, &data, long(cached.size())); session)
+		{
+			state.session_offered = SSL_set_session(state.connection, session) == 1;
+			SSL_SESSION_free(session);
+		}
+	}
+
 	int result = SSL_do_handshake(state.connection);
 	if (result < 0)
 	{
@@ -278,7 +467,7 @@ bool TLSSession::operator!() const
 	return !m_state;
 }
 
-bool TLSSession::init_as_client(IO& io, std::string_view const& remote_name, bool verify_certificate)
+bool TLSSession::init_as_client(IO& io, std::string_view const& remote_name, bool verify_certificate, int remote_port)
 {
 	m_last_error = 0;
 
@@ -288,6 +477,9 @@ bool TLSSession::init_as_client(IO& io, std::string_view const& remote_name, boo
 	m_state->remote_name = remote_name;
 	m_state->handshaking = true;
 
+	if (!remote_name.empty() && remote_port > 0)
+		m_state->cache_key = make_session_cache_key(remote_name, remote_port, verify_certificate);
+
 	// Max TLS frame is 16k
 	m_state->inbuffer.reserve(17 * 1024);
 	m_state->outbuffer.reserve(17 * 1024);
@@ -356,6 +548,10 @@ bool TLSSession::pump_read()
 			m_last_error = gnutls_handshake(m_state->session);
 			if (gnutls_error_is_fatal(m_last_error))
 			{
+				// Don't try the same session again if it may be what the server choked on
+				if (m_state->session_offered)
+					forget_session(m_state->cache_key);
+
 				deinit();
 				return false;
 			}
@@ -364,6 +560,7 @@ bool TLSSession::pump_read()
 				return false;
 
 			m_state->handshaking = false;
+			handshake_completed(*m_state);
 #elif (defined HAVE_OPENSSL)
 			result = SSL_do_handshake(m_state->connection);
 			if (result < 0)
@@ -371,6 +568,10 @@ bool TLSSession::pump_read()
 				result = SSL_get_error(m_state->connection, result);
 				if (result == SSL_ERROR_SSL)
 				{
+					// Don't try the same session again if it may be what the server choked on
+					if (m_state->session_offered)
+						forget_session(m_state->cache_key);
+
 					m_last_error = ERR_get_error();
 					deinit();
 				}
@@ -381,6 +582,7 @@ bool TLSSession::pump_read()
 				return false;
 
 			m_state->handshaking = false;
+			handshake_completed(*m_state);
 #else
 			m_last_error = -1;
 			return false;
@@ -477,6 +679,7 @@ int TLSSession::read(void* data, int maxlen)
 		received = 0;
 	}
 
+	save_pending_session(*m_state);
 	return received;
 #elif (defined HAVE_OPENSSL)
 	int result = SSL_read(m_state->connection, data, maxlen);
@@ -554,6 +757,34 @@ void TLSSession::shutdown()
 #endif
 }
 
+bool TLSSession::is_resumed() const
+{
+#if (defined HAVE_GNUTLS)
+	return m_state && !m_state->handshaking && gnutls_session_is_resumed(m_state->session);
+#elif (defined HAVE_OPENSSL)
+	return m_state && !m_state->handshaking && SSL_session_reused(m_state->connection);
+#else
+	return false;
+#endif
+}
+
+TLSSession::ResumptionStats TLSSession::get_resumption_stats()
+{
+	SessionCache& cache = get_session_cache();
+	std::lock_guard guard(cache.mutex);
+
+	ResumptionStats stats = cache.stats;
+	stats.cached          = cache.sessions.size();
+	return stats;
+}
+
+void TLSSession::flush_session_cache()
+{
+	SessionCache& cache = get_session_cache();
+	std::lock_guard guard(cache.mutex);
+	cache.sessions.clear();
+}
+
 std::string_view TLSSession::get_last_error() const
 {
 #if (defined HAVE_GNUTLS)
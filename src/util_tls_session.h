@@ -19,6 +19,7 @@
 #ifndef DECK_ASSISTANT_UTIL_TLS_SESSION_H
 #define DECK_ASSISTANT_UTIL_TLS_SESSION_H
 
+#include <cstdint>
 #include <memory>
 #include <string_view>
 
@@ -35,6 +36,15 @@ public:
 		virtual int write(void const* data, int len) = 0;
 	};
 
+	struct ResumptionStats
+	{
+		std::uint64_t handshakes = 0; // Completed client handshakes
+		std::uint64_t offered    = 0; // Handshakes that offered a cached session
+		std::uint64_t resumed    = 0; // Handshakes where the server accepted the cached session
+		std::uint64_t stored     = 0; // Sessions or tickets received from servers
+		std::size_t cached       = 0;
+	};
+
 public:
 	TLSSession();
 	TLSSession(TLSSession const&) = delete;
@@ -46,7 +56,8 @@ public:
 	operator bool() const;
 	bool operator!() const;
 
-	bool init_as_client(IO& io, std::string_view const& remote_name, bool verify_certificate = true);
+	// With a remote port given, sessions are cached per host and port and offered again on the next connect
+	bool init_as_client(IO& io, std::string_view const& remote_name, bool verify_certificate = true, int remote_port = 0);
 	// bool init_as_server(IO& io, std::string_view const& certificate);
 	void deinit();
 
@@ -54,6 +65,7 @@ public:
 	bool pump_write();
 	bool is_handshaking() const;
 	bool is_connected() const;
+	bool is_resumed() const;
 
 	int read(void* data, int maxlen);
 	int write(void const* data, int len);
@@ -61,6 +73,9 @@ public:
 
 	std::string_view get_last_error() const;
 
+	static ResumptionStats get_resumption_stats();
+	static void flush_session_cache();
+
 public:
 	struct State;
 	std::unique_ptr<State> m_state;
@@ -0,0 +1,413 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "util_websocket.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace util
+{
+
+namespace websocket
+{
+
+bool parse_frame_header(unsigned char const* data, std::size_t len, FrameHeader& header)
+{
+	if (len < 2)
+		return false;
+
+	header.fin    = data[0] & 0x80;
+	header.rsv1   = data[0] & 0x40;
+	header.rsv23  = data[0] & 0x30;
+	header.opcode = data[0] & 0x0f;
+	header.masked = data[1] & 0x80;
+
+	unsigned char const payload_len = data[1] & 0x7f;
+	std::size_t header_size         = 2;
+
+	if (payload_len == 127)
+	{
+		if (len < 10)
+			return false;
+
+		header.payload_size = 0;
+		for (int i = 2; i < 10; ++i)
+			header.payload_size = (header.payload_size << 8) + data[i];
+
+		header_size += 8;
+	}
+	else if (payload_len == 126)
+	{
+		if (len < 4)
+			return false;
+
+		header.payload_size  = (data[2] << 8) + data[3];
+		header_size         += 2;
+	}
+	else
+	{
+		header.payload_size = payload_len;
+	}
+
+	if (header.masked)
+	{
+		if (len < header_size + 4)
+			return false;
+
+		std::memcpy(header.mask, data + header_size, 4);
+		header_size += 4;
+	}
+
+	header.header_size = header_size;
+	return true;
+}
+
+std::size_t encode_frame_header(unsigned char* dest, unsigned char opcode, std::uint64_t payload_size, bool rsv1, unsigned char const* mask)
+{
+	std::size_t header_size = 0;
+
+	unsigned char const mask_bit = mask ? 0x80 : 0x00;
+	dest[header_size++]          = (rsv1 ? 0xc0 : 0x80) + opcode;
+
+	if (payload_size > 0xffff)
+	{
+		dest[header_size++] = mask_bit + 127;
+		for (int shift = 56; shift >= 0; shift -= 8)
+			dest[header_size++] = (payload_size >> shift) & 0xff;
+	}
+	else if (payload_size >= 126)
+	{
+		dest[header_size++] = mask_bit + 126;
+		dest[header_size++] = payload_size >> 8;
+		dest[header_size++] = payload_size & 0xff;
+	}
+	else
+	{
+		dest[header_size++] = mask_bit + payload_size;
+	}
+
+	if (mask)
+	{
+		std::memcpy(dest + header_size, mask, 4);
+		header_size += 4;
+	}
+
+	return header_size;
+}
+
+void append_frame(BlobBuffer& dest, unsigned char opcode, std::string_view const& payload, bool rsv1, unsigned char const* mask)
+{
+	unsigned char header[MAX_HEADER_SIZE];
+	std::size_t const header_size = encode_frame_header(header, opcode, payload.size(), rsv1, mask);
+
+	// Grow geometrically, a busy tick may queue many small frames
+	std::size_t const needed = header_size + payload.size();
+	if (dest.space() < needed)
+		dest.reserve(dest.capacity() + std::max(dest.capacity(), needed));
+
+	dest.write(header, header_size);
+
+	unsigned char const* const payload_data = reinterpret_cast<unsigned char const*>(payload.data());
+	if (mask)
+	{
+		apply_mask(dest.tail(), payload_data, payload.size(), mask);
+		dest.added_to_tail(payload.size());
+	}
+	else
+	{
+		dest.write(payload_data, payload.size());
+	}
+}
+
+// The 32-bit mask repeats every four bytes, so eight bytes at a time can be XORed with a doubled mask
+void apply_mask(unsigned char* dest, unsigned char const* src, std::size_t len, unsigned char const* mask)
+{
+	unsigned char mask_bytes[8];
+	std::memcpy(mask_bytes, mask, 4);
+	std::memcpy(mask_bytes + 4, mask, 4);
+
+	std::uint64_t wide_mask;
+	std::memcpy(&wide_mask, mask_bytes, 8);
+
+	std::size_t i = 0;
+	for (; i + 8 <= len; i += 8)
+	{
+		std::uint64_t chunk;
+		std::memcpy(&chunk, src + i, 8);
+		chunk ^= wide_mask;
+		std::memcpy(dest + i, &chunk, 8);
+	}
+
+	for (; i < len; ++i)
+		dest[i] = src[i] ^ mask_bytes[i & 3];
+}
+
+FrameReader::FrameReader()
+    : m_consumed(0)
+    , m_max_message_size(SIZE_MAX)
+    , m_stream_fragments(false)
+    , m_require_masked(false)
+    , m_inflate_active(false)
+    , m_no_context_takeover(false)
+    , m_pending_opcode(0)
+    , m_pending_compressed(false)
+    , m_received_compressed(0)
+    , m_received_inflated(0)
+{
+}
+
+void FrameReader::set_max_message_size(std::size_t max_message_size)
+{
+	m_max_message_size = max_message_size;
+}
+
+void FrameReader::set_stream_fragments(bool stream_fragments)
+{
+	m_stream_fragments = stream_fragments;
+	m_pending_frame.clear();
+}
+
+void FrameReader::set_require_masked(bool require_masked)
+{
+	m_require_masked = require_masked;
+}
+
+bool FrameReader::enable_inflate(bool no_context_takeover)
+{
+	m_inflate_active      = m_inflate.init(Inflate::Format::Raw);
+	m_no_context_takeover = no_context_takeover;
+	return m_inflate_active;
+}
+
+void FrameReader::disable_inflate()
+{
+	m_inflate.deinit();
+	m_inflate_active = false;
+}
+
+bool FrameReader::next_frame(BlobBuffer& received, Frame& frame, FrameKind& frame_kind, std::uint16_t& close_reason)
+{
+	close_reason = CLOSE_None;
+	frame_kind   = FrameKind::Complete;
+
+	for (;;)
+	{
+		// Release the previous frame, which the caller is done with by now
+		release(received);
+
+		FrameHeader header;
+		std::size_t const available = received.size();
+		if (!parse_frame_header(received.data(), available, header))
+			return false;
+
+		bool const fin             = header.fin;
+		bool const rsv1            = header.rsv1;
+		bool const is_control      = header.is_control();
+		unsigned char const opcode = header.opcode;
+
+		// RSV1 flags the first frame of a compressed message, and only if compression was negotiated
+		bool valid = !header.rsv23 && !(rsv1 && (!m_inflate_active || opcode == 0 || is_control));
+		valid      = valid && (header.masked || !m_require_masked);
+
+		// Control frames may be interleaved with fragments, but never fragmented themselves
+		if (is_control)
+			valid = valid && fin && header.payload_size <= 125 && opcode <= 10;
+		else if (opcode == 0)
+			valid = valid && m_pending_opcode != 0;
+		else
+			valid = valid && m_pending_opcode == 0 && opcode <= 2;
+
+		if (!valid)
+		{
+			close_reason = CLOSE_ProtocolError;
+			return false;
+		}
+
+		// Checked before waiting for the payload, so an oversized message is refused without buffering it first
+		std::size_t message_size = 0;
+		if (opcode == 0 && !m_stream_fragments)
+			message_size = m_pending_compressed ? m_inflated.size() : m_pending_frame.size();
+
+		if (header.payload_size > m_max_message_size - std::min(message_size, m_max_message_size))
+		{
+			close_reason = CLOSE_MessageTooLarge;
+			return false;
+		}
+
+		std::uint64_t const full_len = header.header_size + header.payload_size;
+		if (available < full_len)
+			return false;
+
+		unsigned char* payload_data = received.data() + header.header_size;
+		if (header.masked)
+			apply_mask(payload_data, payload_data, header.payload_size, header.mask);
+
+		std::string_view payload(reinterpret_cast<char const*>(payload_data), header.payload_size);
+		m_consumed = full_len;
+
+		if (is_control)
+		{
+			frame.first  = opcode;
+			frame.second = payload;
+			return true;
+		}
+
+		if (opcode != 0)
+		{
+			m_pending_opcode     = opcode;
+			m_pending_compressed = rsv1;
+			m_pending_frame.clear();
+			m_inflated.clear();
+		}
+
+		unsigned char const message_opcode = m_pending_opcode;
+		if (fin)
+			m_pending_opcode = 0;
+
+		// Compressed messages are inflated as they come in, so their fragments collect in the inflate buffer
+		if (m_pending_compressed)
+		{
+			if (m_stream_fragments)
+				m_inflated.clear();
+
+			if (!inflate_payload(payload, fin, close_reason))
+				return false;
+
+			payload = std::string_view(reinterpret_cast<char const*>(m_inflated.data()), m_inflated.size());
+		}
+
+		// Complete messages are handed out straight from the receive buffer, only fragments get collected
+		if (opcode != 0 && fin)
+		{
+			frame.first  = opcode;
+			frame.second = payload;
+			return true;
+		}
+
+		if (m_stream_fragments)
+		{
+			frame.first  = message_opcode;
+			frame.second = payload;
+			frame_kind   = fin ? FrameKind::LastFragment : FrameKind::Fragment;
+			return true;
+		}
+
+		if (!m_pending_compressed)
+			m_pending_frame += payload;
+
+		if (fin)
+		{
+			frame.first  = message_opcode;
+			frame.second = m_pending_compressed ? payload : std::string_view(m_pending_frame);
+			return true;
+		}
+	}
+}
+
+void FrameReader::release(BlobBuffer& received)
+{
+	received.advance(m_consumed);
+	m_consumed = 0;
+
+	if (received.empty())
+		received.clear();
+}
+
+void FrameReader::reset()
+{
+	m_consumed           = 0;
+	m_pending_opcode     = 0;
+	m_pending_compressed = false;
+	m_pending_frame.clear();
+	m_inflated.clear();
+}
+
+bool FrameReader::inflate_payload(std::string_view const& payload, bool fin, std::uint16_t& close_reason)
+{
+	std::size_t const initial_size = m_inflated.size();
+	std::size_t const limit        = m_max_message_size - std::min(initial_size, m_max_message_size);
+
+	bool ok = m_inflate.write(payload.data(), payload.size(), m_inflated, limit);
+	if (ok && fin)
+		ok = m_inflate.write(DEFLATE_TRAILER, sizeof(DEFLATE_TRAILER), m_inflated, limit - (m_inflated.size() - initial_size));
+
+	if (!ok)
+	{
+		close_reason = (m_inflated.size() - initial_size > limit) ? CLOSE_MessageTooLarge : CLOSE_InvalidFormat;
+		return false;
+	}
+
+	m_received_compressed += payload.size();
+	m_received_inflated   += m_inflated.size() - initial_size;
+
+	// A final deflate block ends the stream, so the next message can't refer back to this one either
+	if (fin && (m_no_context_takeover || m_inflate.is_finished()))
+		m_inflate.reset();
+
+	return true;
+}
+
+#if (defined HAVE_GNUTLS || defined HAVE_OPENSSL)
+
+bool can_make_accept_nonce()
+{
+	return true;
+}
+
+Blob make_key_nonce()
+{
+	return Blob::from_random(16);
+}
+
+Blob make_accept_nonce(std::string_view const& key_base64)
+{
+	constexpr std::string_view websocket_uuid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+	Blob blob(60);
+	blob += key_base64;
+	blob += websocket_uuid;
+	return blob.sha1();
+}
+
+#else
+
+// Hardcoded due to absence of SHA1, only good enough for the client side
+
+bool can_make_accept_nonce()
+{
+	return false;
+}
+
+Blob make_key_nonce()
+{
+	return Blob::from_literal("DeckAssistantWS!");
+}
+
+Blob make_accept_nonce(std::string_view const&)
+{
+	bool ok;
+	return Blob::from_base64("H3P/IhOIXOMiE9YV+WG5Jqe3G08=", ok);
+}
+
+#endif
+
+} // namespace websocket
+
+} // namespace util
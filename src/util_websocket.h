@@ -0,0 +1,152 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DECK_ASSISTANT_UTIL_WEBSOCKET_H
+#define DECK_ASSISTANT_UTIL_WEBSOCKET_H
+
+#include "util_blob.h"
+#include "util_deflate.h"
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace util
+{
+
+// RFC 6455 framing shared by the websocket client and server connectors
+namespace websocket
+{
+
+enum CloseReason : std::uint16_t
+{
+	CLOSE_None            = 0,
+	CLOSE_Normal          = 1000,
+	CLOSE_GoingAway       = 1001,
+	CLOSE_ProtocolError   = 1002,
+	CLOSE_Unacceptable    = 1003,
+	CLOSE_InvalidFormat   = 1007,
+	CLOSE_PolicyViolated  = 1008,
+	CLOSE_MessageTooLarge = 1009,
+	CLOSE_ExtensionFailed = 1010,
+	CLOSE_InternalError   = 1011,
+	CLOSE_HandshakeFailed = 1015,
+};
+
+struct FrameHeader
+{
+	bool fin;
+	bool rsv1;
+	bool rsv23;
+	bool masked;
+	unsigned char opcode;
+	unsigned char mask[4];
+	std::uint64_t payload_size;
+	std::size_t header_size;
+
+	inline bool is_control() const { return opcode & 0x08; }
+};
+
+enum class FrameKind : char
+{
+	Complete,
+	Fragment,
+	LastFragment,
+};
+
+using Frame = std::pair<unsigned char, std::string_view>;
+
+// Largest possible frame header: 2 bytes, 8 bytes extended length, 4 bytes mask
+constexpr std::size_t const MAX_HEADER_SIZE = 14;
+
+// Tail of a deflate sync flush, stripped from every compressed message (RFC 7692)
+constexpr unsigned char const DEFLATE_TRAILER[] = { 0x00, 0x00, 0xff, 0xff };
+
+// Returns false if the buffer does not hold the complete header yet
+bool parse_frame_header(unsigned char const* data, std::size_t len, FrameHeader& header);
+
+// Writes up to MAX_HEADER_SIZE bytes, pass a mask to produce a client frame
+std::size_t encode_frame_header(unsigned char* dest, unsigned char opcode, std::uint64_t payload_size, bool rsv1, unsigned char const* mask);
+
+// Appends header and (masked) payload in one go
+void append_frame(BlobBuffer& dest, unsigned char opcode, std::string_view const& payload, bool rsv1, unsigned char const* mask);
+
+// XOR with the 4 byte mask, dest and src may be the same buffer
+void apply_mask(unsigned char* dest, unsigned char const* src, std::size_t len, unsigned char const* mask);
+
+/**
+ * Cuts received data into frames and reassembles fragmented messages.
+ *
+ * Frames are handed out straight from the receive buffer where possible and
+ * stay valid until the next call, only fragments and inflated messages are
+ * collected separately. Control frames are returned as they come in, even
+ * in between the fragments of a message.
+ */
+class FrameReader
+{
+public:
+	FrameReader();
+
+	void set_max_message_size(std::size_t max_message_size);
+	void set_stream_fragments(bool stream_fragments);
+	void set_require_masked(bool require_masked);
+
+	// After permessage-deflate was negotiated, RSV1 marks compressed messages
+	bool enable_inflate(bool no_context_takeover);
+	void disable_inflate();
+
+	// Returns false once more data is needed, or with close_reason set when the peer broke the protocol
+	bool next_frame(BlobBuffer& received, Frame& frame, FrameKind& frame_kind, std::uint16_t& close_reason);
+
+	// Drops the last frame handed out from the receive buffer
+	void release(BlobBuffer& received);
+	void reset();
+
+	inline std::uint64_t get_received_compressed() const { return m_received_compressed; }
+	inline std::uint64_t get_received_inflated() const { return m_received_inflated; }
+
+private:
+	bool inflate_payload(std::string_view const& payload, bool fin, std::uint16_t& close_reason);
+
+private:
+	std::size_t m_consumed;
+	std::size_t m_max_message_size;
+	bool m_stream_fragments;
+	bool m_require_masked;
+	bool m_inflate_active;
+	bool m_no_context_takeover;
+	unsigned char m_pending_opcode;
+	bool m_pending_compressed;
+	std::string m_pending_frame;
+	Inflate m_inflate;
+	BlobBuffer m_inflated;
+	std::uint64_t m_received_compressed;
+	std::uint64_t m_received_inflated;
+};
+
+// Checks or produces the Sec-WebSocket-Accept value for a Sec-WebSocket-Key, needs SHA1 from the TLS library
+bool can_make_accept_nonce();
+Blob make_key_nonce();
+Blob make_accept_nonce(std::string_view const& key_base64);
+
+} // namespace websocket
+
+} // namespace util
+
+#endif // DECK_ASSISTANT_UTIL_WEBSOCKET_H
@@ -0,0 +1,290 @@
+/*
+ * DeckAssistant - Creating control panels using scripts.
+ * Copyright (C) 2024  Esther Dalhuisen (Wake of Luna)
+ *
+ * DeckAssistant is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DeckAssistant is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "util_blob.h"
+#include "util_deflate.h"
+#include "util_websocket.h"
+#include <catch2/catch_test_macros.hpp>
+#include <string>
+#include <string_view>
+
+using namespace util;
+using namespace util::websocket;
+
+TEST_CASE("Websocket", "[util]")
+{
+	unsigned char const mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+
+	SECTION("Header sizes")
+	{
+		unsigned char header[MAX_HEADER_SIZE];
+		REQUIRE(encode_frame_header(header, 1, 0, false, nullptr) == 2);
+		REQUIRE(encode_frame_header(header, 1, 125, false, nullptr) == 2);
+		REQUIRE(encode_frame_header(header, 1, 126, false, nullptr) == 4);
+		REQUIRE(encode_frame_header(header, 1, 0xffff, false, nullptr) == 4);
+		REQUIRE(encode_frame_header(header, 1, 0x10000, false, nullptr) == 10);
+		REQUIRE(encode_frame_header(header, 1, 0x10000, false, mask) == 14);
+	}
+
+	SECTION("Header roundtrip")
+	{
+		std::uint64_t const sizes[] = { 0, 5, 125, 126, 300, 0xffff, 0x10000, 0x123456789aULL };
+		for (std::uint64_t size : sizes)
+		{
+			unsigned char header[MAX_HEADER_SIZE];
+			std::size_t const header_size = encode_frame_header(header, 2, size, true, mask);
+
+			FrameHeader parsed;
+			REQUIRE(!parse_frame_header(header, header_size - 1, parsed));
+			REQUIRE(parse_frame_header(header, header_size, parsed));
+			REQUIRE(parsed.fin);
+			REQUIRE(parsed.rsv1);
+			REQUIRE(!parsed.rsv23);
+			REQUIRE(parsed.masked);
+			REQUIRE(parsed.opcode == 2);
+			REQUIRE(!parsed.is_control());
+			REQUIRE(parsed.payload_size == size);
+			REQUIRE(parsed.header_size == header_size);
+			REQUIRE(std::string_view((char const*)parsed.mask, 4) == std::string_view((char const*)mask, 4));
+		}
+	}
+
+	SECTION("64-bit length layout")
+	{
+		// Lengths above 0xffff use the 127 marker followed by 8 big endian bytes
+		unsigned char header[MAX_HEADER_SIZE];
+		REQUIRE(encode_frame_header(header, 2, 0x0102030405060708ULL, false, nullptr) == 10);
+		unsigned char const expected[] = { 0x82, 0x7f, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08 };
+		REQUIRE(std::string_view((char const*)header, 10) == std::string_view((char const*)expected, 10));
+
+		REQUIRE(encode_frame_header(header, 2, 0x10000, false, mask) == 14);
+		unsigned char const expected_masked[] = { 0x82, 0xff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x37, 0xfa, 0x21, 0x3d };
+		REQUIRE(std::string_view((char const*)header, 14) == std::string_view((char const*)expected_masked, 14));
+
+		// A hand built header, as a peer would send it
+		unsigned char const peer[] = { 0x01, 0x7f, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x2a, 0xff };
+		FrameHeader parsed;
+		for (std::size_t len = 0; len < 10; ++len)
+			REQUIRE(!parse_frame_header(peer, len, parsed));
+		REQUIRE(parse_frame_header(peer, sizeof(peer), parsed));
+		REQUIRE(!parsed.fin);
+		REQUIRE(!parsed.masked);
+		REQUIRE(parsed.opcode == 1);
+		REQUIRE(parsed.payload_size == 0x10000002aULL);
+		REQUIRE(parsed.header_size == 10);
+	}
+
+	SECTION("RFC 6455 examples")
+	{
+		// A single-frame unmasked text message
+		BlobBuffer unmasked;
+		append_frame(unmasked, 1, "Hello", false, nullptr);
+		REQUIRE(unmasked.size() == 7);
+		REQUIRE(std::string_view((char const*)unmasked.data(), unmasked.size()) == std::string_view("\x81\x05Hello", 7));
+
+		// A single-frame masked text message
+		BlobBuffer masked;
+		append_frame(masked, 1, "Hello", false, mask);
+		REQUIRE(masked.size() == 11);
+		REQUIRE(std::string_view((char const*)masked.data(), masked.size()) == std::string_view("\x81\x85\x37\xfa\x21\x3d\x7f\x9f\x4d\x51\x58", 11));
+
+		FrameHeader parsed;
+		REQUIRE(parse_frame_header(masked.data(), masked.size(), parsed));
+		apply_mask(masked.data() + parsed.header_size, masked.data() + parsed.header_size, parsed.payload_size, parsed.mask);
+		REQUIRE(std::string_view((char const*)masked.data() + parsed.header_size, parsed.payload_size) == "Hello");
+	}
+
+	SECTION("Masking")
+	{
+		// Exercise the wide path as well as every possible tail length
+		for (std::size_t len = 0; len < 40; ++len)
+		{
+			std::string input;
+			for (std::size_t i = 0; i < len; ++i)
+				input += char('a' + i % 26);
+
+			std::string output(len, 0);
+			apply_mask((unsigned char*)output.data(), (unsigned char const*)input.data(), len, mask);
+
+			for (std::size_t i = 0; i < len; ++i)
+				REQUIRE((unsigned char)output[i] == ((unsigned char)input[i] ^ mask[i & 3]));
+
+			apply_mask((unsigned char*)output.data(), (unsigned char const*)output.data(), len, mask);
+			REQUIRE(output == input);
+		}
+	}
+
+	SECTION("Unaligned masking")
+	{
+		// The wide loop must not depend on the alignment of either buffer
+		unsigned char input[64];
+		for (std::size_t i = 0; i < sizeof(input); ++i)
+			input[i] = (unsigned char)(i * 7 + 3);
+
+		for (std::size_t src_offset = 0; src_offset < 8; ++src_offset)
+		{
+			for (std::size_t dest_offset = 0; dest_offset < 8; ++dest_offset)
+			{
+				for (std::size_t len : { 7, 8, 9, 15, 17, 23, 31, 33 })
+				{
+					unsigned char output[64 + 8] = {};
+					apply_mask(output + dest_offset, input + src_offset, len, mask);
+
+					for (std::size_t i = 0; i < len; ++i)
+						REQUIRE(output[dest_offset + i] == (input[src_offset + i] ^ mask[i & 3]));
+
+					// Nothing is written past the end of the payload
+					REQUIRE(output[dest_offset + len] == 0);
+				}
+			}
+		}
+	}
+
+	if (can_make_accept_nonce())
+	{
+		SECTION("Accept nonce")
+		{
+			REQUIRE(make_accept_nonce("dGhlIHNhbXBsZSBub25jZQ==").to_base64() == "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
+			REQUIRE(make_key_nonce().size() == 16);
+		}
+	}
+}
+
+TEST_CASE("WebsocketFrameReader", "[util]")
+{
+	unsigned char const mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+
+	FrameReader reader;
+	BlobBuffer received;
+	Frame frame;
+	FrameKind frame_kind;
+	std::uint16_t close_reason;
+
+	auto const append_fragment = [&received, &mask](unsigned char opcode, std::string_view const& payload, bool fin) {
+		append_frame(received, opcode, payload, false, mask);
+		if (!fin)
+			received.data()[received.size() - payload.size() - 6] &= 0x7f;
+	};
+
+	SECTION("Partial frames")
+	{
+		BlobBuffer complete;
+		append_frame(complete, 1, "Hello", false, mask);
+
+		received.write(complete.data(), 4);
+		REQUIRE(!reader.next_frame(received, frame, frame_kind, close_reason));
+		REQUIRE(close_reason == CLOSE_None);
+
+		received.write(complete.data() + 4, complete.size() - 4);
+		REQUIRE(reader.next_frame(received, frame, frame_kind, close_reason));
+		REQUIRE(frame.first == 1);
+		REQUIRE(frame.second == "Hello");
+		REQUIRE(frame_kind == FrameKind::Complete);
+
+		REQUIRE(!reader.next_frame(received, frame, frame_kind, close_reason));
+		REQUIRE(received.empty());
+	}
+
+	SECTION("Fragments with a ping in between")
+	{
+		append_fragment(1, "Hel", false);
+		append_fragment(9, "ping", true);
+		append_fragment(0, "lo", true);
+
+		REQUIRE(reader.next_frame(received, frame, frame_kind, close_reason));
+		REQUIRE(frame.first == 9);
+		REQUIRE(frame.second == "ping");
+
+		REQUIRE(reader.next_frame(received, frame, frame_kind, close_reason));
+		REQUIRE(frame.first == 1);
+		REQUIRE(frame.second == "Hello");
+		REQUIRE(frame_kind == FrameKind::Complete);
+	}
+
+	SECTION("Streamed fragments")
+	{
+		reader.set_stream_fragments(true);
+		append_fragment(2, "ab", false);
+		append_fragment(0, "cd", true);
+
+		REQUIRE(reader.next_frame(received, frame, frame_kind, close_reason));
+		REQUIRE(frame.first == 2);
+		REQUIRE(frame.second == "ab");
+		REQUIRE(frame_kind == FrameKind::Fragment);
+
+		REQUIRE(reader.next_frame(received, frame, frame_kind, close_reason));
+		REQUIRE(frame.first == 2);
+		REQUIRE(frame.second == "cd");
+		REQUIRE(frame_kind == FrameKind::LastFragment);
+	}
+
+	if (Deflate::is_available())
+	{
+		SECTION("Compressed message")
+		{
+			Deflate deflate;
+			BlobBuffer deflated;
+			REQUIRE(deflate.init(Deflate::Format::Raw));
+			REQUIRE(deflate.write("Hello Hello Hello", 17, deflated, Deflate::Flush::Sync));
+
+			std::string_view const compressed((char const*)deflated.data(), deflated.size() - sizeof(DEFLATE_TRAILER));
+			append_frame(received, 1, compressed, true, mask);
+
+			REQUIRE(reader.enable_inflate(false));
+			REQUIRE(reader.next_frame(received, frame, frame_kind, close_reason));
+			REQUIRE(frame.first == 1);
+			REQUIRE(frame.second == "Hello Hello Hello");
+			REQUIRE(reader.get_received_compressed() == compressed.size());
+			REQUIRE(reader.get_received_inflated() == 17);
+		}
+	}
+
+	SECTION("Protocol errors")
+	{
+		// Continuation without a message to continue
+		append_fragment(0, "lo", true);
+		REQUIRE(!reader.next_frame(received, frame, frame_kind, close_reason));
+		REQUIRE(close_reason == CLOSE_ProtocolError);
+
+		// Servers only take masked frames
+		reader.reset();
+		received.clear();
+		reader.set_require_masked(true);
+		append_frame(received, 1, "Hello", false, nullptr);
+		REQUIRE(!reader.next_frame(received, frame, frame_kind, close_reason));
+		REQUIRE(close_reason == CLOSE_ProtocolError);
+
+		// Compressed frames while nothing was negotiated
+		reader.reset();
+		received.clear();
+		append_frame(received, 1, "Hello", true, mask);
+		REQUIRE(!reader.next_frame(received, frame, frame_kind, close_reason));
+		REQUIRE(close_reason == CLOSE_ProtocolError);
+	}
+
+	SECTION("Message size limit")
+	{
+		reader.set_max_message_size(4);
+		append_fragment(1, "Hel", false);
+		append_fragment(0, "lo", true);
+
+		REQUIRE(!reader.next_frame(received, frame, frame_kind, close_reason));
+		REQUIRE(close_reason == CLOSE_MessageTooLarge);
+	}
+}